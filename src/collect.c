@@ -23,6 +23,9 @@
 #include "template.h"
 #include "util.h"
 #include "rb_sensor.h"
+#include "rb_ring.h"
+#include "rb_flow_arena.h"
+#include "rb_sink.h"
 
 #include "printbuf.h"
 
@@ -78,32 +81,16 @@ static queued_template_t *new_queued_template(FlowSetV9Ipfix *mtemplate,
   return qt;
 }
 
-typedef rd_fifoq_t template_queue_t;
-#define template_queue_init(q) rd_fifoq_init(q)
-#define template_queue_destroy(q) rd_fifoq_destroy(q);
-/* ********* Template queue ******* */
-static void template_queue_push(queued_template_t *qtemplate,
-                                                            rd_fifoq_t *queue) {
-  rd_fifoq_add(queue,qtemplate);
-}
+/* ********* Worker queue ******* */
 
-/** Convenience function to pop freeing rd_fifoq_elm_t
- * @param  queue Queue to pop
- * @return       [description]
- */
-static void *rb_rd_fifoq_pop(rd_fifoq_t *queue) {
-  rd_fifoq_elm_t *fifoq_elm = rd_fifoq_pop(queue);
-  if(fifoq_elm) {
-    void *elm = fifoq_elm->rfqe_ptr;
-    rd_fifoq_elm_release(queue, fifoq_elm);
-    return elm;
-  }
-  return NULL;
-}
+/// Worker queue messages types
+enum worker_msg_type {
+  WORKER_MSG_PACKET,   ///< QueuedPacket
+  WORKER_MSG_TEMPLATE, ///< queued_template_t
+};
 
-static queued_template_t *template_queue_pop(template_queue_t *queue) {
-  return rb_rd_fifoq_pop(queue);
-}
+/// Max messages a worker pops from its queue at once
+#define WORKER_QUEUE_BATCH 64
 
 /* ******************* */
 
@@ -119,6 +106,14 @@ void sum_worker_stats(struct worker_stats *a, const struct worker_stats *b) {
   a->num_good_templates_received += b->num_good_templates_received;
   a->num_known_templates += b->num_known_templates;
   a->num_bad_templates_received += b->num_bad_templates_received;
+  a->num_dropped_packets += b->num_dropped_packets;
+  a->num_enrichment_cache_hits += b->num_enrichment_cache_hits;
+  a->num_enrichment_cache_misses += b->num_enrichment_cache_misses;
+  a->num_kafka_delayed_msgs += b->num_kafka_delayed_msgs;
+  a->num_kafka_dropped_queue_full += b->num_kafka_dropped_queue_full;
+  a->num_kafka_dropped_msg_size += b->num_kafka_dropped_msg_size;
+  a->num_kafka_dropped_other += b->num_kafka_dropped_other;
+  a->num_sink_dropped_msgs += b->num_sink_dropped_msgs;
 }
 
 struct worker_s {
@@ -131,48 +126,59 @@ struct worker_s {
   /* Collector */
   struct worker_stats stats;
 
-  rd_fifoq_t packetsQueue;
-  template_queue_t templates_queue;
+  /// Packets and templates, in arrival order
+  struct rb_ring queue;
+  /// Bytes of packets in queue
+  atomic_uint64_t queued_bytes;
+  /// Packets dropped because of overload. Written by producers
+  atomic_uint64_t dropped_packets;
+  /// Enrichment databases reader
+  struct rb_epoch_reader epoch_reader;
+  /// Enrichment lookups cache. Can be NULL
+  struct enrichment_cache *enrichment_cache;
+  /// Flows objects recycling arena. Can be NULL
+  struct flow_arena *flow_arena;
+  /// Output sink. NULL means main sink
+  struct rb_sink *sink;
   pthread_t tid;
 };
 
 /* ********************************************************* */
 
-static void kafka_produce(struct printbuf *kafka_line_buffer, uint64_t client_mac){
-  //if(unlikely(readOnlyGlobals.enable_debug))
-  //  traceEvent(TRACE_WARNING,"[KAFKA] line buffer: [len=%d] %s \n",kafka_line_buffer->bpos,kafka_line_buffer->buf);
+/** Send all list messages to a sink, and release list
+  @param list String list
+  @param sink Sink to send to
+  @param arena Arena to give back list objects. Can be NULL
+  @param stats Stats to update. Can be NULL
+  */
+static void send_string_list_to_sink(struct string_list *list,
+    struct rb_sink *sink, struct flow_arena *arena,
+    struct worker_stats *stats) {
+  struct string_list *nodes[RB_SINK_BATCH];
 
-  const int produce_ret = rd_kafka_produce(readOnlyGlobals.kafka.rkt, RD_KAFKA_PARTITION_UA,
-    RD_KAFKA_MSG_F_FREE,
-    /* Payload and length */
-    kafka_line_buffer->buf, kafka_line_buffer->bpos,
-    /* Optional key and its length */
-    NULL,0,
-    /* Message opaque, provided in
-     * delivery report callback as
-     * msg_opaque. */
-    // WARN! if you change this behavior, you need to change the partitioner too.
-    (void *)(intptr_t)client_mac);
+  while(list){
+    size_t i, n_msgs = 0;
 
+    while (list && n_msgs < RB_SINK_BATCH) {
+      struct string_list *node = list;
+      list = list->next;
 
-  if(unlikely(produce_ret<0)){
-    const rd_kafka_resp_err_t err = rd_kafka_errno2err(errno);
-    traceEvent(TRACE_ERROR,"Cannot produce message: %s",rd_kafka_err2str(err));
-  }else{
-    kafka_line_buffer->buf = NULL; /* librdkafka will free it */
-  }
+      if (NULL == node->string) {
+        flow_arena_string_list_free(arena, node);
+        continue;
+      }
 
-  printbuf_free(kafka_line_buffer);
-}
+      nodes[n_msgs++] = node;
+    }
 
-static void send_string_list_to_kafka(struct string_list *list){
-  while(list){
-    if(list->string)
-      kafka_produce(list->string, list->client_mac);
+    if (n_msgs > 0) {
+      rb_sink_send(sink, nodes, n_msgs, stats);
+    }
 
-    struct string_list * aux_list_node = list;
-    list = list->next;
-    free(aux_list_node);
+    for (i = 0; i < n_msgs; ++i) {
+      flow_arena_printbuf_free(arena, nodes[i]->string);
+      flow_arena_string_list_free(arena, nodes[i]);
+    }
   }
 }
 
@@ -341,16 +347,16 @@ static struct string_list *time_split_flow(struct printbuf *kafka_line_buffer,
       TEMPLATE_OF(PRINT_IN_BYTES), &bytes_sw, sizeof(bytes_sw), flowCache);
     printNetflowRecordWithTemplate(kafka_line_buffer,
       TEMPLATE_OF(PRINT_IN_PKTS), &pkts_sw, sizeof(pkts_sw), flowCache);
-    printbuf_memappend_fast(kafka_line_buffer, "}", strlen("}"));
+    flow_message_end(kafka_line_buffer);
     /// @TODO make a function that create a list with 1 node
-    ret = calloc(1,sizeof(ret[0]));
+    ret = flow_arena_string_list_new(flowCache->arena);
     if (likely(ret)) {
       ret->string = kafka_line_buffer;
       ret->client_mac = flowCache->client_mac;
     } else {
       traceEvent(TRACE_ERROR,
         "Can't allocate string list node (out of memory?)");
-      printbuf_free(kafka_line_buffer);
+      flow_arena_printbuf_free(flowCache->arena, kafka_line_buffer);
     }
   }
 
@@ -481,12 +487,14 @@ static void flow_export_timestamp_uptime(const bool handle_ipfix,
  * @param  the5Record    Netflow 5 record
  * @param  flow_idx      Netflow flow idx
  * @param  sensor_object Sensor that sent this flow
+ * @param  worker        Worker that is managing this flow
  * @return               String list with record
  */
 static struct string_list *dissectNetFlowV5Record(const NetFlow5Record *the5Record,
                 const int flow_idx, const sensor_t *sensor_object,
-                observation_id_t *observation_id) {
-  struct printbuf *kafka_line_buffer = printbuf_new();
+                observation_id_t *observation_id, worker_t *worker) {
+  struct printbuf *kafka_line_buffer = flow_arena_printbuf_new(
+                                                          worker->flow_arena);
   const uint16_t *flowVersion = &the5Record->flowHeader.version;
   const uint32_t flowSecuence_h = ntohl(the5Record->flowHeader.flow_sequence)
                                                                     + flow_idx;
@@ -497,10 +505,12 @@ static struct string_list *dissectNetFlowV5Record(const NetFlow5Record *the5Reco
     return NULL;
   }
 
-  printbuf_memappend_fast(kafka_line_buffer, "{", strlen("{"));
+  flow_message_start(kafka_line_buffer);
   struct flowCache flowCache = {
     .sensor = sensor_object,
-    .observation_id = observation_id
+    .observation_id = observation_id,
+    .enrichment_cache = worker->enrichment_cache,
+    .arena = worker->flow_arena,
   };
   uint64_t field_idx=0;
   printNetflowRecordWithTemplate(kafka_line_buffer, TEMPLATE_OF(REDBORDER_TYPE),
@@ -563,11 +573,12 @@ static struct string_list *dissectNetFlowV5(worker_t *worker,
 #endif
 
     struct string_list *string_list = NULL;
+    struct string_list **string_list_tail = &string_list;
     unsigned int flow_idx;
     for(flow_idx=0; flow_idx<numFlows; flow_idx++){
       struct string_list *sl2 = dissectNetFlowV5Record(the5Record,
-        flow_idx, sensor_object, observation_id);
-      string_list_concat(&string_list,sl2);
+        flow_idx, sensor_object, observation_id, worker);
+      string_list_append(&string_list_tail,sl2);
     }
 
     worker->stats.num_flows_processed+=numFlows;
@@ -611,7 +622,7 @@ static void split_after_dns_query_completed(struct dns_ctx *ctx,
   struct string_list *string_list = time_split_flow(opaque->curr_printbuf,
     opaque->flowCache);
 
-  send_string_list_to_kafka(string_list);
+  send_string_list_to_sink(string_list, readOnlyGlobals.sink, NULL, NULL);
 
   if(opaque->flowCache->address.client_name) {
     free(opaque->flowCache->address.client_name);
@@ -619,41 +630,23 @@ static void split_after_dns_query_completed(struct dns_ctx *ctx,
   if(opaque->flowCache->address.target_name) {
     free(opaque->flowCache->address.target_name);
   }
-  if(opaque->flowCache->address.client_name_cache) {
-    dns_cache_decref_elm(opaque->flowCache->address.client_name_cache);
-  }
-  if(opaque->flowCache->address.target_name_cache) {
-    dns_cache_decref_elm(opaque->flowCache->address.target_name_cache);
-  }
 
   free(opaque->flowCache);
   free(opaque);
 }
 
 static void dns_query_completed0(struct dns_ctx *ctx,
-          struct dns_rr_ptr *result, struct udns_opaque *opaque,
-          char **hostname_dst,struct dns_cache_elm ** cache_elm_dst,
-          const uint8_t * (*addr_fn)(const struct flowCache *)) {
+          struct dns_cache_elm *cache_elm, const char *name,
+          struct udns_opaque *opaque, char **hostname_dst) {
 #ifdef UDNS_OPAQUE_MAGIC
   assert(UDNS_OPAQUE_MAGIC == opaque->magic);
 #endif
 
-  const uint8_t *addr = (const uint8_t *) addr_fn(opaque->flowCache);
-
-  if(result && result->dnsptr_nrr > 0) {
-    struct dns_cache_elm *cache_elm = NULL;
-    if(cache_elm_dst) {
-      /* Cache specified, save result in cache */
-      const size_t name_len = strlen(result->dnsptr_ptr[0]);
-      cache_elm = dns_cache_save_elm(readOnlyGlobals.udns.cache,addr,
-        result->dnsptr_ptr[0],name_len,time(NULL));
-      (*cache_elm_dst) = cache_elm;
-    }
-
-    if(NULL == cache_elm_dst || (cache_elm_dst && NULL == cache_elm)) {
-      /* No cache or cache full, neet to return result in another way */
-      (*hostname_dst) = strdup(result->dnsptr_ptr[0]);
-    }
+  /* Cache element is only valid in this callback. It could hold a still
+     valid name if the query failed */
+  const char *hostname = cache_elm ? cache_elm->name : name;
+  if(hostname) {
+    (*hostname_dst) = strdup(hostname);
   }
 
   if(0 == ATOMIC_OP(sub,fetch,&opaque->refcnt.value,1)) {
@@ -662,34 +655,210 @@ static void dns_query_completed0(struct dns_ctx *ctx,
     assert(curr_thread);
     rd_thread_func_call2(curr_thread,split_after_dns_query_completed,ctx,opaque);
   }
-
-  if(result) {
-    free(result);
-  }
 }
 
-static void dns_query_completed_client(struct dns_ctx *ctx, struct dns_rr_ptr *result,
-                                        void *void_opaque) {
+static void dns_query_completed_client(struct dns_ctx *ctx,
+          struct dns_cache_elm *cache_elm, const char *name,
+          void *void_opaque) {
   struct udns_opaque *opaque = void_opaque;
-#ifdef UDNS_OPAQUE_MAGIC
-  assert(UDNS_OPAQUE_MAGIC == opaque->magic);
-#endif
 
-  dns_query_completed0(ctx,result, opaque,
-    &opaque->flowCache->address.client_name,
-    &opaque->flowCache->address.client_name_cache,
-    get_direction_based_client_ip);
+  dns_query_completed0(ctx, cache_elm, name, opaque,
+    &opaque->flowCache->address.client_name);
 }
 
-static void dns_query_completed_target(struct dns_ctx *ctx, struct dns_rr_ptr *result,
-                                        void *void_opaque) {
+static void dns_query_completed_target(struct dns_ctx *ctx,
+          struct dns_cache_elm *cache_elm, const char *name,
+          void *void_opaque) {
   struct udns_opaque *opaque = void_opaque;
-#ifdef UDNS_OPAQUE_MAGIC
-  assert(UDNS_OPAQUE_MAGIC == opaque->magic);
-#endif
 
-  dns_query_completed0(ctx,result,opaque,&opaque->flowCache->address.target_name,
-    &opaque->flowCache->address.target_name_cache, get_direction_based_target_ip);
+  dns_query_completed0(ctx, cache_elm, name, opaque,
+    &opaque->flowCache->address.target_name);
+}
+
+/** Ask for an address PTR in the DNS thread in charge of it
+  @param addr Address. Must be valid until cb is called
+  @param cb Query callback
+  @param opaque Callback opaque
+  */
+static void submit_ptr_query(const uint8_t *addr, dns_ptr_query_cb cb,
+                                                                void *opaque) {
+  const size_t dns_idx = dns_info_idx(addr,
+                                        readOnlyGlobals.numProcessThreads);
+  rd_thread_func_call4(readOnlyGlobals.udns.dns_poll_threads[dns_idx],
+    dns_ptr_query, &readOnlyGlobals.udns.dns_info_array[dns_idx],
+    not_const_cast(addr), cb, opaque);
+}
+
+static void dns_refresh_completed(struct dns_ctx *ctx,
+          struct dns_cache_elm *cache_elm, const char *name, void *addr) {
+  (void)ctx;
+  (void)cache_elm;
+  (void)name;
+
+  /* Failed or timed out refreshes keep the old entry: allow to retry it */
+  dns_cache_refresh_done(readOnlyGlobals.udns.cache, addr);
+  free(addr);
+}
+
+/** Refresh a cache hit in background if it is about to expire, so flows
+  don't have to wait for the query when it finally expires
+  @param elm Cache element
+  @param now Current time
+  */
+static void dns_cache_refresh_ahead(struct dns_cache_elm *elm, time_t now) {
+  if (elm && dns_cache_elm_refresh_ahead(elm, now)) {
+    /* elm can be retired before the query ends */
+    uint8_t *addr_cpy = malloc(sizeof(elm->addr));
+    if (unlikely(NULL == addr_cpy)) {
+      traceEvent(TRACE_ERROR, "Can't allocate PTR query (out of memory?)");
+      dns_cache_refresh_done(readOnlyGlobals.udns.cache, elm->addr);
+      return;
+    }
+
+    memcpy(addr_cpy, elm->addr, sizeof(elm->addr));
+    submit_ptr_query(addr_cpy, dns_refresh_completed, addr_cpy);
+  }
+}
+
+/// Max number of outstanding background queries in cache-only DNS mode
+#define DNS_CACHE_ONLY_MAX_QUERIES 4096
+static uint64_t dns_cache_only_queries = 0;
+
+static void dns_cache_only_query_completed(struct dns_ctx *ctx,
+          struct dns_cache_elm *cache_elm, const char *name, void *addr) {
+  (void)ctx;
+  (void)name;
+
+  /* Answer is already in cache for the next flows */
+  (void)cache_elm;
+  free(addr);
+  ATOMIC_OP(sub,fetch,&dns_cache_only_queries,1);
+}
+
+/** Get an address name from cache. If not cached, ask for it in background,
+  so next flows can use it.
+  @param addr Address
+  @param now Current time
+  @return Cached element, only valid in current worker epoch critical
+          section, or NULL if not cached
+  */
+static struct dns_cache_elm *dns_cache_only_get_elm(const uint8_t *addr,
+                                                                  time_t now) {
+  if (unlikely(NULL == readOnlyGlobals.udns.cache)) {
+    /* Answers would be lost */
+    return NULL;
+  }
+
+  struct dns_cache_elm *elm = dns_cache_get_elm(readOnlyGlobals.udns.cache,
+                                                                    addr, now);
+  if (elm) {
+    dns_cache_refresh_ahead(elm, now);
+    return elm;
+  }
+
+  if (ATOMIC_OP(add,fetch,&dns_cache_only_queries,1)
+                                                > DNS_CACHE_ONLY_MAX_QUERIES) {
+    /* Too many queries, try again in another flow */
+    ATOMIC_OP(sub,fetch,&dns_cache_only_queries,1);
+    return NULL;
+  }
+
+  /* Flow will not wait for the answer, so we need our own address copy */
+  uint8_t *addr_cpy = malloc(sizeof(elm->addr));
+  if (unlikely(NULL == addr_cpy)) {
+    traceEvent(TRACE_ERROR, "Can't allocate PTR query (out of memory?)");
+    ATOMIC_OP(sub,fetch,&dns_cache_only_queries,1);
+    return NULL;
+  }
+
+  memcpy(addr_cpy, addr, sizeof(elm->addr));
+  submit_ptr_query(addr_cpy, dns_cache_only_query_completed, addr_cpy);
+  return NULL;
+}
+
+/** Print flow addresses cached names
+  @param kafka_line_buffer Flow buffer
+  @param flowCache Flow
+  @param client_elm Client address cache element, or NULL
+  @param target_elm Target address cache element, or NULL
+  */
+static void print_dns_cache_elms(struct printbuf *kafka_line_buffer,
+    struct flowCache *flowCache, struct dns_cache_elm *client_elm,
+    struct dns_cache_elm *target_elm) {
+  flowCache->address.client_name_cache = client_elm;
+  flowCache->address.target_name_cache = target_elm;
+
+  printNetflowRecordWithTemplate(kafka_line_buffer,
+    TEMPLATE_OF(DNS_CLIENT_NAME),NULL,0,flowCache);
+  printNetflowRecordWithTemplate(kafka_line_buffer,
+    TEMPLATE_OF(DNS_TARGET_NAME),NULL,0,flowCache);
+
+  /* Elements can't outlive worker epoch critical section */
+  flowCache->address.client_name_cache = NULL;
+  flowCache->address.target_name_cache = NULL;
+}
+
+/** Print flow addresses names that are in cache, without waiting for DNS
+  @param kafka_line_buffer Flow buffer
+  @param flowCache Flow
+  @param solve_client Print client name
+  @param solve_target Print target name
+  */
+static void print_cached_dns_names(struct printbuf *kafka_line_buffer,
+    struct flowCache *flowCache, bool solve_client, bool solve_target) {
+  const time_t now = time(NULL);
+  const uint8_t *client_addr = get_direction_based_client_ip(flowCache);
+  const uint8_t *target_addr = get_direction_based_target_ip(flowCache);
+
+  print_dns_cache_elms(kafka_line_buffer, flowCache,
+    solve_client && client_addr ?
+      dns_cache_only_get_elm(client_addr, now) : NULL,
+    solve_target && target_addr ?
+      dns_cache_only_get_elm(target_addr, now) : NULL);
+}
+
+/** Look up an address in DNS cache, refreshing it in background if needed
+  @param addr Address
+  @param now Current time
+  @return Cached element, only valid in current worker epoch critical
+          section, or NULL if not cached
+  */
+static struct dns_cache_elm *dns_cache_lookup(const uint8_t *addr,
+                                                                  time_t now) {
+  struct dns_cache_elm *elm = dns_cache_get_elm(readOnlyGlobals.udns.cache,
+                                                                    addr, now);
+  dns_cache_refresh_ahead(elm, now);
+  return elm;
+}
+
+/** Print flow addresses names that are in cache, so flow only has to wait
+  for the missing ones. Names are copied right into the flow buffer, so they
+  don't need to outlive worker epoch critical section.
+  @param kafka_line_buffer Flow buffer
+  @param flowCache Flow
+  @param solve_client Client name is needed. Cleared if it was cached
+  @param solve_target Target name is needed. Cleared if it was cached
+  */
+static void print_dns_cache_hits(struct printbuf *kafka_line_buffer,
+    struct flowCache *flowCache, bool *solve_client, bool *solve_target) {
+  const time_t now = time(NULL);
+  const uint8_t *client_addr = get_direction_based_client_ip(flowCache);
+  const uint8_t *target_addr = get_direction_based_target_ip(flowCache);
+
+  *solve_client = *solve_client && client_addr;
+  *solve_target = *solve_target && target_addr;
+  if (NULL == readOnlyGlobals.udns.cache) {
+    return;
+  }
+
+  struct dns_cache_elm *client_elm = *solve_client ?
+    dns_cache_lookup(client_addr, now) : NULL;
+  struct dns_cache_elm *target_elm = *solve_target ?
+    dns_cache_lookup(target_addr, now) : NULL;
+
+  print_dns_cache_elms(kafka_line_buffer, flowCache, client_elm, target_elm);
+  *solve_client = *solve_client && NULL == client_elm;
+  *solve_target = *solve_target && NULL == target_elm;
 }
 
 #endif /* HAVE_UDNS */
@@ -1097,15 +1266,6 @@ static int dissectNetFlowV9V10TemplateSet(worker_t *worker,
   return 1;
 }
 
-#ifdef HAVE_UDNS
-
-static const uint32_t *ipv6_ptr_to_ipv4_ptr(const void *vipv6) {
-  const uint8_t *ipv6 = vipv6;
-  return (const uint32_t *)&ipv6[12];
-}
-
-#endif
-
 /** Dissect a netflow V9/V10 set with a given template
  * @param  worker       Worker that is managing this flow
  * @param  cursor       Template to decode flow with
@@ -1129,6 +1289,7 @@ static struct string_list *dissectNetFlowV9V10FlowSetWithTemplate(
 
   const uint16_t flowVersion_sw = ntohs(flowVersion);
   struct string_list *kafka_string_list = NULL;
+  struct string_list **kafka_string_list_tail = &kafka_string_list;
   ssize_t displ = 0;
   const uint8_t *buffer  = _buffer->buffer;
   sensor_t *sensor_object = _sensor->sensor;
@@ -1153,25 +1314,29 @@ static struct string_list *dissectNetFlowV9V10FlowSetWithTemplate(
     dumpFlow(displ,init_displ + fs->flowsetLen, buffer);
 #endif
 
-    struct printbuf *kafka_line_buffer = printbuf_new();
+    struct printbuf *kafka_line_buffer = flow_arena_printbuf_new(
+                                                          worker->flow_arena);
     if (unlikely(!kafka_line_buffer)) {
       traceEvent(TRACE_ERROR,"Unable to allocate a kafka buffer.");
       return kafka_string_list;
     }
 
-    struct flowCache *flowCache = calloc(1,sizeof(flowCache[0]));
+    struct flowCache *flowCache = flow_arena_flow_cache_new(
+                                                          worker->flow_arena);
     if (unlikely(!flowCache)) {
       traceEvent(TRACE_ERROR,"Unable to allocate flow cache.");
-      printbuf_free(kafka_line_buffer);
+      flow_arena_printbuf_free(worker->flow_arena, kafka_line_buffer);
       return kafka_string_list;
     }
     flow_export_timestamp_uptime(handle_ipfix, flowHeader,
       &flowCache->time.export_timestamp_s, &flowCache->time.sys_uptime_s);
 
-    printbuf_memappend_fast(kafka_line_buffer,"{",strlen("{"));
+    flow_message_start(kafka_line_buffer);
 
     flowCache->sensor = sensor_object;
     flowCache->observation_id = observation_id;
+    flowCache->enrichment_cache = worker->enrichment_cache;
+    flowCache->arena = worker->flow_arena;
 
     printNetflowRecordWithTemplate(kafka_line_buffer,
       TEMPLATE_OF(REDBORDER_TYPE), &flowVersion_sw,
@@ -1254,80 +1419,60 @@ static struct string_list *dissectNetFlowV9V10FlowSetWithTemplate(
     print_sensor_enrichment(kafka_line_buffer,flowCache);
 
 #ifdef HAVE_UDNS
-    const bool solve_client = observation_id_want_client_dns(
+    bool solve_client = observation_id_want_client_dns(
                 flowCache->observation_id),
-               solve_target = observation_id_want_target_dns(
+         solve_target = observation_id_want_target_dns(
                 flowCache->observation_id);
 
-    if((solve_client || solve_target) && readOnlyGlobals.udns.csv_dns_servers
-        && readOnlyGlobals.normalize_directions) {
-      static __thread size_t dns_worker_i = 0; /// @TODO use another way, please.
-      if(++dns_worker_i >= readOnlyGlobals.numProcessThreads) {
-        dns_worker_i = 0;
-      }
+    const bool solve_dns = (solve_client || solve_target)
+      && readOnlyGlobals.udns.csv_dns_servers
+      && readOnlyGlobals.normalize_directions;
+
+    bool wait_dns = false;
+    if(solve_dns && readOnlyGlobals.udns.cache_only) {
+      /* Don't wait for DNS: flow is sent right now with cached names */
+      print_cached_dns_names(kafka_line_buffer, flowCache, solve_client,
+        solve_target);
+    } else if(solve_dns) {
+      /* Only wait for the names that are not cached */
+      print_dns_cache_hits(kafka_line_buffer, flowCache, &solve_client,
+        &solve_target);
+      wait_dns = solve_client || solve_target;
+    }
 
-      rd_thread_t *curr_worker = readOnlyGlobals.udns.dns_poll_threads[dns_worker_i];
+    if(wait_dns) {
       /* Need to reverse solve addresses */
-
       struct udns_opaque *opaque = calloc(1,sizeof(opaque[0]));
 #ifdef UDNS_OPAQUE_MAGIC
       opaque->magic = UDNS_OPAQUE_MAGIC;
 #endif
       opaque->flowCache = flowCache;
+      /* Enrichment cache and arena are not thread safe, so DNS thread can't
+         use them */
+      flowCache->enrichment_cache = NULL;
+      flowCache->arena = NULL;
       opaque->curr_printbuf = kafka_line_buffer;
-      const uint8_t *client_addr = get_direction_based_client_ip(flowCache);
-      const uint8_t *target_addr = get_direction_based_target_ip(flowCache);
-      opaque->refcnt.value = (solve_client && client_addr ? 1 : 0)
-                           + (solve_target && target_addr ? 1 : 0);
-
-      /// @TODO remove duplication
-      if(readOnlyGlobals.udns.cache) {
-        time_t now = time(NULL);
-
-        if(solve_client && client_addr) {
-          opaque->flowCache->address.client_name_cache = dns_cache_get_elm(
-            readOnlyGlobals.udns.cache,(const uint8_t *)client_addr,now);
-          if(NULL != opaque->flowCache->address.client_name_cache) {
-            opaque->refcnt.value--;
-          }
-        }
+      opaque->refcnt.value = (solve_client ? 1 : 0) + (solve_target ? 1 : 0);
 
-        if(solve_target && target_addr) {
-          opaque->flowCache->address.target_name_cache = dns_cache_get_elm(
-            readOnlyGlobals.udns.cache,(const uint8_t *)target_addr,now);
-          if(NULL != opaque->flowCache->address.target_name_cache) {
-            opaque->refcnt.value--;
-          }
-        }
+      /* Same address queries always go to the same DNS thread, so it can
+         coalesce them */
+      if(solve_client) {
+        submit_ptr_query(get_direction_based_client_ip(flowCache),
+          dns_query_completed_client, opaque);
       }
 
-      if (0 == opaque->refcnt.value) {
-        // We had the needed addresses in cache, so we can sent the flow to dissect
-        rd_thread_func_call2(curr_worker,split_after_dns_query_completed,
-          readOnlyGlobals.udns.dns_info_array[dns_worker_i].dns_ctx,opaque);
-      } else {
-        if(solve_client && NULL == flowCache->address.client_name_cache) {
-          void *client = not_const_cast(ipv6_ptr_to_ipv4_ptr(client_addr));
-          rd_thread_func_call4(curr_worker, dns_submit_a4ptr,
-            readOnlyGlobals.udns.dns_info_array[dns_worker_i].dns_ctx,
-            client, dns_query_completed_client, opaque);
-        }
-
-        if(solve_target && NULL == opaque->flowCache->address.target_name_cache) {
-          void *target = not_const_cast(ipv6_ptr_to_ipv4_ptr(target_addr));
-          rd_thread_func_call4(curr_worker, dns_submit_a4ptr,
-            readOnlyGlobals.udns.dns_info_array[dns_worker_i].dns_ctx,
-            target, dns_query_completed_target, opaque);
-        }
+      if(solve_target) {
+        submit_ptr_query(get_direction_based_target_ip(flowCache),
+          dns_query_completed_target, opaque);
       }
     } else {
 #endif
 
       struct string_list *current_record_string_list = time_split_flow(
             kafka_line_buffer, flowCache);
-      string_list_concat(&kafka_string_list,current_record_string_list);
+      string_list_append(&kafka_string_list_tail,current_record_string_list);
 
-      free(flowCache);
+      flow_arena_flow_cache_free(worker->flow_arena, flowCache);
 #ifdef HAVE_UDNS
     }
 #endif
@@ -1591,6 +1736,7 @@ static struct string_list *dissectNetflowV9V10(worker_t *worker,
                     const uint8_t *_buffer, const ssize_t bufferLen,
                     const uint32_t netflow_device_ip) {
   struct string_list *kafka_string_list = NULL;
+  struct string_list **kafka_string_list_tail = &kafka_string_list;
   uint8_t done = 0;
   ssize_t numEntries;
   uint32_t flowSequence;
@@ -1654,7 +1800,7 @@ static struct string_list *dissectNetflowV9V10(worker_t *worker,
     _kafka_string_list = dissectNetFlowV9V10Set(worker, &buffer, &sensor,
                   observation_id, &displ, handle_ipfix, flowVersion,
                   flowSequence);
-    string_list_concat(&kafka_string_list,_kafka_string_list);
+    string_list_append(&kafka_string_list_tail,_kafka_string_list);
   } /* for */
 
   return kafka_string_list;
@@ -1722,60 +1868,104 @@ static int isSflow(const uint8_t *buffer){
   return 0;
 }
 
-/** pop all templates of the template queue
- * @param queue Template queue
+/** Save a queued template in worker's templates database
+ * @param qtemplate Template
  */
-static void pop_all_templates(template_queue_t *template_queue) {
-  queued_template_t *qtemplate = NULL;
-  while((qtemplate = template_queue_pop(template_queue))) {
-    if (unlikely(readOnlyGlobals.enable_debug)) {
-      char buf[BUFSIZ];
-      traceEvent(TRACE_INFO, "Adding template from sensor %s observation_id %"
-                              PRIu32,
-        _intoaV4(qtemplate->template->templateInfo.netflow_device_ip,
-          buf, sizeof(buf)),
-        qtemplate->template->templateInfo.observation_domain_id);
-    }
+static void process_queued_template(queued_template_t *qtemplate) {
+  if (unlikely(readOnlyGlobals.enable_debug)) {
+    char buf[BUFSIZ];
+    traceEvent(TRACE_INFO, "Adding template from sensor %s observation_id %"
+                            PRIu32,
+      _intoaV4(qtemplate->template->templateInfo.netflow_device_ip,
+        buf, sizeof(buf)),
+      qtemplate->template->templateInfo.observation_domain_id);
+  }
+
+  save_template(qtemplate->observation_id, qtemplate->template);
+  free(qtemplate->template);
+  free(qtemplate);
+}
+
+/** Dissect a queued packet and send the result to kafka
+ * @param worker Worker
+ * @param packet Packet
+ */
+static void process_queued_packet(worker_t *worker, QueuedPacket *packet) {
+  if(worker->stats.first_flow_processed_timestamp == 0) {
+    worker->stats.first_flow_processed_timestamp = time(NULL);
+  }
+
+  worker->stats.num_packets_received++;
+
+  if(isSflow(packet->buffer)) {
+    // dissectSflow(packet->buffer, packet->buffer_len, packet->netflow_device_ip); /* sFlow */
+  } else {
+    struct string_list *sl = dissectNetFlow(worker, packet->sensor,
+                packet->netflow_device_ip, packet->buffer,
+                packet->buffer_len);
+    send_string_list_to_sink(sl,
+      worker->sink ? worker->sink : readOnlyGlobals.sink,
+      worker->flow_arena, &worker->stats);
+  }
+
+  freeQueuedPacket(packet);
+}
 
-    save_template(qtemplate->observation_id, qtemplate->template);
-    free(qtemplate->template);
-    free(qtemplate);
+/** Account a packet that leaves worker queue
+ * @param worker Worker
+ * @param packet Packet
+ */
+static void worker_queue_packet_out(worker_t *worker,
+                                                const QueuedPacket *packet) {
+  if (readOnlyGlobals.worker_queue.max_bytes) {
+    ATOMIC_OP(sub, fetch, &worker->queued_bytes.value, packet->buffer_len);
   }
 }
 
 static void *netFlowConsumerLoop(void *vworker) {
   worker_t *worker = vworker;
+  struct rb_ring_msg msgs[WORKER_QUEUE_BATCH];
 
   while(true) {
+    size_t i;
     // TODO Don't use magic constants!
-    QueuedPacket *packet = popPacketFromQueue_timedwait(&worker->packetsQueue, 800);
-    pop_all_templates(&worker->templates_queue);
+    const size_t n_msgs = rb_ring_pop_batch_timedwait(&worker->queue, msgs,
+      WORKER_QUEUE_BATCH, 800);
 
-    if (packet) {
-      // Consume all pending templates first
-      pop_all_templates(&worker->templates_queue);
+    if (n_msgs > 0) {
+      /* Don't let databases reloads free databases under our feet */
+      rb_epoch_enter(&readOnlyGlobals.rb_databases.epoch,
+        &worker->epoch_reader);
+    }
 
-      if(worker->stats.first_flow_processed_timestamp == 0) {
-        worker->stats.first_flow_processed_timestamp = time(NULL);
+    // Templates and packets are processed in the order they were queued
+    for (i=0; i<n_msgs; ++i) {
+      switch (msgs[i].type) {
+      case WORKER_MSG_TEMPLATE:
+        process_queued_template(msgs[i].ptr);
+        break;
+      case WORKER_MSG_PACKET:
+        worker_queue_packet_out(worker, msgs[i].ptr);
+        process_queued_packet(worker, msgs[i].ptr);
+        break;
+      default:
+        traceEvent(TRACE_ERROR, "Unknown worker message type %u",
+          msgs[i].type);
+        break;
       }
+    }
 
-      worker->stats.num_packets_received++;
-
-      if(isSflow(packet->buffer)) {
-        // dissectSflow(packet->buffer, packet->buffer_len, packet->netflow_device_ip); /* sFlow */
-      } else {
-        struct string_list *sl = dissectNetFlow(worker, packet->sensor,
-                    packet->netflow_device_ip, packet->buffer,
-                    packet->buffer_len);
-        send_string_list_to_kafka(sl);
-      }
+    if (n_msgs > 0) {
+      rb_epoch_exit(&worker->epoch_reader);
+    }
 
-      freeQueuedPacket(packet);
-    } else if (ATOMIC_OP(fetch, add, &worker->run.value, 0) == 0) {
-      // No pending packet & don't keep running
-      // Consume all pending templates to avoid memory leaks
-      pop_all_templates(&worker->templates_queue);
+    if (worker->sink) {
+      /* Serve our own sink events (i.e., kafka delivery reports) */
+      rb_sink_poll(worker->sink, 0);
+    }
 
+    if (0 == n_msgs && ATOMIC_OP(fetch, add, &worker->run.value, 0) == 0) {
+      // No pending messages & don't keep running
       worker->stats.last_flow_processed_timestamp = time(NULL);
       break;
     }
@@ -1786,13 +1976,13 @@ static void *netFlowConsumerLoop(void *vworker) {
 
 /* ********************************************************* */
 
-/** Creates a worker */
-worker_t *new_collect_worker() {
+worker_t *new_collect_worker(struct rb_sink *sink) {
   worker_t *ret = calloc(1, sizeof(*ret));
   if (likely(ret)) {
 #ifdef WORKER_S_MAGIC
     ret->magic = WORKER_S_MAGIC;
 #endif
+    ret->sink = sink;
 
     pthread_attr_t tattr;
     struct sched_param param;
@@ -1809,8 +1999,18 @@ worker_t *new_collect_worker() {
     }
 
     ret->run.value = 1;
-    rd_fifoq_init(&ret->packetsQueue);
-    template_queue_init(&ret->templates_queue);
+    const size_t queue_size = readOnlyGlobals.worker_queue.size ?
+      readOnlyGlobals.worker_queue.size : WORKER_QUEUE_DEFAULT_SIZE;
+    if (unlikely(0 != rb_ring_init(&ret->queue, queue_size))) {
+      free(ret);
+      return NULL;
+    }
+
+    rb_epoch_register(&readOnlyGlobals.rb_databases.epoch, &ret->epoch_reader);
+    /* Worker can live without cache, it will just be slower */
+    ret->enrichment_cache = new_enrichment_cache(
+                                              ENRICHMENT_CACHE_DEFAULT_SIZE);
+    ret->flow_arena = new_flow_arena(FLOW_ARENA_DEFAULT_MAX_OBJECTS);
 
     const int pthread_create_rc = pthread_create(&ret->tid, &tattr,
                                                       netFlowConsumerLoop, ret);
@@ -1818,7 +2018,11 @@ worker_t *new_collect_worker() {
       char berr[BUFSIZ];
       strerror_r(errno, berr, sizeof(berr));
       traceEvent(TRACE_ERROR, "Couldn't create worker thread: %s", berr);
-      rd_fifoq_destroy(&ret->packetsQueue);
+      rb_epoch_unregister(&readOnlyGlobals.rb_databases.epoch,
+        &ret->epoch_reader);
+      enrichment_cache_done(ret->enrichment_cache);
+      flow_arena_done(ret->flow_arena);
+      rb_ring_done(&ret->queue);
       free(ret);
       ret = 0;
     }
@@ -1827,19 +2031,153 @@ worker_t *new_collect_worker() {
   return ret;
 };
 
-/** Adds a packet to worker
+/** Try to push a packet in worker queue, respecting queue limits
+  @param qpacket Packet to add
+  @param worker Worker queue to add
+  @return 0 if pushed, !0 if queue is full
+  */
+static int worker_queue_try_push(QueuedPacket *qpacket, worker_t *worker) {
+  const uint64_t max_bytes = readOnlyGlobals.worker_queue.max_bytes;
+  const uint64_t len = qpacket->buffer_len;
+
+  if (max_bytes) {
+    const uint64_t queued_bytes = ATOMIC_OP(add, fetch,
+      &worker->queued_bytes.value, len);
+    /* Always allow at least one packet, no matter how big */
+    if (queued_bytes > max_bytes && queued_bytes > len) {
+      ATOMIC_OP(sub, fetch, &worker->queued_bytes.value, len);
+      return -1;
+    }
+  }
+
+  if (0 != rb_ring_try_push(&worker->queue, qpacket, WORKER_MSG_PACKET)) {
+    if (max_bytes) {
+      ATOMIC_OP(sub, fetch, &worker->queued_bytes.value, len);
+    }
+    return -1;
+  }
+
+  return 0;
+}
+
+/** Try to push many packets in worker queue at once, respecting queue limits
+  @param qpackets Packets to add
+  @param n Number of packets
+  @param worker Worker queue to add
+  @return Number of pushed packets, that are always the first ones
+  */
+static size_t worker_queue_try_push_batch(QueuedPacket **qpackets, size_t n,
+                                                            worker_t *worker) {
+  const uint64_t max_bytes = readOnlyGlobals.worker_queue.max_bytes;
+  uint64_t len = 0;
+  size_t i;
+
+  if (max_bytes) {
+    for (i=0; i<n; ++i) {
+      len += qpackets[i]->buffer_len;
+    }
+
+    const uint64_t queued_bytes = ATOMIC_OP(add, fetch,
+      &worker->queued_bytes.value, len);
+    if (queued_bytes > max_bytes) {
+      /* Let add_packet_to_worker apply the policy one by one */
+      ATOMIC_OP(sub, fetch, &worker->queued_bytes.value, len);
+      return 0;
+    }
+  }
+
+  const size_t pushed = rb_ring_try_push_batch(&worker->queue,
+    (void **)qpackets, n, WORKER_MSG_PACKET);
+
+  if (max_bytes && pushed < n) {
+    /* Pushed packets could be already freed by the worker */
+    for (i=pushed, len=0; i<n; ++i) {
+      len += qpackets[i]->buffer_len;
+    }
+    ATOMIC_OP(sub, fetch, &worker->queued_bytes.value, len);
+  }
+
+  return pushed;
+}
+
+/** Drop a packet because of worker overload
+  @param qpacket Packet to drop
+  @param worker Worker
+  */
+static void worker_drop_packet(QueuedPacket *qpacket, worker_t *worker) {
+  ATOMIC_OP(add, fetch, &worker->dropped_packets.value, 1);
+  if (qpacket->sensor) {
+    sensor_add_dropped_packets(qpacket->sensor, 1);
+  }
+  freeQueuedPacket(qpacket);
+}
+
+/** Drop the oldest packet of worker queue
+  @param worker Worker
+  @return 0 if dropped, !0 if there is no packet at the head of the queue
+  */
+static int worker_drop_oldest_packet(worker_t *worker) {
+  struct rb_ring_msg msg;
+  if (0 != rb_ring_try_pop_type(&worker->queue, &msg, WORKER_MSG_PACKET)) {
+    return -1;
+  }
+
+  worker_queue_packet_out(worker, msg.ptr);
+  worker_drop_packet(msg.ptr, worker);
+  return 0;
+}
+
+/** Adds a packet to worker. If worker queue is full, applies configured
+  overload policy.
   @param qpacket Packet to add
   @param worker Worker queue to add
   */
 void add_packet_to_worker(struct queued_packet_s *qpacket, worker_t *worker) {
-  addPacketToQueue(qpacket, &worker->packetsQueue);
+  unsigned rounds = 0;
+
+  while (0 != worker_queue_try_push(qpacket, worker)) {
+    switch (readOnlyGlobals.worker_queue.policy) {
+    case WORKER_QUEUE_DROP_NEWEST:
+      worker_drop_packet(qpacket, worker);
+      return;
+
+    case WORKER_QUEUE_DROP_OLDEST:
+      if (0 != worker_drop_oldest_packet(worker)) {
+        /* Template in queue head or queue drained by worker. */
+        if (rounds++ > 0) {
+          worker_drop_packet(qpacket, worker);
+          return;
+        }
+      }
+      break;
+
+    case WORKER_QUEUE_BLOCK:
+    default:
+      if (rounds++ < 16) {
+        sched_yield();
+      } else {
+        usleep(100);
+      }
+      break;
+    }
+  }
+}
+
+void add_packets_to_worker(struct queued_packet_s **qpackets, size_t n,
+                                                            worker_t *worker) {
+  size_t i;
+  const size_t pushed = worker_queue_try_push_batch(qpackets, n, worker);
+
+  for (i=pushed; i<n; ++i) {
+    add_packet_to_worker(qpackets[i], worker);
+  }
 }
 
 void add_template_to_worker(struct flowSetV9Ipfix *template,
                           observation_id_t *observation_id, worker_t *worker) {
   queued_template_t *qtemplate = new_queued_template(template, observation_id);
   if (qtemplate) {
-    template_queue_push(qtemplate, &worker->templates_queue);
+    rb_ring_push(&worker->queue, qtemplate, WORKER_MSG_TEMPLATE);
   }
 }
 
@@ -1849,17 +2187,26 @@ void add_template_to_worker(struct flowSetV9Ipfix *template,
   */
 void get_worker_stats(worker_t *worker, struct worker_stats *stats) {
   memcpy(stats, &worker->stats, sizeof(*stats));
+  stats->num_dropped_packets =
+    ATOMIC_OP(fetch, add, &worker->dropped_packets.value, 0);
+  if (worker->enrichment_cache) {
+    enrichment_cache_stats(worker->enrichment_cache,
+      &stats->num_enrichment_cache_hits, &stats->num_enrichment_cache_misses);
+  }
 }
 
 /** Free worker's allocated resources */
 void collect_worker_done(worker_t *worker, struct worker_stats *stats) {
   ATOMIC_OP(fetch,and,&worker->run.value,0);
   pthread_join(worker->tid, NULL);
-  template_queue_destroy(&worker->templates_queue);
-  rd_fifoq_destroy(&worker->packetsQueue);
+  rb_epoch_unregister(&readOnlyGlobals.rb_databases.epoch,
+    &worker->epoch_reader);
+  rb_ring_done(&worker->queue);
 
   if (stats) {
     get_worker_stats(worker, stats);
   }
+  enrichment_cache_done(worker->enrichment_cache);
+  flow_arena_done(worker->flow_arena);
   free(worker);
 }
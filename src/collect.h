@@ -32,8 +32,45 @@ struct worker_stats {
   num_flows_unknown_template,
   num_flows_processed, num_good_templates_received,
   num_known_templates, num_bad_templates_received;
+  /// Packets dropped because of worker queue overload
+  uint64_t num_dropped_packets;
+  /// Enrichment cache fields hits and misses
+  uint64_t num_enrichment_cache_hits, num_enrichment_cache_misses;
+  /// Kafka messages that had to wait for room in producer queue
+  uint64_t num_kafka_delayed_msgs;
+  /// Kafka messages dropped because producer queue was full for too long,
+  /// because they were too large, or because of other errors
+  uint64_t num_kafka_dropped_queue_full, num_kafka_dropped_msg_size,
+    num_kafka_dropped_other;
+  /// Messages dropped by non kafka sinks
+  uint64_t num_sink_dropped_msgs;
 };
 
+/// What to do with a new packet if worker queue is full
+enum worker_queue_policy {
+  WORKER_QUEUE_BLOCK,       ///< Wait for the worker to make room
+  WORKER_QUEUE_DROP_NEWEST, ///< Drop the new packet
+  WORKER_QUEUE_DROP_OLDEST, ///< Drop the oldest queued packet
+};
+
+/// Flow messages encoding
+enum output_format {
+  OUTPUT_FORMAT_JSON, ///< JSON objects
+  OUTPUT_FORMAT_CBOR, ///< CBOR maps (RFC 8949), with the same keys and values
+};
+
+/// Default worker queue capacity, in packets
+#define WORKER_QUEUE_DEFAULT_SIZE 16384
+
+/// Default period of running statistics
+#define STATS_DEFAULT_INTERVAL_S 300
+
+/// Default max time to wait for room in a full kafka producer queue
+#define KAFKA_QUEUE_FULL_DEFAULT_TIMEOUT_MS 5000
+
+/// Default max size of kafka spill journal, in MB
+#define KAFKA_SPILL_DEFAULT_MAX_MB 1024
+
 /** a+=b in worker stats */
 void sum_worker_stats(struct worker_stats *a, const struct worker_stats *b);
 
@@ -41,8 +78,14 @@ void sum_worker_stats(struct worker_stats *a, const struct worker_stats *b);
 */
 typedef struct worker_s worker_t;
 
-/** Creates a worker */
-worker_t *new_collect_worker();
+struct rb_sink;
+
+/** Creates a worker
+  @param sink Sink to send worker flows. If NULL, main sink
+  (readOnlyGlobals.sink) will be used, and worker will not poll it
+  @return New worker
+  */
+worker_t *new_collect_worker(struct rb_sink *sink);
 
 /// @todo delete this FW declaration
 struct queued_packet_s;
@@ -54,6 +97,16 @@ struct flowSetV9Ipfix;
   */
 void add_packet_to_worker(struct queued_packet_s *qpacket, worker_t *worker);
 
+/** Adds many packets to worker, pushing as many of them as possible in the
+  same queue operation. Packets that do not fit are added one by one, with
+  the worker queue overload policy.
+  @param qpackets Packets to add
+  @param n Number of packets
+  @param worker Worker queue to add
+  */
+void add_packets_to_worker(struct queued_packet_s **qpackets, size_t n,
+  worker_t *worker);
+
 /** Add a template to worker sensor
  * @param template Template to add
  * @param observation_id Template observation domain id
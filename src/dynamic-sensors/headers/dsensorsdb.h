@@ -45,6 +45,10 @@ void *sensor_get_worker(const sensor_t *sensor);
 
 void sensor_set_worker(sensor_t *sensor, void *worker);
 
+void sensor_add_dropped_packets(const sensor_t *sensor, uint64_t packets);
+
+uint64_t sensor_get_dropped_packets(const sensor_t *sensor);
+
 void sensor_add_observation_id(sensor_t *sensor,
                                observation_id_t *observation_id);
 
@@ -63,6 +67,10 @@ const network_t *
 observation_id_get_network(const observation_id_t *observation_id,
                            const uint8_t ip[16]);
 
+bool observation_id_get_network_info(const observation_id_t *observation_id,
+                                     const uint8_t ip[16], const char **ip_str,
+                                     const char **name);
+
 const selector_t *
 observation_id_get_selector(const observation_id_t *observation_id,
                             uint64_t selector_id);
@@ -33,6 +33,9 @@ pub extern "C" fn sensors_db_list(database_ptr: *const SensorsDB,
     }
 
     unsafe { *len = sensors_ptrs.len() as size_t };
+    if sensors_ptrs.is_empty() {
+        return ptr::null_mut();
+    }
     let mut raw_slice = sensors_ptrs.into_boxed_slice();
     let raw_ptr = raw_slice.as_mut_ptr();
     Box::into_raw(raw_slice);
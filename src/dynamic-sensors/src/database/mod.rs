@@ -1,5 +1,6 @@
 pub mod bindings;
 
+use lpm::LpmTable;
 use sensor::Sensor;
 use util::apply_netmask;
 
@@ -8,7 +9,11 @@ use std::net::IpAddr;
 
 #[derive(Default)]
 pub struct SensorsDB {
-    database: HashMap<IpAddr, Sensor>,
+    sensors: Vec<Sensor>,
+    /// Sensor network -> index in sensors
+    networks: HashMap<IpAddr, usize>,
+    /// Longest prefix match index of sensors networks
+    lpm: LpmTable<usize>,
 }
 
 impl SensorsDB {
@@ -16,45 +21,43 @@ impl SensorsDB {
         SensorsDB::default()
     }
 
+    /// Most specific sensor whose network contains ip
     pub fn get_sensor(&self, ip: IpAddr) -> Option<&Sensor> {
-        let ip = if let IpAddr::V6(ipv6) = ip {
-            match ipv6.to_ipv4() {
-                Some(ipv4) => IpAddr::from(ipv4),
-                None => IpAddr::from(ipv6),
-            }
-        } else {
-            ip
-        };
-
-        for sensor in self.database.values() {
-            let network = apply_netmask(&ip, &sensor.get_netmask());
-            if let Some(sensor) = self.database.get(&network) {
-                return Some(sensor);
-            }
-        }
-
-        None
+        self.lpm.lookup(ip).map(|idx| &self.sensors[*idx])
     }
 
     pub fn list_sensors(&self) -> Vec<&Sensor> {
-        let mut sensors = Vec::new();
-        for sensor in self.database.values() {
-            sensors.push(sensor);
-        }
+        self.sensors.iter().collect()
+    }
 
-        sensors
+    pub fn len(&self) -> usize {
+        self.sensors.len()
     }
 
+    /// Adds a sensor. A sensor with the same network replaces the previous
+    /// one. Netmasks are expected to be contiguous.
     pub fn add_sensor(&mut self, sensor: Sensor) {
         let network = apply_netmask(&sensor.get_network(), &sensor.get_netmask());
-        self.database.insert(network, sensor);
+        let prefix_len = sensor.get_netmask_prefix_len();
+
+        if let Some(idx) = self.networks.get(&network) {
+            self.sensors[*idx] = sensor;
+            return;
+        }
+
+        let idx = self.sensors.len();
+        self.sensors.push(sensor);
+        self.networks.insert(network, idx);
+        self.lpm.insert(network, prefix_len, idx);
     }
 }
 
 #[cfg(test)]
 mod tests {
     use super::*;
-    use std::net::Ipv4Addr;
+    use std::net::{Ipv4Addr, Ipv6Addr};
+    use std::str::FromStr;
+    use test::Bencher;
 
     #[test]
     fn test_add_sensors() {
@@ -79,4 +82,90 @@ mod tests {
                    sensor_in_db_3.unwrap().get_network());
         assert!(sensor_in_db_4.is_none());
     }
+
+    #[test]
+    fn test_overlapping_sensors() {
+        let mut database = SensorsDB::new();
+
+        database.add_sensor(Sensor::new(IpAddr::from(Ipv4Addr::new(10, 0, 0, 0)),
+                                        IpAddr::from(Ipv4Addr::new(255, 0, 0, 0))));
+        database.add_sensor(Sensor::new(IpAddr::from(Ipv4Addr::new(10, 1, 0, 0)),
+                                        IpAddr::from(Ipv4Addr::new(255, 255, 0, 0))));
+        database.add_sensor(Sensor::new(IpAddr::from(Ipv4Addr::new(10, 1, 2, 3)),
+                                        IpAddr::from(Ipv4Addr::new(255, 255, 255, 255))));
+
+        let network = |ip| format!("{}", database.get_sensor(IpAddr::from(ip)).unwrap().get_network());
+        assert_eq!(network(Ipv4Addr::new(10, 2, 0, 1)), "10.0.0.0");
+        assert_eq!(network(Ipv4Addr::new(10, 1, 2, 4)), "10.1.0.0");
+        assert_eq!(network(Ipv4Addr::new(10, 1, 2, 3)), "10.1.2.3");
+        assert_eq!(database.list_sensors().len(), 3);
+    }
+
+    #[test]
+    fn test_ipv6_sensors() {
+        let mut database = SensorsDB::new();
+        let network = Ipv6Addr::from_str("2001:db8::").unwrap();
+        let netmask = Ipv6Addr::from_str("ffff:ffff::").unwrap();
+        database.add_sensor(Sensor::new(IpAddr::from(network), IpAddr::from(netmask)));
+
+        let in_network = Ipv6Addr::from_str("2001:db8::1").unwrap();
+        let out_network = Ipv6Addr::from_str("2001:db9::1").unwrap();
+        assert!(database.get_sensor(IpAddr::from(in_network)).is_some());
+        assert!(database.get_sensor(IpAddr::from(out_network)).is_none());
+    }
+
+    /// Deterministic pseudo-random generator, so benchmarks are repeatable
+    fn xorshift(state: &mut u32) -> u32 {
+        *state ^= *state << 13;
+        *state ^= *state >> 17;
+        *state ^= *state << 5;
+        *state
+    }
+
+    fn random_sensors_db(n_sensors: usize) -> SensorsDB {
+        let mut database = SensorsDB::new();
+        let mut state = 0x5eed;
+        while database.len() < n_sensors {
+            let prefix_len = 16 + xorshift(&mut state) % 17;
+            let netmask = if prefix_len == 0 { 0 } else { !0u32 << (32 - prefix_len) };
+            let network = xorshift(&mut state) & netmask;
+            database.add_sensor(Sensor::new(IpAddr::from(Ipv4Addr::from(network)),
+                                            IpAddr::from(Ipv4Addr::from(netmask))));
+        }
+
+        database
+    }
+
+    fn bench_get_sensor(b: &mut Bencher, n_sensors: usize) {
+        let database = random_sensors_db(n_sensors);
+        let mut state = 0xbe7c;
+        let ips: Vec<IpAddr> = (0..1024)
+            .map(|_| IpAddr::from(Ipv4Addr::from(xorshift(&mut state))))
+            .collect();
+
+        b.iter(|| {
+            let mut found = 0;
+            for ip in &ips {
+                if database.get_sensor(*ip).is_some() {
+                    found += 1;
+                }
+            }
+            found
+        });
+    }
+
+    #[bench]
+    fn bench_get_sensor_1k(b: &mut Bencher) {
+        bench_get_sensor(b, 1000);
+    }
+
+    #[bench]
+    fn bench_get_sensor_10k(b: &mut Bencher) {
+        bench_get_sensor(b, 10000);
+    }
+
+    #[bench]
+    fn bench_get_sensor_100k(b: &mut Bencher) {
+        bench_get_sensor(b, 100000);
+    }
 }
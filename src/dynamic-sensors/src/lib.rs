@@ -1,6 +1,9 @@
 #![feature(i128_type)]
+#![cfg_attr(test, feature(test))]
 
 extern crate libc;
+#[cfg(test)]
+extern crate test;
 
 pub mod application;
 pub mod database;
@@ -9,6 +12,7 @@ pub mod observation_id;
 pub mod selector;
 pub mod network;
 pub mod interface;
+pub mod lpm;
 pub mod util;
 
 #[repr(C)]
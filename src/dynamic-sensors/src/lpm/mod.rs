@@ -0,0 +1,280 @@
+use std::net::IpAddr;
+
+/// Longest prefix match table for IPv4 and IPv6 networks. Every address
+/// family has its own path-compressed binary radix trie, so a lookup visits
+/// at most one node per distinct prefix length along the address path.
+pub struct LpmTable<V> {
+    v4: LpmTrie<V>,
+    v6: LpmTrie<V>,
+}
+
+impl<V> Default for LpmTable<V> {
+    fn default() -> Self {
+        LpmTable {
+            v4: LpmTrie::new(),
+            v6: LpmTrie::new(),
+        }
+    }
+}
+
+impl<V> LpmTable<V> {
+    pub fn new() -> Self {
+        LpmTable::default()
+    }
+
+    /// Inserts a network. IPv4-mapped IPv6 networks are stored as IPv4 ones.
+    /// Returns the previous value of the same network, if any.
+    pub fn insert(&mut self, network: IpAddr, prefix_len: u32, value: V) -> Option<V> {
+        match network {
+            IpAddr::V4(ip) => self.v4.insert(ipv4_key(&ip.octets()), prefix_len.min(32) as u8, value),
+            IpAddr::V6(ip) => {
+                match ip.to_ipv4() {
+                    Some(ipv4) if is_ipv4_mapped(&ip.octets()) => {
+                        let prefix_len = prefix_len.saturating_sub(96).min(32);
+                        self.v4.insert(ipv4_key(&ipv4.octets()), prefix_len as u8, value)
+                    }
+                    _ => self.v6.insert(ipv6_key(&ip.octets()), prefix_len.min(128) as u8, value),
+                }
+            }
+        }
+    }
+
+    /// Value of the most specific network containing ip
+    pub fn lookup(&self, ip: IpAddr) -> Option<&V> {
+        match ip {
+            IpAddr::V4(ip) => self.v4.lookup(ipv4_key(&ip.octets())),
+            IpAddr::V6(ip) => {
+                let octets = ip.octets();
+                if is_ipv4_mapped(&octets) {
+                    self.v4.lookup(ipv4_key(&[octets[12], octets[13], octets[14], octets[15]]))
+                } else {
+                    self.v6.lookup(ipv6_key(&octets))
+                }
+            }
+        }
+    }
+
+    pub fn len(&self) -> usize {
+        self.v4.len() + self.v6.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+}
+
+fn is_ipv4_mapped(octets: &[u8; 16]) -> bool {
+    octets[..10].iter().all(|o| *o == 0) && octets[10] == 0xff && octets[11] == 0xff
+}
+
+/// IPv4 address, left aligned in the 128 bits key
+fn ipv4_key(octets: &[u8; 4]) -> u128 {
+    let mut key = 0u128;
+    for octet in octets.iter() {
+        key = (key << 8) | (*octet as u128);
+    }
+
+    key << 96
+}
+
+fn ipv6_key(octets: &[u8; 16]) -> u128 {
+    let mut key = 0u128;
+    for octet in octets.iter() {
+        key = (key << 8) | (*octet as u128);
+    }
+
+    key
+}
+
+fn prefix_mask(len: u8) -> u128 {
+    if len == 0 { 0 } else { !0u128 << (128 - len as u32) }
+}
+
+fn bit_at(key: u128, pos: u8) -> usize {
+    ((key >> (127 - pos as u32)) & 1) as usize
+}
+
+/// Length of the common prefix of a and b, up to max_len bits
+fn common_prefix_len(a: u128, b: u128, max_len: u8) -> u8 {
+    let common = (a ^ b).leading_zeros() as u8;
+    common.min(max_len)
+}
+
+struct Node<V> {
+    /// Prefix, left aligned and with the bits beyond len cleared
+    key: u128,
+    len: u8,
+    value: Option<V>,
+    children: [Option<Box<Node<V>>>; 2],
+}
+
+impl<V> Node<V> {
+    fn new(key: u128, len: u8, value: Option<V>) -> Self {
+        Node {
+            key: key & prefix_mask(len),
+            len: len,
+            value: value,
+            children: [None, None],
+        }
+    }
+}
+
+/// Path-compressed binary radix trie over 128 bits left aligned keys
+pub struct LpmTrie<V> {
+    root: Option<Box<Node<V>>>,
+    len: usize,
+}
+
+impl<V> LpmTrie<V> {
+    pub fn new() -> Self {
+        LpmTrie { root: None, len: 0 }
+    }
+
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    /// Inserts prefix key/len. Returns the previous value of the prefix.
+    pub fn insert(&mut self, key: u128, len: u8, value: V) -> Option<V> {
+        let key = key & prefix_mask(len);
+        let ret = Self::insert_node(&mut self.root, key, len, value);
+        if ret.is_none() {
+            self.len += 1;
+        }
+
+        ret
+    }
+
+    fn insert_node(slot: &mut Option<Box<Node<V>>>, key: u128, len: u8, value: V) -> Option<V> {
+        let mut node = match slot.take() {
+            None => {
+                *slot = Some(Box::new(Node::new(key, len, Some(value))));
+                return None;
+            }
+            Some(node) => node,
+        };
+
+        let common = common_prefix_len(node.key, key, node.len.min(len));
+        let ret = if common == node.len && common == len {
+            // Same prefix
+            node.value.replace(value)
+        } else if common == node.len {
+            // Node prefix contains the new one
+            let bit = bit_at(key, node.len);
+            Self::insert_node(&mut node.children[bit], key, len, value)
+        } else {
+            // Split node in the first different bit
+            let mut parent = Box::new(Node::new(key, common, None));
+            let node_bit = bit_at(node.key, common);
+            parent.children[node_bit] = Some(node);
+            if common == len {
+                parent.value = Some(value);
+            } else {
+                parent.children[1 - node_bit] = Some(Box::new(Node::new(key, len, Some(value))));
+            }
+
+            node = parent;
+            None
+        };
+
+        *slot = Some(node);
+        ret
+    }
+
+    /// Value of the longest prefix containing key
+    pub fn lookup(&self, key: u128) -> Option<&V> {
+        let mut best = None;
+        let mut cursor = self.root.as_ref();
+
+        while let Some(node) = cursor {
+            if (key ^ node.key) & prefix_mask(node.len) != 0 {
+                break;
+            }
+
+            if node.value.is_some() {
+                best = node.value.as_ref();
+            }
+
+            if node.len == 128 {
+                break;
+            }
+
+            cursor = node.children[bit_at(key, node.len)].as_ref();
+        }
+
+        best
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::net::{Ipv4Addr, Ipv6Addr};
+    use std::str::FromStr;
+
+    fn v4(ip: &str) -> IpAddr {
+        IpAddr::from(Ipv4Addr::from_str(ip).unwrap())
+    }
+
+    fn v6(ip: &str) -> IpAddr {
+        IpAddr::from(Ipv6Addr::from_str(ip).unwrap())
+    }
+
+    #[test]
+    fn longest_prefix_wins() {
+        let mut table = LpmTable::new();
+        table.insert(v4("10.0.0.0"), 8, 8);
+        table.insert(v4("10.1.0.0"), 16, 16);
+        table.insert(v4("10.1.1.0"), 24, 24);
+        table.insert(v4("10.1.1.1"), 32, 32);
+
+        assert_eq!(table.lookup(v4("10.2.3.4")), Some(&8));
+        assert_eq!(table.lookup(v4("10.1.3.4")), Some(&16));
+        assert_eq!(table.lookup(v4("10.1.1.4")), Some(&24));
+        assert_eq!(table.lookup(v4("10.1.1.1")), Some(&32));
+        assert_eq!(table.lookup(v4("11.1.1.1")), None);
+        assert_eq!(table.len(), 4);
+    }
+
+    #[test]
+    fn insertion_order_does_not_matter() {
+        let mut table = LpmTable::new();
+        table.insert(v4("10.1.1.0"), 24, 24);
+        table.insert(v4("10.1.0.0"), 16, 16);
+        table.insert(v4("10.0.0.0"), 8, 8);
+        table.insert(v4("10.1.2.0"), 24, 25);
+
+        assert_eq!(table.lookup(v4("10.2.3.4")), Some(&8));
+        assert_eq!(table.lookup(v4("10.1.3.4")), Some(&16));
+        assert_eq!(table.lookup(v4("10.1.1.4")), Some(&24));
+        assert_eq!(table.lookup(v4("10.1.2.4")), Some(&25));
+    }
+
+    #[test]
+    fn replace_and_default_route() {
+        let mut table = LpmTable::new();
+        assert_eq!(table.insert(v4("192.168.1.0"), 24, 1), None);
+        assert_eq!(table.insert(v4("192.168.1.7"), 24, 2), Some(1));
+        assert_eq!(table.lookup(v4("192.168.1.1")), Some(&2));
+        assert_eq!(table.lookup(v4("1.1.1.1")), None);
+
+        table.insert(v4("0.0.0.0"), 0, 0);
+        assert_eq!(table.lookup(v4("1.1.1.1")), Some(&0));
+        assert_eq!(table.len(), 2);
+    }
+
+    #[test]
+    fn ipv6_and_mapped_ipv4() {
+        let mut table = LpmTable::new();
+        table.insert(v6("2001:db8::"), 32, 32);
+        table.insert(v6("2001:db8:1::"), 48, 48);
+        table.insert(v6("::ffff:192.168.0.0"), 112, 4);
+
+        assert_eq!(table.lookup(v6("2001:db8:1::1")), Some(&48));
+        assert_eq!(table.lookup(v6("2001:db8:2::1")), Some(&32));
+        assert_eq!(table.lookup(v6("2001:db9::1")), None);
+        assert_eq!(table.lookup(v4("192.168.3.3")), Some(&4));
+        assert_eq!(table.lookup(v6("::ffff:192.168.3.3")), Some(&4));
+        assert_eq!(table.lookup(v4("192.169.3.3")), None);
+    }
+}
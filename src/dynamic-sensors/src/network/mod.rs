@@ -44,6 +44,13 @@ impl Network {
         &self.netmask
     }
 
+    pub fn get_prefix_len(&self) -> u32 {
+        match self.netmask {
+            IpAddr::V4(_) => get_netmask_prefix_ipv4(self.netmask),
+            IpAddr::V6(_) => get_netmask_prefix_ipv6(self.netmask),
+        }
+    }
+
     pub fn get_ip_str(&self) -> &CString {
         &self.addres_as_str
     }
@@ -110,6 +110,37 @@ pub extern "C" fn observation_id_get_network(observation_id_ptr: *const Observat
     }
 }
 
+/// Looks up the home network of ip, returning both its address string and its
+/// name, so callers need only one FFI call (and one trie walk) per address.
+#[no_mangle]
+pub extern "C" fn observation_id_get_network_info(observation_id_ptr: *const ObservationID,
+                                                  ip: &[u8; 16],
+                                                  ip_str: *mut *const c_char,
+                                                  name: *mut *const c_char)
+                                                  -> bool {
+    assert!(!observation_id_ptr.is_null());
+    let observation_id = unsafe { &*observation_id_ptr };
+
+    let network = observation_id.get_network(IpAddr::from(*ip));
+    let (network_ip_str, network_name) = match network {
+        Some(network) => {
+            (network.get_ip_str().as_ptr(), network.get_name().as_ptr())
+        }
+        None => (ptr::null(), ptr::null()),
+    };
+
+    unsafe {
+        if !ip_str.is_null() {
+            *ip_str = network_ip_str;
+        }
+        if !name.is_null() {
+            *name = network_name;
+        }
+    }
+
+    network.is_some()
+}
+
 #[no_mangle]
 pub extern "C" fn observation_id_get_interface(observation_id_ptr: *const ObservationID,
                                                interface_id: u64)
@@ -4,7 +4,7 @@ use application::Application;
 use selector::Selector;
 use network::Network;
 use interface::Interface;
-use util::apply_netmask;
+use lpm::LpmTable;
 
 use libc::c_void;
 use std::collections::HashMap;
@@ -15,7 +15,12 @@ pub struct ObservationID {
     enrichment: Option<Vec<u8>>,
     fallback_first_switch: Option<i64>,
     applications: HashMap<u64, Application>,
-    networks: HashMap<IpAddr, Network>,
+    /// Home networks
+    networks: Vec<Network>,
+    /// Home network address -> index in networks
+    networks_idx: HashMap<IpAddr, usize>,
+    /// Longest prefix match index of home networks
+    networks_lpm: LpmTable<usize>,
     selectors: HashMap<u64, Selector>,
     interfaces: HashMap<u64, Interface>,
     templates: HashMap<u16, *mut c_void>,
@@ -34,7 +39,9 @@ impl ObservationID {
             enrichment: None,
             fallback_first_switch: None,
             applications: HashMap::new(),
-            networks: HashMap::new(),
+            networks: Vec::new(),
+            networks_idx: HashMap::new(),
+            networks_lpm: LpmTable::new(),
             selectors: HashMap::new(),
             interfaces: HashMap::new(),
             templates: HashMap::new(),
@@ -51,28 +58,9 @@ impl ObservationID {
         self.id
     }
 
+    /// Most specific home network that contains ip
     pub fn get_network(&self, ip: IpAddr) -> Option<&Network> {
-        let ip = if let IpAddr::V6(ipv6) = ip {
-            match ipv6.to_ipv4() {
-                Some(ipv4) => IpAddr::from(ipv4),
-                None => IpAddr::from(ipv6),
-            }
-        } else {
-            ip
-        };
-
-        for home_net in self.networks.values() {
-
-            if ip.is_ipv4() && home_net.get_netmask().is_ipv4() ||
-               ip.is_ipv6() && home_net.get_netmask().is_ipv6() {
-                let network = apply_netmask(&ip, &home_net.get_netmask());
-                if let Some(network) = self.networks.get(&network) {
-                    return Some(network);
-                };
-            }
-        }
-
-        None
+        self.networks_lpm.lookup(ip).map(|idx| &self.networks[*idx])
     }
 
     pub fn list_templates(&self) -> Vec<u16> {
@@ -142,8 +130,21 @@ impl ObservationID {
         self.interfaces.insert(interface.get_id(), interface);
     }
 
+    /// Adds a home network. A network with the same address replaces the
+    /// previous one.
     pub fn add_network(&mut self, network: Network) {
-        self.networks.insert(*network.get_ip(), network);
+        let address = *network.get_ip();
+        let prefix_len = network.get_prefix_len();
+
+        if let Some(idx) = self.networks_idx.get(&address) {
+            self.networks[*idx] = network;
+            return;
+        }
+
+        let idx = self.networks.len();
+        self.networks.push(network);
+        self.networks_idx.insert(address, idx);
+        self.networks_lpm.insert(address, prefix_len, idx);
     }
 
     pub fn add_template(&mut self, id: u16, template: *mut c_void) {
@@ -225,4 +226,53 @@ mod tests {
         let should_exists = observation_id.get_network(IpAddr::from_str("10.13.30.44").unwrap());
         assert!(should_exists.is_some());
     }
+
+    #[test]
+    fn test_networks_most_specific() {
+        let mut observation_id = ObservationID::new(1234);
+
+        observation_id.add_network(Network::new(IpAddr::from_str("10.0.0.0").unwrap(),
+                                                IpAddr::from_str("255.0.0.0").unwrap(),
+                                                "wide-net"));
+        observation_id.add_network(Network::new(IpAddr::from_str("10.13.0.0").unwrap(),
+                                                IpAddr::from_str("255.255.0.0").unwrap(),
+                                                "narrow-net"));
+        observation_id.add_network(Network::new(IpAddr::from_str("2001:db8::").unwrap(),
+                                                IpAddr::from_str("ffff:ffff::").unwrap(),
+                                                "v6-net"));
+
+        let name = |ip: &str| {
+            observation_id.get_network(IpAddr::from_str(ip).unwrap())
+                .map(|network| network.get_name().to_str().unwrap().to_string())
+        };
+
+        assert_eq!(name("10.13.30.44"), Some(String::from("narrow-net")));
+        assert_eq!(name("::ffff:10.13.30.44"), Some(String::from("narrow-net")));
+        assert_eq!(name("10.14.30.44"), Some(String::from("wide-net")));
+        assert_eq!(name("2001:db8:1::1"), Some(String::from("v6-net")));
+        assert_eq!(name("11.13.30.44"), None);
+        assert_eq!(name("2001:db9::1"), None);
+
+        assert_eq!(observation_id.get_network(IpAddr::from_str("10.13.1.1").unwrap())
+                       .unwrap()
+                       .get_ip_str()
+                       .to_str()
+                       .unwrap(),
+                   "10.13.0.0/16");
+    }
+
+    #[test]
+    fn test_networks_replace() {
+        let mut observation_id = ObservationID::new(1234);
+
+        observation_id.add_network(Network::new(IpAddr::from_str("10.13.0.0").unwrap(),
+                                                IpAddr::from_str("255.255.0.0").unwrap(),
+                                                "old-name"));
+        observation_id.add_network(Network::new(IpAddr::from_str("10.13.0.0").unwrap(),
+                                                IpAddr::from_str("255.255.0.0").unwrap(),
+                                                "new-name"));
+
+        let network = observation_id.get_network(IpAddr::from_str("10.13.1.1").unwrap());
+        assert_eq!(network.unwrap().get_name().to_str().unwrap(), "new-name");
+    }
 }
@@ -30,6 +30,9 @@ pub extern "C" fn sensor_get_observation_id_list(sensor_ptr: *const Sensor,
 
     let mut observation_id_list = sensor.list_observation_ids().into_boxed_slice();
     unsafe { *len = observation_id_list.len() as size_t };
+    if observation_id_list.is_empty() {
+        return ptr::null_mut();
+    }
     let sensor_list_raw = observation_id_list.as_mut_ptr();
 
     Box::into_raw(observation_id_list);
@@ -71,6 +74,26 @@ pub extern "C" fn sensor_set_worker(sensor_ptr: *mut Sensor, worker: *mut c_void
     sensor.set_worker(worker);
 }
 
+#[no_mangle]
+pub extern "C" fn sensor_add_dropped_packets(sensor_ptr: *const Sensor, packets: u64) {
+    let sensor = unsafe {
+        assert!(!sensor_ptr.is_null());
+        &*sensor_ptr
+    };
+
+    sensor.add_dropped_packets(packets);
+}
+
+#[no_mangle]
+pub extern "C" fn sensor_get_dropped_packets(sensor_ptr: *const Sensor) -> u64 {
+    let sensor = unsafe {
+        assert!(!sensor_ptr.is_null());
+        &*sensor_ptr
+    };
+
+    sensor.get_dropped_packets()
+}
+
 #[no_mangle]
 pub extern "C" fn sensor_add_observation_id(sensor_ptr: *mut Sensor,
                                             observation_id_ptr: *mut ObservationID) {
@@ -6,6 +6,7 @@ use util::{apply_netmask, v6_to_v4};
 use std::collections::HashMap;
 use libc::c_void;
 use std::net::IpAddr;
+use std::sync::atomic::{AtomicU64, Ordering};
 
 pub struct Sensor {
     network: IpAddr,
@@ -14,6 +15,7 @@ pub struct Sensor {
     worker: Option<*mut c_void>,
     default_observation_id: Option<ObservationID>,
     observation_id: HashMap<u32, ObservationID>,
+    dropped_packets: AtomicU64,
 }
 
 impl Sensor {
@@ -35,6 +37,7 @@ impl Sensor {
             worker: None,
             default_observation_id: None,
             observation_id: HashMap::new(),
+            dropped_packets: AtomicU64::new(0),
         }
     }
 
@@ -46,6 +49,14 @@ impl Sensor {
         self.netmask
     }
 
+    /// Number of bits set in the netmask
+    pub fn get_netmask_prefix_len(&self) -> u32 {
+        match self.netmask {
+            IpAddr::V4(netmask) => netmask.octets().iter().map(|o| o.count_ones()).sum(),
+            IpAddr::V6(netmask) => netmask.octets().iter().map(|o| o.count_ones()).sum(),
+        }
+    }
+
     pub fn get_network_string(&self) -> &str {
         &self.str_network
     }
@@ -88,6 +99,16 @@ impl Sensor {
     pub fn add_default_observation_id(&mut self, observation_id: ObservationID) {
         self.default_observation_id = Some(observation_id);
     }
+
+    /// Count packets of this sensor dropped because of worker overload. Can
+    /// be called from any thread.
+    pub fn add_dropped_packets(&self, packets: u64) {
+        self.dropped_packets.fetch_add(packets, Ordering::Relaxed);
+    }
+
+    pub fn get_dropped_packets(&self) -> u64 {
+        self.dropped_packets.load(Ordering::Relaxed)
+    }
 }
 
 #[cfg(test)]
@@ -118,4 +139,15 @@ mod tests {
         assert_eq!(sensor.get_observation_id(123).unwrap().get_id(), 123);
         assert_eq!(sensor.get_observation_id(456).unwrap().get_id(), 0);
     }
+
+    #[test]
+    fn count_dropped_packets() {
+        let sensor = Sensor::new(IpAddr::from(Ipv4Addr::from(3232235901)),
+                                 IpAddr::from(Ipv4Addr::from(0xFFFFFF00)));
+
+        assert_eq!(sensor.get_dropped_packets(), 0);
+        sensor.add_dropped_packets(1);
+        sensor.add_dropped_packets(3);
+        assert_eq!(sensor.get_dropped_packets(), 4);
+    }
 }
@@ -21,6 +21,7 @@
 
 #include "export.h"
 #include "util.h"
+#include "rb_cbor.h"
 #include "rb_mac.h"
 #include "rb_sensor.h"
 
@@ -67,6 +68,244 @@ void free_flowCache(struct flowCache *cache){
   free(cache);
 }
 
+/*
+ *  ENRICHMENT CACHE
+ */
+
+/// AS number and name of an address, split and ready to print
+struct AS_info{
+  const char *number;
+  size_t number_len;
+  const char *name;
+  size_t name_len;
+
+  char number_buf[sizeof("4294967295")]; ///< MaxMind DB AS number
+  char *rsp; ///< Legacy GeoIP response, to free
+};
+
+static void AS_info_done(struct AS_info *asinfo) {
+  free(asinfo->rsp);
+}
+
+/// Entries per enrichment cache set
+#define ENRICHMENT_CACHE_WAYS 4
+
+/// Enrichment cache entry fields
+enum enrichment_cache_field {
+  ENRICHMENT_CACHE_NET      = 1 << 0,
+  ENRICHMENT_CACHE_HOME_NET = 1 << 1,
+  ENRICHMENT_CACHE_COUNTRY  = 1 << 2,
+  ENRICHMENT_CACHE_AS       = 1 << 3,
+};
+
+struct enrichment_cache_entry {
+  uint8_t ip[16];
+  bool used;
+  bool referenced;   ///< CLOCK reference bit
+  uint8_t fields;    ///< Looked up fields (enrichment_cache_field)
+
+  const IPNameAssoc *net; ///< Global networks list entry
+
+  /// Observation id the home net fields belong to
+  const observation_id_t *home_net_observation_id;
+  const char *home_net_ip_str, *home_net_name;
+
+  const char *country;
+  size_t country_len;
+  struct AS_info as;
+};
+
+struct enrichment_cache {
+#ifndef NDEBUG
+#define ENRICHMENT_CACHE_MAGIC 0xE1CAC4EE1CAC4EL
+  uint64_t magic;
+#endif
+  /// rb_databases generation when the cache was filled
+  uint64_t generation;
+  /// Sensors database generation when the cache was filled
+  uint64_t sensors_generation;
+
+  size_t sets_mask;
+  uint8_t *hands; ///< CLOCK hand of each set
+  struct enrichment_cache_entry *entries;
+
+  uint64_t hits, misses;
+};
+
+static void assert_enrichment_cache(const struct enrichment_cache *cache) {
+#ifdef ENRICHMENT_CACHE_MAGIC
+  assert(ENRICHMENT_CACHE_MAGIC == cache->magic);
+#else
+  (void)cache;
+#endif
+}
+
+static void enrichment_cache_entry_done(struct enrichment_cache_entry *entry) {
+  AS_info_done(&entry->as);
+  memset(entry, 0, sizeof(*entry));
+}
+
+static void enrichment_cache_flush(struct enrichment_cache *cache) {
+  const size_t sets = cache->sets_mask + 1;
+  size_t i;
+
+  for (i = 0; i < sets * ENRICHMENT_CACHE_WAYS; ++i) {
+    if (cache->entries[i].used) {
+      enrichment_cache_entry_done(&cache->entries[i]);
+    }
+  }
+  memset(cache->hands, 0, sets * sizeof(cache->hands[0]));
+}
+
+struct enrichment_cache *new_enrichment_cache(size_t size) {
+  size_t sets = 1;
+  while (sets * ENRICHMENT_CACHE_WAYS < size) {
+    sets <<= 1;
+  }
+
+  struct enrichment_cache *cache = calloc(1, sizeof(*cache));
+  if (cache) {
+    cache->hands = calloc(sets, sizeof(cache->hands[0]));
+    cache->entries = calloc(sets * ENRICHMENT_CACHE_WAYS,
+                                                  sizeof(cache->entries[0]));
+  }
+
+  if (!cache || !cache->hands || !cache->entries) {
+    traceEvent(TRACE_ERROR,
+                      "Couldn't allocate enrichment cache (out of memory?)");
+    if (cache) {
+      free(cache->hands);
+      free(cache->entries);
+    }
+    free(cache);
+    return NULL;
+  }
+
+#ifdef ENRICHMENT_CACHE_MAGIC
+  cache->magic = ENRICHMENT_CACHE_MAGIC;
+#endif
+  cache->sets_mask = sets - 1;
+  cache->generation =
+                ATOMIC_LOAD_ACQUIRE(&readOnlyGlobals.rb_databases.generation);
+  cache->sensors_generation = sensors_db_current_generation();
+  return cache;
+}
+
+void enrichment_cache_done(struct enrichment_cache *cache) {
+  if (!cache) {
+    return;
+  }
+
+  assert_enrichment_cache(cache);
+  enrichment_cache_flush(cache);
+  free(cache->hands);
+  free(cache->entries);
+  free(cache);
+}
+
+void enrichment_cache_stats(const struct enrichment_cache *cache,
+                                          uint64_t *hits, uint64_t *misses) {
+  assert_multi(cache, hits, misses);
+  assert_enrichment_cache(cache);
+
+  *hits = cache->hits;
+  *misses = cache->misses;
+}
+
+static size_t enrichment_cache_set(const struct enrichment_cache *cache,
+                                                        const uint8_t ip[16]) {
+  uint64_t hi, lo;
+  memcpy(&hi, ip, sizeof(hi));
+  memcpy(&lo, &ip[sizeof(hi)], sizeof(lo));
+
+  uint64_t hash = (hi * UINT64_C(0x9E3779B97F4A7C15)) ^
+                                          (lo * UINT64_C(0xC2B2AE3D27D4EB4F));
+  hash ^= hash >> 32;
+  return hash & cache->sets_mask;
+}
+
+/** Get the cache entry of an address, evicting another one if needed
+  @param cache Cache
+  @param ip IPv6 (or IPv4 mapped) address
+  @return Address entry. Its fields are empty if it was not in the cache
+  */
+static struct enrichment_cache_entry *enrichment_cache_get(
+                      struct enrichment_cache *cache, const uint8_t ip[16]) {
+  assert_enrichment_cache(cache);
+
+  const uint64_t generation =
+                ATOMIC_LOAD_ACQUIRE(&readOnlyGlobals.rb_databases.generation);
+  const uint64_t sensors_generation = sensors_db_current_generation();
+  if (unlikely(cache->generation != generation ||
+                          cache->sensors_generation != sensors_generation)) {
+    enrichment_cache_flush(cache);
+    cache->generation = generation;
+    cache->sensors_generation = sensors_generation;
+  }
+
+  const size_t set = enrichment_cache_set(cache, ip);
+  struct enrichment_cache_entry *entries =
+                              &cache->entries[set * ENRICHMENT_CACHE_WAYS];
+  struct enrichment_cache_entry *free_entry = NULL;
+  size_t i;
+
+  for (i = 0; i < ENRICHMENT_CACHE_WAYS; ++i) {
+    if (!entries[i].used) {
+      free_entry = free_entry ? free_entry : &entries[i];
+    } else if (0 == memcmp(entries[i].ip, ip, sizeof(entries[i].ip))) {
+      entries[i].referenced = true;
+      return &entries[i];
+    }
+  }
+
+  if (NULL == free_entry) {
+    /* CLOCK: evict first entry not referenced since last hand pass */
+    uint8_t *hand = &cache->hands[set];
+    while (entries[*hand].referenced) {
+      entries[*hand].referenced = false;
+      *hand = (*hand + 1) % ENRICHMENT_CACHE_WAYS;
+    }
+
+    free_entry = &entries[*hand];
+    *hand = (*hand + 1) % ENRICHMENT_CACHE_WAYS;
+    enrichment_cache_entry_done(free_entry);
+  }
+
+  memcpy(free_entry->ip, ip, sizeof(free_entry->ip));
+  free_entry->used = true;
+  return free_entry;
+}
+
+/** Check if an entry field has been looked up, counting hit or miss. Field
+  is marked as looked up, so caller must fill it in case of miss.
+  @param cache Cache
+  @param entry Entry
+  @param field Field to check
+  @return true if hit
+  */
+static bool enrichment_cache_hit(struct enrichment_cache *cache,
+        struct enrichment_cache_entry *entry, enum enrichment_cache_field field) {
+  if (entry->fields & field) {
+    cache->hits++;
+    return true;
+  }
+
+  cache->misses++;
+  entry->fields |= field;
+  return false;
+}
+
+/** Flow cache enrichment entry of an address
+  @param flow_cache Flow cache
+  @param ip IPv6 (or IPv4 mapped) address
+  @return Entry, or NULL if flow has no enrichment cache
+  */
+static struct enrichment_cache_entry *flow_enrichment_entry(
+                        struct flowCache *flow_cache, const uint8_t ip[16]) {
+  return flow_cache && flow_cache->enrichment_cache ?
+            enrichment_cache_get(flow_cache->enrichment_cache, ip) : NULL;
+}
+
 static int ip_direction(int known_src,int known_dst) {
   if(!known_src && known_dst) {
     return DIRECTION_DOWNSTREAM;
@@ -79,6 +318,55 @@ static int ip_direction(int known_src,int known_dst) {
   return DIRECTION_UNSET;
 }
 
+/** Observation id home net of a flow address. Only the first lookup of every
+  address reaches the sensors database, and next ones are served from the flow
+  cache.
+  @param cache Flow cache
+  @param ip IPv6 (or IPv4 mapped) address
+  @return Home net information. ip_str and name are NULL if ip is not in any
+  home net
+  */
+static const struct flow_cache_home_net *flow_cache_home_net(
+                              struct flowCache *cache, const uint8_t ip[16]) {
+  const size_t n_home_nets = RD_ARRAYSIZE(cache->home_nets);
+  size_t i;
+
+  for (i = 0; i < n_home_nets; ++i) {
+    struct flow_cache_home_net *home_net = &cache->home_nets[i];
+    if (!home_net->looked_up) {
+      break;
+    } else if (0 == memcmp(home_net->ip, ip, sizeof(home_net->ip))) {
+      return home_net;
+    }
+  }
+
+  /* Not cached: use first free slot, or overwrite last one */
+  struct flow_cache_home_net *home_net =
+                          &cache->home_nets[i < n_home_nets ? i : i - 1];
+  memcpy(home_net->ip, ip, sizeof(home_net->ip));
+  home_net->looked_up = true;
+
+  struct enrichment_cache_entry *entry = flow_enrichment_entry(cache, ip);
+  if (entry && entry->home_net_observation_id != cache->observation_id) {
+    entry->fields &= ~ENRICHMENT_CACHE_HOME_NET;
+  }
+
+  if (entry && enrichment_cache_hit(cache->enrichment_cache, entry,
+                                                ENRICHMENT_CACHE_HOME_NET)) {
+    home_net->ip_str = entry->home_net_ip_str;
+    home_net->name = entry->home_net_name;
+    return home_net;
+  }
+
+  network_info(cache->observation_id, ip, &home_net->ip_str, &home_net->name);
+  if (entry) {
+    entry->home_net_observation_id = cache->observation_id;
+    entry->home_net_ip_str = home_net->ip_str;
+    entry->home_net_name = home_net->name;
+  }
+  return home_net;
+}
+
 /*
   Try to guess direction based on source and destination address
   return: true if guessed/already setted. false if couldn't set
@@ -93,10 +381,10 @@ bool guessDirection(struct flowCache *cache) {
     return false;
   }
 
-  const int src_ip_in_home_net = NULL!=network_ip(cache->observation_id,
-                                                            cache->address.src);
-  const int dst_ip_in_home_net = NULL!=network_ip(cache->observation_id,
-                                                            cache->address.dst);
+  const int src_ip_in_home_net =
+                  NULL != flow_cache_home_net(cache, cache->address.src)->ip_str;
+  const int dst_ip_in_home_net =
+                  NULL != flow_cache_home_net(cache, cache->address.dst)->ip_str;
 
   const int ip_guessed_direction = ip_direction(src_ip_in_home_net,dst_ip_in_home_net);
   if (ip_guessed_direction != DIRECTION_UNSET) {
@@ -171,6 +459,19 @@ static size_t printbuf_memappend_fast_n10(struct printbuf *kafka_line_buffer,con
   return number_strlen;
 }
 
+/** Print an unsigned integer value: decimal text, or CBOR integer in CBOR
+  output
+  @param kafka_line_buffer Buffer to print number
+  @param value Number
+  @return Bytes written
+  */
+static size_t print_uint0(struct printbuf *kafka_line_buffer,
+                                                        const uint64_t value) {
+  return OUTPUT_FORMAT_CBOR == readOnlyGlobals.output_format ?
+    rb_cbor_put_uint(kafka_line_buffer, value) :
+    printbuf_memappend_fast_n10(kafka_line_buffer, value);
+}
+
 #define get_mac(buffer) net2number(buffer,6);
 
 size_t print_string(struct printbuf *kafka_line_buffer,
@@ -339,8 +640,18 @@ size_t print_number(struct printbuf *kafka_line_buffer, const void *vbuffer,
   assert_multi(kafka_line_buffer, buffer);
   unused_params(flowCache);
 
+  if (OUTPUT_FORMAT_CBOR == readOnlyGlobals.output_format) {
+    switch (real_field_len) {
+    case 1: case 2: case 4: case 6: case 8:
+      break;
+    default:
+      /* net2number would give 0, and it is not the field value */
+      return 0;
+    };
+  }
+
   const uint64_t number = net2number(buffer, real_field_len);
-  return printbuf_memappend_fast_n10(kafka_line_buffer,number);
+  return print_uint0(kafka_line_buffer,number);
 }
 
 size_t print_netflow_type(struct printbuf *kafka_line_buffer,
@@ -598,15 +909,37 @@ static void ipv4buf_to_6(uint8_t ipv6[16],const void *vbuffer){
   @param vbuffer Buffer where net is
   @param real_field_len Length of buffer
   @param flowCache Flow cache information
-  @param sensor_list_search_cb Callback to search in sensor information
+  @param home_net_cb Callback to select home net information to print
   @param global_net_list_cb Callback to manage global nets list.
   @return Printed length
  */
 
+/** Search an address in the global networks list
+  @param flow_cache Flow cache
+  @param ip IPv6 (or IPv4 mapped) address
+  @return Most specific network entry, or NULL if not found
+  */
+static const IPNameAssoc *nets_db_search(struct flowCache *flow_cache,
+                                                        const uint8_t ip[16]) {
+  struct enrichment_cache_entry *entry = flow_enrichment_entry(flow_cache, ip);
+  if (entry && enrichment_cache_hit(flow_cache->enrichment_cache, entry,
+                                                    ENRICHMENT_CACHE_NET)) {
+    return entry->net;
+  }
+
+  const IPNameAssoc *ret = ip_name_db_search(
+    ATOMIC_LOAD_ACQUIRE(&readOnlyGlobals.rb_databases.nets_name_as_db), ip);
+  if (entry) {
+    entry->net = ret;
+  }
+
+  return ret;
+}
+
 static size_t print_net0(struct printbuf *kafka_line_buffer,
     const void *vbuffer, const size_t real_field_len,
     struct flowCache *flowCache,
-    const char *(*sensor_list_search_cb)(observation_id_t *,const uint8_t[16]),
+    const char *(*home_net_cb)(const struct flow_cache_home_net *),
       const char *(*global_net_list_cb)(const IPNameAssoc *)) {
   const uint8_t *buffer = vbuffer;
   assert_multi(kafka_line_buffer, buffer, flowCache);
@@ -617,15 +950,14 @@ static size_t print_net0(struct printbuf *kafka_line_buffer,
   }
 
   /* First try: Has the observation id a home net that contains this ip? */
-  const char *sensor_home_net = sensor_list_search_cb(flowCache->observation_id,
-                                                      buffer);
+  const char *sensor_home_net = home_net_cb(
+                                        flow_cache_home_net(flowCache, buffer));
   if(sensor_home_net){
     return printbuf_memappend_fast_string(kafka_line_buffer, sensor_home_net);
   }
 
   /* Second try: General nets ip list */
-  const IPNameAssoc *ip_name_as = ipInList(buffer,
-    readOnlyGlobals.rb_databases.nets_name_as_list);
+  const IPNameAssoc *ip_name_as = nets_db_search(flowCache, buffer);
 
   if (ip_name_as) {
     const char *to_print = global_net_list_cb(ip_name_as);
@@ -636,6 +968,14 @@ static size_t print_net0(struct printbuf *kafka_line_buffer,
   }
 }
 
+static const char *home_net_ip_str(const struct flow_cache_home_net *home_net) {
+  return home_net->ip_str;
+}
+
+static const char *home_net_name(const struct flow_cache_home_net *home_net) {
+  return home_net->name;
+}
+
 static const char *global_net_list_number(const IPNameAssoc *assoc) {
   return assoc->number;
 }
@@ -648,14 +988,14 @@ static size_t print_net_v6_0(struct printbuf *kafka_line_buffer,
     const void *vbuffer,const size_t real_field_len,
     struct flowCache *flowCache) {
   return print_net0(kafka_line_buffer, vbuffer, real_field_len, flowCache,
-    network_ip, global_net_list_number);
+    home_net_ip_str, global_net_list_number);
 }
 
 static size_t print_net_name_v6_0(struct printbuf *kafka_line_buffer,
     const void *vbuffer,const size_t real_field_len,
     struct flowCache *flowCache) {
   return print_net0(kafka_line_buffer, vbuffer, real_field_len, flowCache,
-    network_name, global_net_list_name);
+    home_net_name, global_net_list_name);
 }
 
 size_t print_net_v6(struct printbuf *kafka_line_buffer,
@@ -715,6 +1055,12 @@ size_t print_net_name(struct printbuf *kafka_line_buffer,
 static size_t print_ipv4_addr0(struct printbuf *kafka_line_buffer,
     const uint32_t ipv4) {
   assert(kafka_line_buffer);
+  if (OUTPUT_FORMAT_CBOR == readOnlyGlobals.output_format) {
+    const uint8_t addr[4] = {ipv4 >> 24, ipv4 >> 16, ipv4 >> 8, ipv4};
+    return rb_cbor_put_tagged_bytes(kafka_line_buffer, RB_CBOR_TAG_IPV4, addr,
+      sizeof(addr));
+  }
+
   static const size_t bufsize = sizeof("255.255.255.255")+1;
   char buf[bufsize];
 
@@ -729,6 +1075,11 @@ static size_t print_ipv6_addr0(struct printbuf *kafka_line_buffer,
     const void *vbuffer) {
   size_t i=0;
   const uint8_t *buffer = vbuffer;
+  if (OUTPUT_FORMAT_CBOR == readOnlyGlobals.output_format) {
+    return rb_cbor_put_tagged_bytes(kafka_line_buffer, RB_CBOR_TAG_IPV6,
+      buffer, 16);
+  }
+
   for (i=0;i<8;++i) {
     printbuf_memappend_fast_n16(kafka_line_buffer,buffer[2*i]);
     printbuf_memappend_fast_n16(kafka_line_buffer,buffer[2*i+1]);
@@ -924,7 +1275,7 @@ size_t print_wan_addr(struct printbuf *kafka_line_buffer,
     get_direction_based_target_ip, print_flow_cache_addr);
 }
 
-static size_t print_mac0(struct printbuf *kafka_line_buffer,
+static size_t print_mac_text0(struct printbuf *kafka_line_buffer,
     const void *vbuffer) {
   const uint8_t *buffer = vbuffer;
   assert_multi(kafka_line_buffer, buffer);
@@ -938,6 +1289,13 @@ static size_t print_mac0(struct printbuf *kafka_line_buffer,
   return strlen("ff:ff:ff:ff:ff:ff");
 }
 
+static size_t print_mac0(struct printbuf *kafka_line_buffer,
+    const void *buffer) {
+  return OUTPUT_FORMAT_CBOR == readOnlyGlobals.output_format ?
+    rb_cbor_put_tagged_bytes(kafka_line_buffer, RB_CBOR_TAG_MAC, buffer, 6) :
+    print_mac_text0(kafka_line_buffer, buffer);
+}
+
 size_t print_mac(struct printbuf *kafka_line_buffer,
     const void *vbuffer,const size_t real_field_len,
     struct flowCache *flowCache) {
@@ -958,10 +1316,10 @@ static size_t print_mac_vendor0(struct printbuf *kafka_line_buffer,const void *b
 
   if(mac){
     const char *vendor = NULL;
-    pthread_rwlock_rdlock(&readOnlyGlobals.rb_databases.mutex);
-    if(readOnlyGlobals.rb_databases.mac_vendor_database)
-      vendor = rb_find_mac_vendor(mac,readOnlyGlobals.rb_databases.mac_vendor_database);
-    pthread_rwlock_unlock(&readOnlyGlobals.rb_databases.mutex);
+    struct mac_vendor_database *mac_vendor_database = ATOMIC_LOAD_ACQUIRE(
+      &readOnlyGlobals.rb_databases.mac_vendor_database);
+    if(mac_vendor_database)
+      vendor = rb_find_mac_vendor(mac,mac_vendor_database);
     if(vendor){
       const size_t vendor_len = strlen(vendor);
       printbuf_memappend_fast(kafka_line_buffer,vendor,vendor_len);
@@ -1082,9 +1440,10 @@ static size_t print_mac_vendor_addr_format0(struct printbuf *kafka_line_buffer,
 static size_t print_mac_map0(struct printbuf *kafka_line_buffer,const void *buffer){
   const uint64_t mac = get_mac(buffer);
   if(mac){
-    pthread_rwlock_rdlock(&readOnlyGlobals.rb_databases.mutex);
-    const char *char_map = find_mac_name(mac,&readOnlyGlobals.rb_databases.mac_name_database);
-    pthread_rwlock_unlock(&readOnlyGlobals.rb_databases.mutex);
+    const mac_addr_list *mac_name_database = ATOMIC_LOAD_ACQUIRE(
+      &readOnlyGlobals.rb_databases.mac_name_database);
+    const char *char_map = mac_name_database ?
+      find_mac_name(mac,mac_name_database) : NULL;
     if(char_map){
       printbuf_memappend_fast_string(kafka_line_buffer,char_map);
     }else{
@@ -1094,7 +1453,8 @@ static size_t print_mac_map0(struct printbuf *kafka_line_buffer,const void *buff
     }
   }
 
-  return print_mac0(kafka_line_buffer,buffer);
+  /* Name field, so MAC is printed as text in every format */
+  return print_mac_text0(kafka_line_buffer,buffer);
 }
 
 size_t print_mac_map(struct printbuf *kafka_line_buffer,
@@ -1141,15 +1501,12 @@ static size_t print_engine_id_name0(struct printbuf *kafka_line_buffer,const uin
   if(engine_id == 0)
     return 0;
 
-  pthread_rwlock_rdlock(&readOnlyGlobals.rb_databases.mutex);
   // @TODO change it to an array!
-  const NumNameAssoc * node =  numInList(engine_id,readOnlyGlobals.rb_databases.engines_name_as_list);
-  const size_t ret = node ?
+  const NumNameAssoc * node =  numInList(engine_id,ATOMIC_LOAD_ACQUIRE(
+    &readOnlyGlobals.rb_databases.engines_name_as_list));
+  return node ?
     printbuf_memappend_fast_string(kafka_line_buffer,node->name) :
     print_engine_id(kafka_line_buffer,engine_id);
-
-  pthread_rwlock_unlock(&readOnlyGlobals.rb_databases.mutex);
-  return ret;
 }
 
 size_t print_engine_id_name(struct printbuf *kafka_line_buffer,
@@ -1201,10 +1558,11 @@ static size_t print_application_id_name0(struct printbuf *kafka_line_buffer,
   const char *appid_str = observation_id_application_name(observation_id,
     appid);
 
-  if (!appid_str && readOnlyGlobals.rb_databases.apps_name_as_list) {
+  NumNameAssocTree *apps_name_as_list = ATOMIC_LOAD_ACQUIRE(
+    &readOnlyGlobals.rb_databases.apps_name_as_list);
+  if (!appid_str && apps_name_as_list) {
     // Search in default db
-    appid_str = searchNameAssociatedInTree(
-      readOnlyGlobals.rb_databases.apps_name_as_list, appid, NULL, 0);
+    appid_str = searchNameAssociatedInTree(apps_name_as_list, appid, NULL, 0);
   }
 
   if (appid_str) {
@@ -1234,7 +1592,7 @@ size_t print_application_id_name(struct printbuf *kafka_line_buffer,
 }
 
 static size_t print_port0(struct printbuf *kafka_line_buffer,const uint16_t port){
-  return printbuf_memappend_fast_n10(kafka_line_buffer,port);
+  return print_uint0(kafka_line_buffer,port);
 }
 
 static size_t process_port0(uint16_t *save_port, const char *port_type,
@@ -1278,7 +1636,7 @@ static size_t print_flow_cache_number(struct printbuf *kafka_line_buffer,
     const struct flowCache *flow_cache,
     uint64_t (*get_number_cb)(const struct flowCache *)) {
   const uint64_t number = get_number_cb(flow_cache);
-  return printbuf_memappend_fast_n10(kafka_line_buffer, number);
+  return print_uint0(kafka_line_buffer, number);
 }
 
 size_t print_lan_port(struct printbuf *kafka_line_buffer, const void *buffer,
@@ -1352,14 +1710,110 @@ size_t print_ipv6_dst_addr(struct printbuf *kafka_line_buffer,
     real_field_len);
 }
 
+/*
+  GeoIP databases are published through rb_databases epoch: workers only need
+  an acquire load to use them, and they are never closed while a worker is
+  using them. Both MaxMind DB and legacy GeoIP databases lookups are read
+  only, so no lock is needed.
+*/
+
+static const struct geoip_database *geoip_as_database(void) {
+  return ATOMIC_LOAD_ACQUIRE(&readOnlyGlobals.rb_databases.geoip_as_database);
+}
+
+static const struct geoip_database *geoip_country_database(void) {
+  return ATOMIC_LOAD_ACQUIRE(
+    &readOnlyGlobals.rb_databases.geoip_country_database);
+}
+
+#define IPV6_LEN 16
+static struct in6_addr get_ipv6(const uint8_t *buffer){
+  struct in6_addr ipv6;
+  memcpy(&ipv6.s6_addr,buffer,IPV6_LEN);
+  return ipv6;
+}
+
+static bool is_private_v4(const uint32_t ipv4) {
+  return (ipv4 & 0xff000000) == 0x0a000000 || // 10.X.X.X/10
+         (ipv4 & 0xfff00000) == 0xac100000 || // 172.16.X.X/12
+         (ipv4 & 0xffff0000) == 0xc0a80000;   // 192.168.X.X/16
+}
+
+static bool is_private_v6(const struct in6_addr ipv6) {
+  return (ipv6.s6_addr[0] & 0x30) == 0x20;
+}
+
+static uint32_t ipv6_to_v4(const struct in6_addr ipv6) {
+  return net2number(&ipv6.s6_addr[12], 4);
+}
+
+static bool is_private(const struct in6_addr ipv6) {
+  if (is_ipv4_mapped(&ipv6)) {
+    const uint32_t ipv4 = ipv6_to_v4(ipv6);
+    return is_private_v4(ipv4);
+  }
+
+  return is_private_v6(ipv6);
+}
+
+/// Country code of an address, searched in the country database
+static const char *geoip_country_code0(const uint8_t ip[16], size_t *len) {
+  const struct geoip_database *db = geoip_country_database();
+  const struct in6_addr ipv6 = get_ipv6(ip);
+  struct rb_mmdb_entry entry;
+  const char *country = NULL;
+
+  if (NULL == db) {
+    return NULL;
+  } else if (db->mmdb) {
+    return rb_mmdb_lookup_v6(db->mmdb, &ipv6, &entry) ?
+      rb_mmdb_entry_country_code(&entry, len) : NULL;
 #ifdef HAVE_GEOIP
+  } else if (is_ipv4_mapped(&ipv6)) {
+    if (db->v4) {
+      country = GeoIP_country_code_by_ipnum(db->v4, ipv6_to_v4(ipv6));
+    }
+  } else if (db->v6) {
+    country = GeoIP_country_code_by_ipnum_v6(db->v6, ipv6);
+#endif
+  }
+
+  if (country) {
+    *len = strlen(country);
+  }
+  return country;
+}
+
+/** Country code of an address
+  @param flow_cache Flow cache
+  @param ip IPv6 (or IPv4 mapped) address
+  @param len Country code length
+  @return Country code, or NULL if not found. Not NUL terminated
+  */
+static const char *geoip_country_code(struct flowCache *flow_cache,
+    const uint8_t ip[16], size_t *len) {
+  struct enrichment_cache_entry *entry = flow_enrichment_entry(flow_cache, ip);
+  if (entry && enrichment_cache_hit(flow_cache->enrichment_cache, entry,
+                                                  ENRICHMENT_CACHE_COUNTRY)) {
+    *len = entry->country_len;
+    return entry->country;
+  }
+
+  const char *country = geoip_country_code0(ip, len);
+  if (entry) {
+    entry->country = country;
+    entry->country_len = country ? *len : 0;
+  }
+
+  return country;
+}
 
 size_t print_country_code(struct printbuf *kafka_line_buffer,
     const void *buffer, const size_t real_field_len,
     struct flowCache *flowCache) {
+  uint8_t ipv6[16];
 
   assert(buffer);
-  unused_params(flowCache);
 
   if (readOnlyGlobals.normalize_directions) {
     /* Nothing to do */
@@ -1371,103 +1825,166 @@ size_t print_country_code(struct printbuf *kafka_line_buffer,
     return 0;
   }
 
-  const uint32_t ipv4 = net2number(buffer, 4);
-  if (readOnlyGlobals.geo_ip_country_db) {
-    pthread_rwlock_rdlock(&readWriteGlobals->geoipRwLock);
-    const char *country = GeoIP_country_code_by_ipnum(
-      readOnlyGlobals.geo_ip_country_db,ipv4);
-    pthread_rwlock_unlock(&readWriteGlobals->geoipRwLock);
-    if (country) {
-      return append_escaped(kafka_line_buffer, country, strlen(country));
-    }
+  ipv4buf_to_6(ipv6, buffer);
+  size_t country_len = 0;
+  const char *country = geoip_country_code(flowCache, ipv6, &country_len);
+  if (country) {
+    return append_escaped(kafka_line_buffer, country, country_len);
   }
 
   return 0;
 }
 
-struct AS_info{
-  const char *number;
-  size_t number_len;
-  const char *name;
-};
-
-static struct AS_info extract_as_from_geoip_response(char *rsp) {
+#ifdef HAVE_GEOIP
+static void extract_as_from_geoip_response(struct AS_info *asinfo) {
   /* rsp = ASDDDDD SSSSSSS */
-  char *aux = NULL;
-  struct AS_info asinfo = {NULL,0,NULL};
-  asinfo.number = strtok_r(rsp," ",&aux);
-  if (asinfo.number) {
-    asinfo.number+=2;
-    asinfo.number_len = aux-rsp-3;
-    asinfo.name = strtok_r(NULL,"",&aux);
+  char *rsp = asinfo->rsp;
+  char *name = strchr(rsp, ' ');
+
+  if (0 == strncmp(rsp, "AS", 2)) {
+    asinfo->number = rsp + 2;
+    asinfo->number_len = name ? (size_t)(name - asinfo->number)
+                              : strlen(asinfo->number);
   }
 
-  return asinfo;
+  if (name && name[1] != '\0') {
+    asinfo->name = name + 1;
+    asinfo->name_len = strlen(asinfo->name);
+  }
 }
+#endif
 
-size_t print_AS_ipv4(struct printbuf *kafka_line_buffer,
-    const void *vbuffer,const size_t real_field_len,
-    struct flowCache *flowCache) {
+static void extract_as_from_mmdb_entry(struct AS_info *asinfo,
+    const struct rb_mmdb_entry *entry) {
+  struct rb_mmdb_as as;
 
-  const uint8_t *buffer = vbuffer;
-  assert(buffer);
-  unused_params(flowCache);
+  if (!rb_mmdb_entry_as(entry, &as)) {
+    return;
+  }
 
-  if (unlikely(4 != real_field_len)) {
-    traceEvent(TRACE_ERROR, "IPv4 length %zu != 4", real_field_len);
-    return 0;
+  if (as.number) {
+    const int rc = snprintf(asinfo->number_buf, sizeof(asinfo->number_buf),
+      "%"PRIu32, as.number);
+    asinfo->number = asinfo->number_buf;
+    asinfo->number_len = rc;
   }
 
-  const unsigned long ipv4 = net2number(buffer, 4);
-  size_t written_len = 0;
+  if (as.name_len > 0) {
+    asinfo->name = as.name;
+    asinfo->name_len = as.name_len;
+  }
+}
 
-  if(ipv4){
-    char *rsp=NULL;
-    pthread_rwlock_rdlock(&readWriteGlobals->geoipRwLock);
-    if(readOnlyGlobals.geo_ip_asn_db)
-      rsp = GeoIP_name_by_ipnum(readOnlyGlobals.geo_ip_asn_db, ipv4);
-    pthread_rwlock_unlock(&readWriteGlobals->geoipRwLock);
-
-    if(rsp){
-      struct AS_info asinfo = extract_as_from_geoip_response(rsp);
-      if(asinfo.number){
-        printbuf_memappend_fast(kafka_line_buffer,asinfo.number,asinfo.number_len);
-        written_len = asinfo.number_len;
-      }
-      free(rsp);
+/** Look up an address AS in the AS database. MaxMind DB fields point to the
+  mapped database, so they can't be used out of the epoch critical section.
+  @param asinfo AS information. Release it with AS_info_done
+  @param ip IPv6 (or IPv4 mapped) address
+  */
+static void geoip_AS_info0(struct AS_info *asinfo, const uint8_t ip[16]) {
+  const struct geoip_database *db = geoip_as_database();
+  const struct in6_addr ipv6 = get_ipv6(ip);
+  struct rb_mmdb_entry entry;
+
+  memset(asinfo, 0, sizeof(*asinfo));
+
+  if (NULL == db) {
+    return;
+  } else if (db->mmdb) {
+    if (rb_mmdb_lookup_v6(db->mmdb, &ipv6, &entry)) {
+      extract_as_from_mmdb_entry(asinfo, &entry);
+    }
+#ifdef HAVE_GEOIP
+  } else if (is_ipv4_mapped(&ipv6)) {
+    if (db->v4) {
+      asinfo->rsp = GeoIP_name_by_ipnum(db->v4, ipv6_to_v4(ipv6));
     }
+  } else if (db->v6) {
+    asinfo->rsp = GeoIP_name_by_ipnum_v6(db->v6, ipv6);
+#endif
   }
 
-  return written_len;
+#ifdef HAVE_GEOIP
+  if (asinfo->rsp) {
+    extract_as_from_geoip_response(asinfo);
+  }
+#endif
 }
 
-static size_t print_buffer_geoip_AS_name(struct printbuf *kafka_line_buffer,char *rsp) {
-  size_t written_len = 0;
+/** AS information of an address
+  @param flow_cache Flow cache
+  @param ip IPv6 (or IPv4 mapped) address
+  @param tmp Storage to use if the flow has no enrichment cache. Caller must
+             call AS_info_done over it when the result is not needed anymore
+  @return AS information
+  */
+static const struct AS_info *geoip_AS_info(struct flowCache *flow_cache,
+    const uint8_t ip[16], struct AS_info *tmp) {
+  struct enrichment_cache_entry *entry = flow_enrichment_entry(flow_cache, ip);
 
-  assert(rsp);
+  memset(tmp, 0, sizeof(*tmp));
+  if (NULL == entry) {
+    geoip_AS_info0(tmp, ip);
+    return tmp;
+  }
 
-  char *toprint = strchr(rsp,' ');
-  if(toprint && *(toprint+1)!='\0')
-    written_len = append_escaped(kafka_line_buffer,toprint+1,strlen(toprint+1));
-  free(rsp);
+  if (!enrichment_cache_hit(flow_cache->enrichment_cache, entry,
+                                                      ENRICHMENT_CACHE_AS)) {
+    geoip_AS_info0(&entry->as, ip);
+  }
+
+  return &entry->as;
+}
+
+static size_t print_AS_number0(struct printbuf *kafka_line_buffer,
+    struct flowCache *flow_cache, const uint8_t ip[16]) {
+  struct AS_info tmp;
+  size_t written_len = 0;
+
+  const struct AS_info *asinfo = geoip_AS_info(flow_cache, ip, &tmp);
+  if (asinfo->number) {
+    printbuf_memappend_fast(kafka_line_buffer, asinfo->number,
+      asinfo->number_len);
+    written_len = asinfo->number_len;
+  }
+  AS_info_done(&tmp);
 
   return written_len;
 }
 
-static size_t print_AS_ipv4_name0(struct printbuf *kafka_line_buffer,
-    const uint32_t ipv4){
+static size_t print_AS_name0(struct printbuf *kafka_line_buffer,
+    struct flowCache *flow_cache, const uint8_t ip[16]) {
+  struct AS_info tmp;
   size_t written_len = 0;
-  assert(kafka_line_buffer);
 
-  char * rsp=NULL;
-  if(readOnlyGlobals.geo_ip_asn_db){
-    pthread_rwlock_rdlock(&readWriteGlobals->geoipRwLock);
-    rsp = GeoIP_name_by_ipnum(readOnlyGlobals.geo_ip_asn_db, ipv4);
-    pthread_rwlock_unlock(&readWriteGlobals->geoipRwLock);
+  const struct AS_info *asinfo = geoip_AS_info(flow_cache, ip, &tmp);
+  if (asinfo->name) {
+    written_len = append_escaped(kafka_line_buffer, asinfo->name,
+      asinfo->name_len);
+  }
+  AS_info_done(&tmp);
+
+  return written_len;
+}
+
+size_t print_AS_ipv4(struct printbuf *kafka_line_buffer,
+    const void *vbuffer,const size_t real_field_len,
+    struct flowCache *flowCache) {
+
+  const uint8_t *buffer = vbuffer;
+  assert(buffer);
+
+  if (unlikely(4 != real_field_len)) {
+    traceEvent(TRACE_ERROR, "IPv4 length %zu != 4", real_field_len);
+    return 0;
   }
 
-  if(rsp){
-    written_len = print_buffer_geoip_AS_name(kafka_line_buffer,rsp);
+  const unsigned long ipv4 = net2number(buffer, 4);
+  size_t written_len = 0;
+
+  if(ipv4){
+    uint8_t ipv6[16];
+    ipv4buf_to_6(ipv6, buffer);
+    written_len = print_AS_number0(kafka_line_buffer, flowCache, ipv6);
   }
 
   return written_len;
@@ -1478,7 +1995,6 @@ size_t print_AS_ipv4_name(struct printbuf *kafka_line_buffer,
     struct flowCache *flowCache) {
   const uint8_t *buffer = vbuffer;
   assert(buffer);
-  (void)flowCache;
 
   if (readOnlyGlobals.normalize_directions) {
     /* Nothing to do */
@@ -1486,81 +2002,27 @@ size_t print_AS_ipv4_name(struct printbuf *kafka_line_buffer,
   }
 
   if (likely(real_field_len==4)) {
-    const uint32_t ipv4 = net2number(buffer, 4);
-    return print_AS_ipv4_name0(kafka_line_buffer, ipv4);
+    uint8_t ipv6[16];
+    ipv4buf_to_6(ipv6, buffer);
+    return print_AS_name0(kafka_line_buffer, flowCache, ipv6);
   } else {
     traceEvent(TRACE_ERROR,"IPv4 with len %zu != 4.", real_field_len);
     return 0;
   }
 }
 
-#define IPV6_LEN 16
-static struct in6_addr get_ipv6(const uint8_t *buffer){
-  struct in6_addr ipv6;
-  memcpy(&ipv6.s6_addr,buffer,IPV6_LEN);
-  return ipv6;
-}
-
-static bool is_private_v4(const uint32_t ipv4) {
-  return (ipv4 & 0xff000000) == 0x0a000000 || // 10.X.X.X/10
-         (ipv4 & 0xfff00000) == 0xac100000 || // 172.16.X.X/12
-         (ipv4 & 0xffff0000) == 0xc0a80000;   // 192.168.X.X/16
-}
-
-static bool is_private_v6(const struct in6_addr ipv6) {
-  return (ipv6.s6_addr[0] & 0x30) == 0x20;
-}
-
-static uint32_t ipv6_to_v4(const struct in6_addr ipv6) {
-  return net2number(&ipv6.s6_addr[12], 4);
-}
-
-static bool is_private(const struct in6_addr ipv6) {
-  if (is_ipv4_mapped(&ipv6)) {
-    const uint32_t ipv4 = ipv6_to_v4(ipv6);
-    return is_private_v4(ipv4);
-  }
-
-  return is_private_v6(ipv6);
-}
-
 /// Decorate geoip call
 static size_t geoip_decorator(struct printbuf *kafka_line_buffer,
-    const struct in6_addr ipv6,
+    struct flowCache *flow_cache, const uint8_t ip[16],
     size_t (*print_geoip_cb)(struct printbuf *kafka_line_buffer,
-      const struct in6_addr ipv6)) {
+      struct flowCache *flow_cache, const uint8_t ip[16])) {
   assert(kafka_line_buffer);
 
-  if (is_private(ipv6)) {
+  if (is_private(get_ipv6(ip))) {
     return 0;
   }
 
-  pthread_rwlock_rdlock(&readWriteGlobals->geoipRwLock);
-  const size_t written_len = print_geoip_cb(kafka_line_buffer, ipv6);
-  pthread_rwlock_unlock(&readWriteGlobals->geoipRwLock);
-
-  return written_len;
-}
-
-/**
- * Print ipv6 AS name with no locking or checking
- * @param  kafka_line_buffer Line buffer to print AS name
- * @param  ipv6              IPv6 to print
- * @return                   Bytes printed
- */
-static size_t print_AS6_name_nl(struct printbuf *kafka_line_buffer,
-    const struct in6_addr ipv6){
-  if (!readOnlyGlobals.geo_ip_asn_db_v6) {
-    return 0;
-  }
-
-  char *rsp=NULL;
-  rsp = GeoIP_name_by_ipnum_v6(readOnlyGlobals.geo_ip_asn_db_v6, ipv6);
-  if (!rsp) {
-    return 0;
-  }
-
-  return print_buffer_geoip_AS_name(kafka_line_buffer, rsp);
+  return print_geoip_cb(kafka_line_buffer, flow_cache, ip);
 }
 
 size_t print_AS6_name(struct printbuf *kafka_line_buffer,
@@ -1568,84 +2030,52 @@ size_t print_AS6_name(struct printbuf *kafka_line_buffer,
     struct flowCache *flowCache) {
   const uint8_t *buffer = vbuffer;
   assert(buffer);
-  (void)flowCache;
 
   if (unlikely(real_field_len!=16)) {
     traceEvent(TRACE_ERROR,"IPv6 length %zu != 16.", real_field_len);
     return 0;
   }
 
-  const struct in6_addr ipv6 = get_ipv6(buffer);
-  return geoip_decorator(kafka_line_buffer, ipv6, print_AS6_name_nl);
-}
-
-static size_t print_AS6_0(struct printbuf *kafka_line_buffer,const struct in6_addr *ipv6){
-  assert(ipv6);
-
-  char *rsp=NULL;
-  size_t bytes_printed = 0;
-  if(readOnlyGlobals.geo_ip_asn_db_v6){
-    pthread_rwlock_rdlock(&readWriteGlobals->geoipRwLock);
-    rsp = GeoIP_name_by_ipnum_v6(readOnlyGlobals.geo_ip_asn_db_v6, *ipv6);
-    pthread_rwlock_unlock(&readWriteGlobals->geoipRwLock);
-  }
-
-  if(rsp){
-    struct AS_info asinfo = extract_as_from_geoip_response(rsp);
-    if(asinfo.number){
-      printbuf_memappend_fast(kafka_line_buffer,asinfo.number,asinfo.number_len);
-      bytes_printed = asinfo.number_len;
-    }
-    free(rsp);
-  }
-
-  return bytes_printed;
+  return geoip_decorator(kafka_line_buffer, flowCache, buffer,
+    print_AS_name0);
 }
 
 size_t print_AS6(struct printbuf *kafka_line_buffer,
     const void *vbuffer,const size_t real_field_len,
     struct flowCache *flowCache) {
   const uint8_t *buffer = vbuffer;
-  (void)flowCache;
 
   if (unlikely(real_field_len!=16)) {
     traceEvent(TRACE_ERROR,"IPv6 length %zu != 16.", real_field_len);
     return 0;
   }
 
-  const struct in6_addr ipv6 = get_ipv6(buffer);
-  return print_AS6_0(kafka_line_buffer,&ipv6);
+  return print_AS_number0(kafka_line_buffer, flowCache, buffer);
 }
 
 /**
- * Print ipv6 country code with no locking or checking
+ * Print ipv6 country code with no checking
  * @param  kafka_line_buffer Line buffer to print country code
- * @param  ipv6              IPv6 to print
+ * @param  flow_cache        Flow cache
+ * @param  ip                IPv6 to print
  * @return                   Bytes printed
  */
 static size_t print_country6_code_nl(struct printbuf *kafka_line_buffer,
-    const struct in6_addr ipv6) {
-  if (!readOnlyGlobals.geo_ip_country_db_v6) {
-    return 0;
-  }
-
-  const char *country = is_ipv4_mapped(&ipv6) ?
-    GeoIP_country_code_by_ipnum(readOnlyGlobals.geo_ip_country_db,
-      ipv6_to_v4(ipv6)) :
-    GeoIP_country_code_by_ipnum_v6(readOnlyGlobals.geo_ip_country_db_v6, ipv6);
+    struct flowCache *flow_cache, const uint8_t ip[16]) {
+  size_t country_len = 0;
+  const char *country = geoip_country_code(flow_cache, ip, &country_len);
   if (!country) {
     return 0;
   }
 
-  return append_escaped(kafka_line_buffer, country, strlen(country));
+  return append_escaped(kafka_line_buffer, country, country_len);
 }
 
 // Same function as print_country6_code0 but with an extra flowCache parameter
 static size_t print_country6_code_fc(struct printbuf *kafka_line_buffer,
     const void *vipv6, struct flowCache *flow_cache) {
-  (void)flow_cache;
-  const struct in6_addr ipv6 = get_ipv6(vipv6);
-  return geoip_decorator(kafka_line_buffer, ipv6, print_country6_code_nl);
+  return geoip_decorator(kafka_line_buffer, flow_cache, vipv6,
+    print_country6_code_nl);
 }
 
 size_t print_country6_code(struct printbuf *kafka_line_buffer,
@@ -1653,15 +2083,14 @@ size_t print_country6_code(struct printbuf *kafka_line_buffer,
     struct flowCache *flowCache) {
   const uint8_t *buffer = vbuffer;
   assert_multi(kafka_line_buffer, buffer);
-  (void)flowCache;
 
   if(unlikely(real_field_len!=16)){
     traceEvent(TRACE_ERROR,"IPv6 length != 16.");
     return 0;
   }
 
-  const struct in6_addr ipv6 = get_ipv6(buffer);
-  return geoip_decorator(kafka_line_buffer, ipv6, print_country6_code_nl);
+  return geoip_decorator(kafka_line_buffer, flowCache, buffer,
+    print_country6_code_nl);
 }
 
 size_t print_lan_country_code(struct printbuf *kafka_line_buffer,
@@ -1680,12 +2109,11 @@ size_t print_wan_country_code(struct printbuf *kafka_line_buffer,
     get_direction_based_target_ip, print_country6_code_fc);
 }
 
-/// Wrapper to call print_AS6_0 with a flow_cache
+/// Wrapper to call print_AS_name0 with a flow_cache
 static size_t print_AS6_name_fc(struct printbuf *kafka_line_buffer,
     const void *vipv6, struct flowCache *flow_cache) {
-  (void)flow_cache;
-  struct in6_addr ipv6 = get_ipv6(vipv6);
-  return geoip_decorator(kafka_line_buffer, ipv6, print_AS6_name_nl);
+  return geoip_decorator(kafka_line_buffer, flow_cache, vipv6,
+    print_AS_name0);
 }
 
 size_t print_lan_AS_name(struct printbuf *kafka_line_buffer,
@@ -1704,14 +2132,20 @@ size_t print_wan_AS_name(struct printbuf *kafka_line_buffer,
     get_direction_based_target_ip, print_AS6_name_fc);
 }
 
-#endif /* HAVE_GEOIP */
-
 size_t print_sensor_enrichment(struct printbuf *kafka_line_buffer,
     const struct flowCache *flowCache) {
   assert_multi(flowCache, flowCache->sensor);
 
   const char *enrichment = observation_id_enrichment(flowCache->observation_id);
-  if (enrichment) {
+  if (enrichment && OUTPUT_FORMAT_CBOR == readOnlyGlobals.output_format) {
+    /* Enrichment is stored as JSON object members */
+    const size_t start_bpos = kafka_line_buffer->bpos;
+    if (0 != rb_cbor_put_json_members(kafka_line_buffer, enrichment,
+                                                        strlen(enrichment))) {
+      return 0;
+    }
+    return kafka_line_buffer->bpos - start_bpos;
+  } else if (enrichment) {
     size_t added = 0;
     added += printbuf_memappend_fast_string(kafka_line_buffer,",");
     added += printbuf_memappend_fast_string(kafka_line_buffer,enrichment);
@@ -2091,23 +2525,78 @@ size_t print_target_name(struct printbuf *kafka_line_buffer,
 
 #endif /* HAVE_UDNS */
 
+void flow_message_start(struct printbuf *kafka_line_buffer) {
+  if (OUTPUT_FORMAT_CBOR == readOnlyGlobals.output_format) {
+    printbuf_memappend_fast(kafka_line_buffer, RB_CBOR_MAP_START, 1);
+  } else {
+    printbuf_memappend_fast(kafka_line_buffer, "{", strlen("{"));
+  }
+}
+
+void flow_message_end(struct printbuf *kafka_line_buffer) {
+  if (OUTPUT_FORMAT_CBOR == readOnlyGlobals.output_format) {
+    printbuf_memappend_fast(kafka_line_buffer, RB_CBOR_BREAK, 1);
+  } else {
+    printbuf_memappend_fast(kafka_line_buffer, "}", strlen("}"));
+  }
+}
+
+/** Check if a quoted field export function appends its value as a CBOR item
+  by itself in CBOR output. Addresses and MACs are encoded straight from the
+  flow, as tagged byte strings. Rest of quoted values are printed as text,
+  and converted to a text item after.
+  @param export_fn Template export function
+  @return true if value is already encoded
+  */
+static bool cbor_native_export_fn(size_t (*export_fn)(
+    struct printbuf *kafka_line_buffer, const void *buffer,
+    const size_t real_field_len, struct flowCache *flowCache)) {
+  static size_t (*const native_export_fns[])(struct printbuf *,
+      const void *, const size_t, struct flowCache *) = {
+    print_number,
+    print_ipv4_src_addr, print_ipv4_dst_addr,
+    print_ipv6_src_addr, print_ipv6_dst_addr,
+    print_sta_ipv4_address, print_lan_addr, print_wan_addr,
+    print_mac, print_client_mac, print_direction_based_client_mac,
+    process_src_mac, process_post_src_mac,
+    process_dst_mac, process_post_dst_mac,
+  };
+  size_t i;
+
+  for (i = 0; i < RD_ARRAYSIZE(native_export_fns); ++i) {
+    if (native_export_fns[i] == export_fn) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
 size_t printNetflowRecordWithTemplate(struct printbuf *kafka_line_buffer,
     const V9V10TemplateElementId *templateElement,
     const void *buffer, const size_t real_field_len,
     struct flowCache *flowCache) {
   const int start_bpos = kafka_line_buffer->bpos;
+  const bool cbor = OUTPUT_FORMAT_CBOR == readOnlyGlobals.output_format;
   int value_ret=0;
-  if(0!=strcmp(kafka_line_buffer->buf,"{")){
-    printbuf_memappend_fast(kafka_line_buffer,",",strlen(","));
-  }
-  printbuf_memappend_fast(kafka_line_buffer,"\"",strlen("\""));
-  printbuf_memappend_fast(kafka_line_buffer,templateElement->jsonElementName,
-    strlen(templateElement->jsonElementName));
-  printbuf_memappend_fast(kafka_line_buffer,"\":",strlen("\":"));
-
-  if (templateElement->quote) {
+  if (cbor) {
+    /* Indefinite length map: no separators, values are typed */
+    rb_cbor_put_text(kafka_line_buffer, templateElement->jsonElementName,
+      strlen(templateElement->jsonElementName));
+  } else {
+    if(0!=strcmp(kafka_line_buffer->buf,"{")){
+      printbuf_memappend_fast(kafka_line_buffer,",",strlen(","));
+    }
     printbuf_memappend_fast(kafka_line_buffer,"\"",strlen("\""));
+    printbuf_memappend_fast(kafka_line_buffer,templateElement->jsonElementName,
+      strlen(templateElement->jsonElementName));
+    printbuf_memappend_fast(kafka_line_buffer,"\":",strlen("\":"));
+
+    if (templateElement->quote) {
+      printbuf_memappend_fast(kafka_line_buffer,"\"",strlen("\""));
+    }
   }
+  const size_t value_bpos = kafka_line_buffer->bpos;
 
   if (NULL!=templateElement->export_fn) {
 #if WITH_PRINT_BOUND_CHECKS
@@ -2275,7 +2764,13 @@ size_t printNetflowRecordWithTemplate(struct printbuf *kafka_line_buffer,
     };
 #endif
 
-  if(value_ret > 0) /* Some added */ {
+  if(value_ret > 0 && cbor) {
+    /* Unquoted values are always CBOR integers */
+    if (templateElement->quote &&
+        !cbor_native_export_fn(templateElement->export_fn)) {
+      value_ret = rb_cbor_text_from(kafka_line_buffer, value_bpos);
+    }
+  } else if(value_ret > 0) /* Some added */ {
     if(templateElement->quote) {
       value_ret+=2;
       printbuf_memappend_fast(kafka_line_buffer,"\"",strlen("\""));
@@ -2401,7 +2896,7 @@ struct string_list *rb_separate_long_time_flow(
 
     current_timestamp_s += dInterval;
 
-    printbuf_memappend_fast(node->string,"}",strlen("}"));
+    flow_message_end(node->string);
   }/* foreach interval in nIntervals */
 
   return kafka_buffers_list;
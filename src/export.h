@@ -56,6 +56,7 @@ struct flowCache {
     /// @TODO use a memory context. Join both cases!!
     /// In case that we do not have a cache
     char *client_name,*target_name;
+    /// Cache hits, only valid inside worker epoch critical section
     struct dns_cache_elm *client_name_cache,*target_name_cache;
 #endif
   }address;
@@ -64,6 +65,19 @@ struct flowCache {
   const sensor_t *sensor;
   observation_id_t *observation_id;
 
+  /// Observation id home nets of flow addresses, so the direction guessing
+  /// and every net printer share one lookup per address
+  struct flow_cache_home_net {
+    uint8_t ip[16];
+    bool looked_up;
+    const char *ip_str, *name; ///< NULL if not in a home net
+  } home_nets[2];
+
+  /// Worker enrichment cache. Can be NULL
+  struct enrichment_cache *enrichment_cache;
+  /// Worker objects arena, to allocate flow output. Can be NULL
+  struct flow_arena *arena;
+
   /// Flow time related information
   struct {
     uint64_t export_timestamp_s;      ///< Flow export timestamp (seconds)
@@ -77,6 +91,45 @@ struct flowCache {
   uint64_t packets;            ///< Flow packets
 };
 
+/**
+ * Per worker cache of IP address enrichment results (networks, home nets,
+ * country and AS), so hot addresses are not searched again in every flow.
+ * It is a fixed size, set associative cache with CLOCK replacement in every
+ * set. Fields are looked up lazily, the first time a printer needs them.
+ * It is not thread safe: every worker must have its own cache, used only
+ * inside its enrichment databases epoch critical section. The cache flushes
+ * itself when any enrichment or sensors database is reloaded.
+ */
+struct enrichment_cache;
+
+/// Default number of enrichment cache entries
+#define ENRICHMENT_CACHE_DEFAULT_SIZE 8192
+
+/**
+ * Creates an enrichment cache.
+ *
+ * @param  size Number of entries. Will be rounded up to a power of 2.
+ * @return      New cache, or NULL if no memory.
+ */
+struct enrichment_cache *new_enrichment_cache(size_t size);
+
+/**
+ * Frees an enrichment cache.
+ *
+ * @param cache Cache to free. Can be NULL.
+ */
+void enrichment_cache_done(struct enrichment_cache *cache);
+
+/**
+ * Enrichment cache counters.
+ *
+ * @param cache  Cache.
+ * @param hits   Fields found in the cache.
+ * @param misses Fields that had to be looked up in databases.
+ */
+void enrichment_cache_stats(const struct enrichment_cache *cache,
+                                            uint64_t *hits, uint64_t *misses);
+
 struct flowCache *new_flowCache();
 uint64_t flowCache_packets(const struct flowCache *);
 uint64_t flowCache_octets(const struct flowCache *);
@@ -84,6 +137,16 @@ void associateSensor(struct flowCache *flowCache, sensor_t *sensor);
 bool guessDirection(struct flowCache *cache);
 void free_flowCache(struct flowCache *cache);
 
+/** Start a flow message, in readOnlyGlobals.output_format
+ * @param kafka_line_buffer Empty buffer
+ */
+void flow_message_start(struct printbuf *kafka_line_buffer);
+
+/** Finish a flow message started with flow_message_start
+ * @param kafka_line_buffer Buffer with message fields
+ */
+void flow_message_end(struct printbuf *kafka_line_buffer);
+
 /** Prints a netflow entity value with a given template
  * @param  kafka_line_buffer     Buffer to print entity.
  * @param  templateElement       Expected element in buffer
@@ -321,8 +384,6 @@ size_t print_mac_vendor(struct printbuf *kafka_line_buffer,
     const void *buffer, const size_t real_field_len,
     struct flowCache *flowCache);
 
-#ifdef HAVE_GEOIP
-
 size_t print_AS_ipv4(struct printbuf * kafka_line_buffer,
     const void *buffer, const size_t real_field_len,
     struct flowCache *flowCache);
@@ -362,8 +423,6 @@ size_t print_wan_AS_name(struct printbuf *kafka_line_buffer,
     const void *buffer, const size_t real_field_len,
     struct flowCache *flow_cache);
 
-#endif /* HAVE_GEOIP */
-
 size_t print_selector_name(struct printbuf *kafka_line_buffer,
     const void *buffer, const size_t real_field_len,
     struct flowCache *flowCache);
@@ -20,6 +20,8 @@
 #include "../config.h"
 #include "rb_kafka.h"
 #include "rb_sensor.h"
+#include "rb_packet_pool.h"
+#include "rb_shm_ring.h"
 
 #ifdef HAVE_UDNS
 #include "rb_dns_cache.h"
@@ -27,6 +29,7 @@
 
 #include "jansson.h"
 #include "f2k.h"
+#include <ctype.h>
 #include <net/ethernet.h>
 #include <pwd.h>
 #include <syslog.h>
@@ -136,7 +139,21 @@ static const struct option long_options[] = {
   { "rdkafka-opt",                      required_argument,       NULL, 'X' },
   { "rdkafka-netflow-consumer-opt",     required_argument,       NULL, 'Y' },
   { "use-kafka-random-partitioner",     no_argument,             NULL, 'p' },
-#endif
+  { "kafka-producers",                  required_argument,       NULL, 272 },
+  { "kafka-queue-full-timeout-ms",      required_argument,       NULL, 273 },
+  { "kafka-spill-dir",                  required_argument,       NULL, 274 },
+  { "kafka-spill-max-mb",               required_argument,       NULL, 275 },
+  { "kafka-batch-msgs",                 required_argument,       NULL, 281 },
+  { "kafka-batch-bytes",                required_argument,       NULL, 282 },
+  { "kafka-batch-ms",                   required_argument,       NULL, 283 },
+  { "kafka-batch-format",               required_argument,       NULL, 284 },
+#endif
+  { "sink",                             required_argument,       NULL, 276 },
+  { "sink-file-rotate-mb",              required_argument,       NULL, 277 },
+  { "sink-file-compress",               no_argument,             NULL, 278 },
+  { "sink-shm-slots",                   required_argument,       NULL, 279 },
+  { "sink-shm-slot-size",               required_argument,       NULL, 280 },
+  { "output-format",                    required_argument,       NULL, 285 },
 
   { "dont-reforge-timestamps",          no_argument,             NULL, 235 },
   { "original-speed",                   no_argument,             NULL, 237 },
@@ -147,11 +164,27 @@ static const struct option long_options[] = {
 
   { "debug",                            no_argument,       NULL, 254 },
   { "dont-reforge-far-timestamp",       no_argument,       NULL, 261 },
+#ifdef HAVE_RECVMMSG
+  { "collector-batch-size",             required_argument, NULL, 262 },
+#endif
+  { "collector-listener-threads",       required_argument, NULL, 263 },
+#ifdef linux
+  { "collector-listener-cpus",          required_argument, NULL, 264 },
+#endif
+  { "packet-pool-size",                 required_argument, NULL, 265 },
+  { "packet-pool-jumbo-size",           required_argument, NULL, 286 },
+  { "worker-queue-size",                required_argument, NULL, 266 },
+  { "worker-queue-bytes",               required_argument, NULL, 267 },
+  { "worker-queue-policy",              required_argument, NULL, 268 },
+  { "stats-interval",                   required_argument, NULL, 287 },
 
 #ifdef HAVE_UDNS
   { "enable-ptr-dns",                   no_argument,       NULL, 'd'},
   { "dns-cache-size-mb",                required_argument, NULL, 'c'},
   { "dns-cache-timeout-s",              required_argument, NULL, 't'},
+  { "dns-cache-negative-timeout-s",     required_argument, NULL, 269 },
+  { "dns-cache-refresh-ahead",          required_argument, NULL, 270 },
+  { "dns-cache-only",                   no_argument,       NULL, 271 },
 #endif
 
   /* End of probe options */
@@ -629,6 +662,18 @@ static void usage() {
          "                                    | [default=%zu]. Use 1 unless you know\n"
          "                                    | what you're doing.\n",
          readOnlyGlobals.numProcessThreads);
+  printf("--worker-queue-size <n>             | Max packets queued per processing thread\n"
+         "                                    | [default=%zu]\n",
+         readOnlyGlobals.worker_queue.size);
+  printf("--worker-queue-bytes <n>            | Max bytes queued per processing thread\n"
+         "                                    | [default=0 (no limit)]\n");
+  printf("--worker-queue-policy <policy>      | What to do when a processing thread\n"
+         "                                    | queue is full: block, drop-newest or\n"
+         "                                    | drop-oldest [default=block]\n");
+  printf("--stats-interval <s>                | Print processing and receive statistics\n"
+         "                                    | every <s> seconds, 0 to print them only\n"
+         "                                    | at exit [default=%u]\n",
+         readOnlyGlobals.stats_interval_s);
   printf("[--separate-long-flows]             | Separate long time flows (default no) \n");
   printf("[--f2k-version|-v]               | Prints the program version.\n");
   printf("[--help|-h]                         | Prints this help.\n");
@@ -654,12 +699,34 @@ static void usage() {
          "                                    | on the specified capture device at the\n"
          "                                    | specified rate. Default: 1:1 [no sampling]\n");
   printf("[--as-list|-A] <AS list>            | GeoIP file containing the list of known ASs.\n"
-         "                                    | Example: GeoIPASNum.dat\n");
+         "                                    | Files ending in .mmdb are read as MaxMind DB\n"
+         "                                    | Example: GeoIPASNum.dat, GeoLite2-ASN.mmdb\n");
   printf("[--pid-file|-g] <PID file>          | Put the PID in the specified file\n");
   printf("[--flow-version|-V] <version>       | NetFlow Version: 5=v5, 9=v9, 10=IPFIX\n");
   printf("[--count|-2] <number>               | Capture a specified number of packets\n"
          "                                    | and quit (debug only)\n");
   printf("[--collector-port|-3] <port>        | NetFlow/sFlow comma separated collector ports for incoming flows\n");
+#ifdef HAVE_RECVMMSG
+  printf("--collector-batch-size <n>          | Receive up to <n> datagrams per syscall in\n"
+         "                                    | collector ports [default=%zu]\n",
+         readOnlyGlobals.listener_batch_size);
+#endif
+  printf("--collector-listener-threads <n>    | Open <n> SO_REUSEPORT sockets, with one\n"
+         "                                    | listener thread each, per collector port\n"
+         "                                    | [default=%zu]\n",
+         readOnlyGlobals.listener_threads);
+#ifdef linux
+  printf("--collector-listener-cpus <list>    | Comma separated list of CPU ids. Listener\n"
+         "                                    | thread N of each port is bound to the\n"
+         "                                    | N-th CPU of the list\n");
+#endif
+  printf("--packet-pool-size <n>              | Recycle up to <n> received packet buffers\n"
+         "                                    | of 2KB and 9KB classes per receiving\n"
+         "                                    | thread [default=%zu]\n",
+         readOnlyGlobals.packet_pool.max_buffers);
+  printf("--packet-pool-jumbo-size <n>        | Recycle up to <n> 64KB packet buffers\n"
+         "                                    | per receiving thread [default=%zu]\n",
+         readOnlyGlobals.packet_pool.max_jumbo_buffers);
 #ifdef linux
   printf("[--cpu-affinity|-4] <CPU/Core Id>   | Binds this process to the specified CPU/Core\n"
          "                                    | Note: the first available CPU corresponds to 0.\n");
@@ -674,7 +741,45 @@ static void usage() {
 #ifdef HAVE_LIBRDKAFKA
   printf("--kafka <broker IP>:<topic>         | Deliver flows to the specified Apache Kafka broker. Example localhost:test\n");
   printf("--use-kafka-random-partitioner      | Use random partitioning in kafka");
-#endif
+  printf("--kafka-producers <n>               | Spread workers among <n> kafka producers,\n"
+         "                                    | from 1 to the number of threads\n"
+         "                                    | [default=1]\n");
+  printf("--kafka-queue-full-timeout-ms <ms>  | Max time to wait for room in a full kafka\n"
+         "                                    | producer queue before dropping flows\n"
+         "                                    | [default=%d]\n",
+         KAFKA_QUEUE_FULL_DEFAULT_TIMEOUT_MS);
+  printf("--kafka-spill-dir <dir>             | Save in <dir> the flows that can't be\n"
+         "                                    | delivered to kafka, and send them later\n");
+  printf("--kafka-spill-max-mb <n>            | Max size of spilled flows\n"
+         "                                    | [default=%d]\n",
+         KAFKA_SPILL_DEFAULT_MAX_MB);
+  printf("--kafka-batch-msgs <n>              | Pack up to <n> flows of the same partition\n"
+         "                                    | in each kafka message [default=1]\n");
+  printf("--kafka-batch-bytes <n>             | Max size of multi-flow messages\n"
+         "                                    | [default=%d]\n",
+         RB_MSG_BATCH_DEFAULT_MAX_BYTES);
+  printf("--kafka-batch-ms <ms>               | Max time a flow waits for more flows of\n"
+         "                                    | its partition [default=%d]\n",
+         RB_MSG_BATCH_DEFAULT_MAX_DELAY_MS);
+  printf("--kafka-batch-format <fmt>          | Multi-flow messages format: ndjson (one\n"
+         "                                    | flow per line) or array (JSON array)\n"
+         "                                    | [default=ndjson]\n");
+#endif
+  printf("--sink <type>[:<path>]              | Where to send flows: kafka, file:<path> (one\n"
+         "                                    | JSON per line), null (discard, for\n"
+         "                                    | benchmarking), unix-dgram:<path>,\n"
+         "                                    | unix-stream:<path> or shm:<path> (memory\n"
+         "                                    | mapped ring) [default=kafka]\n");
+  printf("--sink-file-rotate-mb <n>           | Rotate file sink when it reaches <n> MB\n"
+         "                                    | [default=0, no rotation]\n");
+  printf("--sink-file-compress                | gzip file sink output\n");
+  printf("--sink-shm-slots <n>                | Records in shm sink ring [default=%d]\n",
+         RB_SHM_RING_DEFAULT_SLOTS);
+  printf("--sink-shm-slot-size <bytes>        | Max record size in shm sink ring\n"
+         "                                    | [default=%d]\n",
+         RB_SHM_RING_DEFAULT_SLOT_SIZE);
+  printf("--output-format <format>            | Flows encoding: json, or cbor (binary\n"
+         "                                    | RFC 8949 maps) [default=json]\n");
   printf("--hosts-path                        | Path to your own /etc/hosts, /etc/networks and vlans mapping\n");
   printf("                                    | See VLAN_MAP.txt for details\n");
   printf("--any-template                      | Print all fields in collector mode, even if not specified in template\n");
@@ -697,6 +802,22 @@ static void usage() {
 
 /* ****************************************************** */
 
+#ifdef HAVE_LIBRDKAFKA
+static void printSpillStats(struct rb_spill *spill) {
+  struct rb_spill_stats stats;
+
+  rb_spill_get_stats(spill, &stats);
+  traceEvent(TRACE_NORMAL, "Kafka spill journal: "
+    "[spilled msgs: %"PRIu64"][replayed msgs: %"PRIu64"]"
+    "[dropped msgs: %"PRIu64"][pending bytes: %"PRIu64"]"
+    "[truncated segments: %"PRIu64"]",
+    stats.spilled_msgs, stats.replayed_msgs, stats.dropped_msgs, stats.bytes,
+    stats.truncated_segments);
+}
+#endif
+
+/* ****************************************************** */
+
 static void printProcessingStats(const struct worker_stats *worker_stats,
     const size_t num_workers) {
   struct worker_stats all_stats = {0};
@@ -709,6 +830,10 @@ static void printProcessingStats(const struct worker_stats *worker_stats,
     if (i < num_workers) {
       sum_worker_stats(&all_stats, &worker_stats[i]);
     } else {
+#ifdef HAVE_LIBRDKAFKA
+      /* Multi-flow messages sent out of workers */
+      rb_kafka_sink_sum_stats(&all_stats);
+#endif
       w_stats = &all_stats;
     }
 
@@ -722,10 +847,23 @@ static void printProcessingStats(const struct worker_stats *worker_stats,
 
     traceEvent(TRACE_NORMAL, "[W:%zu/%zu] "
       "Flow collection: [collected pkts: %"PRIu64" (%lf pkts/s)]"
-      "[processed flows: %"PRIu64" (%lf flows/s)]",
+      "[processed flows: %"PRIu64" (%lf flows/s)]"
+      "[dropped pkts: %"PRIu64"]"
+      "[enrichment cache hits/misses: %"PRIu64"/%"PRIu64"]"
+      "[kafka delayed msgs: %"PRIu64"]"
+      "[kafka dropped msgs queue full/too large/other: "
+        "%"PRIu64"/%"PRIu64"/%"PRIu64"]"
+      "[sink dropped msgs: %"PRIu64"]",
       i, readOnlyGlobals.numProcessThreads,
       num_collected_pkts, pkts_per_second, w_stats->num_flows_processed,
-                                                              flows_per_second);
+      flows_per_second, w_stats->num_dropped_packets,
+      w_stats->num_enrichment_cache_hits,
+      w_stats->num_enrichment_cache_misses,
+      w_stats->num_kafka_delayed_msgs,
+      w_stats->num_kafka_dropped_queue_full,
+      w_stats->num_kafka_dropped_msg_size,
+      w_stats->num_kafka_dropped_other,
+      w_stats->num_sink_dropped_msgs);
 
   }
 
@@ -857,15 +995,62 @@ static void parse_port_list(char *port_list, listener_list *list) {
   }
 }
 
+#ifdef linux
+/** Parse listener threads CPU list
+  @param cpu_list Comma separated CPU ids list
+  */
+static void parse_listener_cpus(char *cpu_list) {
+  char *strtok_aux = NULL;
+  const char *scpu = NULL;
+  const long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+  readOnlyGlobals.listener_cpus.len = 0;
+  for (scpu = strtok_r(cpu_list, ",", &strtok_aux); scpu;
+       scpu = strtok_r(NULL, ",", &strtok_aux)) {
+    char *strtol_end = NULL;
+    const long cpu = strtol(scpu, &strtol_end, 10);
+    if (*strtol_end != '\0' || cpu < 0 || cpu >= num_cpus) {
+      traceEvent(TRACE_ERROR, "Invalid CPU %s, skipping", scpu);
+      continue;
+    }
+
+    if (readOnlyGlobals.listener_cpus.len ==
+                          RD_ARRAYSIZE(readOnlyGlobals.listener_cpus.cpus)) {
+      traceEvent(TRACE_WARNING, "Too many listener CPUs, ignoring %s", scpu);
+      continue;
+    }
+
+    readOnlyGlobals.listener_cpus.cpus[readOnlyGlobals.listener_cpus.len++] =
+                                                                          cpu;
+  }
+}
+#endif
+
 static void initDefaults(void) {
   /* Set defaults */
-#ifdef HAVE_GEOIP
-  readOnlyGlobals.geo_ip_asn_db = NULL;
-#endif
   readOnlyGlobals.snaplen = PCAP_DEFAULT_SNAPLEN;
   readOnlyGlobals.pcapFileList = NULL;
   readOnlyGlobals.pcapFile = NULL;
   readOnlyGlobals.unprivilegedUser = strdup("nobody");
+  readOnlyGlobals.listener_batch_size = 1;
+  readOnlyGlobals.listener_threads = 1;
+  readOnlyGlobals.packet_pool.max_buffers = PACKET_POOL_DEFAULT_MAX_BUFFERS;
+  readOnlyGlobals.packet_pool.max_jumbo_buffers =
+    PACKET_POOL_DEFAULT_MAX_JUMBO_BUFFERS;
+  readOnlyGlobals.worker_queue.size = WORKER_QUEUE_DEFAULT_SIZE;
+  readOnlyGlobals.worker_queue.max_bytes = 0;
+  readOnlyGlobals.worker_queue.policy = WORKER_QUEUE_BLOCK;
+  readOnlyGlobals.stats_interval_s = STATS_DEFAULT_INTERVAL_S;
+#ifdef HAVE_LIBRDKAFKA
+  readOnlyGlobals.kafka.queue_full_timeout_ms =
+    KAFKA_QUEUE_FULL_DEFAULT_TIMEOUT_MS;
+  readOnlyGlobals.kafka.spill_max_mb = KAFKA_SPILL_DEFAULT_MAX_MB;
+  readOnlyGlobals.kafka.batch.max_bytes = RB_MSG_BATCH_DEFAULT_MAX_BYTES;
+  readOnlyGlobals.kafka.batch.max_delay_ms = RB_MSG_BATCH_DEFAULT_MAX_DELAY_MS;
+  readOnlyGlobals.kafka.batch.format = RB_MSG_BATCH_NDJSON;
+#endif
+  readOnlyGlobals.sink_conf.shm_slots = RB_SHM_RING_DEFAULT_SLOTS;
+  readOnlyGlobals.sink_conf.shm_slot_size = RB_SHM_RING_DEFAULT_SLOT_SIZE;
 
 #ifdef HAVE_PF_RING
   readOnlyGlobals.cluster_id = -1;
@@ -880,6 +1065,81 @@ static void printArgv(int argc,char *argv[]){
     traceEvent(TRACE_ERROR, "[%d][%s]", i, argv[i]);
 }
 
+/**
+ * Create output sinks, as selected in command line
+ * @return 0 if success, !0 in other case
+ */
+static int init_sinks(void) {
+  const char *path = readOnlyGlobals.sink_conf.path;
+  struct rb_sink *sink = NULL;
+  size_t i;
+
+  switch (readOnlyGlobals.sink_conf.type) {
+#ifdef HAVE_LIBRDKAFKA
+  case RB_SINK_KAFKA:
+    /* One sink per producer */
+    readOnlyGlobals.sinks = calloc(readOnlyGlobals.kafka.n_producers,
+      sizeof(readOnlyGlobals.sinks[0]));
+    if (NULL == readOnlyGlobals.sinks) {
+      traceEvent(TRACE_ERROR, "Not enough memory?");
+      return -1;
+    }
+
+    for (i=0; i<readOnlyGlobals.kafka.n_producers; ++i) {
+      readOnlyGlobals.sinks[i] = rb_sink_kafka_new(
+        &readOnlyGlobals.kafka.producers[i], &readOnlyGlobals.kafka.batch);
+      if (NULL == readOnlyGlobals.sinks[i]) {
+        return -1;
+      }
+      readOnlyGlobals.n_sinks++;
+    }
+    readOnlyGlobals.sink = readOnlyGlobals.sinks[0];
+    return 0;
+#endif
+
+  case RB_SINK_FILE:
+    sink = rb_sink_file_new(path,
+      readOnlyGlobals.sink_conf.file_rotate_mb * 1024 * 1024,
+      readOnlyGlobals.sink_conf.file_compress);
+    break;
+
+  case RB_SINK_NULL:
+    sink = rb_sink_null_new();
+    break;
+
+  case RB_SINK_SHM:
+    sink = rb_sink_shm_new(path, readOnlyGlobals.sink_conf.shm_slots,
+      readOnlyGlobals.sink_conf.shm_slot_size);
+    break;
+
+  case RB_SINK_UNIX_DGRAM:
+  case RB_SINK_UNIX_STREAM:
+    sink = rb_sink_unix_new(path,
+      RB_SINK_UNIX_DGRAM == readOnlyGlobals.sink_conf.type ?
+        SOCK_DGRAM : SOCK_STREAM);
+    break;
+
+  default:
+    traceEvent(TRACE_ERROR, "Sink not available in this build");
+    return -1;
+  };
+
+  if (NULL == sink) {
+    return -1;
+  }
+
+  readOnlyGlobals.sinks = calloc(1, sizeof(readOnlyGlobals.sinks[0]));
+  if (NULL == readOnlyGlobals.sinks) {
+    traceEvent(TRACE_ERROR, "Not enough memory?");
+    rb_sink_done(sink);
+    return -1;
+  }
+
+  readOnlyGlobals.sinks[0] = readOnlyGlobals.sink = sink;
+  readOnlyGlobals.n_sinks = 1;
+  return 0;
+}
+
 /**
  * Parse kafka <broker>@<topic> argument
  * @param  arg Text argument
@@ -936,6 +1196,8 @@ static int parseOptions(int argc, char* argv[], const bool reparse_options) {
   char *new_dns_servers = NULL;
   size_t dns_cache_size_mb = 0;
   time_t dns_cache_timeout_s = 0;
+  time_t dns_cache_negative_timeout_s = 0;
+  unsigned dns_cache_refresh_ahead_pct = 0;
 #endif
 
   if(!reparse_options)
@@ -1283,6 +1545,55 @@ static int parseOptions(int argc, char* argv[], const bool reparse_options) {
       readOnlyGlobals.kafka.use_client_mac_partitioner = 0;
       break;
 
+    case 272: {
+      char *endptr = NULL;
+      errno = 0;
+      const unsigned long n_producers = strtoul(optarg, &endptr, 10);
+      /* strtoul would accept (and wrap) negative numbers. Upper limit
+         depends on workers, that may not be known yet */
+      if (!isdigit((unsigned char)optarg[0]) || '\0' != *endptr ||
+          0 != errno || 0 == n_producers) {
+        traceEvent(TRACE_ERROR,
+          "Invalid number of kafka producers %s (valid values: 1-<number of "
+          "workers>)", optarg);
+        exit(0);
+      }
+      readOnlyGlobals.kafka.n_producers = n_producers;
+      break;
+    }
+
+    case 273:
+      readOnlyGlobals.kafka.queue_full_timeout_ms = strtoul(optarg, NULL, 10);
+      break;
+
+    case 274:
+      free(readOnlyGlobals.kafka.spill_dir);
+      readOnlyGlobals.kafka.spill_dir = strdup(optarg);
+      break;
+
+    case 275:
+      readOnlyGlobals.kafka.spill_max_mb = strtoul(optarg, NULL, 10);
+      break;
+
+    case 281:
+      readOnlyGlobals.kafka.batch.max_msgs = strtoul(optarg, NULL, 10);
+      break;
+
+    case 282:
+      readOnlyGlobals.kafka.batch.max_bytes = strtoul(optarg, NULL, 10);
+      break;
+
+    case 283:
+      readOnlyGlobals.kafka.batch.max_delay_ms = strtoul(optarg, NULL, 10);
+      break;
+
+    case 284:
+      if (0 != rb_msg_batch_format_parse(optarg,
+                                    &readOnlyGlobals.kafka.batch.format)) {
+        exit(0);
+      }
+      break;
+
     case 229:
       {
         const bool rc = parse_kafka_broker_topic_arg(optarg, rk_conf,
@@ -1299,6 +1610,34 @@ static int parseOptions(int argc, char* argv[], const bool reparse_options) {
 
 #endif /* HAVE_LIBRDKAFKA */
 
+    case 276:
+      {
+        const char *path = NULL;
+        if (0 != rb_sink_parse(optarg, &readOnlyGlobals.sink_conf.type,
+                                                                  &path)) {
+          exit(0);
+        }
+        free(readOnlyGlobals.sink_conf.path);
+        readOnlyGlobals.sink_conf.path = path ? strdup(path) : NULL;
+      }
+      break;
+
+    case 277:
+      readOnlyGlobals.sink_conf.file_rotate_mb = strtoul(optarg, NULL, 10);
+      break;
+
+    case 278:
+      readOnlyGlobals.sink_conf.file_compress = true;
+      break;
+
+    case 279:
+      readOnlyGlobals.sink_conf.shm_slots = strtoul(optarg, NULL, 10);
+      break;
+
+    case 280:
+      readOnlyGlobals.sink_conf.shm_slot_size = strtoul(optarg, NULL, 10);
+      break;
+
 #ifdef HAVE_UDNS
     case 'd':
       new_dns_servers = strdup("");
@@ -1311,6 +1650,23 @@ static int parseOptions(int argc, char* argv[], const bool reparse_options) {
     case 't':
       dns_cache_timeout_s = atoi(optarg);
       break;
+
+    case 269:
+      dns_cache_negative_timeout_s = atoi(optarg);
+      break;
+
+    case 270:
+      dns_cache_refresh_ahead_pct = strtoul(optarg, NULL, 10);
+      if (dns_cache_refresh_ahead_pct >= 100) {
+        traceEvent(TRACE_ERROR,
+          "DNS cache refresh ahead must be a percentage below 100, ignoring");
+        dns_cache_refresh_ahead_pct = 0;
+      }
+      break;
+
+    case 271:
+      readOnlyGlobals.udns.cache_only = true;
+      break;
 #endif
 
     case 235:
@@ -1342,6 +1698,89 @@ static int parseOptions(int argc, char* argv[], const bool reparse_options) {
       readOnlyGlobals.dontReforgeFarTimestamp = 1;
       break;
 
+#ifdef HAVE_RECVMMSG
+    case 262: {
+      char *endptr = NULL;
+      errno = 0;
+      const unsigned long batch_size = strtoul(optarg, &endptr, 10);
+      /* strtoul would accept (and wrap) negative numbers */
+      if (!isdigit((unsigned char)optarg[0]) || '\0' != *endptr ||
+          0 != errno || 0 == batch_size ||
+          batch_size > MAX_LISTENER_BATCH_SIZE) {
+        traceEvent(TRACE_ERROR,
+          "Invalid collector batch size %s (valid values: 1-%d)", optarg,
+          MAX_LISTENER_BATCH_SIZE);
+        exit(0);
+      }
+      readOnlyGlobals.listener_batch_size = batch_size;
+      break;
+    }
+#endif
+
+    case 263:
+      readOnlyGlobals.listener_threads = atoi(optarg);
+      if (readOnlyGlobals.listener_threads > MAX_NUM_COLLECTOR_THREADS) {
+        traceEvent(TRACE_WARNING, "Collector listener threads set to %d",
+          MAX_NUM_COLLECTOR_THREADS);
+        readOnlyGlobals.listener_threads = MAX_NUM_COLLECTOR_THREADS;
+      } else if (readOnlyGlobals.listener_threads == 0) {
+        readOnlyGlobals.listener_threads = 1;
+      }
+      break;
+
+#ifdef linux
+    case 264:
+      parse_listener_cpus(optarg);
+      break;
+#endif
+
+    case 265:
+      readOnlyGlobals.packet_pool.max_buffers = strtoul(optarg, NULL, 10);
+      break;
+
+    case 286:
+      readOnlyGlobals.packet_pool.max_jumbo_buffers =
+        strtoul(optarg, NULL, 10);
+      break;
+
+    case 266:
+      readOnlyGlobals.worker_queue.size = strtoul(optarg, NULL, 10);
+      if (readOnlyGlobals.worker_queue.size == 0) {
+        readOnlyGlobals.worker_queue.size = WORKER_QUEUE_DEFAULT_SIZE;
+      }
+      break;
+
+    case 267:
+      readOnlyGlobals.worker_queue.max_bytes = strtoull(optarg, NULL, 10);
+      break;
+
+    case 268:
+      if (0 == strcmp(optarg, "block")) {
+        readOnlyGlobals.worker_queue.policy = WORKER_QUEUE_BLOCK;
+      } else if (0 == strcmp(optarg, "drop-newest")) {
+        readOnlyGlobals.worker_queue.policy = WORKER_QUEUE_DROP_NEWEST;
+      } else if (0 == strcmp(optarg, "drop-oldest")) {
+        readOnlyGlobals.worker_queue.policy = WORKER_QUEUE_DROP_OLDEST;
+      } else {
+        traceEvent(TRACE_ERROR, "Unknown worker queue policy %s", optarg);
+      }
+      break;
+
+    case 287:
+      readOnlyGlobals.stats_interval_s = strtoul(optarg, NULL, 10);
+      break;
+
+    case 285:
+      if (0 == strcmp(optarg, "json")) {
+        readOnlyGlobals.output_format = OUTPUT_FORMAT_JSON;
+      } else if (0 == strcmp(optarg, "cbor")) {
+        readOnlyGlobals.output_format = OUTPUT_FORMAT_CBOR;
+      } else {
+        traceEvent(TRACE_ERROR, "Unknown output format %s", optarg);
+        exit(0);
+      }
+      break;
+
     default:
       traceEvent(TRACE_ERROR,"Unknown parameter %c",opt);
       break;
@@ -1419,12 +1858,20 @@ static int parseOptions(int argc, char* argv[], const bool reparse_options) {
 
   if(dns_cache_size_mb > 0) {
     /// @TODO reload
-    readOnlyGlobals.udns.cache = dns_cache_new(dns_cache_size_mb,dns_cache_timeout_s);
+    readOnlyGlobals.udns.cache = dns_cache_new(
+      &readOnlyGlobals.rb_databases.epoch, dns_cache_size_mb,
+      dns_cache_timeout_s, dns_cache_negative_timeout_s,
+      dns_cache_refresh_ahead_pct);
     if(NULL == readOnlyGlobals.udns.cache) {
       traceEvent(TRACE_ERROR,"Can't allocate a DNS cache (out of memory?)");
     }
   }
 
+  if(readOnlyGlobals.udns.cache_only && NULL == readOnlyGlobals.udns.cache) {
+    traceEvent(TRACE_WARNING,
+      "DNS cache only mode without DNS cache: no names will be resolved");
+  }
+
   free(new_dns_servers);
 udns_config_err:
 #endif
@@ -1435,35 +1882,80 @@ udns_config_err:
 #ifdef HAVE_LIBRDKAFKA
     char errstr[2048];
 
-    if (!kafka_topic) {
-      traceEvent(TRACE_ERROR,
-        "No kafka broker@topic specified for produce. Exiting");
-      exit(0);
-    }
+    if (RB_SINK_KAFKA == readOnlyGlobals.sink_conf.type) {
+      if (!kafka_topic) {
+        traceEvent(TRACE_ERROR,
+          "No kafka broker@topic specified for produce. Exiting");
+        exit(0);
+      }
 
-    parse_kafka_config(rk_conf, NULL, "socket.keepalive.enable=true");
-    parse_kafka_config(rk_conf, NULL, "socket.max.fails=3");
+      parse_kafka_config(rk_conf, NULL, "socket.keepalive.enable=true");
+      parse_kafka_config(rk_conf, NULL, "socket.max.fails=3");
 
-    if (readOnlyGlobals.kafka.use_client_mac_partitioner) {
-      rd_kafka_topic_conf_set_partitioner_cb(rkt_conf,
-        rb_client_mac_partitioner);
-    }
+      if (readOnlyGlobals.kafka.use_client_mac_partitioner) {
+        rd_kafka_topic_conf_set_partitioner_cb(rkt_conf,
+          rb_client_mac_partitioner);
+      }
 
-    readOnlyGlobals.kafka.rk = rd_kafka_new(RD_KAFKA_PRODUCER, rk_conf,
-      errstr, sizeof(errstr));
-    if (unlikely(NULL == readOnlyGlobals.kafka.rk)) {
-      traceEvent(TRACE_ERROR, "Unable to create kafka handler: %s",
-        errstr);
-      exit(0);
-    }
+      if (0 == readOnlyGlobals.kafka.n_producers) {
+        readOnlyGlobals.kafka.n_producers = 1;
+      } else if (readOnlyGlobals.kafka.n_producers >
+                                            readOnlyGlobals.numProcessThreads) {
+        /* More producers than workers would be idle */
+        traceEvent(TRACE_ERROR,
+          "Invalid number of kafka producers %zu (valid values: 1-%zu, the "
+          "number of workers)", readOnlyGlobals.kafka.n_producers,
+          readOnlyGlobals.numProcessThreads);
+        exit(0);
+      }
 
-    readOnlyGlobals.kafka.rkt = rd_kafka_topic_new(readOnlyGlobals.kafka.rk,
-      kafka_topic, rkt_conf);
-    if (unlikely(NULL == readOnlyGlobals.kafka.rkt)) {
-      traceEvent(TRACE_ERROR, "Unable to create a kafka topic");
-      rd_kafka_destroy(readOnlyGlobals.kafka.rk);
-      readOnlyGlobals.kafka.rk = NULL;
-      exit(0);
+      if (readOnlyGlobals.kafka.spill_dir) {
+        readOnlyGlobals.kafka.spill = rb_spill_new(
+          readOnlyGlobals.kafka.spill_dir, RB_SPILL_DEFAULT_SEGMENT_SIZE,
+          readOnlyGlobals.kafka.spill_max_mb * 1024 * 1024,
+          RB_SPILL_DEFAULT_FSYNC_BATCH);
+        if (NULL == readOnlyGlobals.kafka.spill) {
+          exit(0);
+        }
+
+        /* Undelivered messages go to the journal */
+        rd_kafka_conf_set_dr_msg_cb(rk_conf, rb_kafka_spill_msg_delivered);
+      }
+
+      readOnlyGlobals.kafka.producers = calloc(readOnlyGlobals.kafka.n_producers,
+        sizeof(readOnlyGlobals.kafka.producers[0]));
+      if (unlikely(NULL == readOnlyGlobals.kafka.producers)) {
+        traceEvent(TRACE_ERROR, "Not enough memory?");
+        exit(0);
+      }
+
+      for (i=readOnlyGlobals.kafka.n_producers; i-- > 0;) {
+        /* All producers share configuration, including partitioner, so the
+           same client mac goes to the same partition whatever producer sends
+           it. Last producer consumes the original configuration objects */
+        rd_kafka_conf_t *producer_conf = i > 0 ?
+          rd_kafka_conf_dup(rk_conf) : rk_conf;
+        rd_kafka_topic_conf_t *producer_topic_conf = i > 0 ?
+          rd_kafka_topic_conf_dup(rkt_conf) : rkt_conf;
+
+        if (0 != rb_kafka_producer_init(&readOnlyGlobals.kafka.producers[i],
+                        producer_conf, kafka_topic, producer_topic_conf)) {
+          exit(0);
+        }
+      }
+
+      readOnlyGlobals.kafka.rk = readOnlyGlobals.kafka.producers[0].rk;
+      readOnlyGlobals.kafka.rkt = readOnlyGlobals.kafka.producers[0].rkt;
+
+      if (readOnlyGlobals.kafka.spill && 0 != rb_kafka_spill_replayer_start(
+            &readOnlyGlobals.kafka.spill_replayer,
+            &readOnlyGlobals.kafka.producers[0], readOnlyGlobals.kafka.spill)) {
+        exit(0);
+      }
+    } else {
+      /* Kafka not used */
+      rd_kafka_conf_destroy(rk_conf);
+      rd_kafka_topic_conf_destroy(rkt_conf);
     }
 
     free(kafka_topic);
@@ -1475,6 +1967,10 @@ udns_config_err:
     }
 #endif
 
+    if (0 != init_sinks()) {
+      exit(0);
+    }
+
     size_t idx = 0;
     /* Start a pool of threads */
     if((readOnlyGlobals.packetProcessThread = calloc(
@@ -1485,7 +1981,13 @@ udns_config_err:
     }
 
     for(idx=0;idx<readOnlyGlobals.numProcessThreads;++idx){
-      readOnlyGlobals.packetProcessThread[idx] = new_collect_worker();
+      /* Workers with their own sink poll it. Worker 0 gets sinks[0], i.e.
+         producers[0], that main loop polls too: librdkafka allows concurrent
+         polls, and delivery reports are still served when worker 0 is idle */
+      struct rb_sink *sink = readOnlyGlobals.n_sinks > 1 ?
+        rb_sink_of_worker(readOnlyGlobals.sinks, readOnlyGlobals.n_sinks,
+          idx) : NULL;
+      readOnlyGlobals.packetProcessThread[idx] = new_collect_worker(sink);
     }
   }
 
@@ -1571,6 +2073,8 @@ static void stopCaptureFlushAll(void) {
 
   readWriteGlobals->shutdownInProgress = 1;
 
+  /* Stop feeding workers before closing them */
+  listener_list_done(&readOnlyGlobals.listeners);
 
   struct worker_stats worker_stats[readOnlyGlobals.numProcessThreads];
   for (i=0; i<readOnlyGlobals.numProcessThreads; ++i) {
@@ -1579,20 +2083,39 @@ static void stopCaptureFlushAll(void) {
   }
   free(readOnlyGlobals.packetProcessThread);
 
+  /* Sinks could have pending messages for producers */
+  for (i=0; i<readOnlyGlobals.n_sinks; ++i) {
+    rb_sink_done(readOnlyGlobals.sinks[i]);
+  }
+
+  /* After sinks flush, so their last messages are accounted */
   printProcessingStats(worker_stats, readOnlyGlobals.numProcessThreads);
+  free(readOnlyGlobals.sinks);
+  readOnlyGlobals.sinks = NULL;
+  readOnlyGlobals.sink = NULL;
+  readOnlyGlobals.n_sinks = 0;
+
 #ifdef HAVE_LIBRDKAFKA
   if (readOnlyGlobals.kafka.rk) {
-    /* Steps of librdkafka wiki */
+    if (readOnlyGlobals.kafka.spill) {
+      rb_kafka_spill_replayer_stop(&readOnlyGlobals.kafka.spill_replayer);
+    }
 
-    /* 1) Make sure all outstanding requests are transmitted and handled. */
     traceEvent(TRACE_INFO, "Flushing pending kafka messages...");
-    while (rd_kafka_outq_len(readOnlyGlobals.kafka.rk) > 0) {
-      rd_kafka_poll(readOnlyGlobals.kafka.rk, 50);
+    for (i=0; i<readOnlyGlobals.kafka.n_producers; ++i) {
+      rb_kafka_producer_done(&readOnlyGlobals.kafka.producers[i]);
     }
 
-    /* 2) Destroy the topic and handle objects */
-    rd_kafka_topic_destroy(readOnlyGlobals.kafka.rkt);
-    rd_kafka_destroy(readOnlyGlobals.kafka.rk);
+    if (readOnlyGlobals.kafka.spill) {
+      /* Producers flush could have spilled some messages */
+      printSpillStats(readOnlyGlobals.kafka.spill);
+      rb_spill_done(readOnlyGlobals.kafka.spill);
+      readOnlyGlobals.kafka.spill = NULL;
+    }
+    free(readOnlyGlobals.kafka.producers);
+    readOnlyGlobals.kafka.producers = NULL;
+    readOnlyGlobals.kafka.rk = NULL;
+    readOnlyGlobals.kafka.rkt = NULL;
 
     traceEvent(TRACE_INFO, "Disconnected from Kafka ...");
   }
@@ -1603,12 +2126,20 @@ static void stopCaptureFlushAll(void) {
   rb_destroy_mac_vendor_db(readOnlyGlobals.rb_databases.mac_vendor_database);
 
   traceEvent(TRACE_INFO, "Deleting hosts names...");
+  ip_name_db_done(readOnlyGlobals.rb_databases.nets_name_as_db);
   freeHostsList(readOnlyGlobals.rb_databases.ip_name_as_list);
   freeHostsList(readOnlyGlobals.rb_databases.nets_name_as_list);
   if(readOnlyGlobals.rb_databases.apps_name_as_list)
     deleteNumNameAssocTree(readOnlyGlobals.rb_databases.apps_name_as_list);
   freeHostsList(readOnlyGlobals.rb_databases.engines_name_as_list);
   freeHostsList(readOnlyGlobals.rb_databases.domains_name_as_list);
+  if(readOnlyGlobals.rb_databases.mac_name_database) {
+    freeIfAddressList(readOnlyGlobals.rb_databases.mac_name_database);
+    free(readOnlyGlobals.rb_databases.mac_name_database);
+  }
+  deleteGeoIPDatabases();
+  /* Databases replaced in previous reloads */
+  rb_epoch_done(&readOnlyGlobals.rb_databases.epoch);
   free(readOnlyGlobals.rb_databases.hosts_database_path);
 
 }
@@ -1669,6 +2200,10 @@ static void shutdown_f2k(void) {
   traceEvent(TRACE_INFO, "Cleaning globals");
 
   free(readOnlyGlobals.unprivilegedUser);
+#ifdef HAVE_LIBRDKAFKA
+  free(readOnlyGlobals.kafka.spill_dir);
+#endif
+  free(readOnlyGlobals.sink_conf.path);
 
   // free(readOnlyGlobals.packetProcessThread);
 
@@ -1684,10 +2219,6 @@ static void shutdown_f2k(void) {
   dumpLogEvent(probe_stopped, severity_info, "nProbe stopped");
   if(readOnlyGlobals.eventLogPath) free(readOnlyGlobals.eventLogPath);
 
-#ifdef HAVE_GEOIP
-  deleteGeoIPDatabases();
-#endif
-
 #ifdef HAVE_UDNS
   for(ui=0;NULL!=readOnlyGlobals.udns.dns_info_array
       && ui<readOnlyGlobals.numProcessThreads; ++ui) {
@@ -2004,21 +2535,28 @@ static void* fetchPcapPackets(void* _thid) {
   int rc;
   unsigned long thread_id = (unsigned long)_thid;
   unsigned num_failures = 0;
+  struct packet_pool *pool = NULL;
 
   traceEvent(TRACE_INFO, "Fetch packets thread started [thread %lu]", thread_id);
 
+  pool = new_packet_pool(readOnlyGlobals.packet_pool.max_buffers,
+    readOnlyGlobals.packet_pool.max_jumbo_buffers);
+  if(NULL == pool) {
+    traceEvent(TRACE_ERROR, "Can't create pcap packet pool (out of memory?)");
+    return(NULL);
+  }
+
 #if 0
   setThreadAffinity(thread_id % readOnlyGlobals.numProcessThreads);
 #endif
 
   while(!readWriteGlobals->shutdownInProgress) {
-    QueuedPacket *qpacket = calloc(1,sizeof(*qpacket)+readOnlyGlobals.snaplen+1);
+    QueuedPacket *qpacket = packet_pool_get(pool, readOnlyGlobals.snaplen+1);
     if(NULL == qpacket) {
       traceEvent(TRACE_ERROR,"Can't allocate a new packet (out of memory?)");
       sleep(1);
       continue;
     }
-    qpacket->buffer = (uint8_t *)&qpacket[1];
 
     /* traceEvent(TRACE_INFO, "fetchPcapPackets(%d)", (int)notUsed); */
     rc = next_pcap_packet(readOnlyGlobals.pcapPtr, &h, qpacket->buffer);
@@ -2052,6 +2590,8 @@ static void* fetchPcapPackets(void* _thid) {
       qpacket->buffer_len = rc;
       decodePacket(thread_id,&h, qpacket);
       // usleep(1000);
+    } else {
+      freeQueuedPacket(qpacket);
     }
 
     if(rc < 0) {
@@ -2088,7 +2628,6 @@ static void* fetchPcapPackets(void* _thid) {
       if(readOnlyGlobals.pcapFile != NULL) {
         traceEvent(TRACE_INFO, "%s(threadId=%lu): no more packets to read",
                    __FUNCTION__, thread_id);
-        free(qpacket);
         break;
       }
     } else {
@@ -2103,6 +2642,9 @@ static void* fetchPcapPackets(void* _thid) {
     }
   } /* while */
 
+  packet_pool_print_stats(pool, "pcap");
+  packet_pool_done(pool);
+
   traceEvent(TRACE_INFO, "%s(threadId=%lu) terminated",
              __FUNCTION__, thread_id);
 
@@ -2111,8 +2653,6 @@ static void* fetchPcapPackets(void* _thid) {
 
 /* ****************************************************** */
 
-#ifdef HAVE_GEOIP
-
 static void init_geoip(){
   if(readOnlyGlobals.rb_databases.geoip_country_database_path)
     readCountries(readOnlyGlobals.rb_databases.geoip_country_database_path);
@@ -2120,8 +2660,6 @@ static void init_geoip(){
     readASs(readOnlyGlobals.rb_databases.geoip_as_database_path);
 }
 
-#endif /* HAVE_GEOIP */
-
 static void init_globals(void) {
   memset(&readOnlyGlobals, 0, sizeof(readOnlyGlobals));
 
@@ -2151,20 +2689,54 @@ static void init_globals(void) {
 
 static void printCopyrights(void) {
 #ifdef HAVE_GEOIP
-  if(readOnlyGlobals.geo_ip_asn_db != NULL)
-    traceEvent(TRACE_NORMAL, "%s", GeoIP_database_info(readOnlyGlobals.geo_ip_asn_db));
+  const struct geoip_database *as_db =
+    readOnlyGlobals.rb_databases.geoip_as_database;
+  if(as_db != NULL && as_db->v4 != NULL)
+    traceEvent(TRACE_NORMAL, "%s", GeoIP_database_info(as_db->v4));
 #endif
 }
 
 /* ****************************************************** */
 
+/** Print running processing and receive statistics */
+static void printRunningStats() {
+  size_t i;
+  struct worker_stats worker_stats[readOnlyGlobals.numProcessThreads];
+
+  for (i=0; i<readOnlyGlobals.numProcessThreads; ++i) {
+    get_worker_stats(readOnlyGlobals.packetProcessThread[i],
+      &worker_stats[i]);
+  }
+
+  printProcessingStats(worker_stats, readOnlyGlobals.numProcessThreads);
+  listener_list_print_stats(&readOnlyGlobals.listeners);
+#ifdef HAVE_LIBRDKAFKA
+  if (readOnlyGlobals.kafka.spill) {
+    printSpillStats(readOnlyGlobals.kafka.spill);
+  }
+#endif
+}
+
+/// Print running statistics if stats interval has elapsed
+static void check_for_stats_print() {
+  static time_t last_print = 0;
+  const time_t now = time(NULL);
+
+  if (0 == readOnlyGlobals.stats_interval_s) {
+    return;
+  } else if (0 == last_print) {
+    last_print = now;
+  } else if (now - last_print >= (time_t)readOnlyGlobals.stats_interval_s) {
+    last_print = now;
+    printRunningStats();
+  }
+}
+
 static void check_for_database_reloads(){
-#ifdef HAVE_GEOIP
   if(unlikely(readOnlyGlobals.rb_databases.reload_geoip_database)){
-    init_geoip(); // locks and reload properly
+    init_geoip(); // workers switch to new databases without locks
     readOnlyGlobals.rb_databases.reload_geoip_database=0;
   }
-#endif /* HAVE_GEOIP */
 
   check_if_reload(&readOnlyGlobals.rb_databases);
 }
@@ -2194,10 +2766,7 @@ int main(int argc, char *argv[]) {
 
   readWriteGlobals->shutdownInProgress = 0;
 
-#ifdef HAVE_GEOIP
-  pthread_rwlock_init(&readWriteGlobals->geoipRwLock, NULL);
   init_geoip();
-#endif
 
   pthread_rwlock_init(&readOnlyGlobals.ticksLock, NULL);
 
@@ -2232,14 +2801,8 @@ int main(int argc, char *argv[]) {
     }
   }
 
-#ifdef HAVE_GEOIP
-  if(readOnlyGlobals.geo_ip_asn_db == NULL)
-#endif
-    traceEvent(TRACE_NORMAL, "Flows ASs will not be computed "
-#ifndef HAVE_GEOIP
-               "(missing GeoIP support)"
-#endif
-               );
+  if(readOnlyGlobals.rb_databases.geoip_as_database == NULL)
+    traceEvent(TRACE_NORMAL, "Flows ASs will not be computed");
 
   if((readOnlyGlobals.pcapFile == NULL)
      && (readOnlyGlobals.captureDev != NULL)) {
@@ -2339,6 +2902,7 @@ int main(int argc, char *argv[]) {
   if(readOnlyGlobals.pcapFile) {
     while(!readWriteGlobals->endOfPcapReached){
       check_for_database_reloads();
+      check_for_stats_print();
       ntop_sleep(1);
     }
     traceEvent(TRACE_INFO, "No more packets to read. Sleeping...\n");
@@ -2346,7 +2910,8 @@ int main(int argc, char *argv[]) {
     while(readOnlyGlobals.f2k_up) {
       // sleep(5); break;
       check_for_database_reloads();
-      rd_kafka_poll(readOnlyGlobals.kafka.rk, 1000/* 1sec */);
+      check_for_stats_print();
+      rb_sink_poll(readOnlyGlobals.sink, 1000/* 1sec */);
     }
   }
 
@@ -63,8 +63,11 @@
 
 #ifdef HAVE_LIBRDKAFKA
 #include "librdkafka/rdkafka.h"
+#include "rb_kafka.h"
 #endif
 
+#include "rb_sink.h"
+
 #ifdef HAVE_UDNS
 #include <udns.h>
 #endif
@@ -131,8 +134,6 @@ typedef struct flowSetV9Ipfix {
 
 /* ******************************************* */
 
-#define NETFLOW_BUFFER_LEN (16*1024)
-
 #define ACT_NUM_PCAP_THREADS      2
 #define MAX_NUM_PCAP_THREADS     32
 
@@ -153,6 +154,7 @@ typedef unsigned long long ticks;
 /* **************************************************************** */
 
 #define MAX_NUM_COLLECTOR_THREADS  MAX_NUM_PCAP_THREADS
+#define MAX_LISTENER_BATCH_SIZE     1024
 #define MAX_NUM_OPTIONS             128
 
 /* ********************************************* */
@@ -212,14 +214,30 @@ typedef struct {
 
   worker_t **packetProcessThread;
 
-#ifdef HAVE_GEOIP
-  /* GeoIP */
-  GeoIP *geo_ip_asn_db, *geo_ip_asn_db_v6;
-  GeoIP *geo_ip_country_db, *geo_ip_country_db_v6;
-#endif
-
   /* Collector */
   listener_list listeners;
+  size_t listener_batch_size; /* Datagrams per receive syscall */
+  size_t listener_threads; /* SO_REUSEPORT sockets/threads per port */
+  struct {
+    int cpus[MAX_NUM_COLLECTOR_THREADS];
+    size_t len;
+  } listener_cpus; /* Listener thread N is bound to cpus[N % len] */
+  struct {
+    size_t max_buffers;       /* Small and medium buffers per thread */
+    size_t max_jumbo_buffers; /* Jumbo buffers per thread */
+  } packet_pool; /* Recycled received packets buffers */
+
+  /* Workers */
+  struct {
+    size_t size;         /* Max packets per worker queue */
+    uint64_t max_bytes;  /* Max packets bytes per worker queue, 0=no limit */
+    enum worker_queue_policy policy;
+  } worker_queue;
+
+  /// Flow messages encoding
+  enum output_format output_format;
+
+  unsigned stats_interval_s; /* Print running stats period, 0=only at exit */
 
   /* Status */
   bool f2k_up; // TODO delete this!
@@ -234,17 +252,46 @@ typedef struct {
   bool enable_debug,
     reproduceDumpAtRealSpeed,reforgeTimestamps,dontReforgeFarTimestamp;
 
+  /// Output sinks. Workers are spread among them
+  struct rb_sink **sinks;
+  size_t n_sinks;
+  /// Main sink (the first one of sinks)
+  struct rb_sink *sink;
+  /// Sink selected in command line
+  struct {
+    enum rb_sink_type type;
+    char *path;
+    size_t file_rotate_mb;
+    bool file_compress;
+    size_t shm_slots, shm_slot_size;
+  } sink_conf;
+
 #ifdef HAVE_LIBRDKAFKA
   struct {
+    /// Main producer (the first one of producers)
     rd_kafka_t            *rk;
     rd_kafka_topic_t      *rkt;
     bool use_client_mac_partitioner;
+    /// Workers producers. Workers are spread among them
+    struct rb_kafka_producer *producers;
+    size_t n_producers;
+    /// Max time to wait for room in a full producer queue
+    unsigned queue_full_timeout_ms;
+    /// Journal of messages that can't be delivered. NULL if disabled
+    struct rb_spill *spill;
+    char *spill_dir;
+    size_t spill_max_mb;
+    struct rb_kafka_spill_replayer spill_replayer;
+    /// Multi-flow messages
+    struct rb_msg_batch_conf batch;
   } kafka;
 #endif
 
 #ifdef HAVE_UDNS
   struct {
     struct dns_cache *cache;
+    /// Don't make flows wait for DNS answers, only use cached names
+    bool cache_only;
     char *csv_dns_servers;
     struct rb_dns_info *dns_info_array;
     rd_thread_t **dns_poll_threads;
@@ -258,10 +305,6 @@ typedef struct {
 typedef struct {
   bool shutdownInProgress, stopPacketCapture, endOfPcapReached;
 
-#ifdef HAVE_GEOIP
-  pthread_rwlock_t geoipRwLock;
-#endif
-
   bool syslog_opened;
 #ifdef HAVE_PF_RING
   bool ring_enabled;
@@ -19,5 +19,9 @@
 
 #include "f2k.h"
 
-ReadOnlyGlobals  readOnlyGlobals;
+ReadOnlyGlobals  readOnlyGlobals = {
+  .rb_databases = {
+    .epoch = RB_EPOCH_INITIALIZER,
+  },
+};
 ReadWriteGlobals *readWriteGlobals;
@@ -57,7 +57,7 @@ struct printbuf* printbuf_new(void)
 
   p = (struct printbuf*)calloc(1, sizeof(struct printbuf));
   if(!p) return NULL;
-  p->size = 2048;
+  p->size = PRINTBUF_DEFAULT_SIZE;
   p->bpos = 0;
   if(!(p->buf = (char*)malloc(p->size))) {
     free(p);
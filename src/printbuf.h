@@ -24,6 +24,9 @@ struct printbuf {
   size_t size;
 };
 
+/// printbuf_new buffer initial size
+#define PRINTBUF_DEFAULT_SIZE 2048
+
 extern struct printbuf*
 printbuf_new(void);
 
@@ -0,0 +1,365 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rb_cbor.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+size_t rb_cbor_text_from(struct printbuf *pb, size_t start) {
+  const size_t len = pb->bpos - start;
+  uint8_t head[9];
+  const size_t head_len = rb_cbor_head_encode(head, RB_CBOR_TEXT, len);
+
+  /* Make room for head, and move text after it */
+  printbuf_memappend_fast(pb, (const char *)head, head_len);
+  memmove(pb->buf + start + head_len, pb->buf + start, len);
+  memcpy(pb->buf + start, head, head_len);
+
+  return head_len + len;
+}
+
+/*
+ * JSON TRANSCODING
+ */
+
+/// JSON being transcoded
+struct json_cursor {
+  const char *pos, *end;
+};
+
+static void json_skip_spaces(struct json_cursor *cursor) {
+  while (cursor->pos < cursor->end && isspace((unsigned char)*cursor->pos)) {
+    cursor->pos++;
+  }
+}
+
+/** Consume a character if it is the next one
+  @param cursor JSON cursor
+  @param c Character
+  @return true if consumed
+  */
+static bool json_consume(struct json_cursor *cursor, char c) {
+  json_skip_spaces(cursor);
+  if (cursor->pos < cursor->end && *cursor->pos == c) {
+    cursor->pos++;
+    return true;
+  }
+  return false;
+}
+
+/** Parse the 4 hex digits of a \u escape
+  @param cursor JSON cursor, after \u
+  @param code Parsed UTF-16 code unit
+  @return 0 if success, !0 in other case
+  */
+static int json_parse_hex4(struct json_cursor *cursor, uint32_t *code) {
+  size_t i;
+
+  if (cursor->end - cursor->pos < 4) {
+    return -1;
+  }
+
+  *code = 0;
+  for (i = 0; i < 4; ++i) {
+    const char c = *cursor->pos++;
+    if (!isxdigit((unsigned char)c)) {
+      return -1;
+    }
+    *code = *code << 4 | (isdigit((unsigned char)c) ? c - '0' :
+      (tolower((unsigned char)c) - 'a' + 10));
+  }
+
+  return 0;
+}
+
+/** Append an unicode code point as UTF-8
+  @param pb Buffer
+  @param code Code point
+  */
+static void put_utf8(struct printbuf *pb, uint32_t code) {
+  char utf8[4];
+  size_t len;
+
+  if (code < 0x80) {
+    utf8[0] = code;
+    len = 1;
+  } else if (code < 0x800) {
+    utf8[0] = 0xc0 | code >> 6;
+    utf8[1] = 0x80 | (code & 0x3f);
+    len = 2;
+  } else if (code < 0x10000) {
+    utf8[0] = 0xe0 | code >> 12;
+    utf8[1] = 0x80 | (code >> 6 & 0x3f);
+    utf8[2] = 0x80 | (code & 0x3f);
+    len = 3;
+  } else {
+    utf8[0] = 0xf0 | code >> 18;
+    utf8[1] = 0x80 | (code >> 12 & 0x3f);
+    utf8[2] = 0x80 | (code >> 6 & 0x3f);
+    utf8[3] = 0x80 | (code & 0x3f);
+    len = 4;
+  }
+
+  printbuf_memappend_fast(pb, utf8, len);
+}
+
+/** Transcode a JSON string, with cursor at its opening quote
+  @param cursor JSON cursor
+  @param pb Buffer
+  @return 0 if success, !0 in other case
+  */
+static int json_put_string(struct json_cursor *cursor, struct printbuf *pb) {
+  static const char escapes[] = "\"\\/bfnrt";
+  static const char unescaped[] = "\"\\/\b\f\n\r\t";
+  const size_t start = pb->bpos;
+
+  if (!json_consume(cursor, '"')) {
+    return -1;
+  }
+
+  while (cursor->pos < cursor->end && *cursor->pos != '"') {
+    const char *escape;
+    uint32_t code, low;
+
+    if (*cursor->pos != '\\') {
+      const char *next = cursor->pos;
+      while (next < cursor->end && *next != '"' && *next != '\\') {
+        next++;
+      }
+      printbuf_memappend_fast(pb, cursor->pos, (size_t)(next - cursor->pos));
+      cursor->pos = next;
+      continue;
+    }
+
+    if (++cursor->pos == cursor->end) {
+      return -1;
+    }
+
+    if (*cursor->pos != 'u') {
+      escape = memchr(escapes, *cursor->pos, strlen(escapes));
+      if (NULL == escape) {
+        return -1;
+      }
+      printbuf_memappend_fast(pb, &unescaped[escape - escapes], 1);
+      cursor->pos++;
+      continue;
+    }
+
+    cursor->pos++;
+    if (0 != json_parse_hex4(cursor, &code)) {
+      return -1;
+    }
+
+    if (code >= 0xd800 && code < 0xdc00) {
+      /* Surrogate pair */
+      if (cursor->end - cursor->pos < 2 || cursor->pos[0] != '\\' ||
+          cursor->pos[1] != 'u') {
+        return -1;
+      }
+      cursor->pos += 2;
+      if (0 != json_parse_hex4(cursor, &low) || low < 0xdc00 ||
+          low >= 0xe000) {
+        return -1;
+      }
+      code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+    }
+
+    put_utf8(pb, code);
+  }
+
+  if (cursor->pos == cursor->end) {
+    return -1;
+  }
+
+  cursor->pos++;
+  rb_cbor_text_from(pb, start);
+  return 0;
+}
+
+/** Transcode a JSON number
+  @param cursor JSON cursor
+  @param pb Buffer
+  @return 0 if success, !0 in other case
+  */
+static int json_put_number(struct json_cursor *cursor, struct printbuf *pb) {
+  char number[64];
+  const char *end = cursor->pos;
+  bool is_real = false;
+  char *number_end;
+  size_t len;
+
+  while (end < cursor->end && (isdigit((unsigned char)*end) ||
+                                              memchr("+-.eE", *end, 5))) {
+    is_real = is_real || memchr(".eE", *end, 3);
+    end++;
+  }
+
+  len = end - cursor->pos;
+  if (0 == len || len >= sizeof(number)) {
+    return -1;
+  }
+
+  memcpy(number, cursor->pos, len);
+  number[len] = '\0';
+  errno = 0;
+
+  if (is_real) {
+    const double value = strtod(number, &number_end);
+    uint64_t bits;
+    uint8_t encoded[9];
+    size_t i;
+
+    memcpy(&bits, &value, sizeof(bits));
+    encoded[0] = RB_CBOR_SIMPLE << 5 | 27; /* Double precision float */
+    for (i = 8; i > 0; --i, bits >>= 8) {
+      encoded[i] = bits & 0xff;
+    }
+    printbuf_memappend_fast(pb, (const char *)encoded, sizeof(encoded));
+  } else if (number[0] == '-') {
+    const long long value = strtoll(number, &number_end, 10);
+    if (value < 0) {
+      rb_cbor_put_head(pb, RB_CBOR_NEGINT, -1 - value);
+    } else {
+      rb_cbor_put_uint(pb, value); /* -0 */
+    }
+  } else {
+    const unsigned long long value = strtoull(number, &number_end, 10);
+    rb_cbor_put_uint(pb, value);
+  }
+
+  if (errno != 0 || number_end != number + len) {
+    return -1;
+  }
+
+  cursor->pos = end;
+  return 0;
+}
+
+static int json_put_value(struct json_cursor *cursor, struct printbuf *pb);
+
+/** Transcode JSON object members or array elements, until closing character
+  @param cursor JSON cursor, after opening character
+  @param pb Buffer
+  @param close Closing character
+  @return 0 if success, !0 in other case
+  */
+static int json_put_members(struct json_cursor *cursor, struct printbuf *pb,
+                                                                char close) {
+  const bool object = close == '}';
+
+  if (json_consume(cursor, close)) {
+    return 0;
+  }
+
+  do {
+    if (object && (0 != json_put_string(cursor, pb) ||
+                                              !json_consume(cursor, ':'))) {
+      return -1;
+    }
+    if (0 != json_put_value(cursor, pb)) {
+      return -1;
+    }
+  } while (json_consume(cursor, ','));
+
+  return json_consume(cursor, close) ? 0 : -1;
+}
+
+/** Transcode a JSON value
+  @param cursor JSON cursor
+  @param pb Buffer
+  @return 0 if success, !0 in other case
+  */
+static int json_put_value(struct json_cursor *cursor, struct printbuf *pb) {
+  static const struct {
+    const char *json;
+    const char *cbor;
+  } literals[] = {
+    {"false", "\xf4"}, {"true", "\xf5"}, {"null", "\xf6"},
+  };
+  size_t i;
+
+  json_skip_spaces(cursor);
+  if (cursor->pos == cursor->end) {
+    return -1;
+  }
+
+  switch (*cursor->pos) {
+  case '"':
+    return json_put_string(cursor, pb);
+
+  case '{':
+  case '[':
+    {
+      const char close = *cursor->pos == '{' ? '}' : ']';
+      cursor->pos++;
+      printbuf_memappend_fast(pb, close == '}' ? RB_CBOR_MAP_START :
+        RB_CBOR_ARRAY_START, 1);
+      if (0 != json_put_members(cursor, pb, close)) {
+        return -1;
+      }
+      printbuf_memappend_fast(pb, RB_CBOR_BREAK, 1);
+      return 0;
+    }
+
+  default:
+    for (i = 0; i < sizeof(literals) / sizeof(literals[0]); ++i) {
+      const size_t len = strlen(literals[i].json);
+      if ((size_t)(cursor->end - cursor->pos) >= len &&
+          0 == memcmp(cursor->pos, literals[i].json, len)) {
+        cursor->pos += len;
+        printbuf_memappend_fast(pb, literals[i].cbor, 1);
+        return 0;
+      }
+    }
+
+    return json_put_number(cursor, pb);
+  };
+}
+
+int rb_cbor_put_json_members(struct printbuf *pb, const char *json,
+                                                                size_t len) {
+  struct json_cursor cursor = {.pos = json, .end = json + len};
+  const size_t start = pb->bpos;
+
+  json_skip_spaces(&cursor);
+  if (cursor.pos != cursor.end) {
+    do {
+      if (0 != json_put_string(&cursor, pb) || !json_consume(&cursor, ':') ||
+          0 != json_put_value(&cursor, pb)) {
+        goto err;
+      }
+    } while (json_consume(&cursor, ','));
+
+    json_skip_spaces(&cursor);
+    if (cursor.pos != cursor.end) {
+      goto err;
+    }
+  }
+
+  return 0;
+
+err:
+  pb->bpos = start;
+  pb->buf[start] = '\0';
+  return -1;
+}
@@ -0,0 +1,154 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "printbuf.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  Minimal CBOR (RFC 8949) encoder over printbuf. Flow messages are encoded as
+  indefinite length maps, so fields can be appended (and rolled back) one by
+  one, just like JSON ones.
+*/
+
+/// CBOR major types
+enum rb_cbor_major {
+  RB_CBOR_UINT = 0,
+  RB_CBOR_NEGINT = 1,
+  RB_CBOR_BYTES = 2,
+  RB_CBOR_TEXT = 3,
+  RB_CBOR_ARRAY = 4,
+  RB_CBOR_MAP = 5,
+  RB_CBOR_TAG = 6,
+  RB_CBOR_SIMPLE = 7,
+};
+
+/// MAC address tag (RFC 9542), over a 6 bytes string
+#define RB_CBOR_TAG_MAC  48
+/// IPv4 address tag (RFC 9164), over a 4 bytes string
+#define RB_CBOR_TAG_IPV4 52
+/// IPv6 address tag (RFC 9164), over a 16 bytes string
+#define RB_CBOR_TAG_IPV6 54
+
+/// Initial bytes of indefinite length items
+#define RB_CBOR_ARRAY_START "\x9f"
+#define RB_CBOR_MAP_START   "\xbf"
+#define RB_CBOR_BREAK       "\xff"
+
+/** Number of bytes of an item head
+  @param value Head argument
+  @return Head length
+  */
+static inline size_t rb_cbor_head_len(uint64_t value) {
+  return value < 24 ? 1 : value <= UINT8_MAX ? 2 : value <= UINT16_MAX ? 3 :
+    value <= UINT32_MAX ? 5 : 9;
+}
+
+/** Encode an item head
+  @param dst Destination, with rb_cbor_head_len(value) bytes
+  @param major Item major type
+  @param value Head argument
+  @return Head length
+  */
+static inline size_t rb_cbor_head_encode(uint8_t *dst,
+                                  enum rb_cbor_major major, uint64_t value) {
+  const size_t len = rb_cbor_head_len(value);
+  size_t i;
+
+  /* Additional information 24..27 means 1, 2, 4 or 8 bytes argument */
+  static const uint8_t additional_info[] = {0, 0, 24, 25, 0, 26, 0, 0, 0, 27};
+  dst[0] = major << 5 | (len == 1 ? value : additional_info[len]);
+  for (i = len - 1; i > 0; --i, value >>= 8) {
+    dst[i] = value & 0xff;
+  }
+
+  return len;
+}
+
+/** Append an item head
+  @param pb Buffer
+  @param major Item major type
+  @param value Head argument
+  @return Number of bytes written
+  */
+static inline size_t rb_cbor_put_head(struct printbuf *pb,
+                                  enum rb_cbor_major major, uint64_t value) {
+  uint8_t head[9];
+  const size_t len = rb_cbor_head_encode(head, major, value);
+  printbuf_memappend_fast(pb, (const char *)head, len);
+  return len;
+}
+
+/** Append an unsigned integer
+  @param pb Buffer
+  @param value Integer
+  @return Number of bytes written
+  */
+static inline size_t rb_cbor_put_uint(struct printbuf *pb, uint64_t value) {
+  return rb_cbor_put_head(pb, RB_CBOR_UINT, value);
+}
+
+/** Append a text string
+  @param pb Buffer
+  @param str String. It must be valid UTF-8
+  @param len String length
+  @return Number of bytes written
+  */
+static inline size_t rb_cbor_put_text(struct printbuf *pb, const char *str,
+                                                                size_t len) {
+  const size_t head_len = rb_cbor_put_head(pb, RB_CBOR_TEXT, len);
+  printbuf_memappend_fast(pb, str, len);
+  return head_len + len;
+}
+
+/** Append a tagged byte string
+  @param pb Buffer
+  @param tag Tag number
+  @param bytes Bytes
+  @param len Number of bytes
+  @return Number of bytes written
+  */
+static inline size_t rb_cbor_put_tagged_bytes(struct printbuf *pb,
+                          uint64_t tag, const void *bytes, size_t len) {
+  const size_t head_len = rb_cbor_put_head(pb, RB_CBOR_TAG, tag) +
+    rb_cbor_put_head(pb, RB_CBOR_BYTES, len);
+  printbuf_memappend_fast(pb, bytes, len);
+  return head_len + len;
+}
+
+/** Convert the UTF-8 text appended to a buffer since an offset in a text
+  string item
+  @param pb Buffer
+  @param start Offset where text begins
+  @return Item length
+  */
+size_t rb_cbor_text_from(struct printbuf *pb, size_t start);
+
+/** Append the members of a JSON object as CBOR map keys and values
+  @param pb Buffer
+  @param json JSON object members, without braces (i.e., "a":1,"b":[true])
+  @param len JSON length
+  @return 0 if success. If JSON is not valid, nothing is appended and !0 is
+  returned
+  */
+int rb_cbor_put_json_members(struct printbuf *pb, const char *json,
+                                                                size_t len);
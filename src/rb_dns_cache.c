@@ -28,7 +28,10 @@
 #include <librd/rdio.h>
 #include <librd/rdthread.h>
 
+#include <pthread.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 static const int MAX_DNS_TIMEOUT_MS = 500;
@@ -36,6 +39,12 @@ static const int MAX_DNS_TIMEOUT_S  = 0;
 static const int UDNS_GUESS_TIME    = 0;
 
 
+/// Number of cache shards. Must be a power of 2
+#define DNS_CACHE_SHARDS 64
+
+/// Expected name length, to size shards hash tables
+#define DNS_CACHE_EXPECTED_NAME_LEN 32
+
 #ifndef NDEBUG
 #define DNS_CACHE_ENTRY_MAGIC 0xDCACEEA1CL
 #endif
@@ -49,236 +58,498 @@ struct dns_cache_entry {
 	/// cache from where node was allocated
 	struct dns_cache *cache;
 
+	/// Next entry in shard hash bucket. Readers can still follow it after
+	/// the entry has been unlinked, so it's never cleared
+	struct dns_cache_entry *next;
+
 	struct dns_cache_elm elm;
 
 	time_t last_checked;
 
-	/// It's possible to use node after delete it from database.
-	uint32_t refcnt;
-	rd_avl_node_t avl_elm;
-	TAILQ_ENTRY(dns_cache_entry) lru_entry;
+	/// CLOCK reference bit. Set by readers (only if not already set, so
+	/// at most once per CLOCK pass), cleared by eviction
+	int referenced;
+
+	/// Somebody is already refreshing the entry
+	bool refreshing;
 };
 
-typedef TAILQ_HEAD(lru_element_head,dns_cache_entry) lru_t;
-#define lru_init(lru)       TAILQ_INIT(lru)
-#define lru_empty(lru)      TAILQ_EMPTY(lru)
-#define lru_push(lru,elm)   TAILQ_INSERT_HEAD(lru,elm,lru_entry)
-#define lru_remove(lru,elm) do{ \
-		TAILQ_REMOVE(lru,elm,lru_entry); \
-		memset(&(elm)->lru_entry,0,sizeof((elm)->lru_entry)); \
-	}while(0)
-
-static struct dns_cache_entry *lru_pop_nl(lru_t *lru) {
-	struct dns_cache_entry *e = TAILQ_LAST(lru,lru_element_head);
-	lru_remove(lru,e);
-	return e;
-}
+/// @NOTE: Entries deleted from shard are retired through cache epoch, so
+/// lookups in progress can still use them.
+struct dns_cache_shard {
+	/// Insertions and evictions lock. Lookups never take it
+	pthread_mutex_t mutex;
 
-/// @TODO register match/failures/recycled/etc.
-/// @NOTE: When a ntry is deleted from database, it's deleted from lru,
-/// but it will not be freed until you drop to 0 refcnt.
-struct dns_cache {
-	/// Maximum memory that cache can hold
+	struct dns_cache_entry **buckets;
+	size_t buckets_mask;
+	/// CLOCK hand: bucket to look for the next victim
+	size_t clock_hand;
+	size_t entries;
+
+	/// Memory used by shard entries
+	size_t mem_b;
+	/// Maximum memory that shard can hold
 	size_t max_mem_b;
 
+	/* Avoid false sharing between shards locks */
+	char pad[64];
+};
+
+/// @TODO register match/failures/recycled/etc.
+struct dns_cache {
 	/// Timeout in what entry is not valid anymore
 	time_t timeout_s;
+	/// Timeout of negative entries
+	time_t negative_timeout_s;
+	/// Age from which entries should be refreshed. 0 if no refresh ahead
+	time_t refresh_ahead_s;
 
-	pthread_mutex_t mutex;
-	rd_memctx_t memctx;
-	rd_avl_t avl;
-	lru_t lru;
+	/// Removed entries reclamation
+	struct rb_epoch *epoch;
+
+	struct dns_cache_shard shards[DNS_CACHE_SHARDS];
 };
 
-static size_t real_entry_size(struct dns_cache_entry *entry) {
+static size_t real_entry_size(const struct dns_cache_entry *entry) {
 	return sizeof(*entry) + entry->elm.name_len + 1;
 }
 
-static void dns_cache_memctx_free(struct dns_cache_entry *entry) {
-	rd_memctx_freesz(&entry->cache->memctx,entry,real_entry_size(entry));
+static uint64_t dns_addr_hash(const uint8_t *addr) {
+	uint64_t hi, lo;
+	memcpy(&hi, addr, sizeof(hi));
+	memcpy(&lo, &addr[sizeof(hi)], sizeof(lo));
+
+	uint64_t hash = (hi * UINT64_C(0x9E3779B97F4A7C15)) ^
+					(lo * UINT64_C(0xC2B2AE3D27D4EB4F));
+	return hash ^ (hash >> 29);
 }
 
-static int dns_cache_entry_cmp(const void *_e1,const void *_e2) {
-	const struct dns_cache_entry *e1 = _e1;
-	const struct dns_cache_entry *e2 = _e2;
+/// Shard of an address hash. Use hash high bits, low ones are for buckets
+static struct dns_cache_shard *dns_cache_shard(struct dns_cache *cache,
+							uint64_t hash) {
+	return &cache->shards[(hash >> 58) & (DNS_CACHE_SHARDS - 1)];
+}
+
+static struct dns_cache_entry **dns_cache_shard_bucket(
+			struct dns_cache_shard *shard, uint64_t hash) {
+	return &shard->buckets[hash & shard->buckets_mask];
+}
+
+/// Search an address in a shard. Caller must be in an epoch critical section,
+/// or hold shard mutex
+static struct dns_cache_entry *dns_cache_shard_find(
+		struct dns_cache_shard *shard, uint64_t hash,
+		const uint8_t *addr) {
+	struct dns_cache_entry *entry = ATOMIC_LOAD_ACQUIRE(
+					dns_cache_shard_bucket(shard, hash));
 
+	for (; entry; entry = ATOMIC_LOAD_ACQUIRE(&entry->next)) {
 #ifdef DNS_CACHE_ENTRY_MAGIC
-	assert(DNS_CACHE_ENTRY_MAGIC == e1->magic);
-	assert(DNS_CACHE_ENTRY_MAGIC == e2->magic);
+		assert(DNS_CACHE_ENTRY_MAGIC == entry->magic);
 #endif
+		if (0 == memcmp(entry->elm.addr, addr, sizeof(entry->elm.addr))) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+static int dns_cache_shard_init(struct dns_cache_shard *shard,
+							size_t max_mem_b) {
+	const size_t expected_entries = max_mem_b /
+		(sizeof(struct dns_cache_entry) + DNS_CACHE_EXPECTED_NAME_LEN);
+	size_t n_buckets = 8;
+	while (n_buckets < expected_entries) {
+		n_buckets <<= 1;
+	}
+
+	shard->buckets = calloc(n_buckets, sizeof(shard->buckets[0]));
+	if (NULL == shard->buckets) {
+		return -1;
+	}
+
+	shard->buckets_mask = n_buckets - 1;
+	shard->max_mem_b = max_mem_b;
+	pthread_mutex_init(&shard->mutex, NULL);
+	return 0;
+}
 
-	return memcmp(e1->elm.addr,e2->elm.addr,sizeof(e1->elm.addr));
+static void dns_cache_shard_done(struct dns_cache_shard *shard) {
+	size_t i;
+
+	for (i = 0; i <= shard->buckets_mask; ++i) {
+		struct dns_cache_entry *entry = shard->buckets[i];
+		while (entry) {
+			struct dns_cache_entry *next = entry->next;
+			free(entry);
+			entry = next;
+		}
+	}
+
+	free(shard->buckets);
+	pthread_mutex_destroy(&shard->mutex);
 }
 
-struct dns_cache *dns_cache_new(size_t maxmem_m, time_t timeout_s) {
+struct dns_cache *dns_cache_new(struct rb_epoch *epoch, size_t maxmem_m,
+			time_t timeout_s, time_t negative_timeout_s,
+			unsigned refresh_ahead_pct) {
+	size_t i;
+
 	struct dns_cache *ret = calloc(1,sizeof(ret[0]));
 	if(NULL == ret) {
 		traceEvent(TRACE_ERROR, "Can't allocate DNS cache (out of memory?)");
 		return NULL;
 	}
 
-	ret->max_mem_b = maxmem_m * 1024 * 1024;
+	ret->epoch = epoch;
 	ret->timeout_s = timeout_s;
+	ret->negative_timeout_s = negative_timeout_s ? negative_timeout_s :
+								timeout_s;
+	if (refresh_ahead_pct > 0 && refresh_ahead_pct < 100) {
+		ret->refresh_ahead_s = timeout_s * refresh_ahead_pct / 100;
+	}
 
-	pthread_mutex_init(&ret->mutex,NULL);
-	rd_memctx_init(&ret->memctx,NULL /* name */,RD_MEMCTX_F_TRACK);
-	rd_avl_init(&ret->avl,dns_cache_entry_cmp,0);
-	lru_init(&ret->lru);
+	const size_t max_mem_b = maxmem_m * 1024 * 1024;
+	for (i = 0; i < DNS_CACHE_SHARDS; ++i) {
+		if (0 != dns_cache_shard_init(&ret->shards[i],
+					max_mem_b / DNS_CACHE_SHARDS)) {
+			traceEvent(TRACE_ERROR,
+				"Can't allocate DNS cache (out of memory?)");
+			while (i-- > 0) {
+				dns_cache_shard_done(&ret->shards[i]);
+			}
+			free(ret);
+			return NULL;
+		}
+	}
 
 	return ret;
 }
 
 void dns_cache_done(struct dns_cache *cache) {
-	rd_memctx_freeall(&cache->memctx);
-	rd_avl_destroy(&cache->avl);
-	rd_memctx_destroy(&cache->memctx);
-	pthread_mutex_destroy(&cache->mutex);
+	size_t i;
+
+	for (i = 0; i < DNS_CACHE_SHARDS; ++i) {
+		dns_cache_shard_done(&cache->shards[i]);
+	}
+	free(cache);
 }
 
-static void dns_cache_decref_elm0(struct dns_cache_elm *elm,int do_lock) {
-	int freed = 0;
-	rd_memctx_stats_t stats = {0};
+static struct dns_cache_entry *dns_cache_elm_entry(struct dns_cache_elm *elm) {
 	uint8_t *ptr_elm = (uint8_t *)elm;
 	uint8_t *ptr_entry = ptr_elm - offsetof(struct dns_cache_entry, elm);
-	struct dns_cache_entry *entry = (struct dns_cache_entry *)ptr_entry;
-	struct dns_cache *cache = entry->cache;
+
+	return (struct dns_cache_entry *)ptr_entry;
+}
+
+/** Unlink an entry from its shard, and retire it so it's freed when no lookup
+  can reach it anymore. Shard must be locked
+  @param shard Shard
+  @param prev_next Pointer to entry in its bucket list
+  */
+static void dns_cache_shard_remove_nl(struct dns_cache_shard *shard,
+					struct dns_cache_entry **prev_next) {
+	struct dns_cache_entry *entry = *prev_next;
 
 #ifdef DNS_CACHE_ENTRY_MAGIC
 	assert(DNS_CACHE_ENTRY_MAGIC == entry->magic);
 #endif
 
-	if(do_lock) {
-		pthread_mutex_lock(&cache->mutex);
-	}
-
-	if(0 == --entry->refcnt) {
-		dns_cache_memctx_free(entry);
-		if(unlikely(readOnlyGlobals.enable_debug)) {
-			freed = 1;
-			rd_memctx_stats(&cache->memctx,&stats);
-		}
-	}
+	ATOMIC_STORE_RELEASE(prev_next, entry->next);
+	shard->entries--;
+	shard->mem_b -= real_entry_size(entry);
+	rb_epoch_retire(entry->cache->epoch, entry, free);
+}
 
-	if(do_lock) {
-		pthread_mutex_unlock(&cache->mutex);
+/** Evict one entry of the shard using CLOCK: Entries referenced since last
+  hand pass get a second chance. Shard must be locked
+  @param shard Shard
+  @return 0 if evicted, !0 if shard is empty
+  */
+static int dns_cache_shard_evict_nl(struct dns_cache_shard *shard) {
+	if (0 == shard->entries) {
+		return -1;
 	}
 
-	if(unlikely(readOnlyGlobals.enable_debug) && freed) {
-		traceEvent(TRACE_NORMAL,
-			"DNS cache node %p freed. Current stats: "
-			"%d allocations, %zu bytes",
-			entry,stats.out, stats.bytes_out);
-	}
-}
+	while (1) {
+		struct dns_cache_entry **it = &shard->buckets[shard->clock_hand];
+		for (; *it; it = &(*it)->next) {
+			if (ATOMIC_LOAD_ACQUIRE(&(*it)->referenced)) {
+				ATOMIC_STORE_RELEASE(&(*it)->referenced, 0);
+				continue;
+			}
 
-/// Internal reference decrement, use if you have already locked cache.
-static void dns_cache_decref_elm_nl(struct dns_cache_elm *elm) {
-	dns_cache_decref_elm0(elm,0 /* no lock */);
-}
+			if(unlikely(readOnlyGlobals.enable_debug)) {
+				traceEvent(TRACE_NORMAL,"Freeing entry %p, of size %zu",
+					*it, real_entry_size(*it));
+			}
+			dns_cache_shard_remove_nl(shard, it);
+			return 0;
+		}
 
-void dns_cache_decref_elm(struct dns_cache_elm *elm) {
-	dns_cache_decref_elm0(elm,1 /* lock */);
+		shard->clock_hand = (shard->clock_hand + 1) & shard->buckets_mask;
+	}
 }
 
 struct dns_cache_elm * dns_cache_save_elm(struct dns_cache *cache,
 		const uint8_t *addr, const char *name, size_t name_len,
 		time_t now) {
-	struct dns_cache_entry *entry = NULL;
-	rd_memctx_stats_t stats;
-	const size_t needed_size = sizeof(*entry) + name_len + 1;
-	// Can't trust in that bytes_out have been reduced because of refcounting system.
-	size_t freed_size = 0;
-
-	pthread_mutex_lock(&cache->mutex);
-
-	rd_memctx_stats(&cache->memctx,&stats);
-	while(stats.bytes_out + needed_size > cache->max_mem_b + freed_size) {
-		if(unlikely(lru_empty(&cache->lru))) {
-			traceEvent(TRACE_ERROR,"Can't allocate DNs cache element because cache limit.");
-			traceEvent(TRACE_ERROR,"Please consider increase it.");
-			pthread_mutex_unlock(&cache->mutex);
-			return NULL;
-		}
-
-		struct dns_cache_entry *old_entry = lru_pop_nl(&cache->lru);
-		freed_size += real_entry_size(old_entry);
+	const size_t needed_size = sizeof(struct dns_cache_entry) + name_len + 1;
+	const uint64_t hash = dns_addr_hash(addr);
+	struct dns_cache_shard *shard = dns_cache_shard(cache, hash);
 
-		if(unlikely(readOnlyGlobals.enable_debug)) {
-			traceEvent(TRACE_NORMAL,"Freeing entry %p, of size %zu",
-				old_entry, real_entry_size(old_entry));
-		}
+	if (unlikely(needed_size > shard->max_mem_b)) {
+		traceEvent(TRACE_ERROR,"Can't allocate DNs cache element because cache limit.");
+		traceEvent(TRACE_ERROR,"Please consider increase it.");
+		return NULL;
+	}
 
-		RD_AVL_REMOVE_ELM(&cache->avl,old_entry);
-		dns_cache_decref_elm_nl(&old_entry->elm);
+	/* Allocate out of the lock */
+	struct dns_cache_entry *entry = calloc(1, needed_size);
+	if (NULL == entry) {
+		traceEvent(TRACE_ERROR, "Can't allocate DNS cache element (out of memory?)");
+		return NULL;
 	}
 
-	entry = rd_memctx_calloc(&cache->memctx, 1, needed_size);
-	if(NULL != entry) {
 #ifdef DNS_CACHE_ENTRY_MAGIC
-		entry->magic = DNS_CACHE_ENTRY_MAGIC;
+	entry->magic = DNS_CACHE_ENTRY_MAGIC;
 #endif
 
-		/// cache from where node was allocated
-		entry->cache = cache;
+	/// cache from where node was allocated
+	entry->cache = cache;
+
+	memcpy(entry->elm.addr,addr,sizeof(entry->elm.addr));
+	entry->elm.name = name ? memcpy((void *)&entry[1],name,name_len) : NULL;
+	entry->elm.name_len = name_len;
 
-		memcpy(entry->elm.addr,addr,sizeof(entry->elm.addr));
-		entry->elm.name = memcpy((void *)&entry[1],name,name_len);
-		entry->elm.name_len = name_len;
+	entry->last_checked = now;
 
-		entry->last_checked = now;
-		entry->refcnt = 2; /* database & returned */
+	pthread_mutex_lock(&shard->mutex);
 
-		lru_push(&cache->lru,entry);
-		struct dns_cache_entry *oldentry = RD_AVL_INSERT(&cache->avl,entry,avl_elm);
-		if(oldentry) {
+	struct dns_cache_entry **it = dns_cache_shard_bucket(shard, hash);
+	for (; *it; it = &(*it)->next) {
+		if (0 == memcmp((*it)->elm.addr, addr, sizeof((*it)->elm.addr))) {
 			/* Another one inserted it's element first! we will make it dissapear */
-			lru_remove(&cache->lru,oldentry);
-			memset(&oldentry->lru_entry,0,sizeof(oldentry->lru_entry));
-			dns_cache_decref_elm_nl(&oldentry->elm);
+			dns_cache_shard_remove_nl(shard, it);
+			break;
 		}
 	}
-	pthread_mutex_unlock(&cache->mutex);
+
+	while (shard->mem_b + needed_size > shard->max_mem_b) {
+		dns_cache_shard_evict_nl(shard);
+	}
+
+	struct dns_cache_entry **bucket = dns_cache_shard_bucket(shard, hash);
+	entry->next = *bucket;
+	/* Publish entry contents before lookups can reach it */
+	ATOMIC_STORE_RELEASE(bucket, entry);
+	shard->entries++;
+	shard->mem_b += needed_size;
+
+	pthread_mutex_unlock(&shard->mutex);
 
 	return &entry->elm;
 }
 
 struct dns_cache_elm *dns_cache_get_elm(struct dns_cache *cache,const uint8_t *addr,time_t now) {
-	struct dns_cache_entry entry;
-	struct dns_cache_entry *ret = NULL;
-	memset(&entry,0,sizeof(entry));
-#ifdef DNS_CACHE_ENTRY_MAGIC
-	entry.magic = DNS_CACHE_ENTRY_MAGIC;
-#endif
-	memcpy(entry.elm.addr,addr,sizeof(entry.elm.addr));
+	const uint64_t hash = dns_addr_hash(addr);
+	struct dns_cache_shard *shard = dns_cache_shard(cache, hash);
 
-	pthread_mutex_lock(&cache->mutex);
-	ret = RD_AVL_FIND(&cache->avl,&entry);
+	struct dns_cache_entry *ret = dns_cache_shard_find(shard, hash, addr);
 
 	if(ret) {
-		lru_remove(&cache->lru,ret);
-
 		const double age = difftime(now,ret->last_checked);
-		if(age > cache->timeout_s) {
-			/// Invalidate -> please, call again.
+		const time_t timeout_s = ret->elm.name ? cache->timeout_s :
+						cache->negative_timeout_s;
+		if(age > timeout_s) {
+			/// Invalidate -> please, call again. Next save will replace it
 			if(unlikely(readOnlyGlobals.enable_debug)) {
 				traceEvent(TRACE_NORMAL,"Invalidating %p entry (age = %lf > %tu)",
-					ret,age,cache->timeout_s);
+					ret,age,timeout_s);
 			}
-
-			RD_AVL_REMOVE_ELM(&cache->avl,ret);
-			dns_cache_decref_elm_nl(&ret->elm);
 			ret = NULL;
 		} else {
-			// Re-ordering lru
-			lru_push(&cache->lru,ret);
-
-			ret->refcnt++;
+			/* Only write the entry cache line if needed */
+			if (!ATOMIC_LOAD_ACQUIRE(&ret->referenced)) {
+				ATOMIC_STORE_RELEASE(&ret->referenced, 1);
+			}
 		}
 	}
-	pthread_mutex_unlock(&cache->mutex);
 
 	return ret ? &ret->elm : NULL;
+}
+
+bool dns_cache_elm_refresh_ahead(struct dns_cache_elm *elm, time_t now) {
+	struct dns_cache_entry *entry = dns_cache_elm_entry(elm);
+	const struct dns_cache *cache = entry->cache;
+
+	if (0 == cache->refresh_ahead_s || NULL == elm->name ||
+			difftime(now, entry->last_checked) < cache->refresh_ahead_s) {
+		return false;
+	}
+
+	/* Only the first one to arrive refreshes it */
+	if (ATOMIC_LOAD_ACQUIRE(&entry->refreshing) ||
+				ATOMIC_TEST_AND_SET(&entry->refreshing)) {
+		return false;
+	}
+
+	return true;
+}
+
+void dns_cache_refresh_done(struct dns_cache *cache, const uint8_t *addr) {
+	const uint64_t hash = dns_addr_hash(addr);
+	struct dns_cache_entry *entry = dns_cache_shard_find(
+				dns_cache_shard(cache, hash), hash, addr);
+
+	/* A successful refresh replaces the entry, but a failed one keeps the
+	   old one (and its flag) */
+	if (entry && ATOMIC_LOAD_ACQUIRE(&entry->refreshing)) {
+		ATOMIC_STORE_RELEASE(&entry->refreshing, false);
+	}
+}
+
+/*
+ *  IN FLIGHT PTR QUERIES
+ */
 
+/// Flow waiting for a PTR query answer
+struct dns_ptr_query_waiter {
+	dns_ptr_query_cb cb;
+	void *opaque;
+	struct dns_ptr_query_waiter *next;
+};
+
+/// Outstanding PTR query
+struct dns_ptr_query {
+	uint8_t addr[16];
+	struct rb_dns_info *dns_info;
+	struct dns_ptr_query_waiter *waiters;
+	/// Next query in the in flight bucket
+	struct dns_ptr_query *next;
+};
+
+size_t dns_info_idx(const uint8_t *addr, size_t n_dns_info) {
+	return dns_addr_hash(addr) % n_dns_info;
+}
+
+static struct dns_ptr_query **dns_inflight_bucket(
+		struct rb_dns_info *dns_info, const uint8_t *addr) {
+	return &dns_info->inflight[dns_addr_hash(addr) &
+						(DNS_INFLIGHT_BUCKETS - 1)];
+}
+
+/** Complete all flows waiting for a query, and free it
+  @param ctx DNS context
+  @param query Query. Must not be in the in flight table anymore
+  @param name Answer, NULL if none
+  @param save_in_cache Save answer in DNS cache
+  */
+static void dns_ptr_query_done(struct dns_ctx *ctx,
+		struct dns_ptr_query *query, const char *name,
+		int save_in_cache) {
+	struct dns_cache_elm *elm = NULL;
+	struct dns_ptr_query_waiter *waiter = query->waiters;
+
+	if (save_in_cache && readOnlyGlobals.udns.cache) {
+		const time_t now = time(NULL);
+		if (NULL == name) {
+			/* Don't replace a still valid name with a failure (i.e.,
+			   refresh ahead timeout) */
+			elm = dns_cache_get_elm(readOnlyGlobals.udns.cache,
+							query->addr, now);
+			if (elm && NULL == elm->name) {
+				elm = NULL;
+			}
+		}
+
+		if (NULL == elm) {
+			elm = dns_cache_save_elm(readOnlyGlobals.udns.cache,
+				query->addr, name, name ? strlen(name) : 0, now);
+		}
+	}
+
+	while (waiter) {
+		struct dns_ptr_query_waiter *next = waiter->next;
+		waiter->cb(ctx, elm, name, waiter->opaque);
+		free(waiter);
+		waiter = next;
+	}
+
+	free(query);
+}
+
+static void dns_ptr_query_completed(struct dns_ctx *ctx,
+		struct dns_rr_ptr *result, void *vquery) {
+	struct dns_ptr_query *query = vquery;
+	struct dns_ptr_query **it = dns_inflight_bucket(query->dns_info,
+								query->addr);
+
+	for (; *it != query; it = &(*it)->next);
+	*it = query->next;
+
+	const char *name = (result && result->dnsptr_nrr > 0) ?
+						result->dnsptr_ptr[0] : NULL;
+	if (NULL == name && unlikely(readOnlyGlobals.enable_debug)) {
+		char buf[BUFSIZ];
+		traceEvent(TRACE_NORMAL, "No PTR for %s (status %d)",
+			_intoaV4(net2number(&query->addr[12], 4), buf,
+				sizeof(buf)), dns_status(ctx));
+	}
+
+	/* Failures are saved as negative entries too */
+	dns_ptr_query_done(ctx, query, name, 1 /* save */);
+	free(result);
+}
+
+void dns_ptr_query(struct rb_dns_info *dns_info, const uint8_t *addr,
+					dns_ptr_query_cb cb, void *opaque) {
+	struct dns_ptr_query_waiter *waiter = calloc(1, sizeof(*waiter));
+	if (NULL == waiter) {
+		traceEvent(TRACE_ERROR, "Can't allocate PTR query (out of memory?)");
+		cb(dns_info->dns_ctx, NULL, NULL, opaque);
+		return;
+	}
+
+	waiter->cb = cb;
+	waiter->opaque = opaque;
+
+	struct dns_ptr_query **bucket = dns_inflight_bucket(dns_info, addr);
+	struct dns_ptr_query *query = *bucket;
+	for (; query; query = query->next) {
+		if (0 == memcmp(query->addr, addr, sizeof(query->addr))) {
+			/* Already asking for this address */
+			waiter->next = query->waiters;
+			query->waiters = waiter;
+			return;
+		}
+	}
+
+	query = calloc(1, sizeof(*query));
+	if (NULL == query) {
+		traceEvent(TRACE_ERROR, "Can't allocate PTR query (out of memory?)");
+		free(waiter);
+		cb(dns_info->dns_ctx, NULL, NULL, opaque);
+		return;
+	}
+
+	memcpy(query->addr, addr, sizeof(query->addr));
+	query->dns_info = dns_info;
+	query->waiters = waiter;
+	query->next = *bucket;
+	*bucket = query;
+
+	struct in_addr addr4;
+	memcpy(&addr4, &addr[12], sizeof(addr4));
+	if (NULL == dns_submit_a4ptr(dns_info->dns_ctx, &addr4,
+					dns_ptr_query_completed, query)) {
+		traceEvent(TRACE_ERROR, "Can't submit PTR query (status %d)",
+			dns_status(dns_info->dns_ctx));
+		*bucket = query->next;
+		dns_ptr_query_done(dns_info->dns_ctx, query, NULL,
+			0 /* don't save */);
+	}
 }
 
 void *udns_pool_routine(void *_dns_info) {
@@ -294,14 +565,24 @@ void *udns_pool_routine(void *_dns_info) {
 
 	int dns_socket_fd = dns_sock(dns_info->dns_ctx);
 
+	/* Cache lookups, answers callbacks and flows printing use cache elements */
+	rb_epoch_register(&readOnlyGlobals.rb_databases.epoch,
+						&dns_info->epoch_reader);
+
 	while(rd_currthread->rdt_state == RD_THREAD_S_RUNNING) {
+		rb_epoch_enter(&readOnlyGlobals.rb_databases.epoch,
+						&dns_info->epoch_reader);
 		dns_ioevent(dns_info->dns_ctx,UDNS_GUESS_TIME);
 		dns_timeouts(dns_info->dns_ctx,MAX_DNS_TIMEOUT_S,UDNS_GUESS_TIME);
 		rd_thread_poll(0); // Consume all events created in ioevent
+		/* Don't hold back reclamation while waiting for answers */
+		rb_epoch_exit(&dns_info->epoch_reader);
 		rd_io_poll_single(dns_socket_fd,POLLIN,MAX_DNS_TIMEOUT_MS);
 	}
 
 	/* Cleanup */
+	rb_epoch_unregister(&readOnlyGlobals.rb_databases.epoch,
+						&dns_info->epoch_reader);
 	rd_thread_cleanup();
 
 	return NULL;
@@ -21,12 +21,12 @@
 
 #ifdef HAVE_UDNS
 
+#include "rb_epoch.h"
+
 #include <udns.h>
-#include <librd/rdavl.h>
-#include <librd/rdsysqueue.h>
-#include <librd/rdmem.h>
-#include <stdint.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
 
 #ifndef NDEBUG
 #define RB_DNS_MAGIC 0xBA1CBA1CBA1CBA1CL
@@ -39,23 +39,111 @@ struct dns_cache_elm {
 	const char *name;
 };
 
+/*
+  PTR answers cache. Entries are spread over independent shards, each one
+  with its own hash table, memory budget and insertion lock. Lookups don't
+  take any lock nor reference: they must be made inside an epoch critical
+  section of the cache epoch domain, and the returned element is only valid
+  until the section ends. Removed entries are retired through that epoch.
+  Eviction uses CLOCK, so cache hits from different threads never write
+  shared data but the entry reference bit, once per CLOCK pass.
+*/
 struct dns_cache;
 
-struct dns_cache *dns_cache_new(size_t maxmem_m, time_t timeout_s);
+/** Creates a new DNS cache
+  @param epoch Epoch domain of lookups, to retire removed entries
+  @param maxmem_m Maximum memory of cached entries, in megabytes
+  @param timeout_s Entry timeout
+  @param negative_timeout_s Negative entry (address without name) timeout
+  @param refresh_ahead_pct Percentage of timeout_s after which entries
+                           should be refreshed in background. 0 disables it
+  @return New cache, or NULL if error
+  */
+struct dns_cache *dns_cache_new(struct rb_epoch *epoch, size_t maxmem_m,
+			time_t timeout_s, time_t negative_timeout_s,
+			unsigned refresh_ahead_pct);
+
+/// Free cache. Nobody can be using it anymore. Retired entries are freed by
+/// the epoch domain.
 void dns_cache_done(struct dns_cache *cache);
 
-/// Get an element from cache. If success (return not null), must do a dns_cache_decref_elm at the end.
+/// Get an element from cache. Must be called inside an epoch critical
+/// section, and returned element is only valid until it ends: copy name if
+/// you need it later.
 struct dns_cache_elm *dns_cache_get_elm(struct dns_cache *cache,const uint8_t *addr,time_t now);
-void dns_cache_decref_elm(struct dns_cache_elm *);
+
+/** Check if caller should refresh a cached element in background, because
+  it is about to time out. Only returns true once per element, so only one
+  refresh is made.
+  @param elm Element obtained with dns_cache_get_elm
+  @param now Current time
+  @return true if caller should ask again for element address. Caller must
+          copy the address, since elm can be retired before the query ends
+  */
+bool dns_cache_elm_refresh_ahead(struct dns_cache_elm *elm, time_t now);
+
+/** Mark an address background refresh as finished, so it can be refreshed
+  again. Must be called whatever the refresh result is (answer, failure or
+  timeout), inside an epoch critical section.
+  @param cache Cache
+  @param addr Refreshed address
+  */
+void dns_cache_refresh_done(struct dns_cache *cache, const uint8_t *addr);
+
+/// Save an element in cache. A NULL name saves a negative entry, i.e., an
+/// address with no PTR record. Like lookups, returned element is only valid
+/// inside caller epoch critical section.
 struct dns_cache_elm *dns_cache_save_elm(struct dns_cache *cache,const uint8_t *addr,const char *name,size_t name_len,time_t now);
 
+/// In flight PTR queries hash buckets, per DNS thread
+#define DNS_INFLIGHT_BUCKETS 1024
+
+struct dns_ptr_query;
+
 struct rb_dns_info {
 #ifdef RB_DNS_MAGIC
 	uint64_t magic;
 #endif
 	struct dns_ctx *dns_ctx;
+
+	/// PTR queries waiting for an answer. Only used from DNS thread
+	struct dns_ptr_query *inflight[DNS_INFLIGHT_BUCKETS];
+
+	/// DNS thread epoch reader. Cache elements are only used inside its
+	/// critical sections
+	struct rb_epoch_reader epoch_reader;
 };
 
 void *udns_pool_routine(void *);
 
+/** PTR query result callback
+  @param ctx DNS context
+  @param elm Cached answer, or NULL if no cache (or cache is full). Only
+             valid during callback
+  @param name Answer, or NULL if address has no name
+  @param opaque Query opaque
+  */
+typedef void (*dns_ptr_query_cb)(struct dns_ctx *ctx,
+		struct dns_cache_elm *elm, const char *name, void *opaque);
+
+/** Reverse resolve an IPv4 mapped address, and save the answer in the cache.
+  Queries of an address that is already being resolved by the same DNS thread
+  don't generate a new DNS query, they wait for the outstanding one instead.
+  Must be called from dns_info polling thread (i.e., using rd_thread_func_call)
+  @param dns_info DNS thread information
+  @param addr Address to resolve
+  @param cb Result callback
+  @param opaque Callback opaque
+  */
+void dns_ptr_query(struct rb_dns_info *dns_info, const uint8_t *addr,
+					dns_ptr_query_cb cb, void *opaque);
+
+/** DNS thread in charge of an address, so all queries of the same address
+  can be coalesced
+  @param addr Address
+  @param n_dns_info Number of DNS threads
+  @return DNS thread index
+  */
+size_t dns_info_idx(const uint8_t *addr, size_t n_dns_info);
+
 #endif /* HAVE_UDNS */
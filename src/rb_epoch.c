@@ -0,0 +1,172 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rb_epoch.h"
+
+#include "f2k.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct rb_epoch_retired {
+  void *ptr;
+  void (*free_cb)(void *);
+  uint64_t epoch; ///< Epoch in which object was retired
+  struct rb_epoch_retired *next;
+};
+
+static void assert_rb_epoch(const struct rb_epoch *epoch) {
+#ifdef RB_EPOCH_MAGIC
+  assert(RB_EPOCH_MAGIC == epoch->magic);
+#else
+  (void)epoch;
+#endif
+}
+
+void rb_epoch_done(struct rb_epoch *epoch) {
+  assert_rb_epoch(epoch);
+
+  while (epoch->retired) {
+    struct rb_epoch_retired *retired = epoch->retired;
+    epoch->retired = retired->next;
+    retired->free_cb(retired->ptr);
+    free(retired);
+  }
+}
+
+void rb_epoch_register(struct rb_epoch *epoch,
+                                              struct rb_epoch_reader *reader) {
+  assert_rb_epoch(epoch);
+
+  reader->epoch = 0;
+  pthread_mutex_lock(&epoch->mutex);
+  reader->next = epoch->readers;
+  epoch->readers = reader;
+  pthread_mutex_unlock(&epoch->mutex);
+}
+
+void rb_epoch_unregister(struct rb_epoch *epoch,
+                                              struct rb_epoch_reader *reader) {
+  struct rb_epoch_reader **iter;
+  assert_rb_epoch(epoch);
+  assert(0 == reader->epoch);
+
+  pthread_mutex_lock(&epoch->mutex);
+  for (iter = &epoch->readers; *iter; iter = &(*iter)->next) {
+    if (*iter == reader) {
+      *iter = reader->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&epoch->mutex);
+}
+
+void rb_epoch_enter(struct rb_epoch *epoch, struct rb_epoch_reader *reader) {
+  ATOMIC_STORE_RELEASE(&reader->epoch, ATOMIC_LOAD_ACQUIRE(&epoch->epoch));
+  /* Announce epoch before loading any published pointer. Pairs with the
+     fence in rb_epoch_reclaim */
+  ATOMIC_FULL_FENCE();
+}
+
+void rb_epoch_exit(struct rb_epoch_reader *reader) {
+  ATOMIC_STORE_RELEASE(&reader->epoch, 0);
+}
+
+void rb_epoch_retire(struct rb_epoch *epoch, void *ptr,
+                                                    void (*free_cb)(void *)) {
+  assert_rb_epoch(epoch);
+
+  if (NULL == ptr) {
+    return;
+  }
+
+  struct rb_epoch_retired *retired = calloc(1, sizeof(*retired));
+  if (unlikely(NULL == retired)) {
+    /* Can't defer: wait for current readers to leave their sections */
+    traceEvent(TRACE_ERROR, "Can't allocate retired object, waiting readers");
+    pthread_mutex_lock(&epoch->mutex);
+    const uint64_t retire_epoch = ATOMIC_OP(fetch, add, &epoch->epoch, 1);
+    ATOMIC_FULL_FENCE();
+    struct rb_epoch_reader *reader;
+    for (reader = epoch->readers; reader; reader = reader->next) {
+      uint64_t reader_epoch;
+      while ((reader_epoch = ATOMIC_LOAD_ACQUIRE(&reader->epoch)) &&
+                                            reader_epoch <= retire_epoch) {
+        usleep(1000);
+      }
+    }
+    pthread_mutex_unlock(&epoch->mutex);
+    free_cb(ptr);
+    return;
+  }
+
+  retired->ptr = ptr;
+  retired->free_cb = free_cb;
+
+  pthread_mutex_lock(&epoch->mutex);
+  /* Readers in this epoch or previous ones could have seen ptr. New readers
+     will see next epoch, and the new published pointer */
+  retired->epoch = ATOMIC_OP(fetch, add, &epoch->epoch, 1);
+  retired->next = epoch->retired;
+  epoch->retired = retired;
+  pthread_mutex_unlock(&epoch->mutex);
+}
+
+size_t rb_epoch_reclaim(struct rb_epoch *epoch) {
+  struct rb_epoch_retired *to_free = NULL, **iter;
+  struct rb_epoch_reader *reader;
+  size_t pending = 0;
+  assert_rb_epoch(epoch);
+
+  /* See rb_epoch_enter */
+  ATOMIC_FULL_FENCE();
+
+  pthread_mutex_lock(&epoch->mutex);
+  /* Oldest epoch still in use by a reader */
+  uint64_t min_epoch = UINT64_MAX;
+  for (reader = epoch->readers; reader; reader = reader->next) {
+    const uint64_t reader_epoch = ATOMIC_LOAD_ACQUIRE(&reader->epoch);
+    if (reader_epoch && reader_epoch < min_epoch) {
+      min_epoch = reader_epoch;
+    }
+  }
+
+  for (iter = &epoch->retired; *iter;) {
+    struct rb_epoch_retired *retired = *iter;
+    if (retired->epoch < min_epoch) {
+      *iter = retired->next;
+      retired->next = to_free;
+      to_free = retired;
+    } else {
+      iter = &retired->next;
+      pending++;
+    }
+  }
+  pthread_mutex_unlock(&epoch->mutex);
+
+  while (to_free) {
+    struct rb_epoch_retired *retired = to_free;
+    to_free = retired->next;
+    retired->free_cb(retired->ptr);
+    free(retired);
+  }
+
+  return pending;
+}
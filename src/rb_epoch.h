@@ -0,0 +1,120 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "../config.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  Epoch based memory reclamation, for read-mostly data published through an
+  atomic pointer (RCU style).
+
+  Readers never block: they enter a read side critical section announcing the
+  current epoch, load the published pointers with acquire semantics, and exit
+  the section when they don't need the data anymore. Writers build a new
+  version of the data, publish it with a release store, and retire the old
+  one: it will be freed when every reader that could have seen it has exited
+  its critical section.
+
+  Only registered readers are tracked, so a thread that is not registered can
+  only read the data if it is the same thread that publishes it.
+*/
+
+/// Epoch reader. One per reader thread.
+struct rb_epoch_reader {
+  uint64_t epoch; ///< Epoch of the current critical section, 0 if none
+  struct rb_epoch_reader *next;
+};
+
+struct rb_epoch_retired;
+
+/// Epoch reclamation domain
+struct rb_epoch {
+#ifndef NDEBUG
+#define RB_EPOCH_MAGIC 0xE90CE90CE90CE90CL
+  uint64_t magic;
+#endif
+  uint64_t epoch; ///< Global epoch
+
+  /// Protects readers and retired lists. Never taken by reader critical
+  /// sections
+  pthread_mutex_t mutex;
+  struct rb_epoch_reader *readers;
+  struct rb_epoch_retired *retired;
+};
+
+#ifdef RB_EPOCH_MAGIC
+#define RB_EPOCH_INITIALIZER_MAGIC .magic = RB_EPOCH_MAGIC,
+#else
+#define RB_EPOCH_INITIALIZER_MAGIC
+#endif
+
+/// Epoch domain static initializer
+#define RB_EPOCH_INITIALIZER { RB_EPOCH_INITIALIZER_MAGIC \
+  .epoch = 1, .mutex = PTHREAD_MUTEX_INITIALIZER }
+
+/** Free all pending retired objects, i.e., at shutdown. No reader can be in
+  a critical section.
+  @param epoch Epoch domain
+  */
+void rb_epoch_done(struct rb_epoch *epoch);
+
+/** Register a reader thread
+  @param epoch Epoch domain
+  @param reader Reader
+  */
+void rb_epoch_register(struct rb_epoch *epoch, struct rb_epoch_reader *reader);
+
+/** Unregister a reader thread. It must not be in a critical section
+  @param epoch Epoch domain
+  @param reader Reader
+  */
+void rb_epoch_unregister(struct rb_epoch *epoch,
+                                              struct rb_epoch_reader *reader);
+
+/** Enter a read side critical section. Sections can't be nested.
+  @param epoch Epoch domain
+  @param reader Reader
+  */
+void rb_epoch_enter(struct rb_epoch *epoch, struct rb_epoch_reader *reader);
+
+/** Exit a read side critical section
+  @param reader Reader
+  */
+void rb_epoch_exit(struct rb_epoch_reader *reader);
+
+/** Retire an object that has been unpublished. It will be freed when no
+  reader can reach it anymore.
+  @param epoch Epoch domain
+  @param ptr Object
+  @param free_cb Object free function
+  */
+void rb_epoch_retire(struct rb_epoch *epoch, void *ptr,
+                                                    void (*free_cb)(void *));
+
+/** Free retired objects that no reader can reach anymore. Never blocks on
+  readers.
+  @param epoch Epoch domain
+  @return Number of retired objects still pending
+  */
+size_t rb_epoch_reclaim(struct rb_epoch *epoch);
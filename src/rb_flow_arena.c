@@ -0,0 +1,210 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "rb_flow_arena.h"
+
+#include "f2k.h"
+#include "export.h"
+#include "printbuf.h"
+#include "rb_lists.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#ifndef NDEBUG
+#define FLOW_ARENA_MAGIC 0xF10A4E4AF10A4E4AL
+#endif
+
+/// Arena objects types
+enum flow_arena_type {
+  FLOW_ARENA_FLOW_CACHE,
+  FLOW_ARENA_PRINTBUF,
+  FLOW_ARENA_STRING_LIST,
+  FLOW_ARENA_N_TYPES
+};
+
+/// Recycled objects of the same type. Used as a LIFO, so the hottest object
+/// is the next one to be served
+struct flow_arena_stack {
+  void **objs;
+  size_t count;
+};
+
+struct flow_arena {
+#ifdef FLOW_ARENA_MAGIC
+  uint64_t magic;
+#endif
+  size_t max_objects;
+  struct flow_arena_stack stacks[FLOW_ARENA_N_TYPES];
+};
+
+static void flow_arena_assert(const struct flow_arena *arena) {
+  (void)arena;
+#ifdef FLOW_ARENA_MAGIC
+  assert(FLOW_ARENA_MAGIC == arena->magic);
+#endif
+}
+
+struct flow_arena *new_flow_arena(size_t max_objects) {
+  struct flow_arena *arena = calloc(1, sizeof(*arena));
+  void **objs = calloc(FLOW_ARENA_N_TYPES * max_objects, sizeof(objs[0]));
+  size_t i;
+
+  if (NULL == arena || NULL == objs) {
+    traceEvent(TRACE_ERROR, "Can't allocate flow arena (out of memory?)");
+    free(arena);
+    free(objs);
+    return NULL;
+  }
+
+#ifdef FLOW_ARENA_MAGIC
+  arena->magic = FLOW_ARENA_MAGIC;
+#endif
+  arena->max_objects = max_objects;
+  for (i = 0; i < FLOW_ARENA_N_TYPES; ++i) {
+    arena->stacks[i].objs = &objs[i * max_objects];
+  }
+
+  return arena;
+}
+
+void flow_arena_done(struct flow_arena *arena) {
+  size_t i;
+
+  if (NULL == arena) {
+    return;
+  }
+
+  flow_arena_assert(arena);
+  for (i = 0; i < FLOW_ARENA_N_TYPES; ++i) {
+    struct flow_arena_stack *stack = &arena->stacks[i];
+    while (stack->count > 0) {
+      void *obj = stack->objs[--stack->count];
+      if (FLOW_ARENA_PRINTBUF == i) {
+        printbuf_free(obj);
+      } else {
+        free(obj);
+      }
+    }
+  }
+
+  /* All stacks share the same array */
+  free(arena->stacks[0].objs);
+  free(arena);
+}
+
+/** Pop a recycled object
+  @param arena Arena. Can be NULL
+  @param type Object type
+  @return Recycled object, or NULL if none
+  */
+static void *flow_arena_pop(struct flow_arena *arena,
+                                                  enum flow_arena_type type) {
+  if (NULL == arena) {
+    return NULL;
+  }
+
+  flow_arena_assert(arena);
+  struct flow_arena_stack *stack = &arena->stacks[type];
+  return stack->count > 0 ? stack->objs[--stack->count] : NULL;
+}
+
+/** Push an object to recycle it
+  @param arena Arena. Can be NULL
+  @param type Object type
+  @param obj Object
+  @return 0 if pushed, !0 if caller must free the object
+  */
+static int flow_arena_push(struct flow_arena *arena,
+                                      enum flow_arena_type type, void *obj) {
+  if (NULL == arena) {
+    return -1;
+  }
+
+  flow_arena_assert(arena);
+  struct flow_arena_stack *stack = &arena->stacks[type];
+  if (stack->count == arena->max_objects) {
+    return -1;
+  }
+
+  stack->objs[stack->count++] = obj;
+  return 0;
+}
+
+struct flowCache *flow_arena_flow_cache_new(struct flow_arena *arena) {
+  struct flowCache *ret = flow_arena_pop(arena, FLOW_ARENA_FLOW_CACHE);
+  if (ret) {
+    memset(ret, 0, sizeof(*ret));
+    return ret;
+  }
+
+  return calloc(1, sizeof(*ret));
+}
+
+void flow_arena_flow_cache_free(struct flow_arena *arena,
+                                                struct flowCache *flow_cache) {
+  if (0 != flow_arena_push(arena, FLOW_ARENA_FLOW_CACHE, flow_cache)) {
+    free(flow_cache);
+  }
+}
+
+struct printbuf *flow_arena_printbuf_new(struct flow_arena *arena) {
+  struct printbuf *ret = flow_arena_pop(arena, FLOW_ARENA_PRINTBUF);
+  if (NULL == ret) {
+    return printbuf_new();
+  }
+
+  if (NULL == ret->buf) {
+    /* Previous buffer was handed off */
+    ret->size = PRINTBUF_DEFAULT_SIZE;
+    ret->buf = malloc(ret->size);
+    if (unlikely(NULL == ret->buf)) {
+      flow_arena_printbuf_free(arena, ret);
+      return NULL;
+    }
+  }
+
+  ret->bpos = 0;
+  ret->buf[0] = '\0';
+  return ret;
+}
+
+void flow_arena_printbuf_free(struct flow_arena *arena, struct printbuf *pb) {
+  if (0 != flow_arena_push(arena, FLOW_ARENA_PRINTBUF, pb)) {
+    printbuf_free(pb);
+  }
+}
+
+struct string_list *flow_arena_string_list_new(struct flow_arena *arena) {
+  struct string_list *ret = flow_arena_pop(arena, FLOW_ARENA_STRING_LIST);
+  if (ret) {
+    memset(ret, 0, sizeof(*ret));
+    return ret;
+  }
+
+  return calloc(1, sizeof(*ret));
+}
+
+void flow_arena_string_list_free(struct flow_arena *arena,
+                                                    struct string_list *node) {
+  if (0 != flow_arena_push(arena, FLOW_ARENA_STRING_LIST, node)) {
+    free(node);
+  }
+}
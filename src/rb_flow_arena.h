@@ -0,0 +1,99 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "../config.h"
+
+#include <stddef.h>
+
+/*
+  Per-worker recycling arena of the objects a flow needs while it is being
+  dissected: flow cache, output printbuf and string list node. Objects are
+  given back to the arena when the flow is sent, so the next flows reuse them
+  instead of calling malloc/free. Only the owner worker thread can use it.
+
+  Every object is allocated individually, so anybody can still free them with
+  plain free()/printbuf_free() (i.e., the DNS thread). They will just not be
+  recycled. Every function accepts a NULL arena, allocating or freeing the
+  object without recycling.
+
+  Printbuf buffers are handed off to librdkafka, so only the printbuf struct
+  can be recycled after a successful produce.
+*/
+
+struct flowCache;
+struct printbuf;
+struct string_list;
+
+/// Default maximum number of recycled objects of each type
+#define FLOW_ARENA_DEFAULT_MAX_OBJECTS 1024
+
+struct flow_arena;
+
+/** Creates a new flow arena
+  @param max_objects Maximum number of recycled objects of each type. Objects
+  released beyond that will be freed
+  @return New arena, or NULL if no memory
+  */
+struct flow_arena *new_flow_arena(size_t max_objects);
+
+/** Free arena and all recycled objects
+  @param arena Arena
+  */
+void flow_arena_done(struct flow_arena *arena);
+
+/** Get a zeroed flow cache
+  @param arena Arena. Can be NULL
+  @return New flow cache, or NULL if no memory
+  */
+struct flowCache *flow_arena_flow_cache_new(struct flow_arena *arena);
+
+/** Give back a flow cache to the arena
+  @param arena Arena. Can be NULL
+  @param flow_cache Flow cache
+  */
+void flow_arena_flow_cache_free(struct flow_arena *arena,
+                                                struct flowCache *flow_cache);
+
+/** Get an empty printbuf
+  @param arena Arena. Can be NULL
+  @return New printbuf, or NULL if no memory
+  */
+struct printbuf *flow_arena_printbuf_new(struct flow_arena *arena);
+
+/** Give back a printbuf to the arena. Its buffer can be NULL if it has been
+  handed off to another owner.
+  @param arena Arena. Can be NULL
+  @param pb Printbuf
+  */
+void flow_arena_printbuf_free(struct flow_arena *arena, struct printbuf *pb);
+
+/** Get a zeroed string list node
+  @param arena Arena. Can be NULL
+  @return New node, or NULL if no memory
+  */
+struct string_list *flow_arena_string_list_new(struct flow_arena *arena);
+
+/** Give back a string list node to the arena. Node string is not released.
+  @param arena Arena. Can be NULL
+  @param node Node
+  */
+void flow_arena_string_list_free(struct flow_arena *arena,
+                                                    struct string_list *node);
@@ -0,0 +1,352 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rb_ip_name_db.h"
+
+#include "f2k.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Initial hosts hash table size
+#define IP_NAME_DB_INITIAL_HOSTS 64
+
+struct ip_name_db_node {
+  uint8_t key[16];  ///< Prefix, with the bits beyond len cleared
+  unsigned len;     ///< Prefix length
+  const IPNameAssoc *assoc; ///< Entry of exactly this prefix (if any)
+  struct ip_name_db_node *children[2];
+};
+
+struct ip_name_db {
+#ifndef NDEBUG
+#define IP_NAME_DB_MAGIC 0x1DA3E0DB1DA3E0DBL
+  uint64_t magic;
+#endif
+  /// Networks trie
+  struct ip_name_db_node *nets;
+  size_t nets_count;
+
+  /// Hosts open addressing hash table
+  struct {
+    const IPNameAssoc **slots;
+    size_t mask;
+    size_t count;
+  } hosts;
+};
+
+static void assert_ip_name_db(const struct ip_name_db *db) {
+#ifdef IP_NAME_DB_MAGIC
+  assert(IP_NAME_DB_MAGIC == db->magic);
+#else
+  (void)db;
+#endif
+}
+
+/*
+ *  NETWORKS TRIE
+ */
+
+static unsigned netmask_prefix_len(const uint8_t netmask[16]) {
+  unsigned i, len = 0;
+  for (i = 0; i < 16 && 0xff == netmask[i]; ++i) {
+    len += 8;
+  }
+
+  if (i < 16) {
+    len += __builtin_clz(~netmask[i] & 0xff) - 24;
+  }
+
+  return len;
+}
+
+static unsigned bit_at(const uint8_t key[16], unsigned pos) {
+  return (key[pos / 8] >> (7 - pos % 8)) & 1;
+}
+
+/// Length of the common prefix of a and b, up to max_len bits
+static unsigned common_prefix_len(const uint8_t a[16], const uint8_t b[16],
+                                                            unsigned max_len) {
+  unsigned i;
+  for (i = 0; i < 16 && 8 * i < max_len; ++i) {
+    const unsigned diff = a[i] ^ b[i];
+    if (diff) {
+      const unsigned ret = 8 * i + __builtin_clz(diff) - 24;
+      return ret < max_len ? ret : max_len;
+    }
+  }
+
+  return max_len;
+}
+
+static struct ip_name_db_node *new_ip_name_db_node(const uint8_t key[16],
+                                    unsigned len, const IPNameAssoc *assoc) {
+  unsigned i;
+  struct ip_name_db_node *ret = calloc(1, sizeof(*ret));
+  if (unlikely(NULL == ret)) {
+    return NULL;
+  }
+
+  for (i = 0; i < len / 8; ++i) {
+    ret->key[i] = key[i];
+  }
+  if (len % 8) {
+    ret->key[i] = key[i] & (0xff << (8 - len % 8));
+  }
+  ret->len = len;
+  ret->assoc = assoc;
+  return ret;
+}
+
+/** Insert a prefix in the trie
+  @param slot Trie root
+  @param key Prefix
+  @param len Prefix length
+  @param assoc Entry
+  @return 1 if inserted, 0 if prefix was already in the trie, -1 if no memory
+  */
+static int nets_trie_insert(struct ip_name_db_node **slot,
+                const uint8_t key[16], unsigned len, const IPNameAssoc *assoc) {
+  while (*slot) {
+    struct ip_name_db_node *node = *slot;
+    const unsigned common = common_prefix_len(node->key, key,
+                                        node->len < len ? node->len : len);
+
+    if (common == node->len && common == len) {
+      /* Same prefix: first entry of the list wins */
+      if (node->assoc) {
+        return 0;
+      }
+      node->assoc = assoc;
+      return 1;
+    } else if (common == node->len) {
+      slot = &node->children[bit_at(key, node->len)];
+      continue;
+    }
+
+    /* Split node in the first different bit */
+    struct ip_name_db_node *parent = new_ip_name_db_node(key, common,
+                                              common == len ? assoc : NULL);
+    struct ip_name_db_node *leaf = common == len ? NULL :
+                                      new_ip_name_db_node(key, len, assoc);
+    if (unlikely(NULL == parent || (common != len && NULL == leaf))) {
+      free(parent);
+      free(leaf);
+      return -1;
+    }
+
+    parent->children[bit_at(node->key, common)] = node;
+    if (leaf) {
+      parent->children[bit_at(key, common)] = leaf;
+    }
+    *slot = parent;
+    return 1;
+  }
+
+  *slot = new_ip_name_db_node(key, len, assoc);
+  return *slot ? 1 : -1;
+}
+
+static const IPNameAssoc *nets_trie_search(const struct ip_name_db_node *node,
+                                                        const uint8_t ip[16]) {
+  const IPNameAssoc *ret = NULL;
+
+  while (node && common_prefix_len(node->key, ip, node->len) == node->len) {
+    if (node->assoc) {
+      ret = node->assoc;
+    }
+
+    if (node->len == 128) {
+      break;
+    }
+
+    node = node->children[bit_at(ip, node->len)];
+  }
+
+  return ret;
+}
+
+static void nets_trie_done(struct ip_name_db_node *node) {
+  while (node) {
+    struct ip_name_db_node *next = node->children[1];
+    nets_trie_done(node->children[0]);
+    free(node);
+    node = next;
+  }
+}
+
+/*
+ *  HOSTS HASH TABLE
+ */
+
+static size_t host_hash(const uint8_t ip[16]) {
+  uint64_t a, b;
+  memcpy(&a, ip, sizeof(a));
+  memcpy(&b, ip + sizeof(a), sizeof(b));
+
+  uint64_t h = (a * 0x9e3779b97f4a7c15ULL) ^ b;
+  h *= 0xff51afd7ed558ccdULL;
+  return h ^ (h >> 33);
+}
+
+/// Slot of ip in hosts hash table: the entry of ip, or the empty slot where it
+/// should go
+static const IPNameAssoc **hosts_slot(const IPNameAssoc **slots, size_t mask,
+                                                        const uint8_t ip[16]) {
+  size_t i;
+  for (i = host_hash(ip) & mask; slots[i]; i = (i + 1) & mask) {
+    if (0 == memcmp(slots[i]->number_i.net_address.network, ip, 16)) {
+      break;
+    }
+  }
+
+  return &slots[i];
+}
+
+static int hosts_grow(struct ip_name_db *db) {
+  size_t i;
+  const size_t new_size = db->hosts.slots ? 2 * (db->hosts.mask + 1) :
+                                                    IP_NAME_DB_INITIAL_HOSTS;
+  const IPNameAssoc **new_slots = calloc(new_size, sizeof(new_slots[0]));
+  if (unlikely(NULL == new_slots)) {
+    return -1;
+  }
+
+  for (i = 0; db->hosts.slots && i <= db->hosts.mask; ++i) {
+    const IPNameAssoc *assoc = db->hosts.slots[i];
+    if (assoc) {
+      *hosts_slot(new_slots, new_size - 1,
+                              assoc->number_i.net_address.network) = assoc;
+    }
+  }
+
+  free(db->hosts.slots);
+  db->hosts.slots = new_slots;
+  db->hosts.mask = new_size - 1;
+  return 0;
+}
+
+/** Insert a host in the hash table
+  @param db Database
+  @param assoc Host entry
+  @return 1 if inserted, 0 if host was already in the table, -1 if no memory
+  */
+static int hosts_insert(struct ip_name_db *db, const IPNameAssoc *assoc) {
+  /* Keep load factor under 1/2 */
+  if (NULL == db->hosts.slots || 2 * (db->hosts.count + 1) > db->hosts.mask) {
+    if (0 != hosts_grow(db)) {
+      return -1;
+    }
+  }
+
+  const IPNameAssoc **slot = hosts_slot(db->hosts.slots, db->hosts.mask,
+                                        assoc->number_i.net_address.network);
+  if (*slot) {
+    /* First entry of the list wins */
+    return 0;
+  }
+
+  *slot = assoc;
+  db->hosts.count++;
+  return 1;
+}
+
+static const IPNameAssoc *hosts_search(const struct ip_name_db *db,
+                                                        const uint8_t ip[16]) {
+  return db->hosts.count ?
+                      *hosts_slot(db->hosts.slots, db->hosts.mask, ip) : NULL;
+}
+
+/*
+ *  DATABASE
+ */
+
+struct ip_name_db *new_ip_name_db(const IPNameAssoc *list) {
+  struct ip_name_db *db = calloc(1, sizeof(*db));
+  if (unlikely(NULL == db)) {
+    traceEvent(TRACE_ERROR, "Couldn't allocate hosts database (out of memory?)");
+    return NULL;
+  }
+
+#ifdef IP_NAME_DB_MAGIC
+  db->magic = IP_NAME_DB_MAGIC;
+#endif
+
+  for (; list; list = list->next) {
+    const netAddress_t *address = &list->number_i.net_address;
+    const unsigned prefix_len = netmask_prefix_len(address->networkMask);
+    int rc;
+
+    if (prefix_len == 128) {
+      rc = hosts_insert(db, list);
+    } else {
+      rc = nets_trie_insert(&db->nets, address->network, prefix_len, list);
+      if (rc > 0) {
+        db->nets_count++;
+      }
+    }
+
+    if (unlikely(rc < 0)) {
+      traceEvent(TRACE_ERROR,
+        "Couldn't index hosts database entry %s (out of memory?)", list->name);
+      ip_name_db_done(db);
+      return NULL;
+    }
+  }
+
+  return db;
+}
+
+const IPNameAssoc *ip_name_db_search(const struct ip_name_db *db,
+                                                        const uint8_t ip[16]) {
+  if (NULL == db) {
+    return NULL;
+  }
+
+  assert_ip_name_db(db);
+
+  /* A host is always the most specific entry */
+  const IPNameAssoc *ret = hosts_search(db, ip);
+  return ret ? ret : nets_trie_search(db->nets, ip);
+}
+
+void ip_name_db_count(const struct ip_name_db *db, size_t *hosts,
+                                                                size_t *nets) {
+  assert_ip_name_db(db);
+
+  if (hosts) {
+    *hosts = db->hosts.count;
+  }
+  if (nets) {
+    *nets = db->nets_count;
+  }
+}
+
+void ip_name_db_done(struct ip_name_db *db) {
+  if (NULL == db) {
+    return;
+  }
+
+  assert_ip_name_db(db);
+  nets_trie_done(db->nets);
+  free(db->hosts.slots);
+  free(db);
+}
@@ -0,0 +1,66 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "../config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  Hosts/networks names database. Built once from a parsed hosts or networks
+  list: entries with a full netmask (hosts) are indexed in a hash table, and
+  the rest in a path-compressed binary radix trie, so a search is O(1) for
+  hosts and O(prefix length) for networks. The database does not own the
+  list entries.
+
+  A search returns the most specific entry that contains the address. If the
+  same network appears more than once in the list, the first one wins.
+*/
+
+struct _IPNameAssoc;
+struct ip_name_db;
+
+/** Creates a database from an IPNameAssoc list
+  @param list List to index. It must outlive the database
+  @return New database, or NULL if no memory
+  */
+struct ip_name_db *new_ip_name_db(const struct _IPNameAssoc *list);
+
+/** Search the most specific list entry that contains ip
+  @param db Database. Can be NULL
+  @param ip IPv6 (or IPv4 mapped) address
+  @return Entry, or NULL if not found
+  */
+const struct _IPNameAssoc *ip_name_db_search(const struct ip_name_db *db,
+                                                        const uint8_t ip[16]);
+
+/** Number of indexed entries
+  @param db Database
+  @param hosts Number of entries indexed as hosts. Can be NULL
+  @param nets Number of entries indexed as networks. Can be NULL
+  */
+void ip_name_db_count(const struct ip_name_db *db, size_t *hosts,
+                                                                size_t *nets);
+
+/** Free a database. List entries are not freed
+  @param db Database
+  */
+void ip_name_db_done(struct ip_name_db *db);
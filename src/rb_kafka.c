@@ -23,8 +23,26 @@
 
 #include "rb_kafka.h"
 #include "f2k.h"
+#include "printbuf.h"
+#include "rb_lists.h"
+#include "rb_sink.h"
 #include "util.h"
 
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/// Max messages replayed in a row
+#define SPILL_REPLAY_BATCH 1024
+/// Don't replay if producer queue has more messages than this
+#define SPILL_REPLAY_MAX_OUTQ 10000
+/// Time between replay attempts if there is nothing to do
+#define SPILL_REPLAY_IDLE_MS 500
+
+/// Last delivery report was successful, so brokers are reachable
+static int kafka_brokers_up = 1;
+/// Flows topic partitions, as last seen by partitioner. 0 if unknown yet
+static int32_t kafka_partition_cnt = 0;
 
 int32_t rb_client_mac_partitioner (const rd_kafka_topic_t *rkt,
 					 const void *key __attribute__((unused)),
@@ -33,6 +51,9 @@ int32_t rb_client_mac_partitioner (const rd_kafka_topic_t *rkt,
 					 void *rkt_opaque,
 					 void *msg_opaque){
     const uint64_t client_mac = (intptr_t)msg_opaque;
+    /* Multi-flow messages are grouped by partition */
+    if(unlikely(ATOMIC_LOAD_ACQUIRE(&kafka_partition_cnt) != partition_cnt))
+      ATOMIC_STORE_RELEASE(&kafka_partition_cnt, partition_cnt);
     if(client_mac == 0)
     	return rd_kafka_msg_partitioner_random(rkt,NULL,0,partition_cnt,rkt_opaque,msg_opaque);
     else
@@ -99,4 +120,540 @@ void parse_kafka_config(rd_kafka_conf_t *rk_conf,rd_kafka_topic_conf_t *rkt_conf
   free(name);
 }
 
+int rb_kafka_producer_init(struct rb_kafka_producer *producer,
+    rd_kafka_conf_t *rk_conf, const char *topic,
+    rd_kafka_topic_conf_t *rkt_conf) {
+  char errstr[512];
+
+  producer->rk = rd_kafka_new(RD_KAFKA_PRODUCER, rk_conf, errstr,
+    sizeof(errstr));
+  if (unlikely(NULL == producer->rk)) {
+    traceEvent(TRACE_ERROR, "Unable to create kafka handler: %s", errstr);
+    rd_kafka_topic_conf_destroy(rkt_conf);
+    return -1;
+  }
+
+  producer->rkt = rd_kafka_topic_new(producer->rk, topic, rkt_conf);
+  if (unlikely(NULL == producer->rkt)) {
+    traceEvent(TRACE_ERROR, "Unable to create a kafka topic");
+    rd_kafka_destroy(producer->rk);
+    producer->rk = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+void rb_kafka_producer_done(struct rb_kafka_producer *producer) {
+  if (NULL == producer->rk) {
+    return;
+  }
+
+  /* Steps of librdkafka wiki */
+
+  /* 1) Make sure all outstanding requests are transmitted and handled. */
+  while (rd_kafka_outq_len(producer->rk) > 0) {
+    rd_kafka_poll(producer->rk, 50);
+  }
+
+  /* 2) Destroy the topic and handle objects */
+  rd_kafka_topic_destroy(producer->rkt);
+  rd_kafka_destroy(producer->rk);
+  producer->rkt = NULL;
+  producer->rk = NULL;
+}
+
+void rb_kafka_spill_msg_delivered(rd_kafka_t *rk __attribute__((unused)),
+    const rd_kafka_message_t *rkmessage,
+    void *opaque __attribute__((unused))) {
+  int up = 1;
+
+  switch (rkmessage->err) {
+  case RD_KAFKA_RESP_ERR_NO_ERROR:
+    break;
+
+  case RD_KAFKA_RESP_ERR__MSG_TIMED_OUT:
+  case RD_KAFKA_RESP_ERR__TRANSPORT:
+  case RD_KAFKA_RESP_ERR__ALL_BROKERS_DOWN:
+    /* Brokers unreachable. Message can be delivered later */
+    up = 0;
+    if (0 == rb_spill_append(readOnlyGlobals.kafka.spill, rkmessage->payload,
+          rkmessage->len, (intptr_t)rkmessage->_private)) {
+      break;
+    }
+    /* Fallthrough */
+
+  default:
+    traceEvent(TRACE_ERROR, "Message delivery failed: %s\n",
+      rd_kafka_err2str(rkmessage->err));
+    break;
+  };
+
+  if (ATOMIC_LOAD_ACQUIRE(&kafka_brokers_up) != up) {
+    ATOMIC_STORE_RELEASE(&kafka_brokers_up, up);
+  }
+}
+
+/** Send a spilled message to kafka
+  @see rb_spill_replay_cb
+  */
+static int spill_replay_produce(void *buf, size_t len, uint64_t key,
+                                                                void *opaque) {
+  const struct rb_kafka_producer *producer = opaque;
+
+  /* Producer queue full: message stays in journal */
+  return rd_kafka_produce(producer->rkt, RD_KAFKA_PARTITION_UA,
+    RD_KAFKA_MSG_F_FREE, buf, len, NULL, 0, (void *)(intptr_t)key);
+}
+
+static void *spill_replayer_loop(void *vreplayer) {
+  struct rb_kafka_spill_replayer *replayer = vreplayer;
+
+  while (ATOMIC_LOAD_ACQUIRE(&replayer->run)) {
+    size_t replayed = 0;
+
+    rb_spill_sync(replayer->spill);
+
+    /* Failed deliveries would go back to the journal, wait for brokers */
+    if (ATOMIC_LOAD_ACQUIRE(&kafka_brokers_up) &&
+        rd_kafka_outq_len(replayer->producer->rk) < SPILL_REPLAY_MAX_OUTQ) {
+      replayed = rb_spill_replay(replayer->spill, SPILL_REPLAY_BATCH,
+        spill_replay_produce, replayer->producer);
+    }
+
+    if (0 == replayed) {
+      usleep(SPILL_REPLAY_IDLE_MS * 1000);
+    }
+  }
+
+  return NULL;
+}
+
+int rb_kafka_spill_replayer_start(struct rb_kafka_spill_replayer *replayer,
+    struct rb_kafka_producer *producer, struct rb_spill *spill) {
+  int rc;
+
+  replayer->producer = producer;
+  replayer->spill = spill;
+  replayer->run = 1;
+
+  rc = pthread_create(&replayer->thread, NULL, spill_replayer_loop, replayer);
+  if (unlikely(rc != 0)) {
+    traceEvent(TRACE_ERROR, "Can't create spill replayer thread: %s",
+      strerror(rc));
+    replayer->run = 0;
+  }
+
+  return rc;
+}
+
+void rb_kafka_spill_replayer_stop(struct rb_kafka_spill_replayer *replayer) {
+  ATOMIC_STORE_RELEASE(&replayer->run, 0);
+  pthread_join(replayer->thread, NULL);
+}
+
+/// Time to wait for room in kafka producer queue before retrying
+#define KAFKA_QUEUE_FULL_POLL_MS 100
+
+/** Account and log messages that can't be produced
+  @param err Produce error
+  @param n_msgs Number of messages dropped because of err
+  @param stats Stats to update. Can be NULL
+  */
+static void kafka_produce_dropped(rd_kafka_resp_err_t err, size_t n_msgs,
+                                                  struct worker_stats *stats) {
+  if (0 == n_msgs) {
+    return;
+  }
+
+  /* Only one log per batch and reason, not one per message */
+  traceEvent(TRACE_ERROR,"Cannot produce %zu messages: %s", n_msgs,
+    rd_kafka_err2str(err));
+
+  if (NULL == stats) {
+    return;
+  }
+
+  switch (err) {
+  case RD_KAFKA_RESP_ERR__QUEUE_FULL:
+    stats->num_kafka_dropped_queue_full += n_msgs;
+    break;
+  case RD_KAFKA_RESP_ERR_MSG_SIZE_TOO_LARGE:
+    stats->num_kafka_dropped_msg_size += n_msgs;
+    break;
+  default:
+    stats->num_kafka_dropped_other += n_msgs;
+    break;
+  };
+}
+
+/** Produce a batch of messages. Successfully enqueued messages payload is
+  owned by librdkafka after this call. If producer queue is full, it waits
+  for room up to readOnlyGlobals.kafka.queue_full_timeout_ms, so the worker
+  stops consuming packets and its queue pushes back on listeners. Messages
+  that still don't fit are saved in the spill journal, if any.
+  @param producer Producer
+  @param msgs Messages
+  @param nodes String list nodes of messages. Produced ones get their buffer
+  set to NULL
+  @param n_msgs Number of messages
+  @param stats Stats to update. Can be NULL
+  */
+static void kafka_produce_batch(const struct rb_kafka_producer *producer,
+    rd_kafka_message_t *msgs, struct string_list *const *nodes,
+    size_t n_msgs, struct worker_stats *stats) {
+  unsigned waited_ms = 0;
+  /* Messages still pending. nodes array is left untouched for the caller */
+  struct string_list *pending[RB_SINK_BATCH];
+
+  assert(n_msgs <= RB_SINK_BATCH);
+  memcpy(pending, nodes, n_msgs * sizeof(nodes[0]));
+
+  while (n_msgs > 0) {
+    size_t i, n_retry = 0, n_queue_full = 0, n_size = 0, n_other = 0;
+    rd_kafka_resp_err_t other_err = RD_KAFKA_RESP_ERR_NO_ERROR;
+    const bool can_wait = waited_ms < readOnlyGlobals.kafka.queue_full_timeout_ms;
+
+    /* Partitioner is run for each message, using its _private (msg_opaque) */
+    rd_kafka_produce_batch(producer->rkt, RD_KAFKA_PARTITION_UA,
+      RD_KAFKA_MSG_F_FREE, msgs, n_msgs);
+
+    for (i = 0; i < n_msgs; ++i) {
+      switch (msgs[i].err) {
+      case RD_KAFKA_RESP_ERR_NO_ERROR:
+        pending[i]->string->buf = NULL; /* librdkafka will free it */
+        if (waited_ms > 0 && stats) {
+          stats->num_kafka_delayed_msgs++;
+        }
+        break;
+
+      case RD_KAFKA_RESP_ERR__QUEUE_FULL:
+        if (can_wait) {
+          /* Keep it for the next round */
+          msgs[n_retry] = msgs[i];
+          msgs[n_retry].err = RD_KAFKA_RESP_ERR_NO_ERROR;
+          pending[n_retry++] = pending[i];
+        } else if (NULL == readOnlyGlobals.kafka.spill ||
+            0 != rb_spill_append(readOnlyGlobals.kafka.spill,
+              msgs[i].payload, msgs[i].len, (intptr_t)msgs[i]._private)) {
+          n_queue_full++;
+        }
+        break;
+
+      case RD_KAFKA_RESP_ERR_MSG_SIZE_TOO_LARGE:
+        n_size++;
+        break;
+
+      default:
+        other_err = msgs[i].err;
+        n_other++;
+        break;
+      };
+    }
+
+    kafka_produce_dropped(RD_KAFKA_RESP_ERR__QUEUE_FULL, n_queue_full, stats);
+    kafka_produce_dropped(RD_KAFKA_RESP_ERR_MSG_SIZE_TOO_LARGE, n_size, stats);
+    kafka_produce_dropped(other_err, n_other, stats);
+
+    if (n_retry > 0) {
+      /* Serve delivery reports, so librdkafka can free queue room */
+      rd_kafka_poll(producer->rk, KAFKA_QUEUE_FULL_POLL_MS);
+      waited_ms += KAFKA_QUEUE_FULL_POLL_MS;
+    }
+
+    n_msgs = n_retry;
+  }
+}
+
+/*
+ * KAFKA SINK
+ */
+
+/// Multi-flow messages of a kafka sink
+struct kafka_sink_batch {
+  pthread_mutex_t mutex;
+  /// Signaled to stop flusher
+  pthread_cond_t cond;
+  /// Thread that sends messages when their deadline arrives
+  pthread_t flusher;
+  int run;
+  struct rb_msg_batch *msgs;
+  unsigned max_delay_ms;
+};
+
+struct kafka_sink {
+  struct rb_sink sink;
+  const struct rb_kafka_producer *producer;
+  /// Multi-flow messages. NULL if every flow has its own message
+  struct kafka_sink_batch *batch;
+};
+
+/// Stats of multi-flow messages produced out of workers, i.e., by flusher
+/// threads or at sink shutdown. Updated atomically
+static struct worker_stats kafka_sink_stats;
+
+/** Add produce stats to kafka_sink_stats
+  @param stats Stats to add
+  */
+static void kafka_sink_stats_add(const struct worker_stats *stats) {
+  ATOMIC_OP(add, fetch, &kafka_sink_stats.num_kafka_delayed_msgs,
+    stats->num_kafka_delayed_msgs);
+  ATOMIC_OP(add, fetch, &kafka_sink_stats.num_kafka_dropped_queue_full,
+    stats->num_kafka_dropped_queue_full);
+  ATOMIC_OP(add, fetch, &kafka_sink_stats.num_kafka_dropped_msg_size,
+    stats->num_kafka_dropped_msg_size);
+  ATOMIC_OP(add, fetch, &kafka_sink_stats.num_kafka_dropped_other,
+    stats->num_kafka_dropped_other);
+}
+
+void rb_kafka_sink_sum_stats(struct worker_stats *stats) {
+  stats->num_kafka_delayed_msgs += ATOMIC_LOAD_ACQUIRE(
+    &kafka_sink_stats.num_kafka_delayed_msgs);
+  stats->num_kafka_dropped_queue_full += ATOMIC_LOAD_ACQUIRE(
+    &kafka_sink_stats.num_kafka_dropped_queue_full);
+  stats->num_kafka_dropped_msg_size += ATOMIC_LOAD_ACQUIRE(
+    &kafka_sink_stats.num_kafka_dropped_msg_size);
+  stats->num_kafka_dropped_other += ATOMIC_LOAD_ACQUIRE(
+    &kafka_sink_stats.num_kafka_dropped_other);
+}
+
+/// Current monotonic time, in milliseconds
+static uint64_t kafka_sink_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Key that groups flows in multi-flow messages. Flows with the same key go
+  to the same partition, so a message can carry them without breaking client
+  mac partitioning.
+  @param client_mac Flow client mac
+  @return Group key
+  */
+static uint64_t kafka_sink_batch_key(uint64_t client_mac) {
+  const int32_t partition_cnt = ATOMIC_LOAD_ACQUIRE(&kafka_partition_cnt);
+
+  if (!readOnlyGlobals.kafka.use_client_mac_partitioner || 0 == client_mac) {
+    /* Random partition */
+    return 0;
+  }
+
+  /* Until partitioner tells partitions count, group by client */
+  return 1 + (partition_cnt > 0 ? client_mac % partition_cnt : client_mac);
+}
+
+/** Prepare kafka messages of a string list nodes array
+  @param msgs Messages to fill
+  @param nodes String list nodes
+  @param n_msgs Number of messages
+  */
+static void kafka_sink_msgs_init(rd_kafka_message_t *msgs,
+    struct string_list *const *nodes, size_t n_msgs) {
+  size_t i;
+
+  for (i = 0; i < n_msgs; ++i) {
+    memset(&msgs[i], 0, sizeof(msgs[i]));
+    msgs[i].payload = nodes[i]->string->buf;
+    msgs[i].len = nodes[i]->string->bpos;
+    // WARN! if you change this behavior, you need to change the partitioner
+    // too.
+    msgs[i]._private = (void *)(intptr_t)nodes[i]->client_mac;
+  }
+}
+
+/** Produce and free a list of multi-flow messages
+  @param producer Producer
+  @param list Messages
+  @param stats Stats to update. Can be NULL
+  */
+static void kafka_sink_produce_list(const struct rb_kafka_producer *producer,
+    struct string_list *list, struct worker_stats *stats) {
+  while (list) {
+    rd_kafka_message_t msgs[RB_SINK_BATCH];
+    struct string_list *nodes[RB_SINK_BATCH];
+    size_t n_msgs = 0;
+
+    for (; list && n_msgs < RB_SINK_BATCH; list = list->next) {
+      nodes[n_msgs++] = list;
+    }
+
+    kafka_sink_msgs_init(msgs, nodes, n_msgs);
+    kafka_produce_batch(producer, msgs, nodes, n_msgs, stats);
+
+    nodes[n_msgs - 1]->next = NULL;
+    rb_msg_batch_list_free(nodes[0]);
+  }
+}
+
+static void kafka_sink_send(struct rb_sink *vsink,
+    struct string_list *const *nodes, size_t n_msgs,
+    struct worker_stats *stats) {
+  const struct kafka_sink *sink = (const struct kafka_sink *)vsink;
+  struct string_list *ready;
+  uint64_t keys[RB_SINK_BATCH];
+  size_t i;
+
+  if (NULL == sink->batch) {
+    rd_kafka_message_t msgs[RB_SINK_BATCH];
+    kafka_sink_msgs_init(msgs, nodes, n_msgs);
+    kafka_produce_batch(sink->producer, msgs, nodes, n_msgs, stats);
+    return;
+  }
+
+  for (i = 0; i < n_msgs; ++i) {
+    keys[i] = kafka_sink_batch_key(nodes[i]->client_mac);
+  }
+
+  pthread_mutex_lock(&sink->batch->mutex);
+  ready = rb_msg_batch_add(sink->batch->msgs, nodes, keys, n_msgs,
+    kafka_sink_now_ms());
+  pthread_mutex_unlock(&sink->batch->mutex);
+
+  /* Produce out of the lock, it could wait for room in producer queue */
+  kafka_sink_produce_list(sink->producer, ready, stats);
+}
+
+static void *kafka_sink_flusher(void *vsink) {
+  const struct kafka_sink *sink = vsink;
+  struct kafka_sink_batch *batch = sink->batch;
+
+  pthread_mutex_lock(&batch->mutex);
+  while (batch->run) {
+    const uint64_t now_ms = kafka_sink_now_ms();
+    uint64_t deadline_ms;
+    struct string_list *ready = rb_msg_batch_expired(batch->msgs, now_ms,
+      &deadline_ms);
+
+    if (ready) {
+      struct worker_stats stats = {0};
+
+      pthread_mutex_unlock(&batch->mutex);
+      kafka_sink_produce_list(sink->producer, ready, &stats);
+      kafka_sink_stats_add(&stats);
+      pthread_mutex_lock(&batch->mutex);
+      continue;
+    }
+
+    if (UINT64_MAX == deadline_ms) {
+      /* A message started now can't expire before this */
+      deadline_ms = now_ms + batch->max_delay_ms;
+    }
+
+    const struct timespec ts = {
+      .tv_sec = deadline_ms / 1000,
+      .tv_nsec = (deadline_ms % 1000) * 1000000,
+    };
+    pthread_cond_timedwait(&batch->cond, &batch->mutex, &ts);
+  }
+  pthread_mutex_unlock(&batch->mutex);
+
+  return NULL;
+}
+
+/** Free multi-flow messages resources
+  @param batch Multi-flow messages
+  */
+static void kafka_sink_batch_done(struct kafka_sink_batch *batch) {
+  rb_msg_batch_done(batch->msgs);
+  pthread_cond_destroy(&batch->cond);
+  pthread_mutex_destroy(&batch->mutex);
+  free(batch);
+}
+
+/** Start multi-flow messages of a sink
+  @param sink Sink
+  @param conf Multi-flow messages configuration
+  @return 0 if success, !0 in other case
+  */
+static int kafka_sink_batch_start(struct kafka_sink *sink,
+                                      const struct rb_msg_batch_conf *conf) {
+  pthread_condattr_t cond_attr;
+  int rc;
+
+  sink->batch = calloc(1, sizeof(*sink->batch));
+  if (NULL == sink->batch) {
+    traceEvent(TRACE_ERROR, "Can't allocate sink batch (out of memory?)");
+    return -1;
+  }
+
+  sink->batch->msgs = rb_msg_batch_new(conf);
+  if (NULL == sink->batch->msgs) {
+    free(sink->batch);
+    sink->batch = NULL;
+    return -1;
+  }
+
+  /* Deadlines are monotonic */
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&sink->batch->cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+  pthread_mutex_init(&sink->batch->mutex, NULL);
+  sink->batch->max_delay_ms = conf->max_delay_ms;
+  sink->batch->run = 1;
+
+  rc = pthread_create(&sink->batch->flusher, NULL, kafka_sink_flusher, sink);
+  if (0 != rc) {
+    traceEvent(TRACE_ERROR, "Can't create sink flusher thread: %s",
+      strerror(rc));
+    kafka_sink_batch_done(sink->batch);
+    sink->batch = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+static void kafka_sink_poll(struct rb_sink *vsink, int timeout_ms) {
+  const struct kafka_sink *sink = (const struct kafka_sink *)vsink;
+  rd_kafka_poll(sink->producer->rk, timeout_ms);
+}
+
+static void kafka_sink_done(struct rb_sink *vsink) {
+  struct kafka_sink *sink = (struct kafka_sink *)vsink;
+
+  if (sink->batch) {
+    pthread_mutex_lock(&sink->batch->mutex);
+    sink->batch->run = 0;
+    pthread_cond_signal(&sink->batch->cond);
+    pthread_mutex_unlock(&sink->batch->mutex);
+    pthread_join(sink->batch->flusher, NULL);
+
+    struct worker_stats stats = {0};
+    kafka_sink_produce_list(sink->producer,
+      rb_msg_batch_flush(sink->batch->msgs), &stats);
+    kafka_sink_stats_add(&stats);
+    kafka_sink_batch_done(sink->batch);
+  }
+
+  /* Producer is flushed and destroyed by its owner */
+  free(sink);
+}
+
+struct rb_sink *rb_sink_kafka_new(const struct rb_kafka_producer *producer,
+                                  const struct rb_msg_batch_conf *batch_conf) {
+  static const struct rb_sink_ops kafka_sink_ops = {
+    .send = kafka_sink_send,
+    .poll = kafka_sink_poll,
+    .done = kafka_sink_done,
+  };
+
+  struct kafka_sink *sink = calloc(1, sizeof(*sink));
+  if (NULL == sink) {
+    traceEvent(TRACE_ERROR, "Can't allocate sink (out of memory?)");
+    return NULL;
+  }
+
+  sink->sink.ops = &kafka_sink_ops;
+  sink->producer = producer;
+
+  if (batch_conf && batch_conf->max_msgs > 1 &&
+      0 != kafka_sink_batch_start(sink, batch_conf)) {
+    free(sink);
+    return NULL;
+  }
+
+  return &sink->sink;
+}
+
 #endif
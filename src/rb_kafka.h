@@ -23,7 +23,11 @@
 
 #ifdef HAVE_LIBRDKAFKA
 
+#include "rb_msg_batch.h"
+#include "rb_spill.h"
+
 #include <librdkafka/rdkafka.h>
+#include <pthread.h>
 
 int32_t rb_client_mac_partitioner (const rd_kafka_topic_t *rkt,
 					 const void *key, size_t keylen,
@@ -44,4 +48,75 @@ void msg_delivered (rd_kafka_t *rk,
 void parse_kafka_config(rd_kafka_conf_t *rk_conf,rd_kafka_topic_conf_t *rkt_conf,
                                const char *option);
 
+/// Kafka producer and flows topic
+struct rb_kafka_producer {
+  rd_kafka_t *rk;
+  rd_kafka_topic_t *rkt;
+};
+
+/** Creates a kafka producer
+  @param producer Producer to initialize
+  @param rk_conf Producer configuration. Producer takes ownership of it
+  @param topic Flows topic
+  @param rkt_conf Topic configuration. Producer takes ownership of it
+  @return 0 if success, !0 in other case
+  */
+int rb_kafka_producer_init(struct rb_kafka_producer *producer,
+  rd_kafka_conf_t *rk_conf, const char *topic,
+  rd_kafka_topic_conf_t *rkt_conf);
+
+/** Waits for producer pending messages and destroy it
+  @param producer Producer
+  */
+void rb_kafka_producer_done(struct rb_kafka_producer *producer);
+
+/**
+* Message delivery report callback that saves in readOnlyGlobals.kafka.spill
+* the messages that could not be delivered because brokers were unreachable.
+*/
+void rb_kafka_spill_msg_delivered(rd_kafka_t *rk,
+  const rd_kafka_message_t *rkmessage, void *opaque);
+
+/// Background thread that sends spilled messages back to kafka
+struct rb_kafka_spill_replayer {
+  pthread_t thread;
+  struct rb_kafka_producer *producer;
+  struct rb_spill *spill;
+  int run;
+};
+
+/** Start replaying spilled messages
+  @param replayer Replayer to start
+  @param producer Producer to send messages
+  @param spill Spill journal
+  @return 0 if success, !0 in other case
+  */
+int rb_kafka_spill_replayer_start(struct rb_kafka_spill_replayer *replayer,
+  struct rb_kafka_producer *producer, struct rb_spill *spill);
+
+/** Stop replaying spilled messages. Not replayed ones stay in the journal
+  @param replayer Replayer
+  */
+void rb_kafka_spill_replayer_stop(struct rb_kafka_spill_replayer *replayer);
+
+struct rb_sink;
+
+/** Sink that sends messages through a kafka producer
+  @param producer Producer. It must outlive the sink
+  @param batch_conf Pack many flows in each message, grouped by partition.
+  NULL (or less than 2 max_msgs) to send one flow per message
+  @return New sink, or NULL in case of error
+  */
+struct rb_sink *rb_sink_kafka_new(const struct rb_kafka_producer *producer,
+                                  const struct rb_msg_batch_conf *batch_conf);
+
+struct worker_stats;
+
+/** Add to stats the kafka counters of multi-flow messages that are not sent
+  by workers, but by sinks flusher threads when their deadline arrives, or
+  when sinks are freed. They are not accounted in any worker stats.
+  @param stats Stats to add counters to
+  */
+void rb_kafka_sink_sum_stats(struct worker_stats *stats);
+
 #endif
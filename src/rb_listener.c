@@ -19,6 +19,7 @@
 
 #include "rb_listener.h"
 #include "rb_sensor.h"
+#include "rb_packet_pool.h"
 
 #include "f2k.h"
 #include "util.h"
@@ -29,6 +30,28 @@
 
 #define PORT_COLLECTOR_MAGIC 0xE0A1CL
 
+/// Receive batches statistics, so batch size can be tuned
+struct listener_batch_stats {
+  atomic_uint64_t recv_calls;     ///< Number of receive syscalls done
+  atomic_uint64_t datagrams;      ///< Number of datagrams received
+  atomic_uint64_t full_batches;   ///< Batches that filled all slots
+  /// Datagrams dropped because they did not fit in receive buffers
+  atomic_uint64_t truncated_drops;
+};
+
+struct port_collector;
+
+/// Listener thread, with its own (SO_REUSEPORT) socket
+struct listener_thread {
+  struct port_collector *collector;
+  size_t idx;       ///< Thread index inside collector
+  int socket;
+  bool running;     ///< Thread has been created
+  pthread_t thread;
+  struct packet_pool *pool; ///< Received packets buffers
+  struct sensor_cache *sensor_cache; ///< Exporter to sensor cache
+};
+
 struct port_collector{
 #ifdef PORT_COLLECTOR_MAGIC
   uint64_t magic;
@@ -37,8 +60,9 @@ struct port_collector{
   int run;
   enum transport_proto proto;
   uint16_t port;
-  pthread_t listener;
-  int socket;
+  size_t num_threads;
+  struct listener_thread *threads;
+  struct listener_batch_stats batch_stats;
   TAILQ_ENTRY(port_collector) list_entry;
 };
 
@@ -54,121 +78,582 @@ void listener_list_append(listener_list *l1, struct port_collector *collector) {
 #define listener_list_remove(head,elm) TAILQ_REMOVE(head,elm,list_entry)
 #define listener_list_concat(list1,list2) TAILQ_CONCAT(list1,list2,list_entry)
 
-static void* netFlowCollectLoop0(struct port_collector *collector) {
-  QueuedPacket *qpacket=NULL;
-  static const size_t allocated_buffer_len = NETFLOW_BUFFER_LEN- sizeof(*qpacket);
+/// Datagrams are received straight in pooled buffers of this size. Typical
+/// NetFlow datagrams fit in a small one, bigger ones are moved to a medium or
+/// jumbo buffer
+#define LISTENER_RECV_BUFFER_LEN PACKET_POOL_SMALL_BUFFER_LEN
+/// Receive overflow buffer size, so the biggest datagram always fits
+#define LISTENER_OVERFLOW_BUFFER_LEN \
+  (PACKET_POOL_MAX_BUFFER_LEN - LISTENER_RECV_BUFFER_LEN)
+
+/** Prepare a received datagram to be handed to its sensor's worker
+  @param lthread Listener thread that received the datagram
+  @param qpacket Pooled packet the datagram was received in
+  @param received Datagram length
+  @param overflow Datagram bytes that did not fit in qpacket buffer, if
+  received > LISTENER_RECV_BUFFER_LEN
+  @param netflow_device_ip Exporter address (host byte order)
+  @return Packet to hand to the worker: qpacket itself, or a bigger one if the
+  datagram did not fit in it. NULL if the datagram must be discarded, and
+  qpacket can receive the next one.
+  */
+static QueuedPacket *prepare_received_packet(struct listener_thread *lthread,
+    QueuedPacket *qpacket, const size_t received, const uint8_t *overflow,
+    const uint32_t netflow_device_ip) {
+  const struct port_collector *collector = lthread->collector;
+#ifdef DEBUG_FLOWS
+  if(unlikely(readOnlyGlobals.enable_debug))
+    traceEvent(TRACE_INFO,
+      "NETFLOW_DEBUG: Received sFlow/NetFlow packet(len=%zu)",
+      received);
+#endif
+  sensor_t *sensor = sensor_cache_get_sensor(lthread->sensor_cache,
+    readOnlyGlobals.rb_databases.sensors_info, netflow_device_ip);
+  if(NULL==sensor) {
+    const size_t bufsize = 1024;
+    char buf[bufsize];
+    const int bad_sensor_added = addBadSensor(
+    readOnlyGlobals.rb_databases.sensors_info, netflow_device_ip);
+    if(bad_sensor_added) {
+      traceEvent(TRACE_WARNING,
+        "Received a packet from the unknow sensor %s on port %u.",
+                  _intoaV4(netflow_device_ip,buf,bufsize),
+                  collector->port);
+    }
+    return NULL;
+  }
+
+  if (unlikely(received > LISTENER_RECV_BUFFER_LEN)) {
+    /* Rare: Move it to a buffer big enough */
+    QueuedPacket *big_packet = packet_pool_get(lthread->pool, received);
+    if (unlikely(NULL == big_packet)) {
+      return NULL;
+    }
+
+    memcpy(big_packet->buffer, qpacket->buffer, LISTENER_RECV_BUFFER_LEN);
+    memcpy(&big_packet->buffer[LISTENER_RECV_BUFFER_LEN], overflow,
+      received - LISTENER_RECV_BUFFER_LEN);
+    qpacket = big_packet;
+  }
+
+  qpacket->buffer_len = received;
+  qpacket->netflow_device_ip = netflow_device_ip;
+  qpacket->sensor = sensor;
+  return qpacket;
+}
+
+/// Wait for listener socket to have data to read
+static void wait_for_packets(int socket) {
+  fd_set netflowMask;
+  FD_ZERO(&netflowMask);
+  FD_SET(socket, &netflowMask);
+  struct timeval tv = {.tv_sec=0,.tv_usec=500000};
+
+  select(socket+1, &netflowMask, NULL, NULL, &tv);
+}
+
+/// Listener thread has to keep running
+static bool listener_running(struct port_collector *collector) {
+  return !readWriteGlobals->shutdownInProgress &&
+    0 != ATOMIC_OP(fetch,add,&collector->run,0);
+}
+
+static void update_batch_stats(struct port_collector *collector,
+    const size_t received, const size_t batch_size) {
+  struct listener_batch_stats *stats = &collector->batch_stats;
+  ATOMIC_OP(add,fetch,&stats->recv_calls.value,1);
+  ATOMIC_OP(add,fetch,&stats->datagrams.value,received);
+  if (received == batch_size) {
+    ATOMIC_OP(add,fetch,&stats->full_batches.value,1);
+  }
+}
+
+static void print_batch_stats(struct port_collector *collector) {
+  struct listener_batch_stats *stats = &collector->batch_stats;
+  const uint64_t recv_calls = ATOMIC_OP(fetch,add,&stats->recv_calls.value,0);
+  const uint64_t datagrams = ATOMIC_OP(fetch,add,&stats->datagrams.value,0);
+  const uint64_t full_batches = ATOMIC_OP(fetch,add,
+    &stats->full_batches.value,0);
+  const uint64_t truncated_drops = ATOMIC_OP(fetch,add,
+    &stats->truncated_drops.value,0);
+
+  if (0 == recv_calls || readOnlyGlobals.listener_batch_size <= 1) {
+    if (truncated_drops > 0) {
+      traceEvent(TRACE_NORMAL, "[port %u] Truncated drops: %"PRIu64,
+        collector->port, truncated_drops);
+    }
+    return;
+  }
+
+  traceEvent(TRACE_NORMAL, "[port %u] Receive batches: [calls: %"PRIu64"]"
+    "[datagrams: %"PRIu64" (%.2lf/call, batch size %zu)]"
+    "[full batches: %"PRIu64"][truncated drops: %"PRIu64"]",
+    collector->port, recv_calls, datagrams, (double)datagrams/recv_calls,
+    readOnlyGlobals.listener_batch_size, full_batches, truncated_drops);
+}
+
+/** Get a pooled packet to receive a datagram in, waiting for memory if
+  needed
+  @param lthread Listener thread
+  @return New packet, or NULL if listener has to stop
+  */
+static QueuedPacket *listener_recv_packet(struct listener_thread *lthread) {
+  while (listener_running(lthread->collector)) {
+    QueuedPacket *qpacket = packet_pool_get(lthread->pool,
+      LISTENER_RECV_BUFFER_LEN);
+    if (likely(NULL != qpacket)) {
+      return qpacket;
+    }
+
+    sleep(1);
+  }
+
+  return NULL;
+}
+
+static void* netFlowCollectLoop0(struct listener_thread *lthread) {
+  struct port_collector *collector = lthread->collector;
+  QueuedPacket *qpacket = NULL;
   struct sockaddr_in fromHostV4;
   memset(&fromHostV4,0,sizeof(fromHostV4));
 
+  uint8_t *overflow = malloc(LISTENER_OVERFLOW_BUFFER_LEN);
+  if (NULL == overflow) {
+    traceEvent(TRACE_ERROR, "Can't allocate port %u receive buffer",
+      collector->port);
+    return NULL;
+  }
+
   /* traceEvent(TRACE_NORMAL, "netFlowMainLoop(%u) thread...", thread_id); */
   readOnlyGlobals.datalink = DLT_EN10MB;
 
-  while(!readWriteGlobals->shutdownInProgress) {
-    socklen_t socklen = sizeof(fromHostV4);
-    if(NULL==qpacket){
-        qpacket = newQueuedPacket(allocated_buffer_len);
+  while(listener_running(collector)) {
+    if (NULL == qpacket) {
+      qpacket = listener_recv_packet(lthread);
+      if (NULL == qpacket) {
+        break;
+      }
     }
 
-    errno = 0;
-    qpacket->buffer_len = recvfrom(collector->socket,
-                      qpacket->buffer, allocated_buffer_len,
-                      0, (struct sockaddr*)&fromHostV4, &socklen);
+    struct iovec iov[2] = {
+      {.iov_base = qpacket->buffer, .iov_len = LISTENER_RECV_BUFFER_LEN},
+      {.iov_base = overflow, .iov_len = LISTENER_OVERFLOW_BUFFER_LEN},
+    };
+    struct msghdr msg = {
+      .msg_name = &fromHostV4, .msg_namelen = sizeof(fromHostV4),
+      .msg_iov = iov, .msg_iovlen = 2,
+    };
 
-    if(qpacket->buffer_len < 0 && errno != EAGAIN){
-      traceEvent(TRACE_ERROR,"Error in recvfrom: %s",strerror(errno));
-    } else if(qpacket->buffer_len > 0){
-#ifdef DEBUG_FLOWS
-      if(unlikely(readOnlyGlobals.enable_debug))
-        traceEvent(TRACE_INFO,
-          "NETFLOW_DEBUG: Received sFlow/NetFlow packet(len=%d)",
-          qpacket->buffer_len);
-#endif
-      qpacket->netflow_device_ip = ntohl(fromHostV4.sin_addr.s_addr);
-      qpacket->sensor = get_sensor(
-        readOnlyGlobals.rb_databases.sensors_info, qpacket->netflow_device_ip);
-      if(NULL==qpacket->sensor) {
-        const size_t bufsize = 1024;
-        char buf[bufsize];
-        const int bad_sensor_added = addBadSensor(
-        readOnlyGlobals.rb_databases.sensors_info, qpacket->netflow_device_ip);
-        if(bad_sensor_added) {
-          traceEvent(TRACE_WARNING,
-            "Received a packet from the unknow sensor %s on port %u.",
-                      _intoaV4(qpacket->netflow_device_ip,buf,bufsize),
-                      collector->port);
+    errno = 0;
+    const ssize_t received = recvmsg(lthread->socket, &msg, 0);
+
+    if(received < 0 && errno != EAGAIN){
+      traceEvent(TRACE_ERROR,"Error in recvmsg: %s",strerror(errno));
+    } else if(unlikely(received > 0 && (msg.msg_flags & MSG_TRUNC))) {
+      ATOMIC_OP(add,fetch,&collector->batch_stats.truncated_drops.value,1);
+    } else if(received > 0){
+      QueuedPacket *ready = prepare_received_packet(lthread, qpacket,
+        received, overflow, ntohl(fromHostV4.sin_addr.s_addr));
+      if (ready) {
+        add_packet_to_worker(ready, sensor_worker(ready->sensor));
+        if (ready == qpacket) {
+          qpacket = NULL;
         }
-      } else {
-        worker_t *worker = sensor_worker(qpacket->sensor);
-        add_packet_to_worker(qpacket, worker);
-        qpacket = NULL;
       }
     } else {
       /* EAGAIN. Let's poll */
-      fd_set netflowMask;
-      FD_ZERO(&netflowMask);
-      FD_SET(collector->socket, &netflowMask);
-      struct timeval tv = {.tv_sec=0,.tv_usec=500000};
-
-      select(collector->socket+1, &netflowMask, NULL, NULL, &tv);
+      wait_for_packets(lthread->socket);
     }
   }
 
+  if (qpacket) {
+    freeQueuedPacket(qpacket);
+  }
+  free(overflow);
   return(NULL);
 }
 
-static void *netFlowCollectLoop(void* _port_collector) {
-  struct port_collector *collector = _port_collector;
+#ifdef HAVE_RECVMMSG
+
+/// Pre-registered recvmmsg buffers
+struct listener_batch {
+  size_t size;
+  /// Slots packets. Every slot receives in its packet buffer, and the part
+  /// of the datagram that does not fit goes to the slot overflow buffer.
+  QueuedPacket **packets;
+  struct mmsghdr *msgs;
+  struct iovec *iovecs; ///< Two per slot: packet buffer and overflow
+  struct sockaddr_in *addrs;
+  /// LISTENER_OVERFLOW_BUFFER_LEN bytes per slot. It is big enough to be
+  /// mmap-ed by calloc, so only pages of actually oversized datagrams are
+  /// backed by memory
+  uint8_t *overflow;
+
+  /* Packets of the last call ready to hand to workers */
+  QueuedPacket **ready;     ///< Packets, in arrival order
+  worker_t **ready_workers; ///< Worker of each ready packet
+  QueuedPacket **group;     ///< Same worker packets scratch
+};
+
+/// Overflow buffer of slot i
+static uint8_t *listener_batch_overflow(const struct listener_batch *batch,
+    size_t i) {
+  return &batch->overflow[i * LISTENER_OVERFLOW_BUFFER_LEN];
+}
+
+/** Prepare slot i of the batch for the next recvmmsg call, taking a new
+  packet from the pool if the previous one was handed to a worker.
+  @param lthread Listener thread
+  @param batch Batch
+  @param i Slot index
+  @return 0 on success, -1 if listener has to stop
+  */
+static int listener_batch_register_packet(struct listener_thread *lthread,
+    struct listener_batch *batch, size_t i) {
+  if (NULL == batch->packets[i]) {
+    batch->packets[i] = listener_recv_packet(lthread);
+    if (unlikely(NULL == batch->packets[i])) {
+      return -1;
+    }
+  }
+
+  struct iovec *iov = &batch->iovecs[2*i];
+  iov[0].iov_base = batch->packets[i]->buffer;
+  iov[0].iov_len = LISTENER_RECV_BUFFER_LEN;
+  iov[1].iov_base = listener_batch_overflow(batch, i);
+  iov[1].iov_len = LISTENER_OVERFLOW_BUFFER_LEN;
+
+  memset(&batch->msgs[i], 0, sizeof(batch->msgs[i]));
+  batch->msgs[i].msg_hdr.msg_iov = iov;
+  batch->msgs[i].msg_hdr.msg_iovlen = 2;
+  batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+  batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+  return 0;
+}
+
+static void listener_batch_done(struct listener_batch *batch) {
+  size_t i;
+  for (i=0; batch->packets && i<batch->size; ++i) {
+    if (batch->packets[i]) {
+      freeQueuedPacket(batch->packets[i]);
+    }
+  }
+
+  free(batch->packets);
+  free(batch->msgs);
+  free(batch->iovecs);
+  free(batch->addrs);
+  free(batch->overflow);
+  free(batch->ready);
+  free(batch->ready_workers);
+  free(batch->group);
+}
+
+static int listener_batch_init(struct listener_thread *lthread,
+    struct listener_batch *batch, size_t size) {
+  size_t i;
+
+  batch->size = size;
+  batch->packets = calloc(size, sizeof(batch->packets[0]));
+  batch->msgs = calloc(size, sizeof(batch->msgs[0]));
+  batch->iovecs = calloc(2*size, sizeof(batch->iovecs[0]));
+  batch->addrs = calloc(size, sizeof(batch->addrs[0]));
+  batch->overflow = calloc(size, LISTENER_OVERFLOW_BUFFER_LEN);
+  batch->ready = calloc(size, sizeof(batch->ready[0]));
+  batch->ready_workers = calloc(size, sizeof(batch->ready_workers[0]));
+  batch->group = calloc(size, sizeof(batch->group[0]));
+
+  if (unlikely(!batch->packets || !batch->msgs || !batch->iovecs ||
+                                          !batch->addrs || !batch->overflow ||
+                     !batch->ready || !batch->ready_workers || !batch->group)) {
+    traceEvent(TRACE_ERROR, "Can't allocate receive batch (out of memory?)");
+    goto err;
+  }
+
+  for (i=0; i<size; ++i) {
+    if (0 != listener_batch_register_packet(lthread, batch, i)) {
+      goto err;
+    }
+  }
+
+  return 0;
+
+err:
+  listener_batch_done(batch);
+  return -1;
+}
+
+/** Hand ready packets of a batch to their workers, with only one queue
+  operation per worker. Every worker receives its packets in arrival order.
+  @param batch Batch
+  @param n_ready Number of ready packets
+  */
+static void listener_batch_push_ready(struct listener_batch *batch,
+    size_t n_ready) {
+  size_t i, j;
+
+  for (i=0; i<n_ready; ++i) {
+    worker_t *worker = batch->ready_workers[i];
+    size_t n_group = 0;
+    if (NULL == worker) {
+      /* Already pushed with a previous packet's group */
+      continue;
+    }
+
+    for (j=i; j<n_ready; ++j) {
+      if (batch->ready_workers[j] == worker) {
+        batch->group[n_group++] = batch->ready[j];
+        batch->ready_workers[j] = NULL;
+      }
+    }
+
+    add_packets_to_worker(batch->group, n_group, worker);
+  }
+}
+
+/** Collect loop using recvmmsg, so many datagrams are received in the same
+  syscall, straight in the packets handed to workers.
+  @param lthread Listener thread
+  @return NULL
+  */
+static void *netFlowCollectLoopBatch(struct listener_thread *lthread) {
+  struct port_collector *collector = lthread->collector;
+  const size_t batch_size = readOnlyGlobals.listener_batch_size;
+  struct listener_batch batch;
+  size_t i;
+
+  if (0 != listener_batch_init(lthread, &batch, batch_size)) {
+    traceEvent(TRACE_WARNING,
+      "Can't use receive batches on port %u, falling back to recvmsg",
+      collector->port);
+    return netFlowCollectLoop0(lthread);
+  }
+
+  readOnlyGlobals.datalink = DLT_EN10MB;
+
+  while(listener_running(collector)) {
+    errno = 0;
+    const int received = recvmmsg(lthread->socket, batch.msgs, batch.size,
+      MSG_WAITFORONE, NULL);
+
+    if (received < 0 && errno != EAGAIN && errno != EINTR) {
+      traceEvent(TRACE_ERROR,"Error in recvmmsg: %s",strerror(errno));
+      continue;
+    } else if (received <= 0) {
+      /* EAGAIN. Let's poll */
+      wait_for_packets(lthread->socket);
+      continue;
+    }
+
+    update_batch_stats(collector, received, batch.size);
+
+    size_t n_ready = 0;
+    for (i=0; i<(size_t)received; ++i) {
+      const size_t msg_len = batch.msgs[i].msg_len;
+      if (0 == msg_len) {
+        continue;
+      }
+
+      if (unlikely(batch.msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+        ATOMIC_OP(add,fetch,
+          &collector->batch_stats.truncated_drops.value,1);
+        continue;
+      }
+
+      QueuedPacket *ready = prepare_received_packet(lthread, batch.packets[i],
+        msg_len, listener_batch_overflow(&batch, i),
+        ntohl(batch.addrs[i].sin_addr.s_addr));
+      if (ready) {
+        batch.ready[n_ready] = ready;
+        batch.ready_workers[n_ready] = sensor_worker(ready->sensor);
+        n_ready++;
+        if (ready == batch.packets[i]) {
+          batch.packets[i] = NULL;
+        }
+      }
+    }
+
+    listener_batch_push_ready(&batch, n_ready);
+
+    /* Only used slots need to be prepared again */
+    for (i=0; i<(size_t)received; ++i) {
+      if (0 != listener_batch_register_packet(lthread, &batch, i)) {
+        break;
+      }
+    }
+  }
+
+  listener_batch_done(&batch);
+  return NULL;
+}
+
+#endif /* HAVE_RECVMMSG */
+
+/// Bind listener thread to its configured CPU, if any
+static void pin_listener_thread(const struct listener_thread *lthread) {
+#ifdef linux
+  const size_t num_cpus = readOnlyGlobals.listener_cpus.len;
+  if (0 == num_cpus) {
+    return;
+  }
+
+  const int cpu = readOnlyGlobals.listener_cpus.cpus[lthread->idx % num_cpus];
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(cpu, &cpuset);
+
+  const int rc = pthread_setaffinity_np(lthread->thread, sizeof(cpuset),
+                                                                      &cpuset);
+  if (rc != 0) {
+    traceEvent(TRACE_WARNING,
+      "Can't bind port %u listener %zu to CPU %d: errno=%d",
+      lthread->collector->port, lthread->idx, cpu, rc);
+  }
+#else
+  (void)lthread;
+#endif
+}
+
+static void *netFlowCollectLoop(void* _listener_thread) {
+  struct listener_thread *lthread = _listener_thread;
 
   #ifdef PORT_COLLECTOR_MAGIC
-  assert(collector->magic == PORT_COLLECTOR_MAGIC);
+  assert(lthread->collector->magic == PORT_COLLECTOR_MAGIC);
   #endif
 
-  netFlowCollectLoop0(collector);
+  pin_listener_thread(lthread);
+
+  lthread->pool = new_packet_pool(readOnlyGlobals.packet_pool.max_buffers,
+    readOnlyGlobals.packet_pool.max_jumbo_buffers);
+  lthread->sensor_cache = new_sensor_cache(SENSOR_CACHE_DEFAULT_SIZE);
+  if (NULL == lthread->pool || NULL == lthread->sensor_cache) {
+    traceEvent(TRACE_ERROR, "Can't create port %u listener %zu caches",
+      lthread->collector->port, lthread->idx);
+    if (lthread->pool) {
+      packet_pool_done(lthread->pool);
+      lthread->pool = NULL;
+    }
+    sensor_cache_done(lthread->sensor_cache);
+    lthread->sensor_cache = NULL;
+    return NULL;
+  }
+
+#ifdef HAVE_RECVMMSG
+  if (readOnlyGlobals.listener_batch_size > 1) {
+    netFlowCollectLoopBatch(lthread);
+  } else
+#endif
+  netFlowCollectLoop0(lthread);
+
+  char pool_name[sizeof("port 65535 listener 18446744073709551615")];
+  snprintf(pool_name, sizeof(pool_name), "port %u listener %zu",
+    lthread->collector->port, lthread->idx);
+  packet_pool_print_stats(lthread->pool, pool_name);
+  packet_pool_done(lthread->pool);
+  lthread->pool = NULL;
+  sensor_cache_done(lthread->sensor_cache);
+  lthread->sensor_cache = NULL;
+
   return NULL;
 }
 
+/** Stop collector listener threads and close its sockets
+  @param collector Collector
+  */
+static void stopListenerThreads(struct port_collector *collector) {
+  size_t i;
+
+  ATOMIC_OP(fetch,and,&collector->run,0);
+
+  /* Wake up threads blocked in recv */
+  for (i=0; i<collector->num_threads; ++i) {
+    if (collector->threads[i].socket >= 0) {
+      shutdown(collector->threads[i].socket, SHUT_RDWR);
+    }
+  }
+
+  for (i=0; i<collector->num_threads; ++i) {
+    struct listener_thread *lthread = &collector->threads[i];
+    if (lthread->running) {
+      pthread_join(lthread->thread, NULL);
+      lthread->running = false;
+    }
+
+    if (lthread->socket >= 0) {
+      close(lthread->socket);
+      lthread->socket = -1;
+    }
+  }
+}
+
 void closeNetFlowListener(struct port_collector *collector) {
   assert(collector);
 
-  if(collector->socket > 0){
+  if(collector->num_threads > 0 && collector->threads[0].socket >= 0){
     traceEvent(TRACE_NORMAL,"Closing socket UPD port %u",collector->port);
-    close(collector->socket);
+    stopListenerThreads(collector);
+    print_batch_stats(collector);
   }
+  free(collector->threads);
   free(collector);
 }
 
-static int wakeUpListener(struct port_collector *listener) {
+/** Open and bind a listener socket
+  @param collector Collector
+  @return Socket, or -1 in case of error
+  */
+static int openListenerSocket(const struct port_collector *collector) {
   char errbuf[BUFSIZ];
   int sockopt = 1;
+  int sock = -1;
   struct sockaddr_in sockInV4;
-  traceEvent(TRACE_NORMAL,"Creating listening socket in port %d",listener->port);
 
   errno = 0;
-  switch(listener->proto){
+  switch(collector->proto){
   case UDP:
-    listener->socket = socket(AF_INET, SOCK_DGRAM, 0);
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
     break;
   default:
-    traceEvent(TRACE_ERROR,"Unknown protocol %d, can't create socket",listener->proto);
-    goto free_listener;
+    traceEvent(TRACE_ERROR,"Unknown protocol %d, can't create socket",
+      collector->proto);
+    return -1;
   };
 
-  if( listener->socket < 0 ) {
+  if( sock < 0 ) {
     const int _errno = errno;
     strerror_r(_errno,errbuf,sizeof(errbuf));
     traceEvent(TRACE_INFO, "Unable to create a UDPv4 socket - returned %d, error is '%s'(%d)",
-        listener->socket, errbuf, _errno);
-    goto free_listener;
+        sock, errbuf, _errno);
+    return -1;
   }
 
-  maximize_socket_buffer(listener->socket, SO_RCVBUF);
+  maximize_socket_buffer(sock, SO_RCVBUF);
+
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&sockopt, sizeof(sockopt));
 
-  setsockopt(listener->socket, SOL_SOCKET, SO_REUSEADDR, (char *)&sockopt, sizeof(sockopt));
+  if (collector->num_threads > 1) {
+#ifdef SO_REUSEPORT
+    /* Kernel will spread exporters between all port sockets */
+    if (0 != setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char *)&sockopt,
+                                                            sizeof(sockopt))) {
+      strerror_r(errno,errbuf,sizeof(errbuf));
+      traceEvent(TRACE_ERROR, "Can't set SO_REUSEPORT in port %u: %s",
+        collector->port, errbuf);
+      close(sock);
+      return -1;
+    }
+#else
+    traceEvent(TRACE_ERROR, "SO_REUSEPORT not available, can't open %zu "
+      "sockets in port %u", collector->num_threads, collector->port);
+    close(sock);
+    return -1;
+#endif
+  }
 
   sockInV4.sin_family            = AF_INET;
-  sockInV4.sin_port              = (int)htons(listener->port);
+  sockInV4.sin_port              = (int)htons(collector->port);
   sockInV4.sin_addr.s_addr       = INADDR_ANY;
-  const int bind_rc = bind(listener->socket,
+  const int bind_rc = bind(sock,
     (struct sockaddr *)&sockInV4, sizeof(sockInV4));
 
   if(bind_rc < 0) {
@@ -176,24 +661,60 @@ static int wakeUpListener(struct port_collector *listener) {
     strerror_r(_errno,errbuf,sizeof(errbuf));
     traceEvent(TRACE_ERROR,
       "Flow listener UDP port %d already in use ? [%s/%d]",
-      listener->port, errbuf, _errno);
-    goto close_socket;
+      collector->port, errbuf, _errno);
+    close(sock);
+    return -1;
   }
 
-  if(listener->socket > 0)
-    pthread_create(&listener->listener, NULL, netFlowCollectLoop, listener);
+  return sock;
+}
 
-  return 0;
+static int wakeUpListener(struct port_collector *listener) {
+  size_t i;
+
+  if (listener->threads[0].socket >= 0) {
+    /* Already listening */
+    return 0;
+  }
+
+  traceEvent(TRACE_NORMAL,"Creating %zu listening socket(s) in port %d",
+    listener->num_threads, listener->port);
+
+  /* All sockets must be bound before start to receive, so the kernel knows
+     the full SO_REUSEPORT group */
+  for (i=0; i<listener->num_threads; ++i) {
+    listener->threads[i].socket = openListenerSocket(listener);
+    if (listener->threads[i].socket < 0) {
+      goto err;
+    }
+  }
 
-close_socket:
-  closeNetFlowListener(listener);
-  listener = NULL;
+  ATOMIC_OP(fetch,or,&listener->run,1);
+  for (i=0; i<listener->num_threads; ++i) {
+    struct listener_thread *lthread = &listener->threads[i];
+    const int rc = pthread_create(&lthread->thread, NULL, netFlowCollectLoop,
+                                                                      lthread);
+    if (rc != 0) {
+      traceEvent(TRACE_ERROR, "Can't create port %u listener thread: %s",
+        listener->port, strerror(rc));
+      goto err;
+    }
+    lthread->running = true;
+  }
 
-free_listener:
-  free(listener);
+  return 0;
+
+err:
+  stopListenerThreads(listener);
   return -1;
 }
 
+void listener_list_print_stats(listener_list *list) {
+  struct port_collector *i = NULL;
+  listener_list_foreach(i,list)
+    print_batch_stats(i);
+}
+
 void wakeUpListenerList(listener_list *list) {
   struct port_collector *i = NULL;
   listener_list_foreach(i,list)
@@ -201,12 +722,22 @@ void wakeUpListenerList(listener_list *list) {
 }
 
 struct port_collector *createNetFlowListener(enum transport_proto proto,uint16_t collectorInPort){
+  size_t i;
+  const size_t num_threads = readOnlyGlobals.listener_threads > 0 ?
+    readOnlyGlobals.listener_threads : 1;
   struct port_collector *collector = calloc(1,sizeof(*collector));
   if(NULL == collector) {
     traceEvent(TRACE_ERROR,"Invalid address");
     return NULL;
   }
 
+  collector->threads = calloc(num_threads, sizeof(collector->threads[0]));
+  if (NULL == collector->threads) {
+    traceEvent(TRACE_ERROR,"Can't allocate listener threads");
+    free(collector);
+    return NULL;
+  }
+
 #ifdef PORT_COLLECTOR_MAGIC
   collector->magic = PORT_COLLECTOR_MAGIC;
 #endif
@@ -214,7 +745,12 @@ struct port_collector *createNetFlowListener(enum transport_proto proto,uint16_t
   collector->port = collectorInPort;
   collector->proto = proto;
 
-  collector->socket = -1;
+  collector->num_threads = num_threads;
+  for (i=0; i<num_threads; ++i) {
+    collector->threads[i].collector = collector;
+    collector->threads[i].idx = i;
+    collector->threads[i].socket = -1;
+  }
 
   return collector;
 }
@@ -43,4 +43,6 @@ void listener_list_append(listener_list *l1,struct port_collector *collector);
 void mergeNetFlowListenerList(listener_list *l1,listener_list *l2);
 struct port_collector *createNetFlowListener(enum transport_proto proto,uint16_t collectorInPort);
 void closeNetFlowListener(struct port_collector *);
+/// Print receive statistics of every listener in the list
+void listener_list_print_stats(listener_list *list);
 void wakeUpListenerList(listener_list *l1);
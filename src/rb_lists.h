@@ -61,6 +61,24 @@ static void string_list_concat(struct string_list **s1,struct string_list *s2){
   }
 }
 
+/** Append a list to another one, given the last next pointer of the first
+  one, that will be updated to the new list end. Appending many lists this
+  way only walks each appended node once.
+  @param tail Last next pointer of the list (list head if list is empty)
+  @param s2 List to append
+  */
+static void string_list_append(struct string_list ***tail,
+                    struct string_list *s2) __attribute__((unused));
+static void string_list_append(struct string_list ***tail,
+                    struct string_list *s2) {
+  assert(tail);
+  assert(NULL == **tail);
+  **tail = s2;
+  while (**tail) {
+    *tail = &(**tail)->next;
+  }
+}
+
 /*********     number char * lists         ***********/
 
 struct number64_string_list_node{
@@ -0,0 +1,679 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "rb_mmdb.h"
+
+#include "f2k.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Metadata section start marker
+static const uint8_t mmdb_metadata_marker[] = "\xab\xcd\xefMaxMind.com";
+#define MMDB_METADATA_MARKER_LEN (sizeof(mmdb_metadata_marker) - 1)
+/// Metadata section is in the last 128KiB of the file
+#define MMDB_METADATA_MAX_SIZE (128 * 1024)
+/// Zeroes between the search tree and the data section
+#define MMDB_DATA_SECTION_SEPARATOR 16
+/// Maximum nesting level of skipped maps and arrays
+#define MMDB_MAX_DEPTH 64
+
+enum mmdb_type {
+  MMDB_TYPE_EXTENDED = 0,
+  MMDB_TYPE_POINTER = 1,
+  MMDB_TYPE_UTF8_STRING = 2,
+  MMDB_TYPE_DOUBLE = 3,
+  MMDB_TYPE_BYTES = 4,
+  MMDB_TYPE_UINT16 = 5,
+  MMDB_TYPE_UINT32 = 6,
+  MMDB_TYPE_MAP = 7,
+  MMDB_TYPE_INT32 = 8,
+  MMDB_TYPE_UINT64 = 9,
+  MMDB_TYPE_UINT128 = 10,
+  MMDB_TYPE_ARRAY = 11,
+  MMDB_TYPE_CONTAINER = 12,
+  MMDB_TYPE_END_MARKER = 13,
+  MMDB_TYPE_BOOLEAN = 14,
+  MMDB_TYPE_FLOAT = 15,
+};
+
+/// Data or metadata section
+struct mmdb_section {
+  const uint8_t *base;
+  size_t size;
+};
+
+/// Decoded value
+struct mmdb_value {
+  unsigned type;
+  /// Payload size, number of elements of maps and arrays, or pointed offset
+  uint32_t size;
+  size_t offset; ///< Payload offset in the section
+};
+
+struct rb_mmdb {
+#ifndef NDEBUG
+#define RB_MMDB_MAGIC 0x3DDB3DDB3DDB3DDBL
+  uint64_t magic;
+#endif
+  void *map_base;      ///< Mapping, as returned by mmap
+  const uint8_t *map;  ///< Read only view of map_base
+  size_t map_size;
+
+  uint32_t node_count;
+  unsigned record_size; ///< Record size, in bits
+  unsigned node_size;   ///< Node size, in bytes
+  unsigned ip_version;
+  uint32_t ipv4_start_node; ///< Node of ::/96, where IPv4 addresses start
+
+  struct mmdb_section data;
+
+  const char *database_type;
+  size_t database_type_len;
+};
+
+static void assert_rb_mmdb(const struct rb_mmdb *db) {
+#ifdef RB_MMDB_MAGIC
+  assert(RB_MMDB_MAGIC == db->magic);
+#else
+  (void)db;
+#endif
+}
+
+/*
+ *  DATA DECODING
+ */
+
+static uint64_t mmdb_be_number(const uint8_t *buf, size_t len) {
+  uint64_t ret = 0;
+  size_t i;
+  for (i = 0; i < len; ++i) {
+    ret = (ret << 8) | buf[i];
+  }
+
+  return ret;
+}
+
+/** Decode a value header, without following pointers
+  @param s Section
+  @param offset Value offset
+  @param v Decoded value
+  @param next Offset of the next value (maps and arrays elements start here)
+  @return true if success, false if malformed
+  */
+static bool mmdb_decode_raw(const struct mmdb_section *s, size_t offset,
+                                        struct mmdb_value *v, size_t *next) {
+  static const uint32_t pointer_bias[] = {0, 2048, 526336, 0};
+  static const uint32_t size_bias[] = {29, 285, 65821};
+
+  if (unlikely(offset >= s->size)) {
+    return false;
+  }
+
+  const uint8_t ctrl = s->base[offset++];
+  unsigned type = ctrl >> 5;
+  uint32_t size = ctrl & 0x1f;
+
+  if (type == MMDB_TYPE_POINTER) {
+    const unsigned ss = (size >> 3) & 0x3, len = ss + 1;
+    if (unlikely(offset + len > s->size)) {
+      return false;
+    }
+
+    const uint32_t high = ss == 3 ? 0 : (size & 0x7) << (8 * len);
+    v->type = type;
+    v->size = high + mmdb_be_number(&s->base[offset], len) + pointer_bias[ss];
+    v->offset = offset;
+    *next = offset + len;
+    return true;
+  }
+
+  if (type == MMDB_TYPE_EXTENDED) {
+    if (unlikely(offset >= s->size)) {
+      return false;
+    }
+    type = 7 + s->base[offset++];
+    if (unlikely(type < MMDB_TYPE_INT32 || type > MMDB_TYPE_FLOAT)) {
+      return false;
+    }
+  }
+
+  if (size >= 29) {
+    const unsigned len = size - 28;
+    if (unlikely(offset + len > s->size)) {
+      return false;
+    }
+    size = size_bias[len - 1] + mmdb_be_number(&s->base[offset], len);
+    offset += len;
+  }
+
+  v->type = type;
+  v->size = size;
+  v->offset = offset;
+
+  switch (type) {
+  case MMDB_TYPE_MAP:
+  case MMDB_TYPE_ARRAY:
+  case MMDB_TYPE_BOOLEAN:
+    /* No payload */
+    *next = offset;
+    return true;
+  default:
+    if (unlikely(size > s->size - offset)) {
+      return false;
+    }
+    *next = offset + size;
+    return true;
+  };
+}
+
+/** Decode a value header, following it if it is a pointer
+  @param s Section
+  @param offset Value offset
+  @param v Decoded value
+  @param next Offset of the next value. If offset contains a pointer, the one
+              after the pointer.
+  @return true if success, false if malformed
+  */
+static bool mmdb_decode(const struct mmdb_section *s, size_t offset,
+                                        struct mmdb_value *v, size_t *next) {
+  size_t pointed_next;
+
+  if (unlikely(!mmdb_decode_raw(s, offset, v, next))) {
+    return false;
+  }
+
+  if (v->type != MMDB_TYPE_POINTER) {
+    return true;
+  }
+
+  /* Pointers can't point to pointers */
+  return mmdb_decode_raw(s, v->size, v, &pointed_next) &&
+                                              v->type != MMDB_TYPE_POINTER;
+}
+
+/** Skip a value, including all maps and arrays elements
+  @param s Section
+  @param offset Value offset
+  @param next Offset of the next value
+  @param depth Current nesting level
+  @return true if success, false if malformed
+  */
+static bool mmdb_skip(const struct mmdb_section *s, size_t offset,
+                                                size_t *next, unsigned depth) {
+  struct mmdb_value v;
+  uint64_t i, elements;
+
+  if (unlikely(depth > MMDB_MAX_DEPTH ||
+                                      !mmdb_decode_raw(s, offset, &v, next))) {
+    return false;
+  }
+
+  switch (v.type) {
+  case MMDB_TYPE_MAP:
+    elements = 2 * (uint64_t)v.size;
+    break;
+  case MMDB_TYPE_ARRAY:
+    elements = v.size;
+    break;
+  default:
+    return true;
+  };
+
+  for (i = 0; i < elements; ++i) {
+    if (unlikely(!mmdb_skip(s, *next, next, depth + 1))) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/** Search a key in a map
+  @param s Section
+  @param map Map
+  @param key Key to search
+  @param v Value of the key
+  @return true if found, false in other case
+  */
+static bool mmdb_map_get(const struct mmdb_section *s,
+          const struct mmdb_value *map, const char *key, struct mmdb_value *v) {
+  const size_t key_len = strlen(key);
+  size_t offset = map->offset, next;
+  uint32_t i;
+
+  assert(map->type == MMDB_TYPE_MAP);
+
+  for (i = 0; i < map->size; ++i) {
+    struct mmdb_value k;
+    if (unlikely(!mmdb_decode(s, offset, &k, &next) ||
+                                          k.type != MMDB_TYPE_UTF8_STRING)) {
+      return false;
+    }
+
+    if (k.size == key_len && 0 == memcmp(&s->base[k.offset], key, key_len)) {
+      return mmdb_decode(s, next, v, &next);
+    }
+
+    if (unlikely(!mmdb_skip(s, next, &offset, 0))) {
+      return false;
+    }
+  }
+
+  return false;
+}
+
+/** Follow a path of map keys
+  @param s Section
+  @param offset Offset of the first value
+  @param path NULL terminated keys list
+  @param v Found value
+  @return true if found, false in other case
+  */
+static bool mmdb_get_path(const struct mmdb_section *s, size_t offset,
+                          const char *const *path, struct mmdb_value *v) {
+  size_t next;
+
+  if (unlikely(!mmdb_decode(s, offset, v, &next))) {
+    return false;
+  }
+
+  for (; *path; ++path) {
+    if (v->type != MMDB_TYPE_MAP || !mmdb_map_get(s, v, *path, v)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static const char *mmdb_value_string(const struct mmdb_section *s,
+                                  const struct mmdb_value *v, size_t *len) {
+  if (v->type != MMDB_TYPE_UTF8_STRING) {
+    return NULL;
+  }
+
+  *len = v->size;
+  return (const char *)&s->base[v->offset];
+}
+
+static bool mmdb_value_uint(const struct mmdb_section *s,
+                              const struct mmdb_value *v, uint64_t *value) {
+  switch (v->type) {
+  case MMDB_TYPE_UINT16:
+  case MMDB_TYPE_UINT32:
+  case MMDB_TYPE_UINT64:
+  case MMDB_TYPE_UINT128:
+    if (v->size > sizeof(*value)) {
+      return false;
+    }
+    *value = mmdb_be_number(&s->base[v->offset], v->size);
+    return true;
+  default:
+    return false;
+  };
+}
+
+/*
+ *  SEARCH TREE
+ */
+
+static uint32_t mmdb_record(const struct rb_mmdb *db, uint32_t node,
+                                                                unsigned bit) {
+  const uint8_t *p = &db->map[(size_t)node * db->node_size];
+
+  switch (db->record_size) {
+  case 24:
+    return mmdb_be_number(&p[3 * bit], 3);
+  case 28:
+    return bit ? ((uint32_t)(p[3] & 0x0f) << 24) | mmdb_be_number(&p[4], 3)
+               : ((uint32_t)(p[3] & 0xf0) << 20) | mmdb_be_number(p, 3);
+  case 32:
+  default:
+    return mmdb_be_number(&p[4 * bit], 4);
+  };
+}
+
+/** Walk the search tree
+  @param db Database
+  @param node Start node
+  @param addr Address, in network byte order
+  @param bits Number of address bits to walk
+  @param entry Found entry
+  @return true if found, false in other case
+  */
+static bool mmdb_lookup(const struct rb_mmdb *db, uint32_t node,
+          const uint8_t *addr, unsigned bits, struct rb_mmdb_entry *entry) {
+  unsigned i;
+
+  for (i = 0; i < bits && node < db->node_count; ++i) {
+    const unsigned bit = (addr[i >> 3] >> (7 - (i & 7))) & 1;
+    node = mmdb_record(db, node, bit);
+  }
+
+  if (node < (uint64_t)db->node_count + MMDB_DATA_SECTION_SEPARATOR) {
+    /* Not found, or malformed database */
+    return false;
+  }
+
+  const uint64_t offset = (uint64_t)node - db->node_count -
+                                                  MMDB_DATA_SECTION_SEPARATOR;
+  if (unlikely(offset >= db->data.size)) {
+    return false;
+  }
+
+  entry->db = db;
+  entry->offset = offset;
+  return true;
+}
+
+bool rb_mmdb_lookup_v4(const struct rb_mmdb *db, uint32_t ipv4,
+                                                struct rb_mmdb_entry *entry) {
+  const uint8_t addr[] = {ipv4 >> 24, ipv4 >> 16, ipv4 >> 8, ipv4};
+
+  assert(db);
+  assert(entry);
+  assert_rb_mmdb(db);
+
+  return mmdb_lookup(db, db->ipv4_start_node, addr, 32, entry);
+}
+
+bool rb_mmdb_lookup_v6(const struct rb_mmdb *db, const struct in6_addr *ipv6,
+                                                struct rb_mmdb_entry *entry) {
+  static const uint8_t ipv4_mapped_prefix[] = {
+                            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+  const uint8_t *addr = ipv6->s6_addr;
+
+  assert(db);
+  assert(entry);
+  assert_rb_mmdb(db);
+
+  if (0 == memcmp(addr, ipv4_mapped_prefix, sizeof(ipv4_mapped_prefix))) {
+    return mmdb_lookup(db, db->ipv4_start_node,
+                            &addr[sizeof(ipv4_mapped_prefix)], 32, entry);
+  }
+
+  if (db->ip_version != 6) {
+    return false;
+  }
+
+  return mmdb_lookup(db, 0, addr, 128, entry);
+}
+
+/*
+ *  ENTRIES
+ */
+
+const char *rb_mmdb_entry_get_string(const struct rb_mmdb_entry *entry,
+                                      const char *const *path, size_t *len) {
+  struct mmdb_value v;
+
+  assert(entry);
+  assert(len);
+
+  if (!mmdb_get_path(&entry->db->data, entry->offset, path, &v)) {
+    return NULL;
+  }
+
+  return mmdb_value_string(&entry->db->data, &v, len);
+}
+
+bool rb_mmdb_entry_get_uint(const struct rb_mmdb_entry *entry,
+                                    const char *const *path, uint64_t *value) {
+  struct mmdb_value v;
+
+  assert(entry);
+  assert(value);
+
+  return mmdb_get_path(&entry->db->data, entry->offset, path, &v) &&
+                                mmdb_value_uint(&entry->db->data, &v, value);
+}
+
+const char *rb_mmdb_entry_country_code(const struct rb_mmdb_entry *entry,
+                                                                size_t *len) {
+  static const char *const country_path[] = {"country", "iso_code", NULL};
+  static const char *const registered_country_path[] = {
+                                      "registered_country", "iso_code", NULL};
+
+  const char *ret = rb_mmdb_entry_get_string(entry, country_path, len);
+  return ret ? ret
+             : rb_mmdb_entry_get_string(entry, registered_country_path, len);
+}
+
+bool rb_mmdb_entry_as(const struct rb_mmdb_entry *entry,
+                                                      struct rb_mmdb_as *as) {
+  static const char *const number_path[] = {"autonomous_system_number", NULL};
+  static const char *const name_path[] = {
+                                      "autonomous_system_organization", NULL};
+  uint64_t number = 0;
+
+  assert(as);
+
+  if (!rb_mmdb_entry_get_uint(entry, number_path, &number) ||
+                                                        number > UINT32_MAX) {
+    number = 0;
+  }
+
+  as->number = number;
+  as->name = rb_mmdb_entry_get_string(entry, name_path, &as->name_len);
+  if (NULL == as->name) {
+    as->name_len = 0;
+  }
+
+  return as->number || as->name;
+}
+
+/*
+ *  DATABASE
+ */
+
+/// Find the last metadata marker of the file
+static const uint8_t *mmdb_metadata_start(const uint8_t *map, size_t size) {
+  const uint8_t *min = size > MMDB_METADATA_MAX_SIZE ?
+                                    &map[size - MMDB_METADATA_MAX_SIZE] : map;
+  const uint8_t *cursor;
+
+  if (size < MMDB_METADATA_MARKER_LEN) {
+    return NULL;
+  }
+
+  for (cursor = &map[size - MMDB_METADATA_MARKER_LEN]; cursor >= min;
+                                                                    --cursor) {
+    if (0 == memcmp(cursor, mmdb_metadata_marker, MMDB_METADATA_MARKER_LEN)) {
+      return cursor + MMDB_METADATA_MARKER_LEN;
+    }
+
+    if (cursor == min) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static bool mmdb_metadata_uint(const struct mmdb_section *metadata,
+                                        const char *key, uint64_t *value) {
+  const char *const path[] = {key, NULL};
+  struct mmdb_value v;
+
+  return mmdb_get_path(metadata, 0, path, &v) &&
+                                          mmdb_value_uint(metadata, &v, value);
+}
+
+/** Parse database metadata and locate search tree and data sections
+  @param db Database, with the file already mapped
+  @param path File path, for error messages
+  @return true if success, false in other case
+  */
+static bool mmdb_parse_metadata(struct rb_mmdb *db, const char *path) {
+  static const char *const database_type_path[] = {"database_type", NULL};
+  uint64_t node_count = 0, record_size = 0, ip_version = 0;
+  struct mmdb_value v;
+
+  const uint8_t *metadata_start = mmdb_metadata_start(db->map, db->map_size);
+  if (NULL == metadata_start) {
+    traceEvent(TRACE_ERROR, "%s is not a MaxMind DB file (no metadata)", path);
+    return false;
+  }
+
+  const struct mmdb_section metadata = {
+    .base = metadata_start,
+    .size = &db->map[db->map_size] - metadata_start,
+  };
+
+  if (!mmdb_metadata_uint(&metadata, "node_count", &node_count) ||
+      !mmdb_metadata_uint(&metadata, "record_size", &record_size) ||
+      !mmdb_metadata_uint(&metadata, "ip_version", &ip_version)) {
+    traceEvent(TRACE_ERROR, "Invalid MaxMind DB %s metadata", path);
+    return false;
+  }
+
+  if (record_size != 24 && record_size != 28 && record_size != 32) {
+    traceEvent(TRACE_ERROR, "Unsupported MaxMind DB %s record size %"PRIu64,
+                                                          path, record_size);
+    return false;
+  }
+
+  if (ip_version != 4 && ip_version != 6) {
+    traceEvent(TRACE_ERROR, "Unsupported MaxMind DB %s IP version %"PRIu64,
+                                                          path, ip_version);
+    return false;
+  }
+
+  const size_t metadata_offset = metadata_start - db->map -
+                                                      MMDB_METADATA_MARKER_LEN;
+  const uint64_t tree_size = node_count * (record_size / 4);
+  if (node_count > UINT32_MAX ||
+        tree_size + MMDB_DATA_SECTION_SEPARATOR > metadata_offset) {
+    traceEvent(TRACE_ERROR, "MaxMind DB %s search tree exceeds file size",
+                                                                        path);
+    return false;
+  }
+
+  db->node_count = node_count;
+  db->record_size = record_size;
+  db->node_size = record_size / 4;
+  db->ip_version = ip_version;
+  db->data.base = &db->map[tree_size + MMDB_DATA_SECTION_SEPARATOR];
+  db->data.size = metadata_offset - tree_size - MMDB_DATA_SECTION_SEPARATOR;
+
+  if (mmdb_get_path(&metadata, 0, database_type_path, &v)) {
+    db->database_type = mmdb_value_string(&metadata, &v,
+                                                    &db->database_type_len);
+  }
+  if (NULL == db->database_type) {
+    db->database_type = "";
+    db->database_type_len = 0;
+  }
+
+  /* IPv4 addresses live in ::/96 subtree of IPv6 databases */
+  db->ipv4_start_node = 0;
+  if (db->ip_version == 6) {
+    unsigned i;
+    for (i = 0; i < 96 && db->ipv4_start_node < db->node_count; ++i) {
+      db->ipv4_start_node = mmdb_record(db, db->ipv4_start_node, 0);
+    }
+  }
+
+  return true;
+}
+
+struct rb_mmdb *rb_mmdb_open(const char *path) {
+  struct stat st;
+  struct rb_mmdb *db = NULL;
+  void *map = MAP_FAILED;
+
+  assert(path);
+
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    traceEvent(TRACE_ERROR, "Couldn't open %s: %s", path, strerror(errno));
+    return NULL;
+  }
+
+  if (0 != fstat(fd, &st)) {
+    traceEvent(TRACE_ERROR, "Couldn't stat %s: %s", path, strerror(errno));
+    goto err;
+  }
+
+  if (st.st_size <= 0 || (uint64_t)st.st_size > SIZE_MAX) {
+    traceEvent(TRACE_ERROR, "Invalid MaxMind DB %s size", path);
+    goto err;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (MAP_FAILED == map) {
+    traceEvent(TRACE_ERROR, "Couldn't map %s: %s", path, strerror(errno));
+    goto err;
+  }
+
+  db = calloc(1, sizeof(*db));
+  if (NULL == db) {
+    traceEvent(TRACE_ERROR, "Couldn't allocate MaxMind DB (out of memory?)");
+    goto err;
+  }
+
+#ifdef RB_MMDB_MAGIC
+  db->magic = RB_MMDB_MAGIC;
+#endif
+  db->map_base = map;
+  db->map = map;
+  db->map_size = st.st_size;
+
+  if (!mmdb_parse_metadata(db, path)) {
+    goto err;
+  }
+
+  close(fd);
+  return db;
+
+err:
+  free(db);
+  if (MAP_FAILED != map) {
+    munmap(map, st.st_size);
+  }
+  close(fd);
+  return NULL;
+}
+
+const char *rb_mmdb_database_type(const struct rb_mmdb *db, size_t *len) {
+  assert(db);
+  assert(len);
+  assert_rb_mmdb(db);
+
+  *len = db->database_type_len;
+  return db->database_type;
+}
+
+void rb_mmdb_close(struct rb_mmdb *db) {
+  if (NULL == db) {
+    return;
+  }
+
+  assert_rb_mmdb(db);
+  munmap(db->map_base, db->map_size);
+  free(db);
+}
@@ -0,0 +1,120 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "../config.h"
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  MaxMind DB (mmdb) reader. The database file is memory mapped read only, and
+  lookups only walk the search tree and decode the data section in place:
+  returned strings point into the mapping (they are not NUL terminated), and
+  no memory is allocated. A database is immutable once opened, so any number
+  of threads can look it up at the same time without locks.
+*/
+
+struct rb_mmdb;
+
+/// Data section entry of a lookup result
+struct rb_mmdb_entry {
+  const struct rb_mmdb *db;
+  uint32_t offset; ///< Offset in the data section
+};
+
+/// Autonomous system information of an entry
+struct rb_mmdb_as {
+  uint32_t number;  ///< AS number, 0 if unknown
+  const char *name; ///< AS organization. Not NUL terminated. NULL if unknown
+  size_t name_len;
+};
+
+/** Open a MaxMind DB file
+  @param path File path
+  @return New database, or NULL in case of error
+  */
+struct rb_mmdb *rb_mmdb_open(const char *path);
+
+/** Close a database
+  @param db Database. Can be NULL
+  */
+void rb_mmdb_close(struct rb_mmdb *db);
+
+/** Database type, as stated in database metadata
+  @param db Database
+  @param len Type length
+  @return Database type. Not NUL terminated
+  */
+const char *rb_mmdb_database_type(const struct rb_mmdb *db, size_t *len);
+
+/** Search an IPv4 address
+  @param db Database
+  @param ipv4 IPv4 address, in host byte order
+  @param entry Entry found
+  @return true if found, false in other case
+  */
+bool rb_mmdb_lookup_v4(const struct rb_mmdb *db, uint32_t ipv4,
+                                                  struct rb_mmdb_entry *entry);
+
+/** Search an IPv6 address. IPv4 mapped addresses are searched as IPv4 ones
+  @param db Database
+  @param ipv6 IPv6 address
+  @param entry Entry found
+  @return true if found, false in other case
+  */
+bool rb_mmdb_lookup_v6(const struct rb_mmdb *db, const struct in6_addr *ipv6,
+                                                  struct rb_mmdb_entry *entry);
+
+/** Get a string value of an entry
+  @param entry Entry
+  @param path NULL terminated list of map keys to follow
+  @param len String length
+  @return String, or NULL if not found or not a string. Not NUL terminated
+  */
+const char *rb_mmdb_entry_get_string(const struct rb_mmdb_entry *entry,
+                                      const char *const *path, size_t *len);
+
+/** Get an unsigned integer value of an entry
+  @param entry Entry
+  @param path NULL terminated list of map keys to follow
+  @param value Value
+  @return true if found, false if not found or not an unsigned integer
+  */
+bool rb_mmdb_entry_get_uint(const struct rb_mmdb_entry *entry,
+                                      const char *const *path, uint64_t *value);
+
+/** Country ISO code of an entry (country or, if missing, registered country)
+  @param entry Entry
+  @param len Code length
+  @return Country code, or NULL if not found. Not NUL terminated
+  */
+const char *rb_mmdb_entry_country_code(const struct rb_mmdb_entry *entry,
+                                                                  size_t *len);
+
+/** Autonomous system of an entry
+  @param entry Entry
+  @param as AS information
+  @return true if entry has any AS information
+  */
+bool rb_mmdb_entry_as(const struct rb_mmdb_entry *entry,
+                                                      struct rb_mmdb_as *as);
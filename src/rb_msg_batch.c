@@ -0,0 +1,242 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rb_msg_batch.h"
+
+#include "f2k.h"
+#include "printbuf.h"
+#include "rb_cbor.h"
+#include "rb_lists.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/// Flows of the same key being packed
+struct msg_group {
+  struct printbuf *msg;   ///< Message being built. NULL if group is empty
+  uint64_t key;           ///< Group key
+  uint64_t client_mac;    ///< Client mac of the first flow
+  uint64_t deadline_ms;   ///< Time to complete the message
+  size_t n_msgs;          ///< Flows in message
+};
+
+/// Bytes that frame flows in a message, per format
+static const struct msg_batch_framing {
+  const char *start, *separator, *flow_end, *end;
+} msg_batch_framing[] = {
+  [RB_MSG_BATCH_NDJSON] = {"", "", "\n", ""},
+  [RB_MSG_BATCH_ARRAY] = {"[", ",", "", "]"},
+  [RB_MSG_BATCH_CBOR_SEQUENCE] = {"", "", "", ""},
+  [RB_MSG_BATCH_CBOR_ARRAY] = {RB_CBOR_ARRAY_START, "", "", RB_CBOR_BREAK},
+};
+
+struct rb_msg_batch {
+#ifndef NDEBUG
+#define RB_MSG_BATCH_MAGIC 0xBA7C4BA7C4BA7C4BL
+  uint64_t magic;
+#endif
+  struct rb_msg_batch_conf conf;
+  struct msg_group groups[RB_MSG_BATCH_SLOTS];
+};
+
+int rb_msg_batch_format_parse(const char *str,
+                                          enum rb_msg_batch_format *format) {
+  if (0 == strcasecmp(str, "ndjson")) {
+    *format = RB_MSG_BATCH_NDJSON;
+  } else if (0 == strcasecmp(str, "array")) {
+    *format = RB_MSG_BATCH_ARRAY;
+  } else {
+    traceEvent(TRACE_ERROR, "Unknown message format %s (use ndjson or array)",
+      str);
+    return -1;
+  }
+
+  return 0;
+}
+
+struct rb_msg_batch *rb_msg_batch_new(const struct rb_msg_batch_conf *conf) {
+  struct rb_msg_batch *batch = calloc(1, sizeof(*batch));
+  if (NULL == batch) {
+    traceEvent(TRACE_ERROR, "Can't allocate message batch (out of memory?)");
+    return NULL;
+  }
+
+#ifdef RB_MSG_BATCH_MAGIC
+  batch->magic = RB_MSG_BATCH_MAGIC;
+#endif
+  batch->conf = *conf;
+
+  if (OUTPUT_FORMAT_CBOR == readOnlyGlobals.output_format) {
+    /* Flows are CBOR items, so use the CBOR counterpart of the format */
+    if (RB_MSG_BATCH_NDJSON == batch->conf.format) {
+      batch->conf.format = RB_MSG_BATCH_CBOR_SEQUENCE;
+    } else if (RB_MSG_BATCH_ARRAY == batch->conf.format) {
+      batch->conf.format = RB_MSG_BATCH_CBOR_ARRAY;
+    }
+  }
+
+  return batch;
+}
+
+void rb_msg_batch_list_free(struct string_list *list) {
+  while (list) {
+    struct string_list *next = list->next;
+    printbuf_free(list->string);
+    free(list);
+    list = next;
+  }
+}
+
+void rb_msg_batch_done(struct rb_msg_batch *batch) {
+  size_t i;
+
+#ifdef RB_MSG_BATCH_MAGIC
+  assert(RB_MSG_BATCH_MAGIC == batch->magic);
+#endif
+
+  for (i = 0; i < RD_ARRAYSIZE(batch->groups); ++i) {
+    printbuf_free(batch->groups[i].msg);
+  }
+
+  free(batch);
+}
+
+/** Finish a group message and append it to a list
+  @param batch Builder
+  @param group Group to complete. It will be empty after this call
+  @param tail Last next pointer of the list
+  */
+static void msg_group_complete(const struct rb_msg_batch *batch,
+    struct msg_group *group, struct string_list ***tail) {
+  const char *end = msg_batch_framing[batch->conf.format].end;
+  struct string_list *node = calloc(1, sizeof(*node));
+
+  if (unlikely(NULL == node)) {
+    traceEvent(TRACE_ERROR, "Can't allocate message, dropping %zu flows",
+      group->n_msgs);
+    printbuf_free(group->msg);
+  } else {
+    printbuf_memappend_fast(group->msg, end, strlen(end));
+
+    node->string = group->msg;
+    node->client_mac = group->client_mac;
+    **tail = node;
+    *tail = &node->next;
+  }
+
+  group->msg = NULL;
+  group->n_msgs = 0;
+}
+
+/** Add a flow to its group
+  @param batch Builder
+  @param msg Flow
+  @param key Flow group key
+  @param now_ms Current time
+  @param tail Last next pointer of the completed messages list
+  */
+static void msg_batch_add0(struct rb_msg_batch *batch,
+    const struct string_list *msg, uint64_t key, uint64_t now_ms,
+    struct string_list ***tail) {
+  const struct msg_batch_framing *framing =
+    &msg_batch_framing[batch->conf.format];
+  const struct printbuf *flow = msg->string;
+  struct msg_group *group = &batch->groups[key % RB_MSG_BATCH_SLOTS];
+
+  if (group->msg && (group->key != key ||
+      group->msg->bpos + flow->bpos + 2 > batch->conf.max_bytes)) {
+    /* Slot taken by another key, or flow does not fit */
+    msg_group_complete(batch, group, tail);
+  }
+
+  if (NULL == group->msg) {
+    group->msg = printbuf_new();
+    if (unlikely(NULL == group->msg)) {
+      traceEvent(TRACE_ERROR, "Can't allocate message, dropping flow");
+      return;
+    }
+
+    group->key = key;
+    group->client_mac = msg->client_mac;
+    group->deadline_ms = now_ms + batch->conf.max_delay_ms;
+    printbuf_memappend_fast(group->msg, framing->start,
+      strlen(framing->start));
+  } else {
+    printbuf_memappend_fast(group->msg, framing->separator,
+      strlen(framing->separator));
+  }
+
+  printbuf_memappend_fast(group->msg, flow->buf, flow->bpos);
+  printbuf_memappend_fast(group->msg, framing->flow_end,
+    strlen(framing->flow_end));
+
+  if (++group->n_msgs >= batch->conf.max_msgs ||
+      group->msg->bpos >= batch->conf.max_bytes) {
+    msg_group_complete(batch, group, tail);
+  }
+}
+
+struct string_list *rb_msg_batch_add(struct rb_msg_batch *batch,
+    struct string_list *const *msgs, const uint64_t *keys, size_t n_msgs,
+    uint64_t now_ms) {
+  struct string_list *ret = NULL, **tail = &ret;
+  size_t i;
+
+#ifdef RB_MSG_BATCH_MAGIC
+  assert(RB_MSG_BATCH_MAGIC == batch->magic);
+#endif
+
+  for (i = 0; i < n_msgs; ++i) {
+    msg_batch_add0(batch, msgs[i], keys[i], now_ms, &tail);
+  }
+
+  return ret;
+}
+
+struct string_list *rb_msg_batch_expired(struct rb_msg_batch *batch,
+                              uint64_t now_ms, uint64_t *next_deadline_ms) {
+  struct string_list *ret = NULL, **tail = &ret;
+  size_t i;
+
+#ifdef RB_MSG_BATCH_MAGIC
+  assert(RB_MSG_BATCH_MAGIC == batch->magic);
+#endif
+
+  *next_deadline_ms = UINT64_MAX;
+  for (i = 0; i < RD_ARRAYSIZE(batch->groups); ++i) {
+    struct msg_group *group = &batch->groups[i];
+    if (NULL == group->msg) {
+      continue;
+    } else if (group->deadline_ms <= now_ms) {
+      msg_group_complete(batch, group, &tail);
+    } else if (group->deadline_ms < *next_deadline_ms) {
+      *next_deadline_ms = group->deadline_ms;
+    }
+  }
+
+  return ret;
+}
+
+struct string_list *rb_msg_batch_flush(struct rb_msg_batch *batch) {
+  uint64_t next_deadline_ms;
+  return rb_msg_batch_expired(batch, UINT64_MAX, &next_deadline_ms);
+}
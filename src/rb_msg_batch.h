@@ -0,0 +1,118 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "../config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  Multi-flow messages. Flows are grouped by a key (i.e., the kafka partition
+  they would go to), and every group is packed in one message that is
+  completed when it reaches a number of flows, a size, or a deadline.
+  Completed messages are handed back as string_list nodes, with the client mac
+  of the group first flow, so the partitioner sends them where their flows
+  would have gone.
+
+  Functions are not thread safe: callers must serialize them.
+*/
+
+struct string_list;
+
+/// Format of multi-flow messages
+enum rb_msg_batch_format {
+  RB_MSG_BATCH_NDJSON,        ///< One flow per line
+  RB_MSG_BATCH_ARRAY,         ///< JSON array of flows
+  RB_MSG_BATCH_CBOR_SEQUENCE, ///< Concatenated CBOR flows (RFC 8742)
+  RB_MSG_BATCH_CBOR_ARRAY,    ///< CBOR array of flows
+};
+
+/// Default max message size
+#define RB_MSG_BATCH_DEFAULT_MAX_BYTES (256*1024)
+/// Default max time a flow waits in an incomplete message
+#define RB_MSG_BATCH_DEFAULT_MAX_DELAY_MS 100
+
+/// Number of groups that can be open at the same time. Groups whose keys
+/// collide complete each other
+#define RB_MSG_BATCH_SLOTS 256
+
+/// Multi-flow messages configuration
+struct rb_msg_batch_conf {
+  size_t max_msgs;         ///< Max flows per message. <2 disables batching
+  size_t max_bytes;        ///< Max message size, if it has >1 flow
+  unsigned max_delay_ms;   ///< Max time a flow waits for more flows
+  enum rb_msg_batch_format format;
+};
+
+struct rb_msg_batch;
+
+/** Parse a multi-flow message format name
+  @param str Format name: ndjson or array
+  @param format Parsed format
+  @return 0 if success, !0 if str is not a valid format
+  */
+int rb_msg_batch_format_parse(const char *str,
+                                          enum rb_msg_batch_format *format);
+
+/** Create a multi-flow message builder. With CBOR output format, JSON
+  formats are replaced by their CBOR counterparts
+  @param conf Configuration. It is copied
+  @return New builder, or NULL in case of error
+  */
+struct rb_msg_batch *rb_msg_batch_new(const struct rb_msg_batch_conf *conf);
+
+/** Free a builder. Use rb_msg_batch_flush before if you want pending flows
+  @param batch Builder
+  */
+void rb_msg_batch_done(struct rb_msg_batch *batch);
+
+/** Add flows to their groups
+  @param batch Builder
+  @param msgs Flows to add. They are copied, so caller keeps ownership
+  @param keys Group key of each flow
+  @param n_msgs Number of flows
+  @param now_ms Current monotonic time, in milliseconds
+  @return List of completed messages, that caller owns
+  */
+struct string_list *rb_msg_batch_add(struct rb_msg_batch *batch,
+    struct string_list *const *msgs, const uint64_t *keys, size_t n_msgs,
+    uint64_t now_ms);
+
+/** Complete the messages whose deadline has arrived
+  @param batch Builder
+  @param now_ms Current monotonic time, in milliseconds
+  @param next_deadline_ms Deadline of the oldest still incomplete message, or
+  UINT64_MAX if there is none
+  @return List of completed messages, that caller owns
+  */
+struct string_list *rb_msg_batch_expired(struct rb_msg_batch *batch,
+                              uint64_t now_ms, uint64_t *next_deadline_ms);
+
+/** Complete all messages
+  @param batch Builder
+  @return List of completed messages, that caller owns
+  */
+struct string_list *rb_msg_batch_flush(struct rb_msg_batch *batch);
+
+/** Free a list of messages returned by the builder
+  @param list List
+  */
+void rb_msg_batch_list_free(struct string_list *list);
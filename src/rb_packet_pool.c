@@ -0,0 +1,226 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rb_packet_pool.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+
+#ifndef NDEBUG
+#define PACKET_POOL_MAGIC 0xAC1ECA1EAC1ECA1EL
+#endif
+
+static const size_t packet_pool_class_len[PACKET_POOL_N_CLASSES] = {
+  [PACKET_POOL_SMALL]  = PACKET_POOL_SMALL_BUFFER_LEN,
+  [PACKET_POOL_MEDIUM] = PACKET_POOL_MEDIUM_BUFFER_LEN,
+  [PACKET_POOL_JUMBO]  = PACKET_POOL_MAX_BUFFER_LEN,
+};
+
+struct packet_pool_class_list {
+  /// Free buffers, only accessed by pool owner
+  QueuedPacket *cache;
+  /// Buffers released by other threads. Lock-free stack, any thread can push
+  /// but only the owner pops (taking all of them at once), so no ABA problem
+  QueuedPacket *returned;
+  size_t allocated;
+  size_t max_buffers; ///< Max number of allocated buffers
+  struct {
+    uint64_t hits, misses, exhausted;
+  } stats;
+};
+
+struct packet_pool {
+#ifdef PACKET_POOL_MAGIC
+  uint64_t magic;
+#endif
+  /// One reference for the owner, plus one per in-flight pooled packet
+  atomic_uint64_t refcnt;
+  struct packet_pool_class_list classes[PACKET_POOL_N_CLASSES];
+};
+
+struct packet_pool *new_packet_pool(size_t max_buffers,
+    size_t max_jumbo_buffers) {
+  size_t i;
+  struct packet_pool *pool = calloc(1, sizeof(*pool));
+  if (NULL == pool) {
+    traceEvent(TRACE_ERROR, "Can't allocate packet pool (out of memory?)");
+    return NULL;
+  }
+
+#ifdef PACKET_POOL_MAGIC
+  pool->magic = PACKET_POOL_MAGIC;
+#endif
+  pool->refcnt.value = 1;
+  for (i=0; i<PACKET_POOL_N_CLASSES; ++i) {
+    pool->classes[i].max_buffers = PACKET_POOL_JUMBO == i ? max_jumbo_buffers
+                                                          : max_buffers;
+  }
+
+  return pool;
+}
+
+static void free_packet_list(QueuedPacket *list) {
+  while (list) {
+    QueuedPacket *next = list->pool_next;
+    free(list);
+    list = next;
+  }
+}
+
+static void packet_pool_decref(struct packet_pool *pool) {
+  if (0 == ATOMIC_OP(sub,fetch,&pool->refcnt.value,1)) {
+    size_t i;
+    for (i=0; i<PACKET_POOL_N_CLASSES; ++i) {
+      free_packet_list(pool->classes[i].cache);
+      free_packet_list(pool->classes[i].returned);
+    }
+    free(pool);
+  }
+}
+
+void packet_pool_done(struct packet_pool *pool) {
+  assert(pool);
+#ifdef PACKET_POOL_MAGIC
+  assert(PACKET_POOL_MAGIC == pool->magic);
+#endif
+  packet_pool_decref(pool);
+}
+
+/// Smallest class that can hold buffer_len bytes
+static int packet_pool_class(size_t buffer_len) {
+  int i;
+  for (i=0; i<PACKET_POOL_N_CLASSES; ++i) {
+    if (buffer_len <= packet_pool_class_len[i]) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static void init_pool_packet(QueuedPacket *qpacket, struct packet_pool *pool,
+    int pool_class) {
+  qpacket->netflow_device_ip = 0;
+  qpacket->buffer = (uint8_t *)&qpacket[1];
+  qpacket->buffer_len = 0;
+  qpacket->sensor = NULL;
+  qpacket->original_message = NULL;
+  qpacket->pool = pool;
+  qpacket->pool_class = pool_class;
+  qpacket->pool_next = NULL;
+}
+
+QueuedPacket *packet_pool_get(struct packet_pool *pool, size_t buffer_len) {
+  assert(pool);
+  const int pool_class = packet_pool_class(buffer_len);
+  if (unlikely(pool_class < 0)) {
+    return NULL;
+  }
+
+  struct packet_pool_class_list *list = &pool->classes[pool_class];
+  QueuedPacket *ret = NULL;
+
+  if (NULL == list->cache) {
+    /* Take all buffers released since last time */
+    list->cache = __sync_lock_test_and_set(&list->returned, NULL);
+  }
+
+  if (list->cache) {
+    ret = list->cache;
+    list->cache = ret->pool_next;
+    list->stats.hits++;
+  } else if (list->allocated < list->max_buffers) {
+    ret = malloc(sizeof(*ret) + packet_pool_class_len[pool_class]);
+    if (unlikely(NULL == ret)) {
+      traceEvent(TRACE_ERROR, "Can't allocate packet (out of memory?)");
+      return NULL;
+    }
+    list->allocated++;
+    list->stats.misses++;
+  } else {
+    /* Pool exhausted: Allocate out of the pool */
+    list->stats.exhausted++;
+    ret = malloc(sizeof(*ret) + packet_pool_class_len[pool_class]);
+    if (unlikely(NULL == ret)) {
+      traceEvent(TRACE_ERROR, "Can't allocate packet (out of memory?)");
+      return NULL;
+    }
+    init_pool_packet(ret, NULL, pool_class);
+    return ret;
+  }
+
+  ATOMIC_OP(add,fetch,&pool->refcnt.value,1);
+  init_pool_packet(ret, pool, pool_class);
+  return ret;
+}
+
+void packet_pool_release(QueuedPacket *qpacket) {
+  struct packet_pool *pool = qpacket->pool;
+  assert(pool);
+#ifdef PACKET_POOL_MAGIC
+  assert(PACKET_POOL_MAGIC == pool->magic);
+#endif
+
+  struct packet_pool_class_list *list = &pool->classes[qpacket->pool_class];
+  QueuedPacket *head = NULL;
+
+  do {
+    head = list->returned;
+    qpacket->pool_next = head;
+  } while (!__sync_bool_compare_and_swap(&list->returned, head, qpacket));
+
+  packet_pool_decref(pool);
+}
+
+void packet_pool_get_stats(const struct packet_pool *pool,
+    struct packet_pool_stats *stats) {
+  size_t i;
+  assert(pool);
+  assert(stats);
+
+  for (i=0; i<PACKET_POOL_N_CLASSES; ++i) {
+    const struct packet_pool_class_list *list = &pool->classes[i];
+    stats->classes[i].buffer_len = packet_pool_class_len[i];
+    stats->classes[i].allocated = list->allocated;
+    stats->classes[i].hits = list->stats.hits;
+    stats->classes[i].misses = list->stats.misses;
+    stats->classes[i].exhausted = list->stats.exhausted;
+  }
+}
+
+void packet_pool_print_stats(const struct packet_pool *pool,
+    const char *name) {
+  size_t i;
+  struct packet_pool_stats stats;
+
+  packet_pool_get_stats(pool, &stats);
+  for (i=0; i<PACKET_POOL_N_CLASSES; ++i) {
+    if (0 == stats.classes[i].hits + stats.classes[i].misses +
+                                                stats.classes[i].exhausted) {
+      continue;
+    }
+
+    traceEvent(TRACE_NORMAL, "[%s] Packet pool %zu bytes class: "
+      "[allocated: %"PRIu64"][hits: %"PRIu64"][misses: %"PRIu64"]"
+      "[exhausted: %"PRIu64"]", name, stats.classes[i].buffer_len,
+      stats.classes[i].allocated, stats.classes[i].hits,
+      stats.classes[i].misses, stats.classes[i].exhausted);
+  }
+}
@@ -0,0 +1,104 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "../config.h"
+
+#include "f2k.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  Recycling packet buffers pool. Every packet reader (listener thread, pcap
+  thread) owns one pool: only the owner can get buffers from it, but any
+  thread (i.e., workers) can release them with freeQueuedPacket, and they will
+  be recycled by the owner without any lock.
+*/
+
+/// Packet buffer size classes
+enum packet_pool_class {
+  PACKET_POOL_SMALL,  ///< Typical netflow datagram
+  PACKET_POOL_MEDIUM, ///< Jumbo frames
+  PACKET_POOL_JUMBO,  ///< Max UDP datagram size
+  PACKET_POOL_N_CLASSES
+};
+
+/// Buffer size of small class
+#define PACKET_POOL_SMALL_BUFFER_LEN (2*1024)
+/// Buffer size of medium class
+#define PACKET_POOL_MEDIUM_BUFFER_LEN (9*1024)
+/// Biggest buffer a pool can provide
+#define PACKET_POOL_MAX_BUFFER_LEN (64*1024)
+
+/// Default maximum number of small and medium buffers
+#define PACKET_POOL_DEFAULT_MAX_BUFFERS 4096
+/// Default maximum number of jumbo buffers. Jumbo datagrams are rare, and
+/// every buffer costs 64KB
+#define PACKET_POOL_DEFAULT_MAX_JUMBO_BUFFERS 32
+
+struct packet_pool;
+
+struct packet_pool_stats {
+  struct {
+    size_t buffer_len;  ///< Buffers size of this class
+    uint64_t allocated; ///< Buffers allocated by the pool
+    uint64_t hits;      ///< Buffers served from recycled ones
+    uint64_t misses;    ///< Buffers that needed a new allocation
+    uint64_t exhausted; ///< Requests served outside the pool (pool full)
+  } classes[PACKET_POOL_N_CLASSES];
+};
+
+/** Creates a new packet pool
+  @param max_buffers Maximum number of buffers of small and medium classes.
+  If all of them are in use, new packets will be allocated (and freed) out of
+  the pool
+  @param max_jumbo_buffers Maximum number of buffers of jumbo class
+  @return New pool, or NULL if no memory
+  */
+struct packet_pool *new_packet_pool(size_t max_buffers,
+  size_t max_jumbo_buffers);
+
+/** Release pool owner reference. Pool memory will be actually freed when the
+  last in-flight packet is released.
+  @param pool Pool
+  */
+void packet_pool_done(struct packet_pool *pool);
+
+/** Get a packet from the pool. Can only be called from pool owner thread
+  @param pool Pool
+  @param buffer_len Minimum packet buffer length
+  @return New packet (free it with freeQueuedPacket), or NULL if no memory or
+  buffer_len > PACKET_POOL_MAX_BUFFER_LEN
+  */
+QueuedPacket *packet_pool_get(struct packet_pool *pool, size_t buffer_len);
+
+/** Get pool statistics. Can only be called from pool owner thread
+  @param pool Pool
+  @param stats Stats to fill
+  */
+void packet_pool_get_stats(const struct packet_pool *pool,
+  struct packet_pool_stats *stats);
+
+/** Print pool statistics
+  @param pool Pool
+  @param name Pool name to print
+  */
+void packet_pool_print_stats(const struct packet_pool *pool, const char *name);
@@ -0,0 +1,301 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rb_ring.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/// Consumer polling rounds before yielding CPU
+#define RB_RING_SPIN_ROUNDS 64
+/// Consumer yielding rounds before sleeping
+#define RB_RING_YIELD_ROUNDS 16
+
+struct rb_ring_slot {
+  /// Slot sequence. seq==pos means free for producer at position pos;
+  /// seq==pos+1 means ready for consumer at position pos.
+  uint64_t seq;
+  struct rb_ring_msg msg;
+};
+
+static size_t roundup_pow2(size_t n) {
+  size_t ret = 1;
+  while (ret < n) {
+    ret <<= 1;
+  }
+  return ret;
+}
+
+int rb_ring_init(struct rb_ring *ring, size_t size) {
+  size_t i;
+  assert(ring);
+
+  memset(ring, 0, sizeof(*ring));
+  size = roundup_pow2(size < 2 ? 2 : size);
+
+  ring->slots = calloc(size, sizeof(ring->slots[0]));
+  if (NULL == ring->slots) {
+    traceEvent(TRACE_ERROR, "Can't allocate ring of %zu elements "
+      "(out of memory?)", size);
+    return -1;
+  }
+
+  for (i=0; i<size; ++i) {
+    ring->slots[i].seq = i;
+  }
+
+#ifdef RB_RING_MAGIC
+  ring->magic = RB_RING_MAGIC;
+#endif
+  ring->mask = size - 1;
+  pthread_mutex_init(&ring->mutex, NULL);
+  pthread_cond_init(&ring->cond, NULL);
+
+  return 0;
+}
+
+void rb_ring_done(struct rb_ring *ring) {
+#ifdef RB_RING_MAGIC
+  assert(RB_RING_MAGIC == ring->magic);
+#endif
+  pthread_cond_destroy(&ring->cond);
+  pthread_mutex_destroy(&ring->mutex);
+  free(ring->slots);
+  ring->slots = NULL;
+}
+
+/// Wake up consumer if it is sleeping
+static void rb_ring_wakeup(struct rb_ring *ring) {
+  /* Pairs with consumer fence in rb_ring_pop_batch_timedwait: either we see
+     it sleeping, or it sees our message */
+  ATOMIC_FULL_FENCE();
+  if (ATOMIC_LOAD_ACQUIRE(&ring->sleeping)) {
+    pthread_mutex_lock(&ring->mutex);
+    pthread_cond_signal(&ring->cond);
+    pthread_mutex_unlock(&ring->mutex);
+  }
+}
+
+int rb_ring_try_push(struct rb_ring *ring, void *ptr, unsigned type) {
+  struct rb_ring_slot *slot = NULL;
+  uint64_t pos = ATOMIC_LOAD_ACQUIRE(&ring->head);
+
+#ifdef RB_RING_MAGIC
+  assert(RB_RING_MAGIC == ring->magic);
+#endif
+
+  while (1) {
+    slot = &ring->slots[pos & ring->mask];
+    const uint64_t seq = ATOMIC_LOAD_ACQUIRE(&slot->seq);
+    const int64_t diff = (int64_t)(seq - pos);
+
+    if (diff == 0) {
+      if (__sync_bool_compare_and_swap(&ring->head, pos, pos + 1)) {
+        break;
+      }
+    } else if (diff < 0) {
+      /* Consumer has not released this slot yet: Full */
+      return -1;
+    }
+
+    pos = ATOMIC_LOAD_ACQUIRE(&ring->head);
+  }
+
+  slot->msg.ptr = ptr;
+  ATOMIC_STORE_RELEASE(&slot->msg.type, type);
+  ATOMIC_STORE_RELEASE(&slot->seq, pos + 1);
+
+  rb_ring_wakeup(ring);
+  return 0;
+}
+
+size_t rb_ring_try_push_batch(struct rb_ring *ring, void **ptrs, size_t n,
+                                                              unsigned type) {
+  size_t i, claimed;
+  uint64_t pos;
+
+#ifdef RB_RING_MAGIC
+  assert(RB_RING_MAGIC == ring->magic);
+#endif
+
+  while (1) {
+    pos = ATOMIC_LOAD_ACQUIRE(&ring->head);
+    for (claimed=0; claimed<n; ++claimed) {
+      const struct rb_ring_slot *slot =
+                                    &ring->slots[(pos + claimed) & ring->mask];
+      if (ATOMIC_LOAD_ACQUIRE(&slot->seq) != pos + claimed) {
+        break;
+      }
+    }
+
+    if (claimed > 0) {
+      /* If head has not moved, nobody else could claim these slots */
+      if (__sync_bool_compare_and_swap(&ring->head, pos, pos + claimed)) {
+        break;
+      }
+    } else {
+      const struct rb_ring_slot *slot = &ring->slots[pos & ring->mask];
+      if ((int64_t)(ATOMIC_LOAD_ACQUIRE(&slot->seq) - pos) < 0) {
+        /* Consumer has not released this slot yet: Full */
+        return 0;
+      }
+    }
+  }
+
+  for (i=0; i<claimed; ++i) {
+    struct rb_ring_slot *slot = &ring->slots[(pos + i) & ring->mask];
+    slot->msg.ptr = ptrs[i];
+    ATOMIC_STORE_RELEASE(&slot->msg.type, type);
+    ATOMIC_STORE_RELEASE(&slot->seq, pos + i + 1);
+  }
+
+  rb_ring_wakeup(ring);
+  return claimed;
+}
+
+void rb_ring_push(struct rb_ring *ring, void *ptr, unsigned type) {
+  unsigned rounds = 0;
+  while (0 != rb_ring_try_push(ring, ptr, type)) {
+    if (rounds++ < RB_RING_YIELD_ROUNDS) {
+      sched_yield();
+    } else {
+      usleep(100);
+    }
+  }
+}
+
+size_t rb_ring_pop_batch(struct rb_ring *ring, struct rb_ring_msg *msgs,
+                                                            size_t max_msgs) {
+  size_t i, n;
+  uint64_t pos;
+
+#ifdef RB_RING_MAGIC
+  assert(RB_RING_MAGIC == ring->magic);
+#endif
+
+  do {
+    pos = ATOMIC_LOAD_ACQUIRE(&ring->tail);
+    for (n=0; n<max_msgs; ++n) {
+      const struct rb_ring_slot *slot = &ring->slots[(pos + n) & ring->mask];
+      if (ATOMIC_LOAD_ACQUIRE(&slot->seq) != pos + n + 1) {
+        break;
+      }
+    }
+
+    if (0 == n) {
+      return 0;
+    }
+  } while (!__sync_bool_compare_and_swap(&ring->tail, pos, pos + n));
+
+  /* Slots [pos, pos+n) are ours until we release them */
+  for (i=0; i<n; ++i) {
+    struct rb_ring_slot *slot = &ring->slots[(pos + i) & ring->mask];
+    msgs[i] = slot->msg;
+    ATOMIC_STORE_RELEASE(&slot->seq, pos + i + ring->mask + 1);
+  }
+
+  return n;
+}
+
+int rb_ring_try_pop_type(struct rb_ring *ring, struct rb_ring_msg *msg,
+                                                              unsigned type) {
+  uint64_t pos;
+  struct rb_ring_slot *slot = NULL;
+
+#ifdef RB_RING_MAGIC
+  assert(RB_RING_MAGIC == ring->magic);
+#endif
+
+  do {
+    pos = ATOMIC_LOAD_ACQUIRE(&ring->tail);
+    slot = &ring->slots[pos & ring->mask];
+    if (ATOMIC_LOAD_ACQUIRE(&slot->seq) != pos + 1) {
+      return -1;
+    }
+
+    /* If tail has not moved in the CAS, slot can't have been modified */
+    if (ATOMIC_LOAD_ACQUIRE(&slot->msg.type) != type) {
+      return -1;
+    }
+  } while (!__sync_bool_compare_and_swap(&ring->tail, pos, pos + 1));
+
+  *msg = slot->msg;
+  ATOMIC_STORE_RELEASE(&slot->seq, pos + ring->mask + 1);
+  return 0;
+}
+
+size_t rb_ring_pop_batch_timedwait(struct rb_ring *ring,
+          struct rb_ring_msg *msgs, size_t max_msgs, unsigned timeout_ms) {
+  unsigned rounds;
+  size_t ret = 0;
+
+  for (rounds = 0; rounds < RB_RING_SPIN_ROUNDS + RB_RING_YIELD_ROUNDS;
+                                                                    ++rounds) {
+    ret = rb_ring_pop_batch(ring, msgs, max_msgs);
+    if (ret > 0) {
+      return ret;
+    }
+
+    if (rounds < RB_RING_SPIN_ROUNDS) {
+      cpu_relax();
+    } else {
+      sched_yield();
+    }
+  }
+
+  struct timeval now;
+  struct timespec abstime;
+  gettimeofday(&now, NULL);
+  abstime.tv_sec = now.tv_sec + timeout_ms / 1000;
+  abstime.tv_nsec = now.tv_usec * 1000 + (timeout_ms % 1000) * 1000000;
+  if (abstime.tv_nsec >= 1000000000) {
+    abstime.tv_sec++;
+    abstime.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&ring->mutex);
+  ATOMIC_STORE_RELEASE(&ring->sleeping, 1);
+  ATOMIC_FULL_FENCE();
+
+  ret = rb_ring_pop_batch(ring, msgs, max_msgs);
+  if (0 == ret) {
+    pthread_cond_timedwait(&ring->cond, &ring->mutex, &abstime);
+  }
+
+  ATOMIC_STORE_RELEASE(&ring->sleeping, 0);
+  pthread_mutex_unlock(&ring->mutex);
+
+  if (0 == ret) {
+    ret = rb_ring_pop_batch(ring, msgs, max_msgs);
+  }
+
+  return ret;
+}
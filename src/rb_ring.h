@@ -0,0 +1,162 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "../config.h"
+
+#include "f2k.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  Bounded lock-free ring. Any number of threads can push messages. Only one
+  thread (the owner) is expected to consume them, but other threads can
+  steal the oldest message with rb_ring_try_pop_type (i.e., to drop it).
+  Every slot carries its own sequence number, so producers only contend on
+  the head index CAS, and the consumer claims a whole batch of messages with
+  just one CAS on the tail index.
+
+  The consumer can wait for messages spinning a little and then sleeping in a
+  condition variable. Producers only touch the mutex if the consumer is
+  actually sleeping.
+*/
+
+/// Ring message
+struct rb_ring_msg {
+  void *ptr;     ///< Message payload
+  unsigned type; ///< User defined message type
+};
+
+struct rb_ring_slot;
+
+/// Ring. Treat it as opaque, and use rb_ring_* functions
+struct rb_ring {
+#ifndef NDEBUG
+#define RB_RING_MAGIC 0x1C1C1C0A1C1C1C0AL
+  uint64_t magic;
+#endif
+  struct rb_ring_slot *slots;
+  size_t mask;
+
+  /* Producers and consumer indexes live in different cache lines */
+  char pad0[64];
+  uint64_t head; ///< Producers index
+  char pad1[64];
+  uint64_t tail; ///< Consumers index
+  char pad2[64];
+
+  /// Consumer is sleeping (or about to sleep) on cond
+  int sleeping;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+/** Initialize a ring
+  @param ring Ring
+  @param size Ring capacity. Will be rounded up to a power of 2
+  @return 0 if success, !0 in other case
+  */
+int rb_ring_init(struct rb_ring *ring, size_t size);
+
+/** Free ring resources. Messages still in the ring are not freed
+  @param ring Ring
+  */
+void rb_ring_done(struct rb_ring *ring);
+
+/** Ring capacity
+  @param ring Ring
+  @return Maximum number of messages the ring can hold
+  */
+static inline size_t rb_ring_size(const struct rb_ring *ring) {
+  return ring->mask + 1;
+}
+
+/** Number of messages waiting in the ring. Only a hint if other threads are
+  using the ring.
+  @param ring Ring
+  @return Number of queued messages
+  */
+static inline size_t rb_ring_count(const struct rb_ring *ring) {
+  /* Load tail first, so head can't be behind it */
+  const uint64_t tail = ATOMIC_LOAD_ACQUIRE(&ring->tail);
+  return ATOMIC_LOAD_ACQUIRE(&ring->head) - tail;
+}
+
+/** Try to push a message in the ring, waking up the consumer if needed. Can
+  be called from any thread.
+  @param ring Ring
+  @param ptr Message payload
+  @param type Message type
+  @return 0 if pushed, !0 if ring is full
+  */
+int rb_ring_try_push(struct rb_ring *ring, void *ptr, unsigned type);
+
+/** Try to push many messages in the ring, claiming all their slots at once
+  and waking up the consumer only once. Can be called from any thread.
+  @param ring Ring
+  @param ptrs Messages payloads
+  @param n Number of messages
+  @param type Type of all messages
+  @return Number of pushed messages, that are always the first ones of ptrs.
+  Less than n if ring is (almost) full.
+  */
+size_t rb_ring_try_push_batch(struct rb_ring *ring, void **ptrs, size_t n,
+                                                                unsigned type);
+
+/** Push a message in the ring, waiting for the consumer to make room if the
+  ring is full.
+  @param ring Ring
+  @param ptr Message payload
+  @param type Message type
+  */
+void rb_ring_push(struct rb_ring *ring, void *ptr, unsigned type);
+
+/** Pop up to max_msgs messages from the ring.
+  @param ring Ring
+  @param msgs Messages output array
+  @param max_msgs msgs array size
+  @return Number of popped messages
+  */
+size_t rb_ring_pop_batch(struct rb_ring *ring, struct rb_ring_msg *msgs,
+                                                              size_t max_msgs);
+
+/** Pop up to max_msgs messages, waiting up to timeout_ms for the first one.
+  The consumer spins a few rounds before going to sleep. Can only be called
+  from the consumer thread.
+  @param ring Ring
+  @param msgs Messages output array
+  @param max_msgs msgs array size
+  @param timeout_ms Max time to sleep
+  @return Number of popped messages (0 if timeout)
+  */
+size_t rb_ring_pop_batch_timedwait(struct rb_ring *ring,
+          struct rb_ring_msg *msgs, size_t max_msgs, unsigned timeout_ms);
+
+/** Pop the oldest message of the ring, but only if it is of the given type.
+  Can be called from any thread.
+  @param ring Ring
+  @param msg Popped message
+  @param type Expected message type
+  @return 0 if popped, !0 if ring is empty or oldest message is of other type
+  */
+int rb_ring_try_pop_type(struct rb_ring *ring, struct rb_ring_msg *msg,
+                                                                unsigned type);
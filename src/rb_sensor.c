@@ -29,6 +29,29 @@
 // Private //
 /////////////
 
+/// Incremented every time a sensors database is released, so sensor caches
+/// know they have to flush
+static atomic_uint64_t sensors_db_generation;
+
+struct sensor_cache_entry {
+  uint32_t ip;
+  bool used;
+  sensor_t *sensor; ///< NULL if IP is not a known sensor
+};
+
+struct sensor_cache {
+#ifndef NDEBUG
+#define SENSOR_CACHE_MAGIC 0x5E5C4C5E5C4C5E5CL
+  uint64_t magic;
+#endif
+  /// Database the cache entries belong to
+  const sensors_db_t *database;
+  /// sensors_db_generation when the cache was filled
+  uint64_t generation;
+  size_t mask;
+  struct sensor_cache_entry *entries;
+};
+
 #ifdef HAVE_UDNS
 #define ENABLE_PTR_DNS_CLIENT 1 << 0
 #define ENABLE_PTR_DNS_TARGET 1 << 1
@@ -581,13 +604,45 @@ static void free_all_templates(sensors_db_t *database) {
   dsensors_free(sensor_list);
 }
 
+/**
+ * Prints the packets dropped because of worker overload of every sensor
+ *
+ * @param database Sensors database
+ */
+static void print_sensors_dropped_packets(sensors_db_t *database) {
+  size_t list_length = 0;
+  sensor_t **sensor_list = sensors_db_list(database, &list_length);
+  if (!sensor_list) {
+    return;
+  }
+
+  for (size_t i = 0; i < list_length; i++) {
+    const sensor_t *sensor = sensor_list[i];
+    const uint64_t dropped_packets =
+        sensor ? sensor_get_dropped_packets(sensor) : 0;
+    if (dropped_packets > 0) {
+      traceEvent(TRACE_NORMAL,
+                 "Sensor %s: %" PRIu64 " packets dropped by worker overload",
+                 sensor_ip_string(sensor), dropped_packets);
+    }
+  }
+
+  dsensors_free(sensor_list);
+}
+
 ////////////////
 // Public API //
 ////////////////
 
 void delete_rb_sensors_db(sensors_db_t *database) {
+  print_sensors_dropped_packets(database);
   free_all_templates(database);
   sensors_db_destroy(database);
+  ATOMIC_OP(add, fetch, &sensors_db_generation.value, 1);
+}
+
+uint64_t sensors_db_current_generation(void) {
+  return ATOMIC_OP(fetch, add, &sensors_db_generation.value, 0);
 }
 
 sensor_t *get_sensor(sensors_db_t *database, uint64_t ip) {
@@ -602,6 +657,71 @@ sensor_t *get_sensor(sensors_db_t *database, uint64_t ip) {
   return sensors_db_get(database, ip_address);
 }
 
+struct sensor_cache *new_sensor_cache(size_t size) {
+  size_t entries = 1;
+  while (entries < size) {
+    entries <<= 1;
+  }
+
+  struct sensor_cache *cache = calloc(1, sizeof(*cache));
+  if (cache) {
+    cache->entries = calloc(entries, sizeof(cache->entries[0]));
+  }
+
+  if (!cache || !cache->entries) {
+    traceEvent(TRACE_ERROR, "Couldn't allocate sensor cache (out of memory?)");
+    free(cache);
+    return NULL;
+  }
+
+#ifdef SENSOR_CACHE_MAGIC
+  cache->magic = SENSOR_CACHE_MAGIC;
+#endif
+  cache->mask = entries - 1;
+  return cache;
+}
+
+void sensor_cache_done(struct sensor_cache *cache) {
+  if (!cache) {
+    return;
+  }
+
+#ifdef SENSOR_CACHE_MAGIC
+  assert(SENSOR_CACHE_MAGIC == cache->magic);
+#endif
+  free(cache->entries);
+  free(cache);
+}
+
+sensor_t *sensor_cache_get_sensor(struct sensor_cache *cache,
+                                  sensors_db_t *database, uint32_t ip) {
+  assert(cache);
+#ifdef SENSOR_CACHE_MAGIC
+  assert(SENSOR_CACHE_MAGIC == cache->magic);
+#endif
+
+  const uint64_t generation = sensors_db_current_generation();
+  if (unlikely(cache->database != database ||
+               cache->generation != generation)) {
+    memset(cache->entries, 0, (cache->mask + 1) * sizeof(cache->entries[0]));
+    cache->database = database;
+    cache->generation = generation;
+  }
+
+  uint32_t hash = ip * UINT32_C(2654435761);
+  hash ^= hash >> 16;
+  const size_t idx = hash & cache->mask;
+  struct sensor_cache_entry *entry = &cache->entries[idx];
+  if (likely(entry->used && entry->ip == ip)) {
+    return entry->sensor;
+  }
+
+  entry->sensor = get_sensor(database, ip);
+  entry->ip = ip;
+  entry->used = true;
+  return entry->sensor;
+}
+
 const char *sensor_ip_string(const sensor_t *sensor) {
   return sensor_get_network_string(sensor);
 }
@@ -680,21 +800,20 @@ observation_id_interface_name(observation_id_t *observation_id,
 }
 
 const char *network_name(observation_id_t *obs_id, const uint8_t ip[16]) {
-  const network_t *network = observation_id_get_network(obs_id, ip);
-  if (!network) {
-    return NULL;
-  }
-
-  return network_get_name(network);
+  const char *name = NULL;
+  network_info(obs_id, ip, NULL, &name);
+  return name;
 }
 
 const char *network_ip(observation_id_t *obs_id, const uint8_t ip[16]) {
-  const network_t *network = observation_id_get_network(obs_id, ip);
-  if (!network) {
-    return NULL;
-  }
+  const char *ip_str = NULL;
+  network_info(obs_id, ip, &ip_str, NULL);
+  return ip_str;
+}
 
-  return network_get_ip_str(network);
+bool network_info(observation_id_t *obs_id, const uint8_t ip[16],
+                  const char **ip_str, const char **name) {
+  return observation_id_get_network_info(obs_id, ip, ip_str, name);
 }
 
 inline const char *
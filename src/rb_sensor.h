@@ -68,8 +68,58 @@ sensors_db_t *read_rb_config(const char *json_path, worker_t **worker_list,
 
 void delete_rb_sensors_db(sensors_db_t *database);
 
+/**
+ * Sensors database generation. It changes every time a sensors database is
+ * released, so pointers obtained from it can't be used anymore.
+ *
+ * @return Current generation.
+ */
+uint64_t sensors_db_current_generation(void);
+
 sensor_t *get_sensor(sensors_db_t *database, uint64_t ip);
 
+//////////////////
+// Sensor cache //
+//////////////////
+
+/**
+ * Exporter IP to sensor cache, so the sensors database is only searched the
+ * first time a given exporter is seen. It is not thread safe: every packet
+ * reader thread must have its own cache. It is automatically flushed when
+ * the sensors database is reloaded.
+ */
+struct sensor_cache;
+
+/// Default number of sensor cache entries
+#define SENSOR_CACHE_DEFAULT_SIZE 4096
+
+/**
+ * Creates a sensor cache.
+ *
+ * @param  size Number of entries. Will be rounded up to a power of 2.
+ * @return      New cache, or NULL if no memory.
+ */
+struct sensor_cache *new_sensor_cache(size_t size);
+
+/**
+ * Frees a sensor cache.
+ *
+ * @param cache Cache to free.
+ */
+void sensor_cache_done(struct sensor_cache *cache);
+
+/**
+ * Same as get_sensor, but looking first in the cache. Unknown sensors are
+ * cached too.
+ *
+ * @param  cache    Sensor cache.
+ * @param  database Sensors database.
+ * @param  ip       Exporter IPv4 address.
+ * @return          Sensor, or NULL if it is not in the database.
+ */
+sensor_t *sensor_cache_get_sensor(struct sensor_cache *cache,
+                                  sensors_db_t *database, uint32_t ip);
+
 const char *sensor_ip_string(const sensor_t *sensor);
 
 observation_id_t *get_sensor_observation_id(sensor_t *sensor, uint32_t obs_id);
@@ -110,6 +160,16 @@ const char *network_name(observation_id_t *obs_id, const uint8_t ip[16]);
 
 const char *network_ip(observation_id_t *obs_id, const uint8_t ip[16]);
 
+/** Search the observation id home net that contains an ip
+  @param obs_id Observation id
+  @param ip IPv6 (or IPv4 mapped) address
+  @param ip_str Home net address string (NULL if not found). Can be NULL
+  @param name Home net name (NULL if not found). Can be NULL
+  @return true if ip is in a home net
+  */
+bool network_info(observation_id_t *obs_id, const uint8_t ip[16],
+                  const char **ip_str, const char **name);
+
 const char *
 observation_id_interface_description(observation_id_t *observation_id,
                                      uint64_t interface_id);
@@ -0,0 +1,286 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rb_shm_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RB_SHM_RING_MAGIC 0xF2C05A1F2C05A100ULL
+
+#define CACHE_LINE 64
+
+/// File header. Writers index lives in its own cache line
+struct rb_shm_ring_hdr {
+  uint64_t magic;     ///< Written last, when the file is ready
+  uint32_t version;
+  uint32_t slot_size; ///< Bytes of every slot, including slot header
+  uint64_t n_slots;   ///< Power of 2
+  char pad0[CACHE_LINE - 3 * sizeof(uint64_t)];
+  uint64_t head;      ///< Next sequence number to write
+  char pad1[CACHE_LINE - sizeof(uint64_t)];
+};
+
+/// Ring slot
+struct rb_shm_ring_slot {
+  /// Sequence lock: (seq + 1) << 1 when record seq is ready, |1 while it is
+  /// being written, 0 if never written
+  uint64_t lock;
+  uint64_t key;
+  uint32_t len;
+  uint32_t reserved;
+  char payload[];
+};
+
+static uint64_t slot_lock_of(uint64_t seq) {
+  return (seq + 1) << 1;
+}
+
+static struct rb_shm_ring_slot *ring_slot(const struct rb_shm_ring *ring,
+                                                                uint64_t seq) {
+  const struct rb_shm_ring_hdr *hdr = ring->hdr;
+  char *slots = (char *)ring->hdr + sizeof(*hdr);
+
+  return (struct rb_shm_ring_slot *)(slots +
+    (seq & (hdr->n_slots - 1)) * hdr->slot_size);
+}
+
+static size_t round_up_pow2(size_t n) {
+  size_t ret = 1;
+  while (ret < n) {
+    ret <<= 1;
+  }
+  return ret;
+}
+
+int rb_shm_ring_create(struct rb_shm_ring *ring, const char *path,
+                                            size_t n_slots, size_t slot_size) {
+  int fd;
+  void *map;
+
+  n_slots = round_up_pow2(n_slots ? n_slots : 1);
+  if (slot_size <= sizeof(struct rb_shm_ring_slot)) {
+    slot_size = sizeof(struct rb_shm_ring_slot) + 1;
+  }
+  slot_size = (slot_size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+  if (slot_size > UINT32_MAX ||
+            n_slots > (SIZE_MAX - sizeof(struct rb_shm_ring_hdr)) / slot_size) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(ring, 0, sizeof(*ring));
+  ring->map_size = sizeof(struct rb_shm_ring_hdr) + n_slots * slot_size;
+  ring->writable = 1;
+
+  /* Readers of a previous ring keep their (old) file */
+  if (0 != unlink(path) && ENOENT != errno) {
+    return -1;
+  }
+
+  fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (0 != ftruncate(fd, ring->map_size)) {
+    const int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == map) {
+    return -1;
+  }
+
+  /* File is all zeros: every slot is empty */
+  ring->hdr = map;
+  ring->hdr->version = RB_SHM_RING_VERSION;
+  ring->hdr->slot_size = slot_size;
+  ring->hdr->n_slots = n_slots;
+  __atomic_store_n(&ring->hdr->magic, RB_SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+int rb_shm_ring_open(struct rb_shm_ring *ring, const char *path) {
+  const struct rb_shm_ring_hdr *hdr;
+  struct stat st;
+  void *map;
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (0 != fstat(fd, &st)) {
+    const int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  if ((size_t)st.st_size < sizeof(*hdr)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == map) {
+    return -1;
+  }
+
+  memset(ring, 0, sizeof(*ring));
+  ring->hdr = map;
+  ring->map_size = st.st_size;
+
+  hdr = ring->hdr;
+  if (RB_SHM_RING_MAGIC != __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) ||
+      RB_SHM_RING_VERSION != hdr->version ||
+      hdr->slot_size <= sizeof(struct rb_shm_ring_slot) ||
+      0 == hdr->n_slots || 0 != (hdr->n_slots & (hdr->n_slots - 1)) ||
+      hdr->n_slots > (ring->map_size - sizeof(*hdr)) / hdr->slot_size) {
+    rb_shm_ring_close(ring);
+    errno = EINVAL;
+    return -1;
+  }
+
+  return 0;
+}
+
+void rb_shm_ring_close(struct rb_shm_ring *ring) {
+  if (ring->hdr) {
+    munmap(ring->hdr, ring->map_size);
+    ring->hdr = NULL;
+  }
+}
+
+size_t rb_shm_ring_max_record_size(const struct rb_shm_ring *ring) {
+  return ring->hdr->slot_size - sizeof(struct rb_shm_ring_slot);
+}
+
+int rb_shm_ring_write(struct rb_shm_ring *ring, const void *buf, size_t len,
+                                                                uint64_t key) {
+  uint64_t seq, lock;
+  struct rb_shm_ring_slot *slot;
+
+  if (len > rb_shm_ring_max_record_size(ring)) {
+    return -1;
+  }
+
+  seq = __atomic_fetch_add(&ring->hdr->head, 1, __ATOMIC_RELAXED);
+  slot = ring_slot(ring, seq);
+
+  /* Take the slot. Readers of its previous record will notice the change */
+  lock = __atomic_load_n(&slot->lock, __ATOMIC_RELAXED);
+  for (;;) {
+    if ((lock & ~(uint64_t)1) >= slot_lock_of(seq)) {
+      /* A writer one lap ahead owns the slot: our record is already
+         overwritten */
+      return 0;
+    }
+
+    if (lock & 1) {
+      /* Previous lap writer is still copying its record */
+      sched_yield();
+      lock = __atomic_load_n(&slot->lock, __ATOMIC_RELAXED);
+    } else if (__atomic_compare_exchange_n(&slot->lock, &lock,
+          slot_lock_of(seq) | 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  slot->key = key;
+  slot->len = len;
+  memcpy(slot->payload, buf, len);
+
+  __atomic_store_n(&slot->lock, slot_lock_of(seq), __ATOMIC_RELEASE);
+  return 0;
+}
+
+void rb_shm_ring_reader_init(struct rb_shm_ring_reader *reader,
+                                              const struct rb_shm_ring *ring) {
+  reader->ring = ring;
+  reader->next_seq = __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE);
+  reader->lost = 0;
+}
+
+/** Skip the records a reader lost because of an overrun
+  @param reader Reader
+  */
+static void reader_skip_overrun(struct rb_shm_ring_reader *reader) {
+  const struct rb_shm_ring_hdr *hdr = reader->ring->hdr;
+  const uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+  /* Oldest record that is still (probably) there */
+  const uint64_t oldest = head > hdr->n_slots ? head - hdr->n_slots + 1 : 0;
+  const uint64_t next_seq = oldest > reader->next_seq ? oldest :
+    reader->next_seq + 1;
+
+  reader->lost += next_seq - reader->next_seq;
+  reader->next_seq = next_seq;
+}
+
+int rb_shm_ring_read(struct rb_shm_ring_reader *reader, void *buf,
+                              size_t buf_size, size_t *len, uint64_t *key) {
+  for (;;) {
+    const uint64_t seq = reader->next_seq;
+    const struct rb_shm_ring_slot *slot = ring_slot(reader->ring, seq);
+    const uint64_t expected_lock = slot_lock_of(seq);
+    const uint64_t lock = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+    size_t copy_len;
+
+    if (lock < expected_lock || lock == (expected_lock | 1)) {
+      return -1; /* Not written yet */
+    }
+
+    if (lock != expected_lock) {
+      reader_skip_overrun(reader);
+      continue;
+    }
+
+    *key = slot->key;
+    *len = slot->len;
+    copy_len = *len < buf_size ? *len : buf_size;
+    if (copy_len > rb_shm_ring_max_record_size(reader->ring)) {
+      copy_len = rb_shm_ring_max_record_size(reader->ring);
+    }
+    memcpy(buf, slot->payload, copy_len);
+
+    /* Writer could have reused the slot while we were copying */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->lock, __ATOMIC_RELAXED) != lock) {
+      reader_skip_overrun(reader);
+      continue;
+    }
+
+    reader->next_seq++;
+    return 0;
+  }
+}
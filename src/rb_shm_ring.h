@@ -0,0 +1,123 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  Memory mapped ring file, to publish flows to consumers of the same host.
+
+  f2k is the only writer, and any number of readers can map the file read
+  only. Every record is stored in a fixed size slot, tagged with its sequence
+  number. Writers never wait for readers: a slow reader detects that the
+  records it wanted have been overwritten (overrun), and skips them.
+
+  Each slot is protected by a sequence lock: writer marks it as busy, copies
+  the record, and marks it with the record sequence number. Readers copy the
+  record out and check the slot sequence did not change meanwhile. Writer
+  threads a lap apart take the slot in sequence order, and a writer that finds
+  a newer record in its slot drops its own one.
+
+  This file only depends on libc and gcc atomics, so consumers can embed it.
+*/
+
+/// File format version
+#define RB_SHM_RING_VERSION 1
+
+/// Default number of slots
+#define RB_SHM_RING_DEFAULT_SLOTS 65536
+/// Default slot size, including slot header
+#define RB_SHM_RING_DEFAULT_SLOT_SIZE 2048
+
+struct rb_shm_ring_hdr;
+
+/// Mapped ring
+struct rb_shm_ring {
+  struct rb_shm_ring_hdr *hdr;
+  size_t map_size;
+  int writable;
+};
+
+/** Create (or truncate) a ring file, and map it for writing
+  @param ring Ring to initialize
+  @param path File path
+  @param n_slots Number of slots. Will be rounded up to a power of 2
+  @param slot_size Size of each slot. Will be rounded up to a cache line
+  @return 0 if success, !0 in other case (errno is set)
+  */
+int rb_shm_ring_create(struct rb_shm_ring *ring, const char *path,
+                                              size_t n_slots, size_t slot_size);
+
+/** Map an existing ring file for reading
+  @param ring Ring to initialize
+  @param path File path
+  @return 0 if success, !0 in other case (errno is set, EINVAL if file is not
+  a valid ring)
+  */
+int rb_shm_ring_open(struct rb_shm_ring *ring, const char *path);
+
+/** Unmap ring. File is not deleted
+  @param ring Ring
+  */
+void rb_shm_ring_close(struct rb_shm_ring *ring);
+
+/** Biggest record a ring slot can hold
+  @param ring Ring
+  @return Max record size
+  */
+size_t rb_shm_ring_max_record_size(const struct rb_shm_ring *ring);
+
+/** Publish a record. Thread safe
+  @param ring Writable ring
+  @param buf Record
+  @param len Record length
+  @param key Record key (client mac)
+  @return 0 if success (or if a newer record already took its slot), !0 if
+  record is too big
+  */
+int rb_shm_ring_write(struct rb_shm_ring *ring, const void *buf, size_t len,
+                                                                uint64_t key);
+
+/// Ring reader position
+struct rb_shm_ring_reader {
+  const struct rb_shm_ring *ring;
+  uint64_t next_seq; ///< Next record to read
+  uint64_t lost;     ///< Records overwritten before they could be read
+};
+
+/** Start reading a ring from its current end (only new records)
+  @param reader Reader to initialize
+  @param ring Ring
+  */
+void rb_shm_ring_reader_init(struct rb_shm_ring_reader *reader,
+                                                const struct rb_shm_ring *ring);
+
+/** Read next record
+  @param reader Reader
+  @param buf Buffer to copy record into. Should be at least
+  rb_shm_ring_max_record_size bytes
+  @param buf_size Buffer size. Bigger records are truncated
+  @param len Record length
+  @param key Record key
+  @return 0 if a record has been read, !0 if there are no new records
+  */
+int rb_shm_ring_read(struct rb_shm_ring_reader *reader, void *buf,
+                            size_t buf_size, size_t *len, uint64_t *key);
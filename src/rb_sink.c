@@ -0,0 +1,580 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rb_sink.h"
+
+#include "f2k.h"
+#include "printbuf.h"
+#include "rb_lists.h"
+#include "rb_shm_ring.h"
+#include "util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/// Time between connection attempts of stream sockets
+#define UNIX_SINK_RECONNECT_S 1
+
+int rb_sink_parse(const char *arg, enum rb_sink_type *type,
+                                                          const char **path) {
+  static const struct {
+    const char *name;
+    enum rb_sink_type type;
+    bool need_path;
+  } sinks[] = {
+    {"kafka", RB_SINK_KAFKA, false},
+    {"file", RB_SINK_FILE, true},
+    {"null", RB_SINK_NULL, false},
+    {"unix-dgram", RB_SINK_UNIX_DGRAM, true},
+    {"unix-stream", RB_SINK_UNIX_STREAM, true},
+    {"shm", RB_SINK_SHM, true},
+  };
+  const char *colon = strchr(arg, ':');
+  const size_t name_len = colon ? (size_t)(colon - arg) : strlen(arg);
+  size_t i;
+
+  for (i = 0; i < RD_ARRAYSIZE(sinks); ++i) {
+    if (strlen(sinks[i].name) != name_len ||
+                              0 != strncmp(sinks[i].name, arg, name_len)) {
+      continue;
+    }
+
+    if (sinks[i].need_path != (colon && colon[1] != '\0')) {
+      traceEvent(TRACE_ERROR, "Sink %s %s a path", sinks[i].name,
+        sinks[i].need_path ? "needs" : "does not accept");
+      return -1;
+    }
+
+    *type = sinks[i].type;
+    *path = colon ? colon + 1 : NULL;
+    return 0;
+  }
+
+  traceEvent(TRACE_ERROR, "Unknown sink %s", arg);
+  return -1;
+}
+
+/*
+ * NULL SINK
+ */
+
+static void null_sink_send(struct rb_sink *sink __attribute__((unused)),
+    struct string_list *const *msgs __attribute__((unused)),
+    size_t n_msgs __attribute__((unused)),
+    struct worker_stats *stats __attribute__((unused))) {
+}
+
+static void null_sink_done(struct rb_sink *sink) {
+  free(sink);
+}
+
+struct rb_sink *rb_sink_null_new(void) {
+  static const struct rb_sink_ops null_sink_ops = {
+    .send = null_sink_send,
+    .done = null_sink_done,
+  };
+
+  struct rb_sink *sink = calloc(1, sizeof(*sink));
+  if (NULL == sink) {
+    traceEvent(TRACE_ERROR, "Can't allocate sink (out of memory?)");
+    return NULL;
+  }
+
+  sink->ops = &null_sink_ops;
+  return sink;
+}
+
+/*
+ * FILE SINK
+ */
+
+struct file_sink {
+  struct rb_sink sink;
+  pthread_mutex_t mutex;
+  char *path;
+  size_t rotate_bytes;
+  /// Bytes written to current file
+  size_t written;
+  /// Number of rotated files
+  unsigned rotations;
+  bool compress;
+  FILE *fp;
+#ifdef HAVE_ZLIB
+  gzFile gz;
+#endif
+};
+
+/** Open sink file. Need to hold sink mutex
+  @param sink File sink
+  @return 0 if success, !0 in other case
+  */
+static int file_sink_open(struct file_sink *sink) {
+  sink->written = 0;
+
+#ifdef HAVE_ZLIB
+  if (sink->compress) {
+    sink->gz = gzopen(sink->path, "ab");
+    if (NULL == sink->gz) {
+      goto err;
+    }
+    return 0;
+  }
+#endif
+
+  sink->fp = fopen(sink->path, "a");
+  if (NULL == sink->fp) {
+    goto err;
+  }
+
+  return 0;
+
+err:
+  traceEvent(TRACE_ERROR, "Can't open %s: %s", sink->path, strerror(errno));
+  return -1;
+}
+
+/** Check if sink file is open. Need to hold sink mutex
+  @param sink File sink
+  @return true if open
+  */
+static bool file_sink_is_open(const struct file_sink *sink) {
+#ifdef HAVE_ZLIB
+  if (sink->gz) {
+    return true;
+  }
+#endif
+  return NULL != sink->fp;
+}
+
+/** Close sink file. Need to hold sink mutex
+  @param sink File sink
+  */
+static void file_sink_close(struct file_sink *sink) {
+#ifdef HAVE_ZLIB
+  if (sink->gz) {
+    gzclose(sink->gz);
+    sink->gz = NULL;
+  }
+#endif
+  if (sink->fp) {
+    fclose(sink->fp);
+    sink->fp = NULL;
+  }
+}
+
+/** Move current file aside, and open a new one. Need to hold sink mutex
+  @param sink File sink
+  */
+static void file_sink_rotate(struct file_sink *sink) {
+  char rotated_path[PATH_MAX];
+
+  file_sink_close(sink);
+
+  snprintf(rotated_path, sizeof(rotated_path), "%s.%jd.%u", sink->path,
+    (intmax_t)time(NULL), sink->rotations++);
+  if (0 != rename(sink->path, rotated_path)) {
+    traceEvent(TRACE_ERROR, "Can't rename %s to %s: %s", sink->path,
+      rotated_path, strerror(errno));
+  }
+
+  file_sink_open(sink);
+}
+
+/** Write a buffer to sink file. Need to hold sink mutex
+  @param sink File sink
+  @param buf Buffer
+  @param len Buffer length
+  @return 0 if success, !0 in other case
+  */
+static int file_sink_write(struct file_sink *sink, const void *buf,
+                                                                  size_t len) {
+#ifdef HAVE_ZLIB
+  if (sink->gz) {
+    return len == (size_t)gzwrite(sink->gz, buf, len) ? 0 : -1;
+  }
+#endif
+  return len == fwrite(buf, 1, len, sink->fp) ? 0 : -1;
+}
+
+/** Length of the "\n" that terminates every message in stream sinks. CBOR
+  messages don't need it, since CBOR items delimit themselves (RFC 8742)
+  @return 1 if messages are newline terminated, 0 if not
+  */
+static size_t sink_newline_len(void) {
+  return OUTPUT_FORMAT_JSON == readOnlyGlobals.output_format ? 1 : 0;
+}
+
+static void file_sink_send(struct rb_sink *vsink,
+    struct string_list *const *msgs, size_t n_msgs,
+    struct worker_stats *stats) {
+  struct file_sink *sink = (struct file_sink *)vsink;
+  const size_t newline_len = sink_newline_len();
+  size_t i, n_dropped = 0;
+
+  pthread_mutex_lock(&sink->mutex);
+
+  if (!file_sink_is_open(sink) && 0 != file_sink_open(sink)) {
+    n_dropped = n_msgs;
+    goto unlock;
+  }
+
+  for (i = 0; i < n_msgs; ++i) {
+    const struct printbuf *pb = msgs[i]->string;
+    if (0 != file_sink_write(sink, pb->buf, pb->bpos) ||
+        0 != file_sink_write(sink, "\n", newline_len)) {
+      n_dropped++;
+      continue;
+    }
+    sink->written += pb->bpos + newline_len;
+  }
+
+  /* Make batch visible to readers. Compressed streams are only flushed when
+     closed, since every flush would worsen compression */
+  if (sink->fp) {
+    fflush(sink->fp);
+  }
+
+  if (sink->rotate_bytes > 0 && sink->written >= sink->rotate_bytes) {
+    file_sink_rotate(sink);
+  }
+
+unlock:
+  pthread_mutex_unlock(&sink->mutex);
+
+  if (unlikely(n_dropped > 0)) {
+    traceEvent(TRACE_ERROR, "Can't write %zu messages to %s", n_dropped,
+      sink->path);
+    if (stats) {
+      stats->num_sink_dropped_msgs += n_dropped;
+    }
+  }
+}
+
+static void file_sink_done(struct rb_sink *vsink) {
+  struct file_sink *sink = (struct file_sink *)vsink;
+
+  file_sink_close(sink);
+  pthread_mutex_destroy(&sink->mutex);
+  free(sink->path);
+  free(sink);
+}
+
+struct rb_sink *rb_sink_file_new(const char *path, size_t rotate_bytes,
+                                                              bool compress) {
+  static const struct rb_sink_ops file_sink_ops = {
+    .send = file_sink_send,
+    .done = file_sink_done,
+  };
+
+#ifndef HAVE_ZLIB
+  if (compress) {
+    traceEvent(TRACE_ERROR, "f2k was built without zlib, can't compress %s",
+      path);
+    return NULL;
+  }
+#endif
+
+  struct file_sink *sink = calloc(1, sizeof(*sink));
+  if (NULL == sink || NULL == (sink->path = strdup(path))) {
+    traceEvent(TRACE_ERROR, "Can't allocate sink (out of memory?)");
+    free(sink);
+    return NULL;
+  }
+
+  sink->sink.ops = &file_sink_ops;
+  sink->rotate_bytes = rotate_bytes;
+  sink->compress = compress;
+  pthread_mutex_init(&sink->mutex, NULL);
+
+  if (0 != file_sink_open(sink)) {
+    file_sink_done(&sink->sink);
+    return NULL;
+  }
+
+  return &sink->sink;
+}
+
+/*
+ * UNIX SOCKET SINK
+ */
+
+struct unix_sink {
+  struct rb_sink sink;
+  /// Stream socket writes serialization
+  pthread_mutex_t mutex;
+  struct sockaddr_un addr;
+  int type;
+  /// Socket. -1 if stream socket is not connected
+  int fd;
+  /// Don't try to connect stream socket before this time
+  time_t next_connect;
+};
+
+/** Connect stream socket, if it is time to try. Need to hold sink mutex
+  @param sink Unix sink
+  @return 0 if connected, !0 in other case
+  */
+static int unix_sink_connect(struct unix_sink *sink) {
+  const time_t now = time(NULL);
+
+  if (sink->fd >= 0) {
+    return 0;
+  }
+
+  if (now < sink->next_connect) {
+    return -1;
+  }
+
+  sink->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sink->fd >= 0 && 0 != connect(sink->fd,
+                  (const struct sockaddr *)&sink->addr, sizeof(sink->addr))) {
+    traceEvent(TRACE_ERROR, "Can't connect to %s: %s", sink->addr.sun_path,
+      strerror(errno));
+    close(sink->fd);
+    sink->fd = -1;
+  }
+
+  if (sink->fd < 0) {
+    sink->next_connect = now + UNIX_SINK_RECONNECT_S;
+    return -1;
+  }
+
+  return 0;
+}
+
+/** Write a message and its line terminator to a stream socket
+  @param fd Socket
+  @param pb Message
+  @return 0 if success, !0 in other case
+  */
+static int unix_sink_write_line(int fd, const struct printbuf *pb) {
+  struct iovec iov[] = {
+    {.iov_base = pb->buf, .iov_len = pb->bpos},
+    {.iov_base = "\n", .iov_len = sink_newline_len()},
+  };
+  struct msghdr msg = {
+    .msg_iov = iov,
+    .msg_iovlen = RD_ARRAYSIZE(iov),
+  };
+
+  while (msg.msg_iovlen > 0) {
+    ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      return -1;
+    }
+
+    /* Skip sent data */
+    while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+      sent -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen > 0) {
+      msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + sent;
+      msg.msg_iov->iov_len -= sent;
+    }
+  }
+
+  return 0;
+}
+
+static void unix_sink_send(struct rb_sink *vsink,
+    struct string_list *const *msgs, size_t n_msgs,
+    struct worker_stats *stats) {
+  struct unix_sink *sink = (struct unix_sink *)vsink;
+  size_t i = 0, n_dropped = 0;
+  int err = 0;
+
+  if (SOCK_DGRAM == sink->type) {
+    /* Never block the worker if nobody is reading */
+    for (i = 0; i < n_msgs; ++i) {
+      const struct printbuf *pb = msgs[i]->string;
+      if (sendto(sink->fd, pb->buf, pb->bpos, MSG_DONTWAIT | MSG_NOSIGNAL,
+            (const struct sockaddr *)&sink->addr, sizeof(sink->addr)) < 0) {
+        err = errno;
+        n_dropped++;
+      }
+    }
+  } else {
+    pthread_mutex_lock(&sink->mutex);
+    if (0 == unix_sink_connect(sink)) {
+      for (i = 0; i < n_msgs; ++i) {
+        if (0 != unix_sink_write_line(sink->fd, msgs[i]->string)) {
+          err = errno;
+          close(sink->fd);
+          sink->fd = -1;
+          break;
+        }
+      }
+    }
+    n_dropped = n_msgs - i;
+    pthread_mutex_unlock(&sink->mutex);
+  }
+
+  if (unlikely(n_dropped > 0)) {
+    if (err) {
+      /* Only one log per batch */
+      traceEvent(TRACE_ERROR, "Can't send %zu messages to %s: %s", n_dropped,
+        sink->addr.sun_path, strerror(err));
+    }
+    if (stats) {
+      stats->num_sink_dropped_msgs += n_dropped;
+    }
+  }
+}
+
+static void unix_sink_done(struct rb_sink *vsink) {
+  struct unix_sink *sink = (struct unix_sink *)vsink;
+
+  if (sink->fd >= 0) {
+    close(sink->fd);
+  }
+  pthread_mutex_destroy(&sink->mutex);
+  free(sink);
+}
+
+struct rb_sink *rb_sink_unix_new(const char *path, int type) {
+  static const struct rb_sink_ops unix_sink_ops = {
+    .send = unix_sink_send,
+    .done = unix_sink_done,
+  };
+  struct unix_sink *sink = NULL;
+
+  assert(SOCK_DGRAM == type || SOCK_STREAM == type);
+
+  if (strlen(path) >= sizeof(sink->addr.sun_path)) {
+    traceEvent(TRACE_ERROR, "Socket path %s is too long", path);
+    return NULL;
+  }
+
+  sink = calloc(1, sizeof(*sink));
+  if (NULL == sink) {
+    traceEvent(TRACE_ERROR, "Can't allocate sink (out of memory?)");
+    return NULL;
+  }
+
+  sink->sink.ops = &unix_sink_ops;
+  sink->addr.sun_family = AF_UNIX;
+  strcpy(sink->addr.sun_path, path);
+  sink->type = type;
+  sink->fd = -1;
+  pthread_mutex_init(&sink->mutex, NULL);
+
+  if (SOCK_DGRAM == type) {
+    sink->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sink->fd < 0) {
+      traceEvent(TRACE_ERROR, "Can't create socket: %s", strerror(errno));
+      unix_sink_done(&sink->sink);
+      return NULL;
+    }
+  } else {
+    /* Reader can appear later */
+    pthread_mutex_lock(&sink->mutex);
+    unix_sink_connect(sink);
+    pthread_mutex_unlock(&sink->mutex);
+  }
+
+  return &sink->sink;
+}
+
+/*
+ * SHARED MEMORY RING SINK
+ */
+
+struct shm_sink {
+  struct rb_sink sink;
+  struct rb_shm_ring ring;
+  char *path;
+};
+
+static void shm_sink_send(struct rb_sink *vsink,
+    struct string_list *const *msgs, size_t n_msgs,
+    struct worker_stats *stats) {
+  struct shm_sink *sink = (struct shm_sink *)vsink;
+  size_t i, n_dropped = 0;
+
+  for (i = 0; i < n_msgs; ++i) {
+    const struct printbuf *pb = msgs[i]->string;
+    if (0 != rb_shm_ring_write(&sink->ring, pb->buf, pb->bpos,
+                                                      msgs[i]->client_mac)) {
+      n_dropped++;
+    }
+  }
+
+  if (unlikely(n_dropped > 0)) {
+    traceEvent(TRACE_ERROR, "%zu messages too big for %s slots", n_dropped,
+      sink->path);
+    if (stats) {
+      stats->num_sink_dropped_msgs += n_dropped;
+    }
+  }
+}
+
+static void shm_sink_done(struct rb_sink *vsink) {
+  struct shm_sink *sink = (struct shm_sink *)vsink;
+
+  /* Ring file is kept, so readers can drain it */
+  rb_shm_ring_close(&sink->ring);
+  free(sink->path);
+  free(sink);
+}
+
+struct rb_sink *rb_sink_shm_new(const char *path, size_t n_slots,
+                                                            size_t slot_size) {
+  static const struct rb_sink_ops shm_sink_ops = {
+    .send = shm_sink_send,
+    .done = shm_sink_done,
+  };
+
+  struct shm_sink *sink = calloc(1, sizeof(*sink));
+  if (NULL == sink || NULL == (sink->path = strdup(path))) {
+    traceEvent(TRACE_ERROR, "Can't allocate sink (out of memory?)");
+    free(sink);
+    return NULL;
+  }
+
+  sink->sink.ops = &shm_sink_ops;
+  if (0 != rb_shm_ring_create(&sink->ring, path, n_slots, slot_size)) {
+    traceEvent(TRACE_ERROR, "Can't create ring %s: %s", path,
+      strerror(errno));
+    free(sink->path);
+    free(sink);
+    return NULL;
+  }
+
+  return &sink->sink;
+}
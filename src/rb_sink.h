@@ -0,0 +1,164 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "../config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+
+/*
+  Output sinks. Workers send every flow message to a sink, in batches of up to
+  RB_SINK_BATCH messages. Sinks that need to keep a message buffer (i.e.,
+  kafka) take its ownership setting its printbuf buf to NULL; the rest of
+  buffers are recycled by the caller after send.
+
+  Sinks shared among workers must be thread safe.
+*/
+
+struct string_list;
+struct worker_stats;
+
+/// Max messages handed to a sink in the same send call
+#define RB_SINK_BATCH 128
+
+struct rb_sink;
+
+/// Sink implementation
+struct rb_sink_ops {
+  /** Send a batch of messages
+    @param sink Sink
+    @param msgs Messages. Every node has a non-NULL string
+    @param n_msgs Number of messages
+    @param stats Stats to update. Can be NULL
+    */
+  void (*send)(struct rb_sink *sink, struct string_list *const *msgs,
+                                size_t n_msgs, struct worker_stats *stats);
+
+  /** Serve sink events. Can be NULL
+    @param sink Sink
+    @param timeout_ms Max time to wait for events
+    */
+  void (*poll)(struct rb_sink *sink, int timeout_ms);
+
+  /** Flush pending messages and free sink
+    @param sink Sink
+    */
+  void (*done)(struct rb_sink *sink);
+};
+
+/// Sink. Implementations embed it as their first member
+struct rb_sink {
+  const struct rb_sink_ops *ops;
+};
+
+/// Sink types, as selected in command line
+enum rb_sink_type {
+  RB_SINK_KAFKA,
+  RB_SINK_FILE,
+  RB_SINK_NULL,
+  RB_SINK_UNIX_DGRAM,
+  RB_SINK_UNIX_STREAM,
+  RB_SINK_SHM,
+};
+
+/** Parse a sink command line argument, with format <type>[:<path>]
+  @param arg Argument
+  @param type Sink type
+  @param path Sink path, pointing to arg, or NULL if sink type has no path
+  @return 0 if success, !0 if arg is not valid
+  */
+int rb_sink_parse(const char *arg, enum rb_sink_type *type, const char **path);
+
+/** Send a batch of messages
+  @see rb_sink_ops.send
+  */
+static inline void rb_sink_send(struct rb_sink *sink,
+    struct string_list *const *msgs, size_t n_msgs,
+    struct worker_stats *stats) {
+  sink->ops->send(sink, msgs, n_msgs, stats);
+}
+
+/** Serve sink events, or just wait if sink has nothing to serve
+  @see rb_sink_ops.poll
+  */
+static inline void rb_sink_poll(struct rb_sink *sink, int timeout_ms) {
+  if (sink->ops->poll) {
+    sink->ops->poll(sink, timeout_ms);
+  } else if (timeout_ms > 0) {
+    usleep(timeout_ms * 1000);
+  }
+}
+
+/** Sink of a worker, when workers are spread among many sinks. Consecutive
+  workers get different sinks, so every sink has a worker if there are no
+  more sinks than workers
+  @param sinks Sinks
+  @param n_sinks Number of sinks
+  @param worker Worker index
+  @return Worker sink
+  */
+static inline struct rb_sink *rb_sink_of_worker(struct rb_sink **sinks,
+                                              size_t n_sinks, size_t worker) {
+  return sinks[worker % n_sinks];
+}
+
+/** Flush pending messages and free sink
+  @param sink Sink
+  */
+static inline void rb_sink_done(struct rb_sink *sink) {
+  sink->ops->done(sink);
+}
+
+/** Sink that discards all messages, for benchmarking
+  @return New sink
+  */
+struct rb_sink *rb_sink_null_new(void);
+
+/** Sink that writes messages to a file, one per line (NDJSON). CBOR messages
+  are written back to back (CBOR sequence)
+  @param path File path. Rotated files are renamed to <path>.<time>.<n>
+  @param rotate_bytes Rotate file when it reaches this size. 0 to not rotate
+  @param compress Write gzip compressed files
+  @return New sink, or NULL in case of error
+  */
+struct rb_sink *rb_sink_file_new(const char *path, size_t rotate_bytes,
+                                                                bool compress);
+
+/** Sink that writes messages to a unix socket
+  @param path Socket path
+  @param type SOCK_DGRAM to send one message per datagram (dropping them if
+  nobody reads), or SOCK_STREAM to send them as in file sink (blocking if
+  reader is slow)
+  @return New sink, or NULL in case of error
+  */
+struct rb_sink *rb_sink_unix_new(const char *path, int type);
+
+/** Sink that publishes messages in a memory mapped ring file, for consumers
+  of the same host
+  @param path Ring file path. It is created again if it exists
+  @param n_slots Number of ring slots
+  @param slot_size Size of each slot. Bigger messages are dropped
+  @return New sink, or NULL in case of error
+  @see rb_shm_ring.h
+  */
+struct rb_sink *rb_sink_shm_new(const char *path, size_t n_slots,
+                                                            size_t slot_size);
@@ -0,0 +1,499 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rb_spill.h"
+
+#include "f2k.h"
+#include "util.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifndef NDEBUG
+#define RB_SPILL_MAGIC 0x5B1115B1115B1110L
+#endif
+
+/// Every record starts with this value, so truncated records can be detected
+#define RB_SPILL_RECORD_MAGIC 0x5B11u
+
+/// Segment file name suffix
+#define RB_SPILL_SEGMENT_SUFFIX ".spill"
+
+/// Record header. Message payload follows it
+struct rb_spill_record_hdr {
+  uint32_t magic;
+  uint32_t len;
+  uint64_t key;
+};
+
+struct rb_spill {
+#ifdef RB_SPILL_MAGIC
+  uint64_t magic;
+#endif
+  char *dir;
+  size_t segment_size, max_bytes;
+  unsigned fsync_batch;
+
+  pthread_mutex_t mutex;
+
+  /* Writer side */
+  int write_fd;               ///< Segment being written. -1 if not opened yet
+  uint64_t write_seq;         ///< Segment being written sequence number
+  size_t write_segment_bytes; ///< Segment being written size
+  unsigned unsynced_msgs;     ///< Messages appended since last fsync
+
+  /* Reader side. Reader never reaches writer segment, writer is rotated */
+  int read_fd;       ///< Segment being replayed. -1 if not opened yet
+  uint64_t read_seq;  ///< Segment being replayed sequence number
+  off_t read_offset;  ///< Next record offset
+  off_t read_size;    ///< Segment being replayed size
+
+  struct rb_spill_stats stats;
+};
+
+static void rb_spill_assert(const struct rb_spill *spill) {
+  (void)spill;
+#ifdef RB_SPILL_MAGIC
+  assert(RB_SPILL_MAGIC == spill->magic);
+#endif
+}
+
+/** Segment file path
+  @param spill Journal
+  @param seq Segment sequence number
+  @param path Output buffer
+  @param path_size Output buffer size
+  */
+static void segment_path(const struct rb_spill *spill, uint64_t seq,
+                                            char *path, size_t path_size) {
+  snprintf(path, path_size, "%s/%020"PRIu64 RB_SPILL_SEGMENT_SUFFIX,
+    spill->dir, seq);
+}
+
+/** Extract sequence number of a segment file name
+  @param name File name
+  @param seq Sequence number output
+  @return true if name is a segment file name
+  */
+static bool segment_seq(const char *name, uint64_t *seq) {
+  char *end = NULL;
+
+  if (!isdigit((unsigned char)name[0])) {
+    return false;
+  }
+
+  errno = 0;
+  *seq = strtoull(name, &end, 10);
+  return 0 == errno && 0 == strcmp(end, RB_SPILL_SEGMENT_SUFFIX);
+}
+
+/** Look for segments of a previous run
+  @param spill Journal
+  @return 0 if success, !0 in other case
+  */
+static int scan_segments(struct rb_spill *spill) {
+  struct dirent *entry;
+  bool found = false;
+  uint64_t min_seq = 0, max_seq = 0;
+  DIR *dir = opendir(spill->dir);
+
+  if (NULL == dir) {
+    traceEvent(TRACE_ERROR, "Can't open spill directory %s: %s", spill->dir,
+      strerror(errno));
+    return -1;
+  }
+
+  while ((entry = readdir(dir))) {
+    char path[PATH_MAX];
+    struct stat st;
+    uint64_t seq;
+
+    if (!segment_seq(entry->d_name, &seq)) {
+      continue;
+    }
+
+    segment_path(spill, seq, path, sizeof(path));
+    if (0 == stat(path, &st)) {
+      spill->stats.bytes += st.st_size;
+    }
+
+    if (!found || seq < min_seq) {
+      min_seq = seq;
+    }
+    if (!found || seq > max_seq) {
+      max_seq = seq;
+    }
+    found = true;
+  }
+
+  closedir(dir);
+
+  if (found) {
+    traceEvent(TRACE_NORMAL, "Found %"PRIu64" bytes of spilled messages in %s",
+      spill->stats.bytes, spill->dir);
+    spill->read_seq = min_seq;
+    spill->write_seq = max_seq + 1;
+  }
+
+  return 0;
+}
+
+struct rb_spill *rb_spill_new(const char *dir, size_t segment_size,
+                                      size_t max_bytes, unsigned fsync_batch) {
+  struct rb_spill *spill = calloc(1, sizeof(*spill));
+  if (NULL == spill) {
+    traceEvent(TRACE_ERROR, "Can't allocate spill journal (out of memory?)");
+    return NULL;
+  }
+
+#ifdef RB_SPILL_MAGIC
+  spill->magic = RB_SPILL_MAGIC;
+#endif
+  spill->segment_size = segment_size;
+  spill->max_bytes = max_bytes;
+  spill->fsync_batch = fsync_batch;
+  spill->write_fd = spill->read_fd = -1;
+
+  spill->dir = strdup(dir);
+  if (NULL == spill->dir) {
+    traceEvent(TRACE_ERROR, "Can't allocate spill journal (out of memory?)");
+    goto err;
+  }
+
+  if (0 != mkdir(dir, 0700) && EEXIST != errno) {
+    traceEvent(TRACE_ERROR, "Can't create spill directory %s: %s", dir,
+      strerror(errno));
+    goto err;
+  }
+
+  if (0 != scan_segments(spill)) {
+    goto err;
+  }
+
+  pthread_mutex_init(&spill->mutex, NULL);
+  return spill;
+
+err:
+  free(spill->dir);
+  free(spill);
+  return NULL;
+}
+
+/** Sync current segment. Need to hold spill mutex
+  @param spill Journal
+  */
+static void sync_write_segment(struct rb_spill *spill) {
+  if (spill->write_fd >= 0 && spill->unsynced_msgs > 0) {
+    if (0 != fdatasync(spill->write_fd)) {
+      traceEvent(TRACE_ERROR, "Can't sync spill segment: %s", strerror(errno));
+    }
+    spill->unsynced_msgs = 0;
+  }
+}
+
+/** Close current write segment, so next append opens a new one. Need to hold
+  spill mutex
+  @param spill Journal
+  */
+static void rotate_write_segment(struct rb_spill *spill) {
+  if (spill->write_fd < 0) {
+    return;
+  }
+
+  sync_write_segment(spill);
+  close(spill->write_fd);
+  spill->write_fd = -1;
+  spill->write_segment_bytes = 0;
+  spill->write_seq++;
+}
+
+/** Close and delete current read segment. Need to hold spill mutex
+  @param spill Journal
+  */
+static void remove_read_segment(struct rb_spill *spill) {
+  char path[PATH_MAX];
+
+  if (spill->read_fd >= 0) {
+    struct stat st;
+    if (0 == fstat(spill->read_fd, &st)) {
+      spill->stats.bytes -= min(spill->stats.bytes, (uint64_t)st.st_size);
+    }
+    close(spill->read_fd);
+    spill->read_fd = -1;
+  }
+
+  segment_path(spill, spill->read_seq, path, sizeof(path));
+  if (0 != unlink(path) && ENOENT != errno) {
+    traceEvent(TRACE_ERROR, "Can't delete spill segment %s: %s", path,
+      strerror(errno));
+  }
+
+  spill->read_seq++;
+  spill->read_offset = 0;
+}
+
+void rb_spill_done(struct rb_spill *spill) {
+  rb_spill_assert(spill);
+
+  rotate_write_segment(spill);
+  if (spill->read_fd >= 0) {
+    close(spill->read_fd);
+  }
+  pthread_mutex_destroy(&spill->mutex);
+  free(spill->dir);
+  free(spill);
+}
+
+/** Append a message. Need to hold spill mutex
+  @see rb_spill_append
+  */
+static int spill_append0(struct rb_spill *spill, void *buf, size_t len,
+                                                                uint64_t key) {
+  struct rb_spill_record_hdr hdr = {
+    .magic = RB_SPILL_RECORD_MAGIC,
+    .len = len,
+    .key = key,
+  };
+  struct iovec iov[] = {
+    {.iov_base = &hdr, .iov_len = sizeof(hdr)},
+    {.iov_base = buf, .iov_len = len},
+  };
+  const size_t record_size = sizeof(hdr) + len;
+  ssize_t written;
+
+  if (len > UINT32_MAX ||
+                      spill->stats.bytes + record_size > spill->max_bytes) {
+    return -1;
+  }
+
+  if (spill->write_fd < 0) {
+    char path[PATH_MAX];
+    segment_path(spill, spill->write_seq, path, sizeof(path));
+    spill->write_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (spill->write_fd < 0) {
+      traceEvent(TRACE_ERROR, "Can't open spill segment %s: %s", path,
+        strerror(errno));
+      return -1;
+    }
+  }
+
+  written = writev(spill->write_fd, iov, RD_ARRAYSIZE(iov));
+  if (written < 0 || (size_t)written != record_size) {
+    traceEvent(TRACE_ERROR, "Can't write to spill segment: %s",
+      written < 0 ? strerror(errno) : "Short write");
+    /* Don't append anything after a partial record */
+    if (written > 0) {
+      spill->stats.bytes += written;
+      spill->write_segment_bytes += written;
+    }
+    rotate_write_segment(spill);
+    return -1;
+  }
+
+  spill->stats.bytes += record_size;
+  spill->write_segment_bytes += record_size;
+  if (++spill->unsynced_msgs >= spill->fsync_batch) {
+    sync_write_segment(spill);
+  }
+
+  if (spill->write_segment_bytes >= spill->segment_size) {
+    rotate_write_segment(spill);
+  }
+
+  return 0;
+}
+
+int rb_spill_append(struct rb_spill *spill, void *buf, size_t len,
+                                                                uint64_t key) {
+  int rc;
+  rb_spill_assert(spill);
+
+  pthread_mutex_lock(&spill->mutex);
+  rc = spill_append0(spill, buf, len, key);
+  if (0 == rc) {
+    spill->stats.spilled_msgs++;
+  } else {
+    spill->stats.dropped_msgs++;
+  }
+  pthread_mutex_unlock(&spill->mutex);
+
+  return rc;
+}
+
+void rb_spill_sync(struct rb_spill *spill) {
+  rb_spill_assert(spill);
+
+  pthread_mutex_lock(&spill->mutex);
+  sync_write_segment(spill);
+  pthread_mutex_unlock(&spill->mutex);
+}
+
+/// read_record return codes
+enum read_record_rc {
+  READ_RECORD_OK,        ///< Record read
+  READ_RECORD_END,       ///< No more records in segment
+  READ_RECORD_TRUNCATED, ///< Rest of the segment is not valid
+  READ_RECORD_NOMEM,     ///< Can't allocate record, try again later
+};
+
+/** Read next record of the read segment. Need to hold spill mutex
+  @param spill Journal
+  @param hdr Record header
+  @param buf Record payload output. Only valid if READ_RECORD_OK is returned
+  @return Read status
+  */
+static enum read_record_rc read_record(struct rb_spill *spill,
+                                  struct rb_spill_record_hdr *hdr, void **buf) {
+  ssize_t rc = pread(spill->read_fd, hdr, sizeof(*hdr), spill->read_offset);
+
+  *buf = NULL;
+  if (0 == rc) {
+    return READ_RECORD_END;
+  }
+
+  /* Check length before trusting it to malloc */
+  if (rc != sizeof(*hdr) || RB_SPILL_RECORD_MAGIC != hdr->magic ||
+      spill->read_size - spill->read_offset <
+                                      (off_t)(sizeof(*hdr) + hdr->len)) {
+    goto truncated;
+  }
+
+  *buf = malloc(hdr->len ? hdr->len : 1);
+  if (NULL == *buf) {
+    traceEvent(TRACE_ERROR, "Can't allocate spilled message (out of memory?)");
+    return READ_RECORD_NOMEM;
+  }
+
+  rc = pread(spill->read_fd, *buf, hdr->len,
+    spill->read_offset + sizeof(*hdr));
+  if (rc < 0 || (size_t)rc != hdr->len) {
+    goto truncated;
+  }
+
+  return READ_RECORD_OK;
+
+truncated:
+  traceEvent(TRACE_WARNING, "Truncated spill segment %"PRIu64" at offset %jd, "
+    "skipping the rest of it", spill->read_seq, (intmax_t)spill->read_offset);
+  free(*buf);
+  *buf = NULL;
+  return READ_RECORD_TRUNCATED;
+}
+
+/** Open next segment to replay. Need to hold spill mutex
+  @param spill Journal
+  @return 0 if success, !0 if there is no segment to replay
+  */
+static int open_read_segment(struct rb_spill *spill) {
+  while (spill->read_fd < 0) {
+    char path[PATH_MAX];
+
+    if (spill->read_seq == spill->write_seq) {
+      if (0 == spill->write_segment_bytes) {
+        return -1; /* Nothing to replay */
+      }
+      /* Never read the segment we are writing */
+      rotate_write_segment(spill);
+    }
+
+    segment_path(spill, spill->read_seq, path, sizeof(path));
+    spill->read_fd = open(path, O_RDONLY);
+    if (spill->read_fd < 0) {
+      if (ENOENT != errno) {
+        traceEvent(TRACE_ERROR, "Can't open spill segment %s: %s", path,
+          strerror(errno));
+        return -1;
+      }
+
+      /* Hole in sequence, just skip it */
+      spill->read_seq++;
+      spill->read_offset = 0;
+      continue;
+    }
+
+    struct stat st;
+    if (0 != fstat(spill->read_fd, &st)) {
+      traceEvent(TRACE_ERROR, "Can't stat spill segment %s: %s", path,
+        strerror(errno));
+      close(spill->read_fd);
+      spill->read_fd = -1;
+      return -1;
+    }
+    spill->read_size = st.st_size;
+  }
+
+  return 0;
+}
+
+size_t rb_spill_replay(struct rb_spill *spill, size_t max_msgs,
+                                        rb_spill_replay_cb cb, void *opaque) {
+  size_t ret = 0;
+  rb_spill_assert(spill);
+
+  pthread_mutex_lock(&spill->mutex);
+  while (ret < max_msgs && 0 == open_read_segment(spill)) {
+    struct rb_spill_record_hdr hdr;
+    void *buf = NULL;
+    const enum read_record_rc rc = read_record(spill, &hdr, &buf);
+
+    if (READ_RECORD_NOMEM == rc) {
+      /* Keep the segment, so next replay can try again */
+      break;
+    } else if (READ_RECORD_OK != rc) {
+      if (READ_RECORD_TRUNCATED == rc) {
+        spill->stats.truncated_segments++;
+      }
+      remove_read_segment(spill);
+      continue;
+    }
+
+    if (0 != cb(buf, hdr.len, hdr.key, opaque)) {
+      free(buf);
+      break;
+    }
+
+    spill->read_offset += sizeof(hdr) + hdr.len;
+    spill->stats.replayed_msgs++;
+    ret++;
+  }
+  pthread_mutex_unlock(&spill->mutex);
+
+  return ret;
+}
+
+void rb_spill_get_stats(struct rb_spill *spill, struct rb_spill_stats *stats) {
+  rb_spill_assert(spill);
+
+  pthread_mutex_lock(&spill->mutex);
+  *stats = spill->stats;
+  pthread_mutex_unlock(&spill->mutex);
+}
@@ -0,0 +1,113 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "../config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  Spill journal. Messages that can't be delivered are appended to a directory
+  of numbered segment files, and read back later in the same order they were
+  written. Segments are only appended to, and they are unlinked as soon as
+  they have been fully replayed. Writes are fsync-ed in batches, so a crash
+  can lose the last (not yet synced) messages, and a restart can replay again
+  messages of the oldest segment (at least once delivery).
+
+  All functions are thread safe.
+*/
+
+/// Default size of a journal segment
+#define RB_SPILL_DEFAULT_SEGMENT_SIZE (64*1024*1024)
+/// Default number of appended messages between fsyncs
+#define RB_SPILL_DEFAULT_FSYNC_BATCH 256
+
+struct rb_spill;
+
+/// Journal counters
+struct rb_spill_stats {
+  uint64_t spilled_msgs;  ///< Messages written to the journal
+  uint64_t replayed_msgs; ///< Messages read back from the journal
+  uint64_t dropped_msgs;  ///< Messages not written (size cap or I/O error)
+  uint64_t bytes;         ///< Journal size in disk
+  uint64_t truncated_segments; ///< Segments with unreadable records
+};
+
+/** Open a journal, creating directory if needed. Segments already in the
+  directory will be replayed before new ones.
+  @param dir Journal directory
+  @param segment_size Max size of each segment file
+  @param max_bytes Max size of the whole journal. New messages are dropped if
+  it is reached
+  @param fsync_batch Number of messages between fsyncs
+  @return New journal, or NULL in case of error
+  */
+struct rb_spill *rb_spill_new(const char *dir, size_t segment_size,
+                                      size_t max_bytes, unsigned fsync_batch);
+
+/** Sync and close journal. Not replayed messages are kept in disk
+  @param spill Journal
+  */
+void rb_spill_done(struct rb_spill *spill);
+
+/** Append a message to the journal
+  @param spill Journal
+  @param buf Message payload. Not modified, but it is not const because
+  writev(2) iovec needs a mutable pointer
+  @param len Message length
+  @param key Message key, returned back in replay
+  @return 0 if appended, !0 if journal is full or in case of I/O error
+  */
+int rb_spill_append(struct rb_spill *spill, void *buf, size_t len,
+                                                                uint64_t key);
+
+/** Flush appended messages to disk
+  @param spill Journal
+  */
+void rb_spill_sync(struct rb_spill *spill);
+
+/** Replay callback
+  @param buf Message payload, allocated with malloc. Callback owns it if it
+  returns 0
+  @param len Message length
+  @param key Message key
+  @param opaque Replay opaque
+  @return 0 if message has been consumed, !0 to stop replay. In the latter
+  case, message will be replayed again in the next call
+  */
+typedef int (*rb_spill_replay_cb)(void *buf, size_t len, uint64_t key,
+                                                                void *opaque);
+
+/** Read back the oldest messages of the journal, in order
+  @param spill Journal
+  @param max_msgs Max messages to replay
+  @param cb Callback to call with each message
+  @param opaque Callback opaque
+  @return Number of replayed messages
+  */
+size_t rb_spill_replay(struct rb_spill *spill, size_t max_msgs,
+                                        rb_spill_replay_cb cb, void *opaque);
+
+/** Get journal counters
+  @param spill Journal
+  @param stats Counters output
+  */
+void rb_spill_get_stats(struct rb_spill *spill, struct rb_spill_stats *stats);
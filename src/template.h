@@ -38,7 +38,6 @@ const char* getStandardFieldId(size_t id);
 /// Special macro that protects comma, making it looks like only one parameter
 #define C(...) __VA_ARGS__
 
-#ifdef HAVE_GEOIP
 #define X_GEO_IP \
 	/* no normalize direction */ \
 	X(STANDARD_ENTERPRISE_ID, SRC_IP_COUNTRY, PRIVATE_ENTITY_ID, QUOTE_OUTPUT, "SRC_IP_COUNTRY", "src_country_code", "", "Country where the src IP is located",print_country_code,NO_CHILDS)\
@@ -65,14 +64,6 @@ const char* getStandardFieldId(size_t id);
 		STA_IPV4_ADDRESS_AS_NAME)
 #define LAN_IP_GEO_CHILDS C(LAN_IP_COUNTRY, LAN_IP_AS_NAME)
 #define WAN_IP_GEO_CHILDS C(WAN_IP_COUNTRY, WAN_IP_AS_NAME)
-#else
-#define X_GEO_IP
-#define IPV4_SRC_IP_GEO_CHILDS
-#define IPV4_DST_IP_GEO_CHILDS
-#define IPV6_SRC_IP_GEO_CHILDS
-#define IPV6_DST_IP_GEO_CHILDS
-#define STA_IPV4_ADDRESS_GEO_CHILDS
-#endif
 
 #ifdef SECONDS_PRECISION
 #define X_SECONDS_PRECISION
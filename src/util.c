@@ -46,10 +46,8 @@ typedef cpuset_t cpu_set_t;
 extern char *strtok_r(char *, const char *, char **);
 #endif
 
-#ifdef HAVE_GEOIP
 #define GEOIP_DIR_LOCAL_TEMPLATE "%s"
 #define GEOIP_DIR_SYSTEM_TEMPLATE PREFIX "/f2k/%s"
-#endif
 
 /* ************************************ */
 
@@ -155,87 +153,6 @@ const char* _intoa(IpAddress addr, char* buf, size_t bufLen) {
   }
 }
 
-#ifdef HAVE_GEOIP
-static void readGeoIpDatabase(const char *path, const char *database_name, GeoIP ** geo_v4,GeoIP **geo_v6)
-{
-  assert(geo_v4);
-  assert(geo_v6);
-
-  if(path == NULL)
-    return;
-
-  pthread_rwlock_wrlock(&readWriteGlobals->geoipRwLock);
-
-  if(*geo_v4){
-    traceEvent(TRACE_NORMAL,"Closing %s database",database_name);
-    *geo_v4 = NULL;
-    GeoIP_delete(*geo_v4);
-  }
-  if(*geo_v6){
-    traceEvent(TRACE_NORMAL,"Closing %s IPV6 database",database_name);
-    *geo_v6 = NULL;
-    GeoIP_delete(*geo_v6);
-  }
-
-  struct stat stats;
-  char the_path[256];
-
-  if(stat(path, &stats) == 0)
-    snprintf(the_path, sizeof(the_path), GEOIP_DIR_LOCAL_TEMPLATE, path);
-  else
-    snprintf(the_path, sizeof(the_path), GEOIP_DIR_SYSTEM_TEMPLATE, path);
-
-  if((*geo_v4 = GeoIP_open(the_path, GEOIP_MEMORY_CACHE)) != NULL) {
-    traceEvent(TRACE_NORMAL, "GeoIP: loaded %s config file %s", database_name,the_path);
-    (*geo_v4)->charset = GEOIP_CHARSET_UTF8;
-  }else{
-    traceEvent(TRACE_WARNING, "Unable to load %s file %s. %s support disabled", database_name,the_path,database_name);
-  }
-
-  /* ********************************************* */
-
-  strcpy(&the_path[strlen(the_path)-4], "v6.dat");
-
-  if((*geo_v6 = GeoIP_open(the_path, GEOIP_MEMORY_CACHE)) != NULL) {
-    traceEvent(TRACE_NORMAL, "GeoIP: loaded %s IPv6 config file %s", database_name,the_path);
-    (*geo_v6)->charset = GEOIP_CHARSET_UTF8;
-  }else{
-    traceEvent(TRACE_WARNING, "Unable to load %s IPv6 file %s. AS IPv6 support disabled", database_name,the_path);
-  }
-
-  pthread_rwlock_unlock(&readWriteGlobals->geoipRwLock);
-}
-
-void readASs(const char *path) {
-  readGeoIpDatabase(path,"AS",&readOnlyGlobals.geo_ip_asn_db,&readOnlyGlobals.geo_ip_asn_db_v6);
-}
-
-void deleteGeoIPDatabases()
-{
-  pthread_rwlock_wrlock(&readWriteGlobals->geoipRwLock);
-  if(readOnlyGlobals.geo_ip_asn_db != NULL)
-    GeoIP_delete(readOnlyGlobals.geo_ip_asn_db);
-  readOnlyGlobals.geo_ip_asn_db = NULL;
-  if(readOnlyGlobals.geo_ip_asn_db_v6 != NULL)
-    GeoIP_delete(readOnlyGlobals.geo_ip_asn_db_v6);
-  readOnlyGlobals.geo_ip_asn_db_v6 = NULL;
-  if(readOnlyGlobals.geo_ip_country_db != NULL)
-    GeoIP_delete(readOnlyGlobals.geo_ip_country_db);
-  readOnlyGlobals.geo_ip_country_db = NULL;
-  if(readOnlyGlobals.geo_ip_country_db_v6 != NULL)
-    GeoIP_delete(readOnlyGlobals.geo_ip_country_db_v6);
-  readOnlyGlobals.geo_ip_country_db_v6 = NULL;
-  pthread_rwlock_unlock(&readWriteGlobals->geoipRwLock);
-}
-#endif
-
-/* ******************************************** */
-#ifdef HAVE_GEOIP
-void readCountries(const char *path) {
-  readGeoIpDatabase(path,"cities",&readOnlyGlobals.geo_ip_country_db,&readOnlyGlobals.geo_ip_country_db_v6);
-}
-#endif
-
 /* ******************************************** */
 
 uint64_t net2number(const void *vbuffer, const uint16_t real_field_len) {
@@ -396,6 +313,7 @@ size_t append_escaped(struct printbuf *buffer,const char *string,size_t string_l
       printbuf_memappend_fast_n16(buffer,string[i]);
       ++i;
     } else if (utf8_length == 1 &&
+        OUTPUT_FORMAT_JSON == readOnlyGlobals.output_format &&
         (escaped = memchr(to_escape_chars,string[i],strlen(to_escape_chars)))) {
       /* Need to escape JSON character */
       const size_t escaped_offset = escaped - to_escape_chars;
@@ -966,141 +884,302 @@ static int bindthread2core(pthread_t thread_id, int core_id) {
 /*                     ENEO STUFFS                        */
 /* ****************************************************** */
 
+/*
+  Databases reload. New databases are built apart without any lock, and then
+  published with an atomic pointer store, so workers never wait for a reload.
+  Old databases are freed when no worker can be using them anymore.
+*/
+
+static void free_hosts_list_cb(void *list) {
+  freeHostsList(list);
+}
+
+static void free_ip_name_db_cb(void *db) {
+  ip_name_db_done(db);
+}
+
+static void free_apps_tree_cb(void *tree) {
+  deleteNumNameAssocTree(tree);
+}
+
+static void free_keyval_list_cb(void *vlist) {
+  rb_keyval_list_t *list = vlist;
+  freeOSList(&list);
+}
+
+static void free_mac_list_cb(void *list) {
+  freeIfAddressList(list);
+  free(list);
+}
+
+static void free_mac_vendor_db_cb(void *db) {
+  rb_destroy_mac_vendor_db(db);
+}
+
+/// Publish a new database version, retiring the previous one. Generation
+/// is bumped after the store, so a reader that sees the new generation sees
+/// the new database too
+#define rb_databases_publish(rb_databases, field, new_db, free_cb) do {       \
+    __typeof__((rb_databases)->field) _old_db = (rb_databases)->field;        \
+    ATOMIC_STORE_RELEASE(&(rb_databases)->field, new_db);                     \
+    ATOMIC_OP(add, fetch, &(rb_databases)->generation, 1);                    \
+    rb_epoch_retire(&(rb_databases)->epoch, _old_db, free_cb);                \
+  } while(0)
+
+static void geoip_database_done(struct geoip_database *db) {
+  if(db == NULL)
+    return;
+
+  rb_mmdb_close(db->mmdb);
+#ifdef HAVE_GEOIP
+  if(db->v4)
+    GeoIP_delete(db->v4);
+  if(db->v6)
+    GeoIP_delete(db->v6);
+#endif
+  free(db);
+}
+
+static void free_geoip_database_cb(void *db) {
+  geoip_database_done(db);
+}
+
+/** Load a GeoIP database. Files ending in .mmdb are memory mapped as MaxMind
+  DB, that contains both IPv4 and IPv6 networks. Other files are loaded as
+  legacy GeoIP, with the IPv6 database in the same path ending in v6.dat, if
+  f2k was built with libGeoIP.
+  @param path Database path
+  @param database_name Database name, for log messages
+  @return New database, or NULL if it can't be loaded
+  */
+static struct geoip_database *readGeoIpDatabase(const char *path,
+                                                const char *database_name) {
+  static const char mmdb_suffix[] = ".mmdb";
+  struct stat stats;
+  char the_path[256];
+
+  if(stat(path, &stats) == 0)
+    snprintf(the_path, sizeof(the_path), GEOIP_DIR_LOCAL_TEMPLATE, path);
+  else
+    snprintf(the_path, sizeof(the_path), GEOIP_DIR_SYSTEM_TEMPLATE, path);
+
+  struct geoip_database *db = calloc(1, sizeof(*db));
+  if(db == NULL) {
+    traceEvent(TRACE_ERROR, "Unable to allocate %s database", database_name);
+    return NULL;
+  }
+
+  const size_t path_len = strlen(the_path);
+  if(path_len > strlen(mmdb_suffix) &&
+      0 == strcmp(&the_path[path_len - strlen(mmdb_suffix)], mmdb_suffix)) {
+    if((db->mmdb = rb_mmdb_open(the_path)) != NULL) {
+      size_t type_len = 0;
+      const char *type = rb_mmdb_database_type(db->mmdb, &type_len);
+      traceEvent(TRACE_NORMAL, "GeoIP: loaded %s MaxMind DB %s (%.*s)",
+        database_name, the_path, (int)type_len, type);
+      return db;
+    }
+
+    traceEvent(TRACE_WARNING, "Unable to load %s file %s. %s support disabled", database_name,the_path,database_name);
+    free(db);
+    return NULL;
+  }
+
+#ifdef HAVE_GEOIP
+  if((db->v4 = GeoIP_open(the_path, GEOIP_MEMORY_CACHE)) != NULL) {
+    traceEvent(TRACE_NORMAL, "GeoIP: loaded %s config file %s", database_name,the_path);
+    db->v4->charset = GEOIP_CHARSET_UTF8;
+  }else{
+    traceEvent(TRACE_WARNING, "Unable to load %s file %s. %s support disabled", database_name,the_path,database_name);
+  }
+
+  /* ********************************************* */
+
+  strcpy(&the_path[strlen(the_path)-4], "v6.dat");
+
+  if((db->v6 = GeoIP_open(the_path, GEOIP_MEMORY_CACHE)) != NULL) {
+    traceEvent(TRACE_NORMAL, "GeoIP: loaded %s IPv6 config file %s", database_name,the_path);
+    db->v6->charset = GEOIP_CHARSET_UTF8;
+  }else{
+    traceEvent(TRACE_WARNING, "Unable to load %s IPv6 file %s. AS IPv6 support disabled", database_name,the_path);
+  }
+
+  if(db->v4 == NULL && db->v6 == NULL) {
+    free(db);
+    return NULL;
+  }
+
+  return db;
+#else
+  traceEvent(TRACE_WARNING, "Unable to load %s file %s: legacy GeoIP databases "
+    "need libGeoIP support, use a MaxMind DB (.mmdb) file. %s support disabled",
+    database_name, the_path, database_name);
+  free(db);
+  return NULL;
+#endif
+}
+
+void readASs(const char *path) {
+  if(path == NULL)
+    return;
+
+  rb_databases_publish(&readOnlyGlobals.rb_databases, geoip_as_database,
+    readGeoIpDatabase(path, "AS"), free_geoip_database_cb);
+}
+
+void readCountries(const char *path) {
+  if(path == NULL)
+    return;
+
+  rb_databases_publish(&readOnlyGlobals.rb_databases, geoip_country_database,
+    readGeoIpDatabase(path, "cities"), free_geoip_database_cb);
+}
+
+void deleteGeoIPDatabases()
+{
+  rb_databases_publish(&readOnlyGlobals.rb_databases, geoip_as_database,
+    NULL, free_geoip_database_cb);
+  rb_databases_publish(&readOnlyGlobals.rb_databases, geoip_country_database,
+    NULL, free_geoip_database_cb);
+}
+
 void check_if_reload(/*const int templateElementId,*/struct rb_databases * rb_databases)
 {
   assert(rb_databases);
+  char buf[1024];
 
   if(unlikely(rb_databases->reload_hosts_database || rb_databases->reload_nets_database))
   {
     if(unlikely(readOnlyGlobals.enable_debug))
       traceEvent(TRACE_NORMAL,"reloading hosts_database");
-    pthread_rwlock_wrlock(&rb_databases->mutex);
-    freeHostsList(rb_databases->ip_name_as_list);
-    freeHostsList(rb_databases->nets_name_as_list);
-    rb_databases->ip_name_as_list = rb_databases->nets_name_as_list = NULL;
-
-    parseHostsList(rb_databases->hosts_database_path);
+    IPNameAssoc *hosts = NULL, *nets = NULL;
+    parseHostsList(rb_databases->hosts_database_path, &hosts, &nets);
+    struct ip_name_db *nets_db = new_ip_name_db(nets);
+
+    rb_databases_publish(rb_databases, nets_name_as_db, nets_db,
+                                                        free_ip_name_db_cb);
+    rb_databases_publish(rb_databases, nets_name_as_list, nets,
+                                                        free_hosts_list_cb);
+    rb_databases_publish(rb_databases, ip_name_as_list, hosts,
+                                                        free_hosts_list_cb);
     rb_databases->reload_hosts_database = rb_databases->reload_nets_database = 0;
-    pthread_rwlock_unlock(&rb_databases->mutex);
   }
 
   if(unlikely(rb_databases->reload_apps_database))
   {
     if(unlikely(readOnlyGlobals.enable_debug))
       traceEvent(TRACE_NORMAL,"reloading apps_database");
-    pthread_rwlock_wrlock(&rb_databases->mutex);
-    if(rb_databases->apps_name_as_list)
-      deleteNumNameAssocTree(rb_databases->apps_name_as_list);
-    rb_databases->apps_name_as_list = newNumNameAssocTree();
-    char buf[1024];
-    snprintf(buf,1024,"%s%s",rb_databases->hosts_database_path,"/applications");
-    parseAppList(buf);
+    NumNameAssocTree *apps = newNumNameAssocTree();
+    snprintf(buf,sizeof(buf),"%s%s",rb_databases->hosts_database_path,"/applications");
+    if (apps) {
+      parseAppList(buf, apps);
+    }
+    rb_databases_publish(rb_databases, apps_name_as_list, apps,
+                                                          free_apps_tree_cb);
     rb_databases->reload_apps_database = 0;
-    pthread_rwlock_unlock(&rb_databases->mutex);
   }
 
   if(unlikely(rb_databases->reload_engines_database))
   {
     if(unlikely(readOnlyGlobals.enable_debug))
       traceEvent(TRACE_NORMAL,"reloading engines_database");
-    pthread_rwlock_wrlock(&rb_databases->mutex);
-    freeNumList(rb_databases->engines_name_as_list);
-    char buf[1024];
-    snprintf(buf,1024,"%s%s",rb_databases->hosts_database_path,"/engines");
-    parseEngineList(buf);
+    NumNameAssoc *engines = NULL;
+    snprintf(buf,sizeof(buf),"%s%s",rb_databases->hosts_database_path,"/engines");
+    parseEngineList(buf, &engines);
+    rb_databases_publish(rb_databases, engines_name_as_list, engines,
+                                                        free_hosts_list_cb);
     rb_databases->reload_engines_database = 0;
-    pthread_rwlock_unlock(&rb_databases->mutex);
   }
 
   if(unlikely(rb_databases->reload_domains_database))
   {
     if(unlikely(readOnlyGlobals.enable_debug))
       traceEvent(TRACE_NORMAL,"reloading domains_database");
-    pthread_rwlock_wrlock(&rb_databases->mutex);
-    freeNumList(rb_databases->domains_name_as_list);
-    char buf[1024];
-    snprintf(buf,1024,"%s%s",rb_databases->hosts_database_path,"/http_domains");
-    parseHTTPDomainsList(buf);
+    NumNameAssoc *domains = NULL;
+    snprintf(buf,sizeof(buf),"%s%s",rb_databases->hosts_database_path,"/http_domains");
+    parseHTTPDomainsList(buf, &domains);
+    rb_databases_publish(rb_databases, domains_name_as_list, domains,
+                                                        free_hosts_list_cb);
     rb_databases->reload_domains_database = 0;
 
-    freeOSList(&rb_databases->domainalias_database);
-    snprintf(buf,1024,"%s%s",rb_databases->hosts_database_path,"/http_host_l1_alias");
-    parseCharCharList_File(&rb_databases->domainalias_database,buf);
+    rb_keyval_list_t *domainalias = NULL;
+    snprintf(buf,sizeof(buf),"%s%s",rb_databases->hosts_database_path,"/http_host_l1_alias");
+    parseCharCharList_File(&domainalias,buf);
+    rb_databases_publish(rb_databases, domainalias_database, domainalias,
+                                                        free_keyval_list_cb);
     rb_databases->reload_domainalias_database = 0;
-    pthread_rwlock_unlock(&rb_databases->mutex);
   }
 
   if(unlikely(rb_databases->reload_os_database))
   {
     if(unlikely(readOnlyGlobals.enable_debug))
       traceEvent(TRACE_NORMAL,"reloading os_database");
-    pthread_rwlock_wrlock(&rb_databases->mutex);
-    freeOSList(&rb_databases->os_name_as_list);
-    char buf[1024];
-    snprintf(buf,1024,"%s%s",rb_databases->hosts_database_path,"/os");
-    parseCharCharList_File(&rb_databases->os_name_as_list,buf);
+    rb_keyval_list_t *os = NULL;
+    snprintf(buf,sizeof(buf),"%s%s",rb_databases->hosts_database_path,"/os");
+    parseCharCharList_File(&os,buf);
+    rb_databases_publish(rb_databases, os_name_as_list, os,
+                                                        free_keyval_list_cb);
     rb_databases->reload_os_database = 0;
-    pthread_rwlock_unlock(&rb_databases->mutex);
   }
 
   if(unlikely(rb_databases->reload_macs_database))
   {
     if(unlikely(readOnlyGlobals.enable_debug))
       traceEvent(TRACE_NORMAL,"reloading macs_database");
-    pthread_rwlock_wrlock(&rb_databases->mutex);
-    freeIfAddressList(&rb_databases->mac_name_database);
-    char buf[1024];
-    snprintf(buf,1024,"%s%s",rb_databases->hosts_database_path,"/macs");
-    parseIfAddressList(buf);
+    mac_addr_list *macs = calloc(1, sizeof(*macs));
+    if (macs) {
+      snprintf(buf,sizeof(buf),"%s%s",rb_databases->hosts_database_path,"/macs");
+      parseIfAddressList(buf, macs);
+    } else {
+      traceEvent(TRACE_ERROR, "Couldn't allocate macs database");
+    }
+    rb_databases_publish(rb_databases, mac_name_database, macs,
+                                                          free_mac_list_cb);
     rb_databases->reload_macs_database=0;
-    pthread_rwlock_unlock(&rb_databases->mutex);
   }
 
   if(unlikely(rb_databases->reload_macs_vendor_database))
   {
     if(unlikely(readOnlyGlobals.enable_debug))
       traceEvent(TRACE_NORMAL,"reloading macs_vendor_database");
-    pthread_rwlock_wrlock(&rb_databases->mutex);
-    if(rb_databases->mac_vendor_database)
-      rb_destroy_mac_vendor_db(rb_databases->mac_vendor_database);
+    struct mac_vendor_database *mac_vendor_database = NULL;
     if(rb_databases->mac_vendor_database_path){
-      rb_databases->mac_vendor_database = rb_new_mac_vendor_db(rb_databases->mac_vendor_database_path);
+      mac_vendor_database = rb_new_mac_vendor_db(rb_databases->mac_vendor_database_path);
     }
+    rb_databases_publish(rb_databases, mac_vendor_database,
+                                  mac_vendor_database, free_mac_vendor_db_cb);
     rb_databases->reload_macs_vendor_database = 0;
-    pthread_rwlock_unlock(&rb_databases->mutex);
   }
+
+  /* Free old databases that workers are not using anymore */
+  rb_epoch_reclaim(&rb_databases->epoch);
 }
 
-int parseHostsList_File(char * filename,PARSEHOSTSLIST_ORDER order){
+int parseHostsList_File(char * filename,PARSEHOSTSLIST_ORDER order,void *dst){
   char line_buffer[1024] = {'\0'};
   IPNameAssoc ** iter = NULL;
+  NumNameAssocTree *apps = NULL;
+  mac_addr_list *macs = NULL;
   switch(order)
   {
     case HOST_ORDER:
-      iter = &readOnlyGlobals.rb_databases.ip_name_as_list;
-      break;
     case NETWORK_ORDER:
-      iter = &readOnlyGlobals.rb_databases.nets_name_as_list;
-      break;
-    case APPLICATION_ORDER:
-      /* Managed later */
-      break;
     case ENGINE_ORDER:
-      iter = &readOnlyGlobals.rb_databases.engines_name_as_list;
-      break;
     case DOMAINS_ORDER:
-      iter = &readOnlyGlobals.rb_databases.domains_name_as_list;
+      iter = dst;
+      break;
+    case APPLICATION_ORDER:
+      apps = dst;
       break;
     case IFADDR_ORDER:
-      STAILQ_INIT(&readOnlyGlobals.rb_databases.mac_name_database);
+      macs = dst;
+      STAILQ_INIT(macs);
       break;
     default:
       traceEvent(TRACE_ERROR, "FATAL ERROR: Not a valid order given.\n");
       exit(-1);
   };
 
-
-
   FILE *file = fopen(filename,"r");
   int line=1;
 
@@ -1131,7 +1210,7 @@ int parseHostsList_File(char * filename,PARSEHOSTSLIST_ORDER order){
               node->name     = strdup(tok1);
               node->number_a = strdup(tok2);
               node->number_i = mac_atoi(node->number_a);
-              STAILQ_INSERT_TAIL(&readOnlyGlobals.rb_databases.mac_name_database, node, next);
+              STAILQ_INSERT_TAIL(macs, node, next);
             }
             break;
 
@@ -1146,7 +1225,7 @@ int parseHostsList_File(char * filename,PARSEHOSTSLIST_ORDER order){
               continue;
             }
 
-            const int addNum_rc = addNumNameAssocToTree(readOnlyGlobals.rb_databases.apps_name_as_list,app_id,tok1,err,sizeof(err));
+            const int addNum_rc = addNumNameAssocToTree(apps,app_id,tok1,err,sizeof(err));
             if(addNum_rc == 0){
               traceEvent(TRACE_ERROR,"Can't add app_id: %s",err);
             }
@@ -1199,7 +1278,7 @@ int parseHostsList_File(char * filename,PARSEHOSTSLIST_ORDER order){
   return 1;
 }
 
-void parseHostsList(char * etc_path){
+void parseHostsList(char * etc_path,IPNameAssoc **hosts,IPNameAssoc **nets){
   assert(etc_path);
   size_t len_etc_path = strlen(etc_path);
   // Maximum use of buffer
@@ -1207,10 +1286,10 @@ void parseHostsList(char * etc_path){
   strcpy(buf,etc_path);
 
   strcpy(buf+len_etc_path,"/hosts");
-  parseHostsList_File(buf,HOST_ORDER);
+  parseHostsList_File(buf,HOST_ORDER,hosts);
 
   strcpy(buf+len_etc_path,"/networks");
-  parseHostsList_File(buf,NETWORK_ORDER);
+  parseHostsList_File(buf,NETWORK_ORDER,nets);
 
   free(buf);
 }
@@ -1327,7 +1406,9 @@ const char * rb_l1_domain(const char *url, size_t *domain_len,const NumNameAssoc
     if(l1_domain)
     {
       rb_keyval_list_t * iter;
-      for(iter = readOnlyGlobals.rb_databases.domainalias_database; iter; iter = iter->next)
+      for(iter = ATOMIC_LOAD_ACQUIRE(
+            &readOnlyGlobals.rb_databases.domainalias_database);
+          iter; iter = iter->next)
       {
         if(0==strncasecmp(iter->key,l1_domain,*domain_len))
         {
@@ -36,6 +36,9 @@
 #include "librd/rdqueue.h"
 
 #include "NumNameAssocTree.h"
+#include "rb_ip_name_db.h"
+#include "rb_epoch.h"
+#include "rb_mmdb.h"
 
 #ifdef likely
 #undef likely
@@ -51,22 +54,44 @@
 #ifdef HAVE_ATOMICS_32_ATOMIC
 // Atomic test & set
 #define ATOMIC_TEST_AND_SET(PTR) __atomic_test_and_set(PTR, __ATOMIC_SEQ_CST)
+// Acquire load & release store
+#define ATOMIC_LOAD_ACQUIRE(PTR) __atomic_load_n(PTR, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE_RELEASE(PTR, VAL) \
+  __atomic_store_n(PTR, VAL, __ATOMIC_RELEASE)
+#define ATOMIC_FULL_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
 #else /* HAVE_ATOMICS_32_SYNC */
 #define ATOMIC_TEST_AND_SET(PTR) __sync_val_compare_and_swap(PTR, false, true)
+#define ATOMIC_LOAD_ACQUIRE(PTR) \
+  ({ __typeof__(*(PTR)) _v = *(volatile __typeof__(PTR))(PTR); \
+     __sync_synchronize(); _v; })
+#define ATOMIC_STORE_RELEASE(PTR, VAL) \
+  do { __sync_synchronize(); *(volatile __typeof__(PTR))(PTR) = (VAL); } \
+  while (0)
+#define ATOMIC_FULL_FENCE() __sync_synchronize()
 #endif
 
 typedef struct sensor_s sensor_t;
 typedef struct sensors_db_s sensors_db_t;
 
 /* ********* Packets queue ************ */
+struct packet_pool;
+
 typedef struct queued_packet_s {
   uint32_t netflow_device_ip;
   uint8_t *buffer;
   ssize_t buffer_len;
   sensor_t *sensor;
   rd_kafka_message_t *original_message;
+
+  /* Packet pool information. See rb_packet_pool.h */
+  struct packet_pool *pool; ///< Owner pool, NULL if not pooled
+  int pool_class;
+  struct queued_packet_s *pool_next;
 } QueuedPacket;
 
+/// Give back a packet to its pool. See rb_packet_pool.h
+void packet_pool_release(QueuedPacket *qpacket);
+
 static inline QueuedPacket *newQueuedPacket(size_t allocated_buffer_len) {
   QueuedPacket *qpacket = calloc(1,sizeof(*qpacket) + allocated_buffer_len);
 
@@ -81,23 +106,12 @@ static inline void freeQueuedPacket(QueuedPacket *packet){
   if (packet->original_message) {
     rd_kafka_message_destroy(packet->original_message);
   }
-  free(packet);
-}
-
-static inline void addPacketToQueue(QueuedPacket *packet,rd_fifoq_t *queue){
-//  fprintf(stderr,"Push packet %p\n",packet);
-  rd_fifoq_add(queue,packet);
-}
 
-static inline QueuedPacket *popPacketFromQueue_timedwait(rd_fifoq_t *queue,time_t timeout_ms){
-  rd_fifoq_elm_t *fifoq_elm = rd_fifoq_pop_timedwait(queue,timeout_ms);
-  if(fifoq_elm){
-    QueuedPacket *packet = fifoq_elm->rfqe_ptr;
-    rd_fifoq_elm_release(queue,fifoq_elm);
-    // fprintf(stderr,"Pop packet %p\n",packet);
-    return packet;
+  if (packet->pool) {
+    packet_pool_release(packet);
+  } else {
+    free(packet);
   }
-  return NULL;
 }
 
 #define PCAP_LONG_SNAPLEN        1600
@@ -149,12 +163,10 @@ void daemonize(void);
 
 void setThreadAffinity(u_int core_id);
 
-#ifdef HAVE_GEOIP
 void readASs(const char *path);
 void readCountries(const char *path);
 void deleteGeoIPDatabases();
 void initAS(void);
-#endif /* HAVE_GEOIP */
 
 uint32_t msTimeDiff(struct timeval *end, struct timeval *begin);
 float timevalDiff(struct timeval *end, struct timeval *begin);
@@ -305,18 +317,6 @@ static inline void apply_netmask(uint8_t dst[16], const uint8_t ip[16], const ui
     dst[i] = ip[i]&netmask[i];
 }
 
-static inline const IPNameAssoc * ipInList(const uint8_t ip[16],
-    const IPNameAssoc * list) {
-  for(;list;list=list->next){
-    uint8_t _ip[16];
-    apply_netmask(_ip,ip,list->number_i.net_address.networkMask);
-
-    if(0==memcmp(_ip,list->number_i.net_address.network,sizeof(_ip)))
-      break;
-  }
-  return list;
-}
-
 static inline const NumNameAssoc * numInList(const uint32_t num,const NumNameAssoc * list){
   for(;list;list=list->next){
     if( num == list->number_i.number )
@@ -335,13 +335,21 @@ static inline const NumNameAssoc * namenInList(const char *name, const NumNameAs
 }
 
 typedef enum{HOST_ORDER,NETWORK_ORDER,APPLICATION_ORDER,ENGINE_ORDER,DOMAINS_ORDER,OS_ORDER,IFADDR_ORDER} PARSEHOSTSLIST_ORDER;
-int parseHostsList_File(char * filename,PARSEHOSTSLIST_ORDER order);
-void parseHostsList(char * etc_path);
+/** Parse a hosts/networks/applications/... list file
+  @param filename File path
+  @param order File type
+  @param dst Where to store parsed entries: IPNameAssoc ** list for HOST_ORDER,
+  NETWORK_ORDER, ENGINE_ORDER and DOMAINS_ORDER; NumNameAssocTree * for
+  APPLICATION_ORDER; and mac_addr_list * for IFADDR_ORDER
+  @return 1 if file could be read, 0 in other case
+  */
+int parseHostsList_File(char * filename,PARSEHOSTSLIST_ORDER order,void *dst);
+void parseHostsList(char * etc_path,IPNameAssoc **hosts,IPNameAssoc **nets);
 void freeHostsList(IPNameAssoc * p_ip_name_list);
-static inline int parseAppList(char * apps_path){return parseHostsList_File(apps_path,APPLICATION_ORDER);}
-static inline int parseEngineList(char * apps_path){return parseHostsList_File(apps_path,ENGINE_ORDER);}
-static inline int parseHTTPDomainsList(char * list_path){return parseHostsList_File(list_path,DOMAINS_ORDER);}
-static inline int parseIfAddressList(char * list_path){return parseHostsList_File(list_path,IFADDR_ORDER);}
+static inline int parseAppList(char * apps_path,NumNameAssocTree *apps){return parseHostsList_File(apps_path,APPLICATION_ORDER,apps);}
+static inline int parseEngineList(char * apps_path,NumNameAssoc **engines){return parseHostsList_File(apps_path,ENGINE_ORDER,engines);}
+static inline int parseHTTPDomainsList(char * list_path,NumNameAssoc **domains){return parseHostsList_File(list_path,DOMAINS_ORDER,domains);}
+static inline int parseIfAddressList(char * list_path,mac_addr_list *macs){return parseHostsList_File(list_path,IFADDR_ORDER,macs);}
 static inline void freeNumList(NumNameAssoc * p)
 {
   NumNameAssoc * aux;
@@ -355,8 +363,25 @@ static inline void freeNumList(NumNameAssoc * p)
   }
 }
 
+/// GeoIP database, in MaxMind DB (mmdb) or in legacy GeoIP format
+struct geoip_database {
+  struct rb_mmdb *mmdb; ///< MaxMind DB, for both IPv4 and IPv6
+#ifdef HAVE_GEOIP
+  GeoIP *v4, *v6;       ///< Legacy GeoIP databases
+#endif
+};
+
+/*
+  Enrichment databases are replaced as a whole on reload, and old ones are
+  freed through epoch. Readers must load them with ATOMIC_LOAD_ACQUIRE inside
+  an rb_epoch critical section (see rb_epoch.h).
+*/
 struct rb_databases{
-  pthread_rwlock_t mutex;
+  pthread_rwlock_t mutex; ///< Sensors database
+  struct rb_epoch epoch;  ///< Reloaded enrichment databases reclamation
+  /// Incremented every time an enrichment database is published, so caches
+  /// of database results know they have to flush
+  uint64_t generation;
   int reload_hosts_database;
   int reload_nets_database;
   int reload_vlans_database;
@@ -370,16 +395,19 @@ struct rb_databases{
   int reload_geoip_database;
   IPNameAssoc *ip_name_as_list;
   IPNameAssoc *nets_name_as_list;
+  struct ip_name_db *nets_name_as_db; ///< nets_name_as_list search index
   NumNameAssocTree *apps_name_as_list;
   NumNameAssoc *engines_name_as_list;
   NumNameAssoc *domains_name_as_list;
   rb_keyval_list_t *os_name_as_list;
   rb_keyval_list_t *domainalias_database;
-  mac_addr_list mac_name_database;
+  mac_addr_list *mac_name_database;
   struct mac_vendor_database *mac_vendor_database;
   char *hosts_database_path;
   char *geoip_as_database_path;
   char *geoip_country_database_path;
+  struct geoip_database *geoip_as_database;
+  struct geoip_database *geoip_country_database;
   char *mac_vendor_database_path;
   char *sensors_info_path;
   sensors_db_t *sensors_info;
@@ -126,7 +126,7 @@ static void test_listeners() {
 		.proto = UDP,
 		.port = 2056
 	};
-	worker_t *worker = new_collect_worker();
+	worker_t *worker = new_collect_worker(NULL);
 
 	char tmpFilePath[BUFSIZ];
 	int fd = temp_file(tmpFilePath,sizeof(tmpFilePath));
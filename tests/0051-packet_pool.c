@@ -0,0 +1,151 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#undef NDEBUG
+
+#include "rb_packet_pool.h"
+
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+static void testPacketPoolClasses() {
+	struct packet_pool_stats stats;
+	struct packet_pool *pool = new_packet_pool(4, 4);
+	assert_non_null(pool);
+
+	QueuedPacket *small = packet_pool_get(pool, 1500);
+	QueuedPacket *medium = packet_pool_get(pool, 9000);
+	QueuedPacket *jumbo = packet_pool_get(pool, PACKET_POOL_MAX_BUFFER_LEN);
+	QueuedPacket *too_big = packet_pool_get(pool,
+		PACKET_POOL_MAX_BUFFER_LEN + 1);
+
+	assert_non_null(small);
+	assert_non_null(medium);
+	assert_non_null(jumbo);
+	assert_null(too_big);
+
+	/* Buffers must be fully writable */
+	memset(small->buffer, 0, 1500);
+	memset(medium->buffer, 0, 9000);
+	memset(jumbo->buffer, 0, PACKET_POOL_MAX_BUFFER_LEN);
+
+	packet_pool_get_stats(pool, &stats);
+	assert_int_equal(stats.classes[PACKET_POOL_SMALL].misses, 1);
+	assert_int_equal(stats.classes[PACKET_POOL_MEDIUM].misses, 1);
+	assert_int_equal(stats.classes[PACKET_POOL_JUMBO].misses, 1);
+
+	freeQueuedPacket(small);
+	freeQueuedPacket(medium);
+	freeQueuedPacket(jumbo);
+	packet_pool_done(pool);
+}
+
+static void testPacketPoolRecycle() {
+	struct packet_pool_stats stats;
+	struct packet_pool *pool = new_packet_pool(4, 4);
+	assert_non_null(pool);
+
+	QueuedPacket *qpacket = packet_pool_get(pool, 100);
+	assert_non_null(qpacket);
+	qpacket->buffer += 10; /* Packet decoders can move buffer pointer */
+	qpacket->buffer_len = 90;
+	freeQueuedPacket(qpacket);
+
+	QueuedPacket *recycled = packet_pool_get(pool, 200);
+	assert_ptr_equal(qpacket, recycled);
+	assert_ptr_equal(recycled->buffer, (uint8_t *)&recycled[1]);
+	assert_int_equal(recycled->buffer_len, 0);
+
+	packet_pool_get_stats(pool, &stats);
+	assert_int_equal(stats.classes[PACKET_POOL_SMALL].allocated, 1);
+	assert_int_equal(stats.classes[PACKET_POOL_SMALL].misses, 1);
+	assert_int_equal(stats.classes[PACKET_POOL_SMALL].hits, 1);
+
+	/* Pool memory must survive owner until last packet is released */
+	packet_pool_done(pool);
+	freeQueuedPacket(recycled);
+}
+
+static void testPacketPoolExhausted() {
+	size_t i;
+	struct packet_pool_stats stats;
+	QueuedPacket *packets[3];
+	struct packet_pool *pool = new_packet_pool(2, 2);
+	assert_non_null(pool);
+
+	for (i=0; i<sizeof(packets)/sizeof(packets[0]); ++i) {
+		packets[i] = packet_pool_get(pool, 100);
+		assert_non_null(packets[i]);
+	}
+
+	assert_null(packets[2]->pool);
+
+	packet_pool_get_stats(pool, &stats);
+	assert_int_equal(stats.classes[PACKET_POOL_SMALL].allocated, 2);
+	assert_int_equal(stats.classes[PACKET_POOL_SMALL].exhausted, 1);
+
+	for (i=0; i<sizeof(packets)/sizeof(packets[0]); ++i) {
+		freeQueuedPacket(packets[i]);
+	}
+	packet_pool_done(pool);
+}
+
+static void testPacketPoolJumboLimit() {
+	size_t i;
+	struct packet_pool_stats stats;
+	QueuedPacket *small[2], *jumbo[2];
+	struct packet_pool *pool = new_packet_pool(2, 1);
+	assert_non_null(pool);
+
+	for (i=0; i<2; ++i) {
+		small[i] = packet_pool_get(pool, 100);
+		jumbo[i] = packet_pool_get(pool, PACKET_POOL_MAX_BUFFER_LEN);
+		assert_non_null(small[i]);
+		assert_non_null(jumbo[i]);
+	}
+
+	/* Only one jumbo buffer is recycled, no matter small limit */
+	assert_non_null(small[1]->pool);
+	assert_non_null(jumbo[0]->pool);
+	assert_null(jumbo[1]->pool);
+
+	packet_pool_get_stats(pool, &stats);
+	assert_int_equal(stats.classes[PACKET_POOL_SMALL].allocated, 2);
+	assert_int_equal(stats.classes[PACKET_POOL_JUMBO].allocated, 1);
+	assert_int_equal(stats.classes[PACKET_POOL_JUMBO].exhausted, 1);
+
+	for (i=0; i<2; ++i) {
+		freeQueuedPacket(small[i]);
+		freeQueuedPacket(jumbo[i]);
+	}
+	packet_pool_done(pool);
+}
+
+int main(){
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(testPacketPoolClasses),
+		cmocka_unit_test(testPacketPoolRecycle),
+		cmocka_unit_test(testPacketPoolExhausted),
+		cmocka_unit_test(testPacketPoolJumboLimit),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,281 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rb_ring.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#define N_PRODUCERS 4
+#define MSGS_PER_PRODUCER 100000
+
+static void testRingOrder() {
+	size_t i, j;
+	struct rb_ring ring;
+	struct rb_ring_msg msgs[3];
+
+	assert_int_equal(rb_ring_init(&ring, 3), 0);
+	assert_int_equal(rb_ring_size(&ring), 4);
+
+	/* Wrap around the ring several times */
+	for (j=0; j<10; ++j) {
+		for (i=0; i<4; ++i) {
+			assert_int_equal(rb_ring_try_push(&ring,
+				(void *)(intptr_t)(i+1), i%2), 0);
+		}
+		assert_int_not_equal(rb_ring_try_push(&ring, NULL, 0), 0);
+
+		assert_int_equal(rb_ring_pop_batch(&ring, msgs, 3), 3);
+		for (i=0; i<3; ++i) {
+			assert_ptr_equal(msgs[i].ptr, (void *)(intptr_t)(i+1));
+			assert_int_equal(msgs[i].type, i%2);
+		}
+
+		assert_int_equal(rb_ring_pop_batch(&ring, msgs, 3), 1);
+		assert_ptr_equal(msgs[0].ptr, (void *)(intptr_t)4);
+		assert_int_equal(rb_ring_pop_batch(&ring, msgs, 3), 0);
+	}
+
+	assert_int_equal(rb_ring_pop_batch_timedwait(&ring, msgs, 3, 10), 0);
+	rb_ring_done(&ring);
+}
+
+static void testRingPushBatch() {
+	size_t i;
+	struct rb_ring ring;
+	struct rb_ring_msg msgs[8];
+	void *ptrs[6];
+
+	for (i=0; i<6; ++i) {
+		ptrs[i] = (void *)(intptr_t)(i+1);
+	}
+
+	assert_int_equal(rb_ring_init(&ring, 4), 0);
+	assert_int_equal(rb_ring_try_push(&ring, NULL, 1), 0);
+
+	/* Only 3 slots left */
+	assert_int_equal(rb_ring_try_push_batch(&ring, ptrs, 6, 0), 3);
+	assert_int_equal(rb_ring_try_push_batch(&ring, &ptrs[3], 3, 0), 0);
+
+	assert_int_equal(rb_ring_pop_batch(&ring, msgs, 2), 2);
+	assert_null(msgs[0].ptr);
+	assert_int_equal(msgs[0].type, 1);
+	assert_ptr_equal(msgs[1].ptr, ptrs[0]);
+
+	/* Wrap around */
+	assert_int_equal(rb_ring_try_push_batch(&ring, &ptrs[3], 3, 0), 2);
+	assert_int_equal(rb_ring_pop_batch(&ring, msgs, 8), 4);
+	for (i=0; i<4; ++i) {
+		assert_ptr_equal(msgs[i].ptr, ptrs[i+1]);
+		assert_int_equal(msgs[i].type, 0);
+	}
+
+	assert_int_equal(rb_ring_pop_batch(&ring, msgs, 8), 0);
+	rb_ring_done(&ring);
+}
+
+static void testRingPopType() {
+	struct rb_ring ring;
+	struct rb_ring_msg msg;
+
+	assert_int_equal(rb_ring_init(&ring, 4), 0);
+	assert_int_not_equal(rb_ring_try_pop_type(&ring, &msg, 0), 0);
+
+	assert_int_equal(rb_ring_try_push(&ring, (void *)(intptr_t)1, 0), 0);
+	assert_int_equal(rb_ring_try_push(&ring, (void *)(intptr_t)2, 1), 0);
+
+	/* Oldest message is not of type 1 */
+	assert_int_not_equal(rb_ring_try_pop_type(&ring, &msg, 1), 0);
+	assert_int_equal(rb_ring_try_pop_type(&ring, &msg, 0), 0);
+	assert_ptr_equal(msg.ptr, (void *)(intptr_t)1);
+	assert_int_equal(rb_ring_try_pop_type(&ring, &msg, 1), 0);
+	assert_ptr_equal(msg.ptr, (void *)(intptr_t)2);
+	assert_int_equal(rb_ring_pop_batch(&ring, &msg, 1), 0);
+
+	rb_ring_done(&ring);
+}
+
+struct producer_args {
+	struct rb_ring *ring;
+	unsigned id;
+};
+
+static void *producer(void *vargs) {
+	size_t i;
+	struct producer_args *args = vargs;
+
+	for (i=1; i<=MSGS_PER_PRODUCER; ++i) {
+		rb_ring_push(args->ring, (void *)(intptr_t)i, args->id);
+	}
+
+	return NULL;
+}
+
+/// Push messages in batches of up to 7
+static void *batch_producer(void *vargs) {
+	size_t i = 1, j;
+	struct producer_args *args = vargs;
+	void *ptrs[7];
+
+	while (i <= MSGS_PER_PRODUCER) {
+		size_t n = 0;
+		for (j=0; j<7 && i+j <= MSGS_PER_PRODUCER; ++j) {
+			ptrs[n++] = (void *)(intptr_t)(i+j);
+		}
+
+		const size_t pushed = rb_ring_try_push_batch(args->ring, ptrs, n,
+			args->id);
+		if (0 == pushed) {
+			sched_yield();
+		}
+		i += pushed;
+	}
+
+	return NULL;
+}
+
+/// Every producer's messages must arrive complete and in order
+static void ringProducers(void *(*producer_fn)(void *)) {
+	size_t i, received = 0;
+	struct rb_ring ring;
+	pthread_t threads[N_PRODUCERS];
+	struct producer_args args[N_PRODUCERS];
+	intptr_t last[N_PRODUCERS] = {0};
+	struct rb_ring_msg msgs[16];
+
+	assert_int_equal(rb_ring_init(&ring, 64), 0);
+
+	for (i=0; i<N_PRODUCERS; ++i) {
+		args[i].ring = &ring;
+		args[i].id = i;
+		assert_int_equal(pthread_create(&threads[i], NULL, producer_fn,
+			&args[i]), 0);
+	}
+
+	while (received < N_PRODUCERS * MSGS_PER_PRODUCER) {
+		const size_t n = rb_ring_pop_batch_timedwait(&ring, msgs,
+			sizeof(msgs)/sizeof(msgs[0]), 100);
+		for (i=0; i<n; ++i) {
+			assert_true(msgs[i].type < N_PRODUCERS);
+			assert_int_equal((intptr_t)msgs[i].ptr,
+				last[msgs[i].type] + 1);
+			last[msgs[i].type]++;
+		}
+		received += n;
+	}
+
+	for (i=0; i<N_PRODUCERS; ++i) {
+		pthread_join(threads[i], NULL);
+		assert_int_equal(last[i], MSGS_PER_PRODUCER);
+	}
+
+	assert_int_equal(rb_ring_pop_batch(&ring, msgs, 1), 0);
+	rb_ring_done(&ring);
+}
+
+static void testRingProducers() {
+	ringProducers(producer);
+}
+
+static void testRingBatchProducers() {
+	ringProducers(batch_producer);
+}
+
+struct thief_args {
+	struct rb_ring *ring;
+	uint64_t stolen;
+	int run;
+};
+
+static void *thief(void *vargs) {
+	struct thief_args *args = vargs;
+	struct rb_ring_msg msg;
+
+	while (__sync_fetch_and_add(&args->run, 0)) {
+		if (0 == rb_ring_try_pop_type(args->ring, &msg, 0)) {
+			__sync_fetch_and_add(&args->stolen, 1);
+		}
+	}
+
+	return NULL;
+}
+
+/// Messages can be stolen while consumer pops, but never lost or repeated
+static void testRingThief() {
+	size_t i;
+	uint64_t received = 0;
+	struct rb_ring ring;
+	pthread_t threads[N_PRODUCERS], thief_thread;
+	struct producer_args args[N_PRODUCERS];
+	struct thief_args t_args;
+	intptr_t last[N_PRODUCERS] = {0};
+	struct rb_ring_msg msgs[16];
+
+	assert_int_equal(rb_ring_init(&ring, 64), 0);
+	t_args.ring = &ring;
+	t_args.stolen = 0;
+	t_args.run = 1;
+	assert_int_equal(pthread_create(&thief_thread, NULL, thief, &t_args), 0);
+
+	for (i=0; i<N_PRODUCERS; ++i) {
+		args[i].ring = &ring;
+		args[i].id = i;
+		assert_int_equal(pthread_create(&threads[i], NULL, producer,
+			&args[i]), 0);
+	}
+
+	while (received + __sync_fetch_and_add(&t_args.stolen, 0) <
+					N_PRODUCERS * MSGS_PER_PRODUCER) {
+		const size_t n = rb_ring_pop_batch(&ring, msgs,
+			sizeof(msgs)/sizeof(msgs[0]));
+		for (i=0; i<n; ++i) {
+			/* Gaps are allowed, but not disorder */
+			assert_true((intptr_t)msgs[i].ptr > last[msgs[i].type]);
+			last[msgs[i].type] = (intptr_t)msgs[i].ptr;
+		}
+		received += n;
+	}
+
+	__sync_fetch_and_and(&t_args.run, 0);
+	pthread_join(thief_thread, NULL);
+	for (i=0; i<N_PRODUCERS; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	assert_int_equal(received + t_args.stolen,
+		N_PRODUCERS * MSGS_PER_PRODUCER);
+	assert_int_equal(rb_ring_pop_batch(&ring, msgs, 1), 0);
+	rb_ring_done(&ring);
+}
+
+int main(){
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(testRingOrder),
+		cmocka_unit_test(testRingPushBatch),
+		cmocka_unit_test(testRingPopType),
+		cmocka_unit_test(testRingProducers),
+		cmocka_unit_test(testRingBatchProducers),
+		cmocka_unit_test(testRingThief),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
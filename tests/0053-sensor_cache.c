@@ -0,0 +1,83 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#undef NDEBUG
+
+#include "rb_sensor.h"
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+/// 192.168.1.0/24 sensors database
+static sensors_db_t *sensors_db_192_168_1() {
+	const uint8_t network[16] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 192, 168, 1, 0};
+	const uint8_t netmask[16] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0xff, 0xff, 0xff, 0};
+
+	sensors_db_t *database = sensors_db_new();
+	assert_non_null(database);
+	sensors_db_add(database, sensor_new(network, netmask));
+	return database;
+}
+
+static void testSensorCache() {
+	static const uint32_t sensor_ip = 0xc0a80101;   /* 192.168.1.1 */
+	static const uint32_t sensor_ip_2 = 0xc0a80102; /* 192.168.1.2 */
+	static const uint32_t unknown_ip = 0xc0a80201;  /* 192.168.2.1 */
+	struct sensor_cache *cache = new_sensor_cache(4);
+	assert_non_null(cache);
+
+	sensors_db_t *database = sensors_db_192_168_1();
+	sensor_t *sensor = get_sensor(database, sensor_ip);
+	assert_non_null(sensor);
+
+	/* Miss & hit must return the same as database */
+	assert_ptr_equal(sensor_cache_get_sensor(cache, database, sensor_ip),
+		sensor);
+	assert_ptr_equal(sensor_cache_get_sensor(cache, database, sensor_ip),
+		sensor);
+	assert_ptr_equal(sensor_cache_get_sensor(cache, database, sensor_ip_2),
+		sensor);
+	assert_null(sensor_cache_get_sensor(cache, database, unknown_ip));
+	assert_null(sensor_cache_get_sensor(cache, database, unknown_ip));
+
+	/* Reload: Cache must not return old sensors */
+	delete_rb_sensors_db(database);
+	database = sensors_db_new();
+	assert_non_null(database);
+	assert_null(sensor_cache_get_sensor(cache, database, sensor_ip));
+	delete_rb_sensors_db(database);
+
+	database = sensors_db_192_168_1();
+	sensor = get_sensor(database, sensor_ip);
+	assert_ptr_equal(sensor_cache_get_sensor(cache, database, sensor_ip),
+		sensor);
+	delete_rb_sensors_db(database);
+
+	sensor_cache_done(cache);
+}
+
+int main(){
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(testSensorCache),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,149 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#undef NDEBUG
+
+#include "f2k.h"
+#include "util.h"
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+/// Prepend a new entry to an IPNameAssoc list
+static IPNameAssoc *add_entry(IPNameAssoc *list, const char *name,
+							const char *address) {
+	IPNameAssoc *ret = calloc(1, sizeof(*ret));
+	assert_non_null(ret);
+	ret->name = strdup(name);
+	ret->number = strdup(address);
+	assert_true(safe_parse_address(address, &ret->number_i.net_address));
+	ret->next = list;
+	return ret;
+}
+
+static const char *search(const struct ip_name_db *db, const char *address) {
+	netAddress_t net_address;
+	assert_true(safe_parse_address(address, &net_address));
+	const IPNameAssoc *assoc = ip_name_db_search(db, net_address.network);
+	return assoc ? assoc->name : NULL;
+}
+
+static void testIPNameDbLongestPrefix() {
+	/* Reverse order, so list is in file order */
+	IPNameAssoc *list = NULL;
+	list = add_entry(list, "v6_net_48", "2001:db8:1::/48");
+	list = add_entry(list, "v6_net_32", "2001:db8::/32");
+	list = add_entry(list, "v6_host", "2001:db8:1::1");
+	list = add_entry(list, "host", "10.1.1.1");
+	list = add_entry(list, "net_8_dup", "10.0.0.0/8");
+	list = add_entry(list, "net_24", "10.1.1.0/24");
+	list = add_entry(list, "net_8", "10.0.0.0/8");
+	list = add_entry(list, "net_16", "10.1.0.0/16");
+
+	struct ip_name_db *db = new_ip_name_db(list);
+	assert_non_null(db);
+
+	size_t hosts, nets;
+	ip_name_db_count(db, &hosts, &nets);
+	assert_int_equal(hosts, 2);
+	assert_int_equal(nets, 5);
+
+	assert_string_equal(search(db, "10.1.1.1"), "host");
+	assert_string_equal(search(db, "10.1.1.2"), "net_24");
+	assert_string_equal(search(db, "10.1.2.2"), "net_16");
+	assert_string_equal(search(db, "10.2.2.2"), "net_8");
+	assert_null(search(db, "11.2.2.2"));
+	assert_string_equal(search(db, "2001:db8:1::1"), "v6_host");
+	assert_string_equal(search(db, "2001:db8:1::2"), "v6_net_48");
+	assert_string_equal(search(db, "2001:db8:2::2"), "v6_net_32");
+	assert_null(search(db, "2001:db9::1"));
+	assert_null(ip_name_db_search(NULL, list->number_i.net_address.network));
+
+	ip_name_db_done(db);
+	freeHostsList(list);
+}
+
+/// Database search must be the same as a list linear search of the most
+/// specific entry
+static void testIPNameDbManyEntries() {
+	static const size_t n_entries = 20000;
+	IPNameAssoc *list = NULL;
+	size_t i;
+	char buf[BUFSIZ];
+
+	srand(0);
+	for (i = 0; i < n_entries; ++i) {
+		const unsigned mask = (i % 3 == 0) ? 32 : 8 + rand() % 24;
+		snprintf(buf, sizeof(buf), "10.%d.%d.%d/%u", rand() % 16,
+			rand() % 256, rand() % 256, mask);
+		list = add_entry(list, buf, buf);
+	}
+
+	struct ip_name_db *db = new_ip_name_db(list);
+	assert_non_null(db);
+
+	for (i = 0; i < 2000; ++i) {
+		netAddress_t ip;
+		snprintf(buf, sizeof(buf), "10.%d.%d.%d", rand() % 16, rand() % 256,
+			rand() % 256);
+		assert_true(safe_parse_address(buf, &ip));
+
+		const IPNameAssoc *expected = NULL, *iter;
+		unsigned expected_len = 0;
+		for (iter = list; iter; iter = iter->next) {
+			uint8_t masked[16];
+			unsigned len = 0, j;
+			const netAddress_t *net = &iter->number_i.net_address;
+			apply_netmask(masked, ip.network, net->networkMask);
+			for (j = 0; j < 16; ++j) {
+				len += __builtin_popcount(net->networkMask[j]);
+			}
+
+			uint8_t network[16];
+			apply_netmask(network, net->network, net->networkMask);
+			if (0 == memcmp(masked, network, sizeof(masked)) &&
+					(NULL == expected || len > expected_len)) {
+				expected = iter;
+				expected_len = len;
+			}
+		}
+
+		const IPNameAssoc *found = ip_name_db_search(db, ip.network);
+		if (NULL == expected) {
+			assert_null(found);
+		} else {
+			/* Duplicated prefixes may return any entry of the same network */
+			assert_non_null(found);
+			assert_memory_equal(found->number_i.net_address.networkMask,
+				expected->number_i.net_address.networkMask, 16);
+		}
+	}
+
+	ip_name_db_done(db);
+	freeHostsList(list);
+}
+
+int main(){
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(testIPNameDbLongestPrefix),
+		cmocka_unit_test(testIPNameDbManyEntries),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
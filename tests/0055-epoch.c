@@ -0,0 +1,153 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "f2k.h"
+#include "rb_epoch.h"
+
+#include <pthread.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#define N_READERS 4
+#define N_VERSIONS 2000
+
+#define OBJECT_MAGIC 0x0B1EC70B1EC7L
+
+struct object {
+	uint64_t magic;
+	uint64_t version;
+};
+
+static struct rb_epoch epoch = RB_EPOCH_INITIALIZER;
+static struct object *published;
+static int running;
+static uint64_t freed_objects;
+
+static void free_object(void *vobject) {
+	struct object *object = vobject;
+	assert_int_equal(object->magic, OBJECT_MAGIC);
+	object->magic = 0;
+	free(object);
+	ATOMIC_OP(add, fetch, &freed_objects, 1);
+}
+
+static struct object *new_object(uint64_t object_version) {
+	struct object *ret = calloc(1, sizeof(*ret));
+	assert_non_null(ret);
+	ret->magic = OBJECT_MAGIC;
+	ret->version = object_version;
+	return ret;
+}
+
+static void *reader_thread(void *unused) {
+	(void)unused;
+	struct rb_epoch_reader reader;
+	uint64_t last_version = 0;
+
+	rb_epoch_register(&epoch, &reader);
+	while (ATOMIC_LOAD_ACQUIRE(&running)) {
+		rb_epoch_enter(&epoch, &reader);
+		const struct object *object = ATOMIC_LOAD_ACQUIRE(&published);
+		/* Object can't be freed while we are in the critical section */
+		sched_yield();
+		assert_int_equal(object->magic, OBJECT_MAGIC);
+		assert_true(object->version >= last_version);
+		last_version = object->version;
+		rb_epoch_exit(&reader);
+	}
+	rb_epoch_unregister(&epoch, &reader);
+
+	return NULL;
+}
+
+static void testEpochReclaim() {
+	struct rb_epoch_reader reader;
+	rb_epoch_register(&epoch, &reader);
+
+	/* Object retired while reader is in a section must survive it */
+	published = new_object(0);
+	rb_epoch_enter(&epoch, &reader);
+	struct object *old = published;
+	ATOMIC_STORE_RELEASE(&published, new_object(1));
+	rb_epoch_retire(&epoch, old, free_object);
+	assert_int_equal(rb_epoch_reclaim(&epoch), 1);
+	assert_int_equal(old->magic, OBJECT_MAGIC);
+	rb_epoch_exit(&reader);
+
+	assert_int_equal(rb_epoch_reclaim(&epoch), 0);
+	assert_int_equal(freed_objects, 1);
+
+	/* Readers entering after the retire can't see it */
+	rb_epoch_enter(&epoch, &reader);
+	old = published;
+	ATOMIC_STORE_RELEASE(&published, new_object(2));
+	rb_epoch_retire(&epoch, old, free_object);
+	rb_epoch_exit(&reader);
+	rb_epoch_enter(&epoch, &reader);
+	assert_int_equal(rb_epoch_reclaim(&epoch), 0);
+	rb_epoch_exit(&reader);
+	assert_int_equal(freed_objects, 2);
+
+	rb_epoch_unregister(&epoch, &reader);
+	free_object(published);
+	published = NULL;
+	freed_objects = 0;
+}
+
+static void testEpochConcurrentReaders() {
+	pthread_t readers[N_READERS];
+	size_t i;
+
+	published = new_object(0);
+	running = 1;
+	for (i = 0; i < N_READERS; ++i) {
+		assert_int_equal(pthread_create(&readers[i], NULL, reader_thread,
+									NULL), 0);
+	}
+
+	for (i = 1; i <= N_VERSIONS; ++i) {
+		struct object *old = published;
+		ATOMIC_STORE_RELEASE(&published, new_object(i));
+		rb_epoch_retire(&epoch, old, free_object);
+		rb_epoch_reclaim(&epoch);
+	}
+
+	ATOMIC_STORE_RELEASE(&running, 0);
+	for (i = 0; i < N_READERS; ++i) {
+		pthread_join(readers[i], NULL);
+	}
+
+	/* No readers: everything can be freed */
+	assert_int_equal(rb_epoch_reclaim(&epoch), 0);
+	assert_int_equal(freed_objects, N_VERSIONS);
+
+	rb_epoch_retire(&epoch, published, free_object);
+	rb_epoch_done(&epoch);
+	assert_int_equal(freed_objects, N_VERSIONS + 1);
+}
+
+int main(){
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(testEpochReclaim),
+		cmocka_unit_test(testEpochConcurrentReaders),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,440 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#undef NDEBUG
+
+#include "f2k.h"
+#include "rb_mmdb.h"
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+/*
+ *  TEST DATABASE BUILDER
+ */
+
+#define MAX_NODES 512
+#define RECORD_EMPTY -1
+#define RECORD_DATA(offset) (-2 - (int64_t)(offset))
+
+struct mmdb_builder {
+	int64_t records[MAX_NODES][2];
+	size_t node_count;
+	size_t metadata_node_count; ///< Node count to write, if not 0
+	uint8_t data[1024];
+	size_t data_len;
+};
+
+static void builder_init(struct mmdb_builder *b) {
+	memset(b, 0, sizeof(*b));
+	b->records[0][0] = b->records[0][1] = RECORD_EMPTY;
+	b->node_count = 1;
+}
+
+static void builder_insert(struct mmdb_builder *b, const uint8_t *addr,
+						unsigned bits, size_t data_offset) {
+	size_t node = 0;
+	unsigned i;
+
+	for (i = 0; i < bits; ++i) {
+		const unsigned bit = (addr[i / 8] >> (7 - i % 8)) & 1;
+		int64_t *record = &b->records[node][bit];
+
+		if (i == bits - 1) {
+			*record = RECORD_DATA(data_offset);
+		} else if (*record >= 0) {
+			node = *record;
+		} else {
+			/* New node inherits less specific network data */
+			assert_true(b->node_count < MAX_NODES);
+			b->records[b->node_count][0] = *record;
+			b->records[b->node_count][1] = *record;
+			*record = b->node_count;
+			node = b->node_count++;
+		}
+	}
+}
+
+static void builder_insert_v4(struct mmdb_builder *b, unsigned ip_version,
+			const char *network, unsigned bits, size_t data_offset) {
+	uint8_t addr[16] = {0};
+	const unsigned prefix = ip_version == 6 ? 96 : 0;
+	assert_int_equal(inet_pton(AF_INET, network, &addr[prefix / 8]), 1);
+	builder_insert(b, addr, prefix + bits, data_offset);
+}
+
+static void builder_insert_v6(struct mmdb_builder *b, const char *network,
+				unsigned bits, size_t data_offset) {
+	uint8_t addr[16];
+	assert_int_equal(inet_pton(AF_INET6, network, addr), 1);
+	builder_insert(b, addr, bits, data_offset);
+}
+
+static uint32_t builder_record(const struct mmdb_builder *b, int64_t record) {
+	if (record >= 0) {
+		return record;
+	} else if (record == RECORD_EMPTY) {
+		return b->node_count;
+	}
+
+	return b->node_count + 16 + (uint32_t)(-2 - record);
+}
+
+/* Data section encoders */
+
+static void put_byte(uint8_t *buf, size_t *len, uint8_t byte) {
+	buf[(*len)++] = byte;
+}
+
+static void put_be(uint8_t *buf, size_t *len, uint64_t value, size_t bytes) {
+	while (bytes--) {
+		put_byte(buf, len, value >> (8 * bytes));
+	}
+}
+
+static size_t uint_len(uint64_t value) {
+	size_t ret = 0;
+	for (; value; value >>= 8) {
+		ret++;
+	}
+	return ret;
+}
+
+static void put_map(uint8_t *buf, size_t *len, unsigned pairs) {
+	put_byte(buf, len, (7 << 5) | pairs);
+}
+
+static void put_array(uint8_t *buf, size_t *len, unsigned elements) {
+	put_byte(buf, len, 0 << 5 | elements);
+	put_byte(buf, len, 11 - 7);
+}
+
+static void put_string(uint8_t *buf, size_t *len, const char *str) {
+	const size_t str_len = strlen(str);
+	if (str_len < 29) {
+		put_byte(buf, len, (2 << 5) | str_len);
+	} else {
+		put_byte(buf, len, (2 << 5) | 29);
+		put_byte(buf, len, str_len - 29);
+	}
+	memcpy(&buf[*len], str, str_len);
+	*len += str_len;
+}
+
+static void put_uint(uint8_t *buf, size_t *len, unsigned type,
+							uint64_t value) {
+	const size_t bytes = uint_len(value);
+	if (type < 8) {
+		put_byte(buf, len, (type << 5) | bytes);
+	} else {
+		put_byte(buf, len, bytes);
+		put_byte(buf, len, type - 7);
+	}
+	put_be(buf, len, value, bytes);
+}
+
+static void put_pointer(uint8_t *buf, size_t *len, uint32_t offset) {
+	assert_true(offset < 2048);
+	put_byte(buf, len, (1 << 5) | (offset >> 8));
+	put_byte(buf, len, offset);
+}
+
+#define MMDB_TYPE_UINT16 5
+#define MMDB_TYPE_UINT32 6
+#define MMDB_TYPE_UINT64 9
+
+static const char GOOGLE_ORG[] = "Google LLC";
+static const char LONG_ORG[] =
+				"A very long autonomous system organization name";
+
+/// Offsets of the test database data records
+struct test_records {
+	size_t google, private, nested, org_key, google_name;
+};
+
+static struct test_records builder_add_records(struct mmdb_builder *b) {
+	struct test_records ret;
+	uint8_t *d = b->data;
+	size_t *len = &b->data_len;
+
+	ret.google = *len;
+	put_map(d, len, 3);
+	put_string(d, len, "autonomous_system_number");
+	put_uint(d, len, MMDB_TYPE_UINT32, 15169);
+	ret.org_key = *len;
+	put_string(d, len, "autonomous_system_organization");
+	ret.google_name = *len;
+	put_string(d, len, GOOGLE_ORG);
+	put_string(d, len, "country");
+	put_map(d, len, 1);
+	put_string(d, len, "iso_code");
+	put_string(d, len, "US");
+
+	/* Only registered country, AS name through pointer, and a complex value
+	   to skip before them */
+	ret.private = *len;
+	put_map(d, len, 4);
+	put_string(d, len, "skip_me");
+	put_array(d, len, 2);
+	put_map(d, len, 1);
+	put_string(d, len, "country");
+	put_string(d, len, "XX");
+	put_uint(d, len, MMDB_TYPE_UINT16, 7);
+	put_string(d, len, "registered_country");
+	put_map(d, len, 1);
+	put_string(d, len, "iso_code");
+	put_string(d, len, "ES");
+	put_string(d, len, "autonomous_system_number");
+	put_uint(d, len, MMDB_TYPE_UINT64, 64512);
+	put_pointer(d, len, ret.org_key);
+	put_pointer(d, len, ret.google_name);
+
+	/* Long string, and key through pointer */
+	ret.nested = *len;
+	put_map(d, len, 2);
+	put_string(d, len, "autonomous_system_organization");
+	put_string(d, len, LONG_ORG);
+	put_pointer(d, len, ret.google + 1);
+	put_uint(d, len, MMDB_TYPE_UINT32, 3352);
+
+	assert_true(*len < sizeof(b->data));
+	return ret;
+}
+
+/// Write database to a temp file, and return its path
+static char *builder_write(const struct mmdb_builder *b, unsigned record_size,
+						unsigned ip_version) {
+	static const uint8_t marker[] = "\xab\xcd\xefMaxMind.com";
+	static uint8_t buf[MAX_NODES * 8 + 2048];
+	char *path = strdup("/tmp/f2k-test-mmdb-XXXXXX");
+	size_t len = 0, i;
+	unsigned r;
+
+	assert_non_null(path);
+
+	for (i = 0; i < b->node_count; ++i) {
+		uint32_t records[2];
+		for (r = 0; r < 2; ++r) {
+			records[r] = builder_record(b, b->records[i][r]);
+		}
+
+		switch (record_size) {
+		case 24:
+			put_be(buf, &len, records[0], 3);
+			put_be(buf, &len, records[1], 3);
+			break;
+		case 28:
+			put_be(buf, &len, records[0] & 0xffffff, 3);
+			put_byte(buf, &len, ((records[0] >> 20) & 0xf0) |
+						((records[1] >> 24) & 0x0f));
+			put_be(buf, &len, records[1] & 0xffffff, 3);
+			break;
+		case 32:
+			put_be(buf, &len, records[0], 4);
+			put_be(buf, &len, records[1], 4);
+			break;
+		default:
+			fail_msg("Unknown record size %u", record_size);
+		};
+	}
+
+	memset(&buf[len], 0, 16);
+	len += 16;
+	memcpy(&buf[len], b->data, b->data_len);
+	len += b->data_len;
+
+	memcpy(&buf[len], marker, sizeof(marker) - 1);
+	len += sizeof(marker) - 1;
+	put_map(buf, &len, 4);
+	put_string(buf, &len, "node_count");
+	put_uint(buf, &len, MMDB_TYPE_UINT32, b->metadata_node_count ?
+				b->metadata_node_count : b->node_count);
+	put_string(buf, &len, "record_size");
+	put_uint(buf, &len, MMDB_TYPE_UINT16, record_size);
+	put_string(buf, &len, "ip_version");
+	put_uint(buf, &len, MMDB_TYPE_UINT16, ip_version);
+	put_string(buf, &len, "database_type");
+	put_string(buf, &len, "f2k-Test");
+
+	const int fd = mkstemp(path);
+	assert_true(fd >= 0);
+	assert_int_equal(write(fd, buf, len), len);
+	close(fd);
+
+	return path;
+}
+
+static struct rb_mmdb *open_test_db(unsigned record_size,
+						unsigned ip_version) {
+	struct mmdb_builder b;
+	builder_init(&b);
+	const struct test_records records = builder_add_records(&b);
+
+	builder_insert_v4(&b, ip_version, "8.8.8.0", 24, records.google);
+	builder_insert_v4(&b, ip_version, "10.0.0.0", 8, records.private);
+	builder_insert_v4(&b, ip_version, "10.1.0.0", 16, records.nested);
+	if (ip_version == 6) {
+		builder_insert_v6(&b, "2001:db8::", 32, records.nested);
+	}
+
+	char *path = builder_write(&b, record_size, ip_version);
+	struct rb_mmdb *db = rb_mmdb_open(path);
+	unlink(path);
+	free(path);
+
+	assert_non_null(db);
+	return db;
+}
+
+/*
+ *  TESTS
+ */
+
+static uint32_t ipv4_addr(const char *ip) {
+	struct in_addr addr;
+	assert_int_equal(inet_pton(AF_INET, ip, &addr), 1);
+	return ntohl(addr.s_addr);
+}
+
+static struct in6_addr ipv6_addr(const char *ip) {
+	struct in6_addr addr;
+	assert_int_equal(inet_pton(AF_INET6, ip, &addr), 1);
+	return addr;
+}
+
+static void assert_mmdb_str(const char *str, size_t len, const char *expected) {
+	assert_non_null(str);
+	assert_int_equal(len, strlen(expected));
+	assert_memory_equal(str, expected, len);
+}
+
+static void assert_entry(const struct rb_mmdb_entry *entry,
+		const char *country, uint32_t as_number, const char *as_name) {
+	struct rb_mmdb_as as;
+	size_t len = 0;
+
+	const char *entry_country = rb_mmdb_entry_country_code(entry, &len);
+	if (country) {
+		assert_mmdb_str(entry_country, len, country);
+	} else {
+		assert_null(entry_country);
+	}
+
+	assert_true(rb_mmdb_entry_as(entry, &as));
+	assert_int_equal(as.number, as_number);
+	assert_mmdb_str(as.name, as.name_len, as_name);
+}
+
+static void test_lookups(struct rb_mmdb *db, unsigned ip_version) {
+	struct rb_mmdb_entry entry;
+	struct in6_addr ipv6;
+	size_t len = 0;
+
+	const char *type = rb_mmdb_database_type(db, &len);
+	assert_mmdb_str(type, len, "f2k-Test");
+
+	assert_true(rb_mmdb_lookup_v4(db, ipv4_addr("8.8.8.8"), &entry));
+	assert_entry(&entry, "US", 15169, GOOGLE_ORG);
+
+	ipv6 = ipv6_addr("::ffff:8.8.4.4");
+	assert_false(rb_mmdb_lookup_v6(db, &ipv6, &entry));
+	ipv6 = ipv6_addr("::ffff:8.8.8.4");
+	assert_true(rb_mmdb_lookup_v6(db, &ipv6, &entry));
+	assert_entry(&entry, "US", 15169, GOOGLE_ORG);
+
+	assert_false(rb_mmdb_lookup_v4(db, ipv4_addr("9.9.9.9"), &entry));
+	assert_false(rb_mmdb_lookup_v4(db, ipv4_addr("0.0.0.0"), &entry));
+
+	assert_true(rb_mmdb_lookup_v4(db, ipv4_addr("10.2.0.1"), &entry));
+	assert_entry(&entry, "ES", 64512, GOOGLE_ORG);
+
+	/* More specific network wins */
+	assert_true(rb_mmdb_lookup_v4(db, ipv4_addr("10.1.2.3"), &entry));
+	assert_entry(&entry, NULL, 3352, LONG_ORG);
+
+	static const char *const missing_path[] = {"country", "iso_code", NULL};
+	assert_null(rb_mmdb_entry_get_string(&entry, missing_path, &len));
+
+	ipv6 = ipv6_addr("2001:db8::1");
+	if (ip_version == 6) {
+		assert_true(rb_mmdb_lookup_v6(db, &ipv6, &entry));
+		assert_entry(&entry, NULL, 3352, LONG_ORG);
+	} else {
+		assert_false(rb_mmdb_lookup_v6(db, &ipv6, &entry));
+	}
+
+	ipv6 = ipv6_addr("2001:db9::1");
+	assert_false(rb_mmdb_lookup_v6(db, &ipv6, &entry));
+}
+
+static void testMMDBLookups(void **state) {
+	static const unsigned record_sizes[] = {24, 28, 32};
+	static const unsigned ip_versions[] = {4, 6};
+	size_t i, j;
+
+	(void)state;
+
+	for (i = 0; i < RD_ARRAYSIZE(record_sizes); ++i) {
+		for (j = 0; j < RD_ARRAYSIZE(ip_versions); ++j) {
+			struct rb_mmdb *db = open_test_db(record_sizes[i],
+								ip_versions[j]);
+			test_lookups(db, ip_versions[j]);
+			rb_mmdb_close(db);
+		}
+	}
+}
+
+static void testMMDBInvalid(void **state) {
+	static const char not_mmdb[] = "This is not a MaxMind DB";
+	char path[] = "/tmp/f2k-test-mmdb-XXXXXX";
+	struct mmdb_builder b;
+
+	(void)state;
+
+	assert_null(rb_mmdb_open("/nonexistent/f2k.mmdb"));
+
+	const int fd = mkstemp(path);
+	assert_true(fd >= 0);
+	assert_int_equal(write(fd, not_mmdb, sizeof(not_mmdb)),
+							sizeof(not_mmdb));
+	close(fd);
+	assert_null(rb_mmdb_open(path));
+	unlink(path);
+
+	/* Search tree bigger than file */
+	builder_init(&b);
+	b.metadata_node_count = 1000;
+	char *big_tree_path = builder_write(&b, 24, 6);
+	assert_null(rb_mmdb_open(big_tree_path));
+	unlink(big_tree_path);
+	free(big_tree_path);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(testMMDBLookups),
+		cmocka_unit_test(testMMDBInvalid),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
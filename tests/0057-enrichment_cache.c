@@ -0,0 +1,164 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "f2k.h"
+#include "export.h"
+#include "util.h"
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+static const uint8_t home_ip[16] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 192, 168, 1, 1};
+static const uint8_t global_ip[16] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 10, 1, 1, 1};
+
+/// Global networks database with only one net
+static struct ip_name_db *global_nets_db(const char *name,
+						IPNameAssoc **list) {
+	IPNameAssoc *ret = calloc(1, sizeof(*ret));
+	assert_non_null(ret);
+	ret->name = strdup(name);
+	ret->number = strdup("10.0.0.0/8");
+	assert_true(safe_parse_address(ret->number,
+		&ret->number_i.net_address));
+	*list = ret;
+
+	struct ip_name_db *db = new_ip_name_db(ret);
+	assert_non_null(db);
+	return db;
+}
+
+/// Sensors database with a 192.168.1.0/24 home net in observation id 1, and
+/// no home nets in observation id 2
+static sensors_db_t *home_nets_db(observation_id_t **observation_id,
+					observation_id_t **observation_id_2) {
+	netAddress_t home_net;
+	assert_true(safe_parse_address("192.168.1.0/24", &home_net));
+
+	sensors_db_t *database = sensors_db_new();
+	assert_non_null(database);
+	sensor_t *sensor = sensor_new(home_net.network, home_net.networkMask);
+	assert_non_null(sensor);
+	observation_id_t *home_observation_id = observation_id_new(1);
+	assert_non_null(home_observation_id);
+	observation_id_add_network(home_observation_id,
+		network_new(home_net.network, home_net.networkMask, "home"));
+	sensor_add_observation_id(sensor, home_observation_id);
+	sensor_add_observation_id(sensor, observation_id_new(2));
+	sensors_db_add(database, sensor);
+
+	/* Database owns sensors and observation ids now */
+	sensor = get_sensor(database, 0xc0a80101);
+	assert_non_null(sensor);
+	*observation_id = sensor_get_observation_id(sensor, 1);
+	*observation_id_2 = sensor_get_observation_id(sensor, 2);
+	assert_non_null(*observation_id);
+	assert_non_null(*observation_id_2);
+	return database;
+}
+
+/** Print an address net name in a new flow, like workers do
+  @param cache Enrichment cache
+  @param observation_id Flow observation id
+  @param ip Address to print
+  @param expected Expected net name, or NULL if none
+  */
+static void check_net_name(struct enrichment_cache *cache,
+			observation_id_t *observation_id, const uint8_t ip[16],
+			const char *expected) {
+	struct flowCache flow_cache = {
+		.observation_id = observation_id,
+		.enrichment_cache = cache,
+	};
+	struct printbuf *buf = printbuf_new();
+	assert_non_null(buf);
+
+	const size_t written = print_net_name_v6(buf, ip, 16, &flow_cache);
+	if (expected) {
+		assert_int_equal(written, strlen(expected));
+		assert_memory_equal(buf->buf, expected, written);
+	} else {
+		assert_int_equal(written, 0);
+	}
+
+	printbuf_free(buf);
+}
+
+static void check_stats(const struct enrichment_cache *cache,
+					uint64_t expected_hits,
+					uint64_t expected_misses) {
+	uint64_t hits, misses;
+	enrichment_cache_stats(cache, &hits, &misses);
+	assert_int_equal(hits, expected_hits);
+	assert_int_equal(misses, expected_misses);
+}
+
+static void testEnrichmentCache() {
+	IPNameAssoc *list = NULL, *list2 = NULL;
+	observation_id_t *observation_id = NULL, *observation_id_2 = NULL;
+	sensors_db_t *sensors_db = home_nets_db(&observation_id,
+							&observation_id_2);
+	struct enrichment_cache *cache = new_enrichment_cache(16);
+	assert_non_null(cache);
+
+	readOnlyGlobals.rb_databases.nets_name_as_db =
+		global_nets_db("global", &list);
+
+	/* Home net: first flow misses, next one hits */
+	check_net_name(cache, observation_id, home_ip, "home");
+	check_stats(cache, 0, 1);
+	check_net_name(cache, observation_id, home_ip, "home");
+	check_stats(cache, 1, 1);
+
+	/* Global net: home net and global nets lookups */
+	check_net_name(cache, observation_id, global_ip, "global");
+	check_stats(cache, 1, 3);
+	check_net_name(cache, observation_id, global_ip, "global");
+	check_stats(cache, 3, 3);
+
+	/* Other observation id can't use cached home net */
+	check_net_name(cache, observation_id_2, home_ip, NULL);
+	check_stats(cache, 3, 5);
+	check_net_name(cache, observation_id, home_ip, "home");
+	check_stats(cache, 3, 6);
+
+	/* Database publication must flush the cache */
+	struct ip_name_db *old_db = readOnlyGlobals.rb_databases.nets_name_as_db;
+	readOnlyGlobals.rb_databases.nets_name_as_db =
+		global_nets_db("global2", &list2);
+	readOnlyGlobals.rb_databases.generation++;
+	check_net_name(cache, observation_id, global_ip, "global2");
+
+	enrichment_cache_done(cache);
+	ip_name_db_done(old_db);
+	ip_name_db_done(readOnlyGlobals.rb_databases.nets_name_as_db);
+	readOnlyGlobals.rb_databases.nets_name_as_db = NULL;
+	freeHostsList(list);
+	freeHostsList(list2);
+	delete_rb_sensors_db(sensors_db);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(testEnrichmentCache),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,378 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "f2k.h"
+#include "rb_dns_cache.h"
+#include "rb_epoch.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#ifdef HAVE_UDNS
+
+#define BENCH_THREADS 4
+#define BENCH_ADDRESSES 1024
+#define BENCH_LOOKUPS (1024 * 1024)
+/// Lookups per epoch critical section, like a worker messages batch
+#define BENCH_SECTION_LOOKUPS 1024
+
+/// Cache entries reclamation
+static struct rb_epoch test_epoch = RB_EPOCH_INITIALIZER;
+/// Main test thread reader
+static struct rb_epoch_reader test_reader;
+
+static void test_addr(uint8_t addr[16], uint32_t i) {
+	memset(addr, 0, 16);
+	addr[10] = addr[11] = 0xff;
+	addr[12] = 10;
+	addr[13] = i >> 16;
+	addr[14] = i >> 8;
+	addr[15] = i;
+}
+
+static struct dns_cache *test_cache_new(size_t maxmem_m, time_t timeout_s,
+			time_t negative_timeout_s, unsigned refresh_ahead_pct) {
+	struct dns_cache *cache = dns_cache_new(&test_epoch, maxmem_m,
+		timeout_s, negative_timeout_s, refresh_ahead_pct);
+	assert_non_null(cache);
+	rb_epoch_register(&test_epoch, &test_reader);
+	return cache;
+}
+
+static void test_cache_done(struct dns_cache *cache) {
+	rb_epoch_unregister(&test_epoch, &test_reader);
+	dns_cache_done(cache);
+	rb_epoch_done(&test_epoch);
+}
+
+static void save(struct dns_cache *cache, uint32_t i, const char *name,
+								time_t now) {
+	uint8_t addr[16];
+	test_addr(addr, i);
+	rb_epoch_enter(&test_epoch, &test_reader);
+	struct dns_cache_elm *elm = dns_cache_save_elm(cache, addr, name,
+							strlen(name), now);
+	assert_non_null(elm);
+	rb_epoch_exit(&test_reader);
+}
+
+/// Checks cached name of an address. Expected NULL means not cached
+static void check(struct dns_cache *cache, uint32_t i, const char *expected,
+								time_t now) {
+	uint8_t addr[16];
+	test_addr(addr, i);
+	rb_epoch_enter(&test_epoch, &test_reader);
+	struct dns_cache_elm *elm = dns_cache_get_elm(cache, addr, now);
+	if (NULL == expected) {
+		assert_null(elm);
+	} else {
+		assert_non_null(elm);
+		assert_int_equal(elm->name_len, strlen(expected));
+		assert_memory_equal(elm->name, expected, elm->name_len);
+	}
+	rb_epoch_exit(&test_reader);
+}
+
+static void testDNSCacheGetSave() {
+	static const time_t now = 1000;
+	struct dns_cache *cache = test_cache_new(1, 60, 0, 0);
+
+	check(cache, 1, NULL, now);
+	save(cache, 1, "host1.example.com", now);
+	save(cache, 2, "host2.example.com", now);
+	check(cache, 1, "host1.example.com", now);
+	check(cache, 2, "host2.example.com", now + 60);
+
+	/* Entries are not valid after timeout */
+	check(cache, 1, NULL, now + 61);
+
+	/* Saving again replaces old entry */
+	save(cache, 1, "host1b.example.com", now + 61);
+	check(cache, 1, "host1b.example.com", now + 61);
+
+	/* No reader in a critical section: replaced entries can be freed */
+	assert_int_equal(0, rb_epoch_reclaim(&test_epoch));
+
+	/* Old elements are still valid while in epoch critical section */
+	uint8_t addr[16];
+	test_addr(addr, 2);
+	rb_epoch_enter(&test_epoch, &test_reader);
+	struct dns_cache_elm *elm = dns_cache_get_elm(cache, addr, now);
+	assert_non_null(elm);
+	assert_non_null(dns_cache_save_elm(cache, addr, "host2b.example.com",
+				strlen("host2b.example.com"), now));
+	/* Replaced entry is retired, not freed */
+	assert_int_equal(1, rb_epoch_reclaim(&test_epoch));
+	assert_memory_equal(elm->name, "host2.example.com", elm->name_len);
+	rb_epoch_exit(&test_reader);
+	assert_int_equal(0, rb_epoch_reclaim(&test_epoch));
+	check(cache, 2, "host2b.example.com", now);
+
+	/* Negative entries */
+	test_addr(addr, 3);
+	rb_epoch_enter(&test_epoch, &test_reader);
+	elm = dns_cache_save_elm(cache, addr, NULL, 0, now);
+	assert_non_null(elm);
+	elm = dns_cache_get_elm(cache, addr, now);
+	assert_non_null(elm);
+	assert_null(elm->name);
+	assert_int_equal(elm->name_len, 0);
+	rb_epoch_exit(&test_reader);
+
+	test_cache_done(cache);
+}
+
+/// Negative entries have their own timeout, and entries about to expire are
+/// refreshed only once
+static void testDNSCacheNegativeRefreshAhead() {
+	static const time_t now = 1000;
+	uint8_t addr[16];
+	struct dns_cache *cache = test_cache_new(1, 60, 10, 80);
+
+	test_addr(addr, 1);
+	rb_epoch_enter(&test_epoch, &test_reader);
+	struct dns_cache_elm *elm = dns_cache_save_elm(cache, addr, NULL, 0, now);
+	assert_non_null(elm);
+	elm = dns_cache_get_elm(cache, addr, now + 10);
+	assert_non_null(elm);
+	/* Negative entries are never refreshed in advance */
+	assert_false(dns_cache_elm_refresh_ahead(elm, now + 10));
+	rb_epoch_exit(&test_reader);
+	check(cache, 1, NULL, now + 11);
+
+	save(cache, 2, "host2.example.com", now);
+	test_addr(addr, 2);
+	rb_epoch_enter(&test_epoch, &test_reader);
+	elm = dns_cache_get_elm(cache, addr, now + 47);
+	assert_non_null(elm);
+	assert_false(dns_cache_elm_refresh_ahead(elm, now + 47));
+	assert_true(dns_cache_elm_refresh_ahead(elm, now + 48));
+	assert_false(dns_cache_elm_refresh_ahead(elm, now + 49));
+	/* Refresh failed or timed out: entry is kept and can be refreshed
+	   again */
+	dns_cache_refresh_done(cache, addr);
+	assert_true(dns_cache_elm_refresh_ahead(elm, now + 50));
+	assert_false(dns_cache_elm_refresh_ahead(elm, now + 51));
+	rb_epoch_exit(&test_reader);
+	check(cache, 2, "host2.example.com", now + 60);
+
+	/* Successful refresh replaces the entry, and finishing it must not
+	   affect the new one */
+	save(cache, 2, "host2.example.com", now + 52);
+	rb_epoch_enter(&test_epoch, &test_reader);
+	dns_cache_refresh_done(cache, addr);
+	elm = dns_cache_get_elm(cache, addr, now + 100);
+	assert_non_null(elm);
+	assert_true(dns_cache_elm_refresh_ahead(elm, now + 100));
+	rb_epoch_exit(&test_reader);
+
+	/* Unknown addresses are ignored */
+	test_addr(addr, 3);
+	rb_epoch_enter(&test_epoch, &test_reader);
+	dns_cache_refresh_done(cache, addr);
+	rb_epoch_exit(&test_reader);
+
+	test_cache_done(cache);
+}
+
+/// Cache must keep memory limit, but keep a frequently used entry
+static void testDNSCacheEviction() {
+	static const time_t now = 1000;
+	static const uint32_t hot_addr = 0xffffff;
+	static const uint32_t n_addrs = 100000;
+	uint32_t i, cached = 0;
+	struct dns_cache *cache = test_cache_new(1, 60, 0, 0);
+
+	save(cache, hot_addr, "hot.example.com", now);
+	for (i = 0; i < n_addrs; ++i) {
+		save(cache, i, "a-long-enough-host-name.example.com", now);
+		check(cache, hot_addr, "hot.example.com", now);
+	}
+
+	for (i = 0; i < n_addrs; ++i) {
+		uint8_t addr[16];
+		test_addr(addr, i);
+		rb_epoch_enter(&test_epoch, &test_reader);
+		if (dns_cache_get_elm(cache, addr, now)) {
+			cached++;
+		}
+		rb_epoch_exit(&test_reader);
+	}
+
+	/* Can't hold all entries in 1MB */
+	assert_true(cached > 0);
+	assert_true(cached < n_addrs);
+	assert_true(cached * (sizeof(struct dns_cache_elm) +
+		strlen("a-long-enough-host-name.example.com")) < 1024 * 1024);
+	/* Newest entry was never evicted */
+	check(cache, n_addrs - 1, "a-long-enough-host-name.example.com", now);
+
+	test_cache_done(cache);
+}
+
+struct bench_args {
+	struct dns_cache *cache;
+	unsigned seed;
+	/// Lookups of evicted addresses are allowed
+	bool allow_misses;
+	/// Stop looking up when set. NULL to do BENCH_LOOKUPS lookups
+	const int *stop;
+};
+
+static void *bench_lookups(void *vargs) {
+	struct bench_args *args = vargs;
+	struct rb_epoch_reader reader;
+	uint32_t i, hits = 0;
+	uint8_t addr[16];
+
+	rb_epoch_register(&test_epoch, &reader);
+	for (i = 0; args->stop ? !ATOMIC_LOAD_ACQUIRE(args->stop) :
+						i < BENCH_LOOKUPS; ++i) {
+		if (0 == i % BENCH_SECTION_LOOKUPS) {
+			if (i > 0) {
+				rb_epoch_exit(&reader);
+			}
+			rb_epoch_enter(&test_epoch, &reader);
+		}
+
+		test_addr(addr, (args->seed + i * 7) % BENCH_ADDRESSES);
+		struct dns_cache_elm *elm = dns_cache_get_elm(args->cache, addr,
+									1000);
+		if (elm) {
+			hits++;
+			assert_int_equal(elm->name_len,
+						strlen("bench.example.com"));
+			assert_memory_equal(elm->name, "bench.example.com",
+								elm->name_len);
+		}
+	}
+	if (i > 0) {
+		rb_epoch_exit(&reader);
+	}
+	rb_epoch_unregister(&test_epoch, &reader);
+
+	if (!args->allow_misses) {
+		assert_int_equal(hits, BENCH_LOOKUPS);
+	}
+	return NULL;
+}
+
+static double elapsed_s(const struct timespec *begin) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - begin->tv_sec) +
+				(end.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+/// Contention benchmark: all threads look up the same hot addresses
+static void testDNSCacheContention() {
+	struct bench_args args[BENCH_THREADS];
+	pthread_t threads[BENCH_THREADS];
+	struct timespec begin;
+	size_t n_threads, i;
+
+	struct dns_cache *cache = test_cache_new(16, 60, 0, 0);
+	for (i = 0; i < BENCH_ADDRESSES; ++i) {
+		save(cache, i, "bench.example.com", 1000);
+	}
+
+	for (n_threads = 1; n_threads <= BENCH_THREADS; n_threads <<= 1) {
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		for (i = 0; i < n_threads; ++i) {
+			memset(&args[i], 0, sizeof(args[i]));
+			args[i].cache = cache;
+			args[i].seed = i * 131;
+			assert_int_equal(0, pthread_create(&threads[i], NULL,
+				bench_lookups, &args[i]));
+		}
+		for (i = 0; i < n_threads; ++i) {
+			pthread_join(threads[i], NULL);
+		}
+
+		const double seconds = elapsed_s(&begin);
+		printf("DNS cache: %zu threads, %.0f lookups/s\n", n_threads,
+			n_threads * BENCH_LOOKUPS / seconds);
+	}
+
+	test_cache_done(cache);
+}
+
+/// Lookups must be safe while another thread replaces and evicts the same
+/// entries, and reclaims them
+static void testDNSCacheConcurrentEviction() {
+	struct bench_args args[BENCH_THREADS];
+	pthread_t threads[BENCH_THREADS];
+	int stop = 0;
+	size_t i;
+
+	/* Small cache, so saves evict entries */
+	struct dns_cache *cache = test_cache_new(1, 60, 0, 0);
+	for (i = 0; i < BENCH_ADDRESSES; ++i) {
+		save(cache, i, "bench.example.com", 1000);
+	}
+
+	for (i = 0; i < BENCH_THREADS; ++i) {
+		memset(&args[i], 0, sizeof(args[i]));
+		args[i].cache = cache;
+		args[i].seed = i * 131;
+		args[i].allow_misses = true;
+		args[i].stop = &stop;
+		assert_int_equal(0, pthread_create(&threads[i], NULL,
+			bench_lookups, &args[i]));
+	}
+
+	for (i = 0; i < 64 * BENCH_ADDRESSES; ++i) {
+		/* Out of readers range addresses force evictions */
+		save(cache, i % (16 * BENCH_ADDRESSES),
+					"bench.example.com", 1000);
+		if (0 == i % BENCH_ADDRESSES) {
+			rb_epoch_reclaim(&test_epoch);
+		}
+	}
+
+	ATOMIC_STORE_RELEASE(&stop, 1);
+	for (i = 0; i < BENCH_THREADS; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	test_cache_done(cache);
+}
+
+#else /* HAVE_UDNS */
+static void skip_test() { skip(); }
+#endif
+
+int main() {
+	const struct CMUnitTest tests[] = {
+#ifdef HAVE_UDNS
+		cmocka_unit_test(testDNSCacheGetSave),
+		cmocka_unit_test(testDNSCacheNegativeRefreshAhead),
+		cmocka_unit_test(testDNSCacheEviction),
+		cmocka_unit_test(testDNSCacheContention),
+		cmocka_unit_test(testDNSCacheConcurrentEviction),
+#else
+		cmocka_unit_test(skip_test),
+#endif
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,330 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "f2k.h"
+
+#include "rb_netflow_test.h"
+#include "rb_mem_wraps.h"
+#include "rb_flow_arena.h"
+#include "rb_sink.h"
+#include "printbuf.h"
+#include "rb_lists.h"
+
+#include <librd/rd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+static const NetFlow5Record record_v5 = {
+	.flowHeader = {
+		.version = 0x0500,
+		.count = 0x0100,
+		.sys_uptime = 12345,
+		.unix_secs = 12345,
+		.unix_nsecs = 12345,
+		.flow_sequence = 1050,
+	},
+	.flowRecord = {
+		[0] = {
+			.srcaddr = 0x08080808L,
+			.dstaddr = 0x0A0A0A0AL,
+			.output = 255,
+			.dPkts = 0x0100,
+			.dOctets = 0x4600,
+			.first = 0xa8484205,
+			.last = 0xa8484205,
+			.srcport = 0xbb01,
+			.dstport = 0x7527,
+			.proto = 2,
+		},
+	},
+};
+
+struct TestV9Template{
+	V9FlowHeader flowHeader;
+	V9TemplateHeader flowSetHeader;
+	V9TemplateDef templateHeader;
+	V9FlowSet templateSet[3];
+};
+
+struct TestV9Flow{
+	V9FlowHeader flowHeader;
+	V9TemplateHeader flowSetHeader;
+	const uint8_t buffer1[20];
+	const uint8_t buffer2[20];
+}__attribute__((packed));
+
+static const struct TestV9Template v9_template = {
+	.flowHeader = {
+		/*uint16_t*/ .version = 0x0900,           /* Current version=9*/
+		/*uint16_t*/ .count = 0x0100,           /* The number of records in PDU. */
+		/*uint32_t*/ .sys_uptime = 0x00003039,     /* Current time in msecs since router booted */
+		/*uint32_t*/ .unix_secs = 0xe2336552,     /* Current seconds since 0000 UTC 1970 */
+		/*uint32_t*/ .flow_sequence = 0x38040000, /* Sequence number of total flows seen */
+		/*uint32_t*/ .source_id = 0x01000000,      /* Source id */
+	},
+
+	.flowSetHeader = {
+		/*uint16_t*/ .templateFlowset = 0x0000,
+		/*uint16_t*/ .flowsetLen = 0x1400,
+	},
+
+	.templateHeader = {
+		/*uint16_t*/ .templateId = 0x0301, /*259*/
+		/*uint16_t*/ .fieldCount = 0x0300,
+	},
+
+	.templateSet = { /* all uint16_t*/
+		[0] = {.templateId = 0x0800 /*   8: IPV4_SRC_ADDR */, .flowsetLen = 0x0400},
+		[1] = {.templateId = 0x0100 /*   1: BYTES */, .flowsetLen = 0x0800},
+		[2] = {.templateId = 0x0200 /*   2: PKTS */, .flowsetLen = 0x0800},
+	}
+};
+
+static const struct TestV9Flow v9_flow = {
+	.flowHeader = {
+		/*uint16_t*/ .version = 0x0900,           /* Current version=9*/
+		/*uint16_t*/ .count = 0x0100,           /* The number of records in PDU. */
+		/*uint32_t*/ .sys_uptime = 0x00003039,     /* Current time in msecs since router booted */
+		/*uint32_t*/ .unix_secs = 0x98346552,     /* Current seconds since 0000 UTC 1970 */
+		/*uint32_t*/ .flow_sequence = 0x76040000, /* Sequence number of total flows seen */
+		/*uint32_t*/ .source_id = 0x01000000,      /* Source id */
+	},
+
+	.flowSetHeader = {
+		/*uint16_t*/ .templateFlowset = 0x0301,
+		/*uint16_t*/ .flowsetLen = 0x2c00,
+	},
+
+	.buffer1 = {
+		0x0a, 0x0d, 0x5e, 0xdf,             /* IPV4_SRC_ADDR: 10.13.94.223 */
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1d, 0xb3, /* Bytes */
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x07, /* Packets */
+	},
+
+	.buffer2 = {
+		0x0a, 0x0d, 0x5e, 0xe0,             /* IPV4_SRC_ADDR: 10.13.94.224 */
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1d, 0xb4, /* Bytes */
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x08, /* Packets */
+	},
+};
+
+static const struct checkdata_value checkdata_values_v5[] = {
+	{.key = "type", .value = "netflowv5"},
+	{.key = "src", .value = "8.8.8.8"},
+	{.key = "dst", .value = "10.10.10.10"},
+	{.key = "bytes", .value = "4587520"},
+};
+
+static const struct checkdata_value checkdata_values_v9_1[] = {
+	{.key = "type", .value = "netflowv9"},
+	{.key = "src", .value = "10.13.94.223"},
+	{.key = "bytes", .value = "7603"},
+};
+
+static const struct checkdata_value checkdata_values_v9_2[] = {
+	{.key = "type", .value = "netflowv9"},
+	{.key = "src", .value = "10.13.94.224"},
+	{.key = "bytes", .value = "7604"},
+};
+
+#define CHECKS(values) {.size = RD_ARRAYSIZE(values), .checks = values}
+
+static int prepare_test_nf_v5(void **state) {
+	static const struct checkdata checkdata[] = {
+		CHECKS(checkdata_values_v5),
+	};
+
+	struct test_params test_params[] = {
+		[0] = {
+			.config_json_path = "./tests/0000-testFlowV5.json",
+			.netflow_src_ip = 0x04030201,
+			.record = &record_v5, .record_size = sizeof(record_v5),
+			.checkdata = checkdata,
+			.checkdata_size = RD_ARRAYSIZE(checkdata),
+		},
+	};
+
+	*state = prepare_tests(test_params, RD_ARRAYSIZE(test_params));
+	return *state == NULL;
+}
+
+static int prepare_test_nf_v9(void **state) {
+	static const struct checkdata checkdata[] = {
+		CHECKS(checkdata_values_v9_1),
+		CHECKS(checkdata_values_v9_2),
+	};
+
+	struct test_params test_params[] = {
+		[0] = {
+			.config_json_path = "./tests/0000-testFlowV5.json",
+			.netflow_src_ip = 0x04030201,
+			.record = &v9_template, .record_size = sizeof(v9_template),
+		},
+		[1] = {
+			.netflow_src_ip = 0x04030201,
+			.record = &v9_flow, .record_size = sizeof(v9_flow),
+			.checkdata = checkdata,
+			.checkdata_size = RD_ARRAYSIZE(checkdata),
+		},
+	};
+
+	*state = prepare_tests(test_params, RD_ARRAYSIZE(test_params));
+	return *state == NULL;
+}
+
+/// Sink that takes ownership of messages buffers, as kafka sink does
+static void handoff_sink_send(struct rb_sink *sink,
+		struct string_list *const *msgs, size_t n_msgs,
+		struct worker_stats *stats) {
+	size_t i;
+	(void)sink;
+	(void)stats;
+
+	for (i = 0; i < n_msgs; ++i) {
+		free(msgs[i]->string->buf);
+		msgs[i]->string->buf = NULL;
+	}
+}
+
+static void handoff_sink_done(struct rb_sink *sink) {
+	(void)sink;
+}
+
+static struct rb_sink handoff_sink = {
+	.ops = &(const struct rb_sink_ops) {
+		.send = handoff_sink_send,
+		.done = handoff_sink_done,
+	},
+};
+
+/** Dissect test records with a warm worker flow arena, and check the
+ * allocations of each flow
+ * @param state Test state
+ * @param sink Sink to send flows
+ * @param flow_allocs Expected allocations per flow
+ */
+static void check_flow_allocs(void **state, struct rb_sink *sink,
+							size_t flow_allocs) {
+	const struct nf_test_state *st = *state;
+	const size_t n_records = st->params.records_size;
+	struct flow_allocs allocs[n_records];
+	size_t i;
+
+	flow_allocs_test(state, sink, allocs);
+
+	for (i = 0; i < n_records; ++i) {
+		if (0 == allocs[i].flows) {
+			/* Template record */
+			continue;
+		}
+
+#if WITH_PRINT_BOUND_CHECKS
+		/* Every printed field is copied to the heap */
+		skip();
+#endif
+		assert_int_equal(allocs[i].allocs,
+					allocs[i].flows * flow_allocs);
+	}
+}
+
+/// Warm arena recycles every flow object, and null sink leaves the payload
+/// buffer in its printbuf
+static void check_null_sink_flow_allocs(void **state) {
+	struct rb_sink *sink = rb_sink_null_new();
+	assert_non_null(sink);
+	check_flow_allocs(state, sink, 0);
+	rb_sink_done(sink);
+}
+
+/// Payload buffer is the only allocation if sink takes it
+static void check_handoff_sink_flow_allocs(void **state) {
+	check_flow_allocs(state, &handoff_sink, 1);
+}
+
+static void testFlowV5ArenaNullSink(void **state) {
+	check_null_sink_flow_allocs(state);
+}
+
+static void testFlowV5ArenaHandoffSink(void **state) {
+	check_handoff_sink_flow_allocs(state);
+}
+
+static void testFlowV9ArenaNullSink(void **state) {
+	check_null_sink_flow_allocs(state);
+}
+
+static void testFlowV9ArenaHandoffSink(void **state) {
+	check_handoff_sink_flow_allocs(state);
+}
+
+/// Objects beyond arena limit must be freed, and arena must keep working
+static void testFlowArenaLimit() {
+	struct printbuf *pbs[8];
+	const size_t n_pbs = sizeof(pbs) / sizeof(pbs[0]);
+	const size_t max_objects = n_pbs / 2;
+	size_t i;
+
+	struct flow_arena *arena = new_flow_arena(max_objects);
+	assert_non_null(arena);
+
+	for (i = 0; i < n_pbs; ++i) {
+		pbs[i] = flow_arena_printbuf_new(arena);
+		assert_non_null(pbs[i]);
+	}
+
+	for (i = 0; i < n_pbs; ++i) {
+		flow_arena_printbuf_free(arena, pbs[i]);
+	}
+
+	/* Recycled printbufs keep their buffer */
+	const size_t allocs_before = mem_wraps_get_n_allocs();
+	for (i = 0; i < max_objects; ++i) {
+		pbs[i] = flow_arena_printbuf_new(arena);
+		assert_non_null(pbs[i]);
+	}
+	assert_int_equal(mem_wraps_get_n_allocs() - allocs_before, 0);
+
+	/* Arena is empty again */
+	pbs[max_objects] = flow_arena_printbuf_new(arena);
+	assert_non_null(pbs[max_objects]);
+	assert_int_equal(mem_wraps_get_n_allocs() - allocs_before, 2);
+
+	for (i = 0; i <= max_objects; ++i) {
+		flow_arena_printbuf_free(arena, pbs[i]);
+	}
+
+	flow_arena_done(arena);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup(testFlowV5ArenaNullSink,
+							prepare_test_nf_v5),
+		cmocka_unit_test_setup(testFlowV5ArenaHandoffSink,
+							prepare_test_nf_v5),
+		cmocka_unit_test_setup(testFlowV9ArenaNullSink,
+							prepare_test_nf_v9),
+		cmocka_unit_test_setup(testFlowV9ArenaHandoffSink,
+							prepare_test_nf_v9),
+		cmocka_unit_test(testFlowArenaLimit),
+	};
+
+	return cmocka_run_group_tests(tests, nf_test_setup, nf_test_teardown);
+}
@@ -0,0 +1,427 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rb_spill.h"
+
+#include "f2k.h"
+
+#include "rb_mem_wraps.h"
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBRDKAFKA
+#include "rb_kafka.h"
+
+#if RD_KAFKA_VERSION >= 0x010500ff
+#define SPILL_MOCK_CLUSTER
+#include <librdkafka/rdkafka_mock.h>
+#endif
+#endif
+
+/// Replay callback arguments
+struct replay_check {
+	size_t next_msg;   ///< Next expected message
+	size_t max_accept; ///< Messages to accept before refusing
+};
+
+static void msg_of(size_t i, char *buf, size_t buf_size) {
+	snprintf(buf, buf_size, "{\"msg\":%zu}", i);
+}
+
+static int check_replay_cb(void *buf, size_t len, uint64_t key,
+								void *opaque) {
+	struct replay_check *check = opaque;
+	char expected[64];
+
+	if (0 == check->max_accept) {
+		return -1;
+	}
+
+	msg_of(check->next_msg, expected, sizeof(expected));
+	assert_int_equal(len, strlen(expected));
+	assert_memory_equal(buf, expected, len);
+	assert_int_equal(key, check->next_msg);
+
+	free(buf);
+	check->next_msg++;
+	check->max_accept--;
+	return 0;
+}
+
+static void append_msgs(struct rb_spill *spill, size_t from, size_t to) {
+	size_t i;
+	for (i = from; i < to; ++i) {
+		char msg[64];
+		msg_of(i, msg, sizeof(msg));
+		assert_int_equal(0, rb_spill_append(spill, msg, strlen(msg), i));
+	}
+}
+
+static void assert_spill_empty(struct rb_spill *spill, const char *dir) {
+	struct rb_spill_stats stats;
+	rb_spill_get_stats(spill, &stats);
+	assert_int_equal(stats.bytes, 0);
+	rb_spill_done(spill);
+
+	/* No segments left */
+	assert_int_equal(0, rmdir(dir));
+}
+
+/// Messages are replayed in order, across many segments
+static void testSpillReplayOrder() {
+	char dir[] = "/tmp/f2k-spill-XXXXXX";
+	struct replay_check check = {.next_msg = 0, .max_accept = SIZE_MAX};
+	struct rb_spill_stats stats;
+	assert_non_null(mkdtemp(dir));
+
+	struct rb_spill *spill = rb_spill_new(dir, 128, 1024 * 1024, 4);
+	assert_non_null(spill);
+
+	append_msgs(spill, 0, 100);
+	assert_int_equal(10, rb_spill_replay(spill, 10, check_replay_cb,
+		&check));
+
+	/* Appends interleaved with replays */
+	append_msgs(spill, 100, 150);
+	assert_int_equal(140, rb_spill_replay(spill, SIZE_MAX,
+		check_replay_cb, &check));
+	assert_int_equal(0, rb_spill_replay(spill, SIZE_MAX,
+		check_replay_cb, &check));
+	assert_int_equal(check.next_msg, 150);
+
+	rb_spill_get_stats(spill, &stats);
+	assert_int_equal(stats.spilled_msgs, 150);
+	assert_int_equal(stats.replayed_msgs, 150);
+	assert_int_equal(stats.dropped_msgs, 0);
+
+	assert_spill_empty(spill, dir);
+}
+
+/// Refused message is replayed again
+static void testSpillReplayRefused() {
+	char dir[] = "/tmp/f2k-spill-XXXXXX";
+	struct replay_check check = {.next_msg = 0, .max_accept = 3};
+	assert_non_null(mkdtemp(dir));
+
+	struct rb_spill *spill = rb_spill_new(dir, 1024, 1024 * 1024, 1);
+	assert_non_null(spill);
+
+	append_msgs(spill, 0, 10);
+	assert_int_equal(3, rb_spill_replay(spill, SIZE_MAX, check_replay_cb,
+		&check));
+	assert_int_equal(0, rb_spill_replay(spill, SIZE_MAX, check_replay_cb,
+		&check));
+
+	check.max_accept = SIZE_MAX;
+	assert_int_equal(7, rb_spill_replay(spill, SIZE_MAX, check_replay_cb,
+		&check));
+
+	assert_spill_empty(spill, dir);
+}
+
+/// Journal does not grow beyond its size cap
+static void testSpillMaxBytes() {
+	char dir[] = "/tmp/f2k-spill-XXXXXX";
+	struct replay_check check = {.next_msg = 0, .max_accept = SIZE_MAX};
+	struct rb_spill_stats stats;
+	size_t i;
+	assert_non_null(mkdtemp(dir));
+
+	struct rb_spill *spill = rb_spill_new(dir, 1024, 256, 1);
+	assert_non_null(spill);
+
+	for (i = 0; 0 == rb_spill_append(spill, "{\"msg\":0}",
+					strlen("{\"msg\":0}"), 0); ++i);
+	assert_true(i > 0);
+
+	rb_spill_get_stats(spill, &stats);
+	assert_int_equal(stats.spilled_msgs, i);
+	assert_int_equal(stats.dropped_msgs, 1);
+	assert_true(stats.bytes <= 256);
+
+	/* Replaying frees room. All messages are the same one */
+	while (rb_spill_replay(spill, 1, check_replay_cb, &check)) {
+		check.next_msg = 0;
+	}
+	assert_int_equal(0, rb_spill_append(spill, "{\"msg\":0}",
+		strlen("{\"msg\":0}"), 0));
+	assert_int_equal(1, rb_spill_replay(spill, SIZE_MAX, check_replay_cb,
+		&check));
+
+	assert_spill_empty(spill, dir);
+}
+
+/// Messages survive a restart, and they are replayed before the new ones
+static void testSpillReopen() {
+	char dir[] = "/tmp/f2k-spill-XXXXXX";
+	struct replay_check check = {.next_msg = 0, .max_accept = SIZE_MAX};
+	assert_non_null(mkdtemp(dir));
+
+	struct rb_spill *spill = rb_spill_new(dir, 128, 1024 * 1024, 4);
+	assert_non_null(spill);
+	append_msgs(spill, 0, 20);
+	rb_spill_done(spill);
+
+	spill = rb_spill_new(dir, 128, 1024 * 1024, 4);
+	assert_non_null(spill);
+	append_msgs(spill, 20, 40);
+	assert_int_equal(40, rb_spill_replay(spill, SIZE_MAX, check_replay_cb,
+		&check));
+
+	assert_spill_empty(spill, dir);
+}
+
+/** Offset of a record in the first segment
+  @param n Record index
+  @return Offset
+  */
+static off_t record_offset(size_t n) {
+	/* magic + len + key */
+	static const size_t hdr_size = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+	off_t ret = 0;
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		char msg[64];
+		msg_of(i, msg, sizeof(msg));
+		ret += hdr_size + strlen(msg);
+	}
+
+	return ret;
+}
+
+/// Corrupted record length is not trusted, and rest of segment is skipped
+static void testSpillCorruptLen() {
+	char dir[] = "/tmp/f2k-spill-XXXXXX";
+	char path[PATH_MAX];
+	struct replay_check check = {.next_msg = 0, .max_accept = SIZE_MAX};
+	struct rb_spill_stats stats;
+	const uint32_t bad_len = UINT32_MAX;
+	assert_non_null(mkdtemp(dir));
+
+	struct rb_spill *spill = rb_spill_new(dir, 1024, 1024 * 1024, 1);
+	assert_non_null(spill);
+	append_msgs(spill, 0, 5);
+
+	snprintf(path, sizeof(path), "%s/%020d.spill", dir, 0);
+	const int fd = open(path, O_WRONLY);
+	assert_true(fd >= 0);
+	assert_int_equal(sizeof(bad_len), pwrite(fd, &bad_len, sizeof(bad_len),
+		record_offset(2) + sizeof(uint32_t)));
+	close(fd);
+
+	/* Only valid records are allocated */
+	const size_t allocs_before = mem_wraps_get_n_allocs();
+	assert_int_equal(2, rb_spill_replay(spill, SIZE_MAX, check_replay_cb,
+		&check));
+	assert_int_equal(mem_wraps_get_n_allocs() - allocs_before, 2);
+
+	rb_spill_get_stats(spill, &stats);
+	assert_int_equal(stats.replayed_msgs, 2);
+	assert_int_equal(stats.truncated_segments, 1);
+
+	assert_spill_empty(spill, dir);
+}
+
+/// Segment is kept if record can't be allocated
+static void testSpillReplayNoMem() {
+	char dir[] = "/tmp/f2k-spill-XXXXXX";
+	struct replay_check check = {.next_msg = 0, .max_accept = SIZE_MAX};
+	struct rb_spill_stats stats;
+	assert_non_null(mkdtemp(dir));
+
+	struct rb_spill *spill = rb_spill_new(dir, 1024, 1024 * 1024, 1);
+	assert_non_null(spill);
+	append_msgs(spill, 0, 5);
+
+	mem_wraps_set_fail_in(1);
+	assert_int_equal(0, rb_spill_replay(spill, SIZE_MAX, check_replay_cb,
+		&check));
+	mem_wraps_set_fail_in(0);
+
+	rb_spill_get_stats(spill, &stats);
+	assert_int_equal(stats.replayed_msgs, 0);
+	assert_int_equal(stats.truncated_segments, 0);
+	assert_true(stats.bytes > 0);
+
+	/* Nothing was lost */
+	assert_int_equal(5, rb_spill_replay(spill, SIZE_MAX, check_replay_cb,
+		&check));
+
+	assert_spill_empty(spill, dir);
+}
+
+#ifdef SPILL_MOCK_CLUSTER
+
+#define MOCK_TOPIC "f2k-spill"
+#define MOCK_TIMEOUT_MS 30000
+
+/** Produce messages and wait for their delivery reports
+  @param producer Producer
+  @param from First message
+  @param to Last message (not included)
+  */
+static void produce_msgs(const struct rb_kafka_producer *producer,
+						size_t from, size_t to) {
+	size_t i;
+	for (i = from; i < to; ++i) {
+		char msg[64];
+		msg_of(i, msg, sizeof(msg));
+		assert_int_equal(0, rd_kafka_produce(producer->rkt, 0,
+			RD_KAFKA_MSG_F_COPY, msg, strlen(msg), NULL, 0,
+			(void *)(intptr_t)i));
+	}
+
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+		rd_kafka_flush(producer->rk, MOCK_TIMEOUT_MS));
+}
+
+/** Consume all messages of the mock topic, and check that spilled ones are
+  in order
+  @param bootstraps Mock cluster bootstrap servers
+  @param n_spilled Spilled messages, that start at 0
+  @param n_msgs Total messages in topic
+  */
+static void check_mock_topic(const char *bootstraps, size_t n_spilled,
+								size_t n_msgs) {
+	char errstr[512];
+	size_t i, next_spilled = 0;
+	rd_kafka_conf_t *conf = rd_kafka_conf_new();
+
+	assert_int_equal(RD_KAFKA_CONF_OK, rd_kafka_conf_set(conf,
+		"bootstrap.servers", bootstraps, errstr, sizeof(errstr)));
+	rd_kafka_t *rk = rd_kafka_new(RD_KAFKA_CONSUMER, conf, errstr,
+		sizeof(errstr));
+	assert_non_null(rk);
+	rd_kafka_topic_t *rkt = rd_kafka_topic_new(rk, MOCK_TOPIC, NULL);
+	assert_non_null(rkt);
+	assert_int_equal(0, rd_kafka_consume_start(rkt, 0,
+		RD_KAFKA_OFFSET_BEGINNING));
+
+	for (i = 0; i < n_msgs; ++i) {
+		char expected[64];
+		rd_kafka_message_t *rkm = rd_kafka_consume(rkt, 0,
+			MOCK_TIMEOUT_MS);
+		assert_non_null(rkm);
+		assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR, rkm->err);
+
+		/* Live messages can be interleaved with replayed ones */
+		msg_of(next_spilled, expected, sizeof(expected));
+		if (next_spilled < n_spilled && rkm->len == strlen(expected) &&
+				0 == memcmp(rkm->payload, expected, rkm->len)) {
+			next_spilled++;
+		}
+		rd_kafka_message_destroy(rkm);
+	}
+	assert_int_equal(next_spilled, n_spilled);
+
+	rd_kafka_consume_stop(rkt, 0);
+	rd_kafka_topic_destroy(rkt);
+	rd_kafka_destroy(rk);
+}
+
+/// Messages that timed out are spilled, and sent again when broker is back
+static void testSpillMockCluster() {
+	static const size_t n_spilled = 50;
+	char dir[] = "/tmp/f2k-spill-XXXXXX";
+	char errstr[512];
+	struct rb_kafka_producer producer;
+	struct rb_kafka_spill_replayer replayer;
+	struct rb_spill_stats stats;
+	size_t i;
+	assert_non_null(mkdtemp(dir));
+
+	readOnlyGlobals.kafka.spill = rb_spill_new(dir, 512, 1024 * 1024, 1);
+	assert_non_null(readOnlyGlobals.kafka.spill);
+
+	rd_kafka_conf_t *conf = rd_kafka_conf_new();
+	assert_int_equal(RD_KAFKA_CONF_OK, rd_kafka_conf_set(conf,
+		"test.mock.num.brokers", "1", errstr, sizeof(errstr)));
+	assert_int_equal(RD_KAFKA_CONF_OK, rd_kafka_conf_set(conf,
+		"message.timeout.ms", "1000", errstr, sizeof(errstr)));
+	rd_kafka_conf_set_dr_msg_cb(conf, rb_kafka_spill_msg_delivered);
+	assert_int_equal(0, rb_kafka_producer_init(&producer, conf, MOCK_TOPIC,
+		rd_kafka_topic_conf_new()));
+
+	rd_kafka_mock_cluster_t *mcluster = rd_kafka_handle_mock_cluster(
+		producer.rk);
+	assert_non_null(mcluster);
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+		rd_kafka_mock_topic_create(mcluster, MOCK_TOPIC, 1, 1));
+
+	/* Broker down: every message times out and goes to the journal */
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+		rd_kafka_mock_broker_set_down(mcluster, 1));
+	produce_msgs(&producer, 0, n_spilled);
+	rb_spill_get_stats(readOnlyGlobals.kafka.spill, &stats);
+	assert_int_equal(stats.spilled_msgs, n_spilled);
+
+	/* Broker up: a live delivery tells replayer to send the journal */
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+		rd_kafka_mock_broker_set_up(mcluster, 1));
+	assert_int_equal(0, rb_kafka_spill_replayer_start(&replayer, &producer,
+		readOnlyGlobals.kafka.spill));
+	produce_msgs(&producer, n_spilled, n_spilled + 1);
+
+	for (i = 0; i < MOCK_TIMEOUT_MS / 100; ++i) {
+		rb_spill_get_stats(readOnlyGlobals.kafka.spill, &stats);
+		if (stats.replayed_msgs == n_spilled) {
+			break;
+		}
+		rd_kafka_poll(producer.rk, 100);
+	}
+	rb_kafka_spill_replayer_stop(&replayer);
+	assert_int_equal(stats.replayed_msgs, n_spilled);
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+		rd_kafka_flush(producer.rk, MOCK_TIMEOUT_MS));
+
+	/* Nothing went back to the journal */
+	rb_spill_get_stats(readOnlyGlobals.kafka.spill, &stats);
+	assert_int_equal(stats.spilled_msgs, n_spilled);
+
+	check_mock_topic(rd_kafka_mock_cluster_bootstraps(mcluster), n_spilled,
+		n_spilled + 1);
+
+	rb_kafka_producer_done(&producer);
+	assert_spill_empty(readOnlyGlobals.kafka.spill, dir);
+	readOnlyGlobals.kafka.spill = NULL;
+}
+
+#endif /* SPILL_MOCK_CLUSTER */
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(testSpillReplayOrder),
+		cmocka_unit_test(testSpillReplayRefused),
+		cmocka_unit_test(testSpillMaxBytes),
+		cmocka_unit_test(testSpillReopen),
+		cmocka_unit_test(testSpillCorruptLen),
+		cmocka_unit_test(testSpillReplayNoMem),
+#ifdef SPILL_MOCK_CLUSTER
+		cmocka_unit_test(testSpillMockCluster),
+#endif
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
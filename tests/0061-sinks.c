@@ -0,0 +1,228 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rb_sink.h"
+
+#include "f2k.h"
+#include "printbuf.h"
+#include "rb_lists.h"
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define N_MSGS 4
+
+/// Messages to send, and their list nodes
+struct test_msgs {
+	struct printbuf *pbs[N_MSGS];
+	struct string_list nodes[N_MSGS];
+	struct string_list *msgs[N_MSGS];
+};
+
+static void test_msgs_init(struct test_msgs *msgs) {
+	size_t i;
+	for (i = 0; i < N_MSGS; ++i) {
+		char buf[64];
+		const int len = snprintf(buf, sizeof(buf), "{\"msg\":%zu}", i);
+
+		msgs->pbs[i] = printbuf_new();
+		assert_non_null(msgs->pbs[i]);
+		printbuf_memappend_fast(msgs->pbs[i], buf, len);
+		msgs->nodes[i].string = msgs->pbs[i];
+		msgs->nodes[i].client_mac = i;
+		msgs->msgs[i] = &msgs->nodes[i];
+	}
+}
+
+static void test_msgs_done(struct test_msgs *msgs) {
+	size_t i;
+	for (i = 0; i < N_MSGS; ++i) {
+		/* Non kafka sinks never keep buffers */
+		assert_non_null(msgs->pbs[i]->buf);
+		printbuf_free(msgs->pbs[i]);
+	}
+}
+
+static size_t count_files(const char *dir) {
+	struct dirent *entry;
+	size_t ret = 0;
+	DIR *d = opendir(dir);
+	assert_non_null(d);
+
+	while ((entry = readdir(d))) {
+		if (entry->d_name[0] != '.') {
+			ret++;
+		}
+	}
+
+	closedir(d);
+	return ret;
+}
+
+static void testNullSink() {
+	struct test_msgs msgs;
+	struct worker_stats stats = {0};
+	struct rb_sink *sink = rb_sink_null_new();
+	assert_non_null(sink);
+
+	test_msgs_init(&msgs);
+	rb_sink_send(sink, msgs.msgs, N_MSGS, &stats);
+	assert_int_equal(stats.num_sink_dropped_msgs, 0);
+	test_msgs_done(&msgs);
+
+	rb_sink_done(sink);
+}
+
+/// File sink writes one message per line, and rotates files
+static void testFileSink() {
+	char dir[] = "/tmp/f2k-sink-XXXXXX";
+	char path[PATH_MAX], contents[BUFSIZ];
+	struct test_msgs msgs;
+	struct worker_stats stats = {0};
+	assert_non_null(mkdtemp(dir));
+	snprintf(path, sizeof(path), "%s/flows.json", dir);
+
+	/* Rotate after every batch */
+	struct rb_sink *sink = rb_sink_file_new(path, 1, false);
+	assert_non_null(sink);
+
+	test_msgs_init(&msgs);
+	rb_sink_send(sink, msgs.msgs, N_MSGS, &stats);
+	assert_int_equal(stats.num_sink_dropped_msgs, 0);
+	assert_int_equal(count_files(dir), 2);
+
+	rb_sink_send(sink, msgs.msgs, 1, &stats);
+	assert_int_equal(count_files(dir), 3);
+	test_msgs_done(&msgs);
+	rb_sink_done(sink);
+
+	/* Current file is empty: all messages were rotated */
+	FILE *fp = fopen(path, "r");
+	assert_non_null(fp);
+	assert_int_equal(0, fread(contents, 1, sizeof(contents), fp));
+	fclose(fp);
+
+	/* Check rotated files and clean */
+	struct dirent *entry;
+	bool first_batch_found = false;
+	DIR *d = opendir(dir);
+	assert_non_null(d);
+	while ((entry = readdir(d))) {
+		char rotated_path[PATH_MAX];
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+
+		snprintf(rotated_path, sizeof(rotated_path), "%s/%s", dir,
+			entry->d_name);
+		fp = fopen(rotated_path, "r");
+		assert_non_null(fp);
+		const size_t len = fread(contents, 1, sizeof(contents) - 1, fp);
+		contents[len] = '\0';
+		fclose(fp);
+
+		if (0 == strcmp(contents, "{\"msg\":0}\n{\"msg\":1}\n"
+					"{\"msg\":2}\n{\"msg\":3}\n")) {
+			first_batch_found = true;
+		} else {
+			assert_true(0 == len ||
+				0 == strcmp(contents, "{\"msg\":0}\n"));
+		}
+		unlink(rotated_path);
+	}
+	closedir(d);
+
+	assert_true(first_batch_found);
+	assert_int_equal(0, rmdir(dir));
+}
+
+/// Unix datagram sink sends one message per datagram, and drops them if
+/// nobody is listening
+static void testUnixDgramSink() {
+	char dir[] = "/tmp/f2k-sink-XXXXXX";
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	struct test_msgs msgs;
+	struct worker_stats stats = {0};
+	char buf[BUFSIZ];
+	size_t i;
+	assert_non_null(mkdtemp(dir));
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/sock", dir);
+
+	struct rb_sink *sink = rb_sink_unix_new(addr.sun_path, SOCK_DGRAM);
+	assert_non_null(sink);
+	test_msgs_init(&msgs);
+
+	/* Nobody listening */
+	rb_sink_send(sink, msgs.msgs, N_MSGS, &stats);
+	assert_int_equal(stats.num_sink_dropped_msgs, N_MSGS);
+
+	const int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	assert_true(fd >= 0);
+	assert_int_equal(0, bind(fd, (struct sockaddr *)&addr, sizeof(addr)));
+
+	rb_sink_send(sink, msgs.msgs, N_MSGS, &stats);
+	assert_int_equal(stats.num_sink_dropped_msgs, N_MSGS);
+	for (i = 0; i < N_MSGS; ++i) {
+		const ssize_t len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		assert_int_equal(len, msgs.pbs[i]->bpos);
+		assert_memory_equal(buf, msgs.pbs[i]->buf, len);
+	}
+
+	test_msgs_done(&msgs);
+	rb_sink_done(sink);
+	close(fd);
+	unlink(addr.sun_path);
+	assert_int_equal(0, rmdir(dir));
+}
+
+static void testSinkParse() {
+	enum rb_sink_type type;
+	const char *path;
+
+	assert_int_equal(0, rb_sink_parse("null", &type, &path));
+	assert_int_equal(type, RB_SINK_NULL);
+	assert_null(path);
+
+	assert_int_equal(0, rb_sink_parse("file:/tmp/f.json", &type, &path));
+	assert_int_equal(type, RB_SINK_FILE);
+	assert_string_equal(path, "/tmp/f.json");
+
+	assert_int_equal(0, rb_sink_parse("unix-stream:/tmp/s", &type, &path));
+	assert_int_equal(type, RB_SINK_UNIX_STREAM);
+
+	assert_int_not_equal(0, rb_sink_parse("file", &type, &path));
+	assert_int_not_equal(0, rb_sink_parse("null:/tmp/x", &type, &path));
+	assert_int_not_equal(0, rb_sink_parse("nul", &type, &path));
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(testNullSink),
+		cmocka_unit_test(testFileSink),
+		cmocka_unit_test(testUnixDgramSink),
+		cmocka_unit_test(testSinkParse),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
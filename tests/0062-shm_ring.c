@@ -0,0 +1,317 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rb_shm_ring.h"
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void tmp_ring_path(char *path, size_t path_size) {
+	static unsigned n = 0;
+	snprintf(path, path_size, "/tmp/f2k-shm-ring-%d-%u", getpid(), n++);
+}
+
+static void write_record(struct rb_shm_ring *ring, uint64_t i) {
+	char buf[64];
+	const int len = snprintf(buf, sizeof(buf), "{\"msg\":%"PRIu64"}", i);
+	assert_int_equal(0, rb_shm_ring_write(ring, buf, len, i));
+}
+
+static void check_record(struct rb_shm_ring_reader *reader, uint64_t i) {
+	char buf[RB_SHM_RING_DEFAULT_SLOT_SIZE], expected[64];
+	size_t len;
+	uint64_t key;
+	const int expected_len = snprintf(expected, sizeof(expected),
+		"{\"msg\":%"PRIu64"}", i);
+
+	assert_int_equal(0, rb_shm_ring_read(reader, buf, sizeof(buf), &len,
+		&key));
+	assert_int_equal(len, expected_len);
+	assert_memory_equal(buf, expected, len);
+	assert_int_equal(key, i);
+}
+
+static void assert_ring_empty(struct rb_shm_ring_reader *reader) {
+	char buf[RB_SHM_RING_DEFAULT_SLOT_SIZE];
+	size_t len;
+	uint64_t key;
+	assert_int_not_equal(0, rb_shm_ring_read(reader, buf, sizeof(buf),
+		&len, &key));
+}
+
+/// Readers see records in order, and they start at the end of the ring
+static void testShmRingReadWrite() {
+	char path[PATH_MAX];
+	struct rb_shm_ring writer, ring;
+	struct rb_shm_ring_reader reader1, reader2;
+	uint64_t i;
+
+	tmp_ring_path(path, sizeof(path));
+	assert_int_equal(0, rb_shm_ring_create(&writer, path, 16,
+		RB_SHM_RING_DEFAULT_SLOT_SIZE));
+	assert_int_equal(0, rb_shm_ring_open(&ring, path));
+
+	write_record(&writer, 0);
+	rb_shm_ring_reader_init(&reader1, &ring);
+	assert_ring_empty(&reader1);
+
+	for (i = 1; i < 10; ++i) {
+		write_record(&writer, i);
+	}
+
+	rb_shm_ring_reader_init(&reader2, &ring);
+	for (i = 1; i < 10; ++i) {
+		check_record(&reader1, i);
+	}
+	assert_ring_empty(&reader1);
+	assert_ring_empty(&reader2);
+	assert_int_equal(reader1.lost, 0);
+
+	/* Too big records are refused */
+	char big[RB_SHM_RING_DEFAULT_SLOT_SIZE] = {0};
+	assert_int_not_equal(0, rb_shm_ring_write(&writer, big, sizeof(big),
+		0));
+
+	rb_shm_ring_close(&ring);
+	rb_shm_ring_close(&writer);
+	unlink(path);
+}
+
+/// Slow readers detect they have been overrun, and skip lost records
+static void testShmRingOverrun() {
+	char path[PATH_MAX];
+	struct rb_shm_ring writer, ring;
+	struct rb_shm_ring_reader reader;
+	uint64_t i;
+
+	tmp_ring_path(path, sizeof(path));
+	assert_int_equal(0, rb_shm_ring_create(&writer, path, 8, 128));
+	assert_int_equal(0, rb_shm_ring_open(&ring, path));
+	rb_shm_ring_reader_init(&reader, &ring);
+
+	for (i = 0; i < 20; ++i) {
+		write_record(&writer, i);
+	}
+
+	/* Records 0..12 were overwritten. 12 could be being overwritten */
+	check_record(&reader, 13);
+	assert_int_equal(reader.lost, 13);
+	for (i = 14; i < 20; ++i) {
+		check_record(&reader, i);
+	}
+	assert_ring_empty(&reader);
+
+	rb_shm_ring_close(&ring);
+	rb_shm_ring_close(&writer);
+	unlink(path);
+}
+
+static void testShmRingInvalidFile() {
+	char path[PATH_MAX];
+	struct rb_shm_ring ring;
+	tmp_ring_path(path, sizeof(path));
+
+	FILE *fp = fopen(path, "w");
+	assert_non_null(fp);
+	fprintf(fp, "This is not a ring, but it is long enough to hold a ring "
+		"header. This is not a ring, but it is long enough to hold a "
+		"ring header.");
+	fclose(fp);
+
+	assert_int_not_equal(0, rb_shm_ring_open(&ring, path));
+	assert_int_equal(errno, EINVAL);
+	unlink(path);
+}
+
+#define N_WRITERS 4
+#define N_RECORDS_PER_WRITER 10000
+
+static void *writer_thread(void *vring) {
+	struct rb_shm_ring *ring = vring;
+	uint64_t i;
+	for (i = 0; i < N_RECORDS_PER_WRITER; ++i) {
+		write_record(ring, i);
+	}
+	return NULL;
+}
+
+/// Records are never torn, even with concurrent writers lapping the reader
+static void testShmRingConcurrentWriters() {
+	char path[PATH_MAX], buf[RB_SHM_RING_DEFAULT_SLOT_SIZE];
+	struct rb_shm_ring writer, ring;
+	struct rb_shm_ring_reader reader;
+	pthread_t threads[N_WRITERS];
+	uint64_t read = 0;
+	size_t i;
+
+	tmp_ring_path(path, sizeof(path));
+	assert_int_equal(0, rb_shm_ring_create(&writer, path, 64, 128));
+	assert_int_equal(0, rb_shm_ring_open(&ring, path));
+	rb_shm_ring_reader_init(&reader, &ring);
+
+	for (i = 0; i < N_WRITERS; ++i) {
+		assert_int_equal(0, pthread_create(&threads[i], NULL,
+			writer_thread, &writer));
+	}
+
+	while (read + reader.lost < N_WRITERS * N_RECORDS_PER_WRITER) {
+		char expected[64];
+		size_t len;
+		uint64_t key;
+
+		if (0 != rb_shm_ring_read(&reader, buf, sizeof(buf), &len,
+								&key)) {
+			continue;
+		}
+
+		snprintf(expected, sizeof(expected), "{\"msg\":%"PRIu64"}",
+			key);
+		assert_int_equal(len, strlen(expected));
+		assert_memory_equal(buf, expected, len);
+		read++;
+	}
+
+	for (i = 0; i < N_WRITERS; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	rb_shm_ring_close(&ring);
+	rb_shm_ring_close(&writer);
+	unlink(path);
+}
+
+#define N_LAPPING_WRITERS 8
+#define N_LAPPING_RECORDS_PER_WRITER 20000
+#define N_LAPPING_SLOTS 1
+
+/** Record of the lapping writers test. Its length and content depend on its
+  key, so a record mixed with another one is detected
+  @param key Record key
+  @param buf Record output
+  @return Record length
+  */
+static size_t lapping_record(uint64_t key, char *buf) {
+	const size_t len = sizeof(key) + key % 48;
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		buf[i] = ((const char *)&key)[i % sizeof(key)];
+	}
+	return len;
+}
+
+static void check_lapping_record(const char *buf, size_t len, uint64_t key) {
+	char expected[64];
+	const size_t expected_len = lapping_record(key, expected);
+	assert_int_equal(len, expected_len);
+	assert_memory_equal(buf, expected, len);
+}
+
+struct lapping_writer {
+	pthread_t thread;
+	struct rb_shm_ring *ring;
+	uint64_t id;
+};
+
+static void *lapping_writer_thread(void *vwriter) {
+	const struct lapping_writer *writer = vwriter;
+	uint64_t i;
+	for (i = 0; i < N_LAPPING_RECORDS_PER_WRITER; ++i) {
+		char buf[64];
+		const uint64_t key = writer->id << 32 | i;
+		const size_t len = lapping_record(key, buf);
+		assert_int_equal(0, rb_shm_ring_write(writer->ring, buf, len,
+			key));
+	}
+	return NULL;
+}
+
+/// Writers a lap apart in the same slot don't mix their records, and the
+/// newest record is the one that stays in the slot
+static void testShmRingLappingWriters() {
+	char path[PATH_MAX], buf[RB_SHM_RING_DEFAULT_SLOT_SIZE];
+	struct rb_shm_ring ring, rd_ring;
+	struct rb_shm_ring_reader reader;
+	struct lapping_writer writers[N_LAPPING_WRITERS];
+	uint64_t read = 0, head;
+	size_t i, len;
+	uint64_t key;
+
+	tmp_ring_path(path, sizeof(path));
+	assert_int_equal(0, rb_shm_ring_create(&ring, path, N_LAPPING_SLOTS,
+		128));
+	assert_int_equal(0, rb_shm_ring_open(&rd_ring, path));
+	rb_shm_ring_reader_init(&reader, &rd_ring);
+
+	for (i = 0; i < N_LAPPING_WRITERS; ++i) {
+		writers[i].ring = &ring;
+		writers[i].id = i;
+		assert_int_equal(0, pthread_create(&writers[i].thread, NULL,
+			lapping_writer_thread, &writers[i]));
+	}
+
+	while (read + reader.lost <
+			N_LAPPING_WRITERS * N_LAPPING_RECORDS_PER_WRITER) {
+		if (0 == rb_shm_ring_read(&reader, buf, sizeof(buf), &len,
+								&key)) {
+			check_lapping_record(buf, len, key);
+			read++;
+		}
+	}
+
+	for (i = 0; i < N_LAPPING_WRITERS; ++i) {
+		pthread_join(writers[i].thread, NULL);
+	}
+
+	/* Last record of every slot is readable */
+	rb_shm_ring_reader_init(&reader, &rd_ring);
+	head = reader.next_seq;
+	reader.next_seq = head - N_LAPPING_SLOTS;
+	for (i = 0; i < N_LAPPING_SLOTS; ++i) {
+		assert_int_equal(0, rb_shm_ring_read(&reader, buf, sizeof(buf),
+			&len, &key));
+		check_lapping_record(buf, len, key);
+	}
+	assert_int_equal(reader.lost, 0);
+	assert_int_equal(reader.next_seq, head);
+
+	rb_shm_ring_close(&rd_ring);
+	rb_shm_ring_close(&ring);
+	unlink(path);
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(testShmRingReadWrite),
+		cmocka_unit_test(testShmRingOverrun),
+		cmocka_unit_test(testShmRingInvalidFile),
+		cmocka_unit_test(testShmRingConcurrentWriters),
+		cmocka_unit_test(testShmRingLappingWriters),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,274 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rb_msg_batch.h"
+#include "rb_lists.h"
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N_FLOWS 8
+
+/// Test flows
+struct test_flows {
+	struct string_list nodes[N_FLOWS];
+	struct string_list *msgs[N_FLOWS];
+};
+
+static void test_flows_init(struct test_flows *flows,
+						const uint64_t *client_macs) {
+	size_t i;
+
+	memset(flows, 0, sizeof(*flows));
+	for (i = 0; i < N_FLOWS; ++i) {
+		flows->nodes[i].string = printbuf_new();
+		assert_non_null(flows->nodes[i].string);
+		sprintbuf(flows->nodes[i].string, "{\"flow\":%zu}", i);
+		flows->nodes[i].client_mac = client_macs ? client_macs[i] : 0;
+		flows->msgs[i] = &flows->nodes[i];
+	}
+}
+
+static void test_flows_done(struct test_flows *flows) {
+	size_t i;
+	for (i = 0; i < N_FLOWS; ++i) {
+		printbuf_free(flows->nodes[i].string);
+	}
+}
+
+/** Check a multi-flow message and return the next one
+  @param msg Message
+  @param expected Expected message payload
+  @param client_mac Expected client mac
+  @return Next message
+  */
+static const struct string_list *check_msg(const struct string_list *msg,
+				const char *expected, uint64_t client_mac) {
+	assert_non_null(msg);
+	assert_int_equal(msg->string->bpos, strlen(expected));
+	assert_memory_equal(msg->string->buf, expected, strlen(expected));
+	assert_int_equal(msg->client_mac, client_mac);
+	return msg->next;
+}
+
+static struct rb_msg_batch *test_msg_batch_new(size_t max_msgs,
+		size_t max_bytes, enum rb_msg_batch_format format) {
+	const struct rb_msg_batch_conf conf = {
+		.max_msgs = max_msgs,
+		.max_bytes = max_bytes,
+		.max_delay_ms = 100,
+		.format = format,
+	};
+
+	struct rb_msg_batch *batch = rb_msg_batch_new(&conf);
+	assert_non_null(batch);
+	return batch;
+}
+
+/// Messages are completed when they reach max flows, or when flushed
+static void testMsgBatchNDJSON() {
+	static const uint64_t keys[N_FLOWS] = {0};
+	struct test_flows flows;
+	struct string_list *msgs;
+	struct rb_msg_batch *batch = test_msg_batch_new(3, 1024,
+		RB_MSG_BATCH_NDJSON);
+
+	test_flows_init(&flows, NULL);
+
+	msgs = rb_msg_batch_add(batch, flows.msgs, keys, 2, 0);
+	assert_null(msgs);
+	msgs = rb_msg_batch_add(batch, &flows.msgs[2], keys, 2, 0);
+	assert_null(check_msg(msgs,
+		"{\"flow\":0}\n{\"flow\":1}\n{\"flow\":2}\n", 0));
+	rb_msg_batch_list_free(msgs);
+
+	msgs = rb_msg_batch_flush(batch);
+	assert_null(check_msg(msgs, "{\"flow\":3}\n", 0));
+	rb_msg_batch_list_free(msgs);
+	assert_null(rb_msg_batch_flush(batch));
+
+	rb_msg_batch_done(batch);
+	test_flows_done(&flows);
+}
+
+/// JSON array format
+static void testMsgBatchArray() {
+	static const uint64_t keys[N_FLOWS] = {0};
+	struct test_flows flows;
+	struct string_list *msgs;
+	struct rb_msg_batch *batch = test_msg_batch_new(2, 1024,
+		RB_MSG_BATCH_ARRAY);
+
+	test_flows_init(&flows, NULL);
+
+	msgs = rb_msg_batch_add(batch, flows.msgs, keys, 3, 0);
+	assert_null(check_msg(msgs, "[{\"flow\":0},{\"flow\":1}]", 0));
+	rb_msg_batch_list_free(msgs);
+
+	msgs = rb_msg_batch_flush(batch);
+	assert_null(check_msg(msgs, "[{\"flow\":2}]", 0));
+	rb_msg_batch_list_free(msgs);
+
+	rb_msg_batch_done(batch);
+	test_flows_done(&flows);
+}
+
+/// Flows of different keys never share a message, and messages carry the
+/// client mac of their first flow
+static void testMsgBatchGroups() {
+	static const uint64_t macs[N_FLOWS] = {10, 20, 30, 40, 50, 60, 70, 80};
+	static const uint64_t keys[N_FLOWS] = {1, 2, 1, 2, 1, 2, 1, 2};
+	const struct string_list *msg;
+	struct test_flows flows;
+	struct string_list *msgs;
+	struct rb_msg_batch *batch = test_msg_batch_new(3, 1024,
+		RB_MSG_BATCH_NDJSON);
+
+	test_flows_init(&flows, macs);
+
+	msgs = rb_msg_batch_add(batch, flows.msgs, keys, N_FLOWS, 0);
+	msg = check_msg(msgs, "{\"flow\":0}\n{\"flow\":2}\n{\"flow\":4}\n", 10);
+	assert_null(check_msg(msg,
+		"{\"flow\":1}\n{\"flow\":3}\n{\"flow\":5}\n", 20));
+	rb_msg_batch_list_free(msgs);
+
+	msgs = rb_msg_batch_flush(batch);
+	msg = check_msg(msgs, "{\"flow\":6}\n", 70);
+	assert_null(check_msg(msg, "{\"flow\":7}\n", 80));
+	rb_msg_batch_list_free(msgs);
+
+	rb_msg_batch_done(batch);
+	test_flows_done(&flows);
+}
+
+/// Keys that share a slot complete each other messages
+static void testMsgBatchSlotCollision() {
+	static const uint64_t keys[N_FLOWS] = {1, 1, 1 + RB_MSG_BATCH_SLOTS};
+	const struct string_list *msg;
+	struct test_flows flows;
+	struct string_list *msgs;
+	struct rb_msg_batch *batch = test_msg_batch_new(N_FLOWS, 1024,
+		RB_MSG_BATCH_NDJSON);
+
+	test_flows_init(&flows, NULL);
+
+	msgs = rb_msg_batch_add(batch, flows.msgs, keys, 3, 0);
+	assert_null(check_msg(msgs, "{\"flow\":0}\n{\"flow\":1}\n", 0));
+	rb_msg_batch_list_free(msgs);
+
+	msgs = rb_msg_batch_flush(batch);
+	msg = check_msg(msgs, "{\"flow\":2}\n", 0);
+	assert_null(msg);
+	rb_msg_batch_list_free(msgs);
+
+	rb_msg_batch_done(batch);
+	test_flows_done(&flows);
+}
+
+/// Messages don't grow over max bytes, unless a single flow is bigger
+static void testMsgBatchMaxBytes() {
+	static const uint64_t keys[N_FLOWS] = {0};
+	const struct string_list *msg;
+	struct test_flows flows;
+	struct string_list *msgs;
+	/* Each flow takes 11 bytes plus newline */
+	struct rb_msg_batch *batch = test_msg_batch_new(N_FLOWS, 30,
+		RB_MSG_BATCH_NDJSON);
+
+	test_flows_init(&flows, NULL);
+
+	msgs = rb_msg_batch_add(batch, flows.msgs, keys, 3, 0);
+	assert_null(check_msg(msgs, "{\"flow\":0}\n{\"flow\":1}\n", 0));
+	rb_msg_batch_list_free(msgs);
+	rb_msg_batch_done(batch);
+
+	batch = test_msg_batch_new(N_FLOWS, 5, RB_MSG_BATCH_NDJSON);
+	msgs = rb_msg_batch_add(batch, flows.msgs, keys, 2, 0);
+	msg = check_msg(msgs, "{\"flow\":0}\n", 0);
+	assert_null(check_msg(msg, "{\"flow\":1}\n", 0));
+	rb_msg_batch_list_free(msgs);
+	assert_null(rb_msg_batch_flush(batch));
+
+	rb_msg_batch_done(batch);
+	test_flows_done(&flows);
+}
+
+/// Messages are completed at their deadline
+static void testMsgBatchDeadline() {
+	static const uint64_t keys[N_FLOWS] = {1, 2};
+	uint64_t next_deadline_ms;
+	struct test_flows flows;
+	struct string_list *msgs;
+	struct rb_msg_batch *batch = test_msg_batch_new(N_FLOWS, 1024,
+		RB_MSG_BATCH_NDJSON);
+
+	test_flows_init(&flows, NULL);
+
+	assert_null(rb_msg_batch_expired(batch, 0, &next_deadline_ms));
+	assert_true(UINT64_MAX == next_deadline_ms);
+
+	assert_null(rb_msg_batch_add(batch, flows.msgs, keys, 1, 1000));
+	assert_null(rb_msg_batch_add(batch, &flows.msgs[1], &keys[1], 1,
+		1050));
+
+	assert_null(rb_msg_batch_expired(batch, 1099, &next_deadline_ms));
+	assert_int_equal(next_deadline_ms, 1100);
+
+	msgs = rb_msg_batch_expired(batch, 1100, &next_deadline_ms);
+	assert_null(check_msg(msgs, "{\"flow\":0}\n", 0));
+	rb_msg_batch_list_free(msgs);
+	assert_int_equal(next_deadline_ms, 1150);
+
+	msgs = rb_msg_batch_expired(batch, 2000, &next_deadline_ms);
+	assert_null(check_msg(msgs, "{\"flow\":1}\n", 0));
+	rb_msg_batch_list_free(msgs);
+	assert_true(UINT64_MAX == next_deadline_ms);
+
+	rb_msg_batch_done(batch);
+	test_flows_done(&flows);
+}
+
+static void testMsgBatchFormatParse() {
+	enum rb_msg_batch_format format;
+
+	assert_int_equal(0, rb_msg_batch_format_parse("ndjson", &format));
+	assert_int_equal(format, RB_MSG_BATCH_NDJSON);
+	assert_int_equal(0, rb_msg_batch_format_parse("array", &format));
+	assert_int_equal(format, RB_MSG_BATCH_ARRAY);
+	assert_int_not_equal(0, rb_msg_batch_format_parse("xml", &format));
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(testMsgBatchNDJSON),
+		cmocka_unit_test(testMsgBatchArray),
+		cmocka_unit_test(testMsgBatchGroups),
+		cmocka_unit_test(testMsgBatchSlotCollision),
+		cmocka_unit_test(testMsgBatchMaxBytes),
+		cmocka_unit_test(testMsgBatchDeadline),
+		cmocka_unit_test(testMsgBatchFormatParse),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,290 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "f2k.h"
+#include "export.h"
+#include "rb_cbor.h"
+#include "rb_lists.h"
+#include "rb_msg_batch.h"
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define assert_buf_equal(pb, expected) do { \
+		assert_int_equal((pb)->bpos, sizeof(expected) - 1); \
+		assert_memory_equal((pb)->buf, expected, sizeof(expected) - 1); \
+	} while (0)
+
+static int cbor_setup(void **state) {
+	(void)state;
+	readOnlyGlobals.output_format = OUTPUT_FORMAT_CBOR;
+	return 0;
+}
+
+static int cbor_teardown(void **state) {
+	(void)state;
+	readOnlyGlobals.output_format = OUTPUT_FORMAT_JSON;
+	return 0;
+}
+
+/// Integers use the shortest head
+static void testCborUint() {
+	static const struct {
+		uint64_t value;
+		const char *cbor;
+		size_t cbor_len;
+	} tests[] = {
+		{0, "\x00", 1},
+		{23, "\x17", 1},
+		{24, "\x18\x18", 2},
+		{255, "\x18\xff", 2},
+		{256, "\x19\x01\x00", 3},
+		{65535, "\x19\xff\xff", 3},
+		{65536, "\x1a\x00\x01\x00\x00", 5},
+		{UINT32_MAX, "\x1a\xff\xff\xff\xff", 5},
+		{UINT32_MAX + 1ULL, "\x1b\x00\x00\x00\x01\x00\x00\x00\x00", 9},
+		{UINT64_MAX, "\x1b\xff\xff\xff\xff\xff\xff\xff\xff", 9},
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+		struct printbuf *pb = printbuf_new();
+		assert_int_equal(tests[i].cbor_len,
+			rb_cbor_put_uint(pb, tests[i].value));
+		assert_int_equal(pb->bpos, tests[i].cbor_len);
+		assert_memory_equal(pb->buf, tests[i].cbor, tests[i].cbor_len);
+		printbuf_free(pb);
+	}
+}
+
+/// Text printed in buffer is converted to items in place
+static void testCborFromPrinted() {
+	char text[30];
+	struct printbuf *pb = printbuf_new();
+
+	printbuf_memappend_fast(pb, "\xbf", 1);
+	printbuf_memappend_fast(pb, "abc", 3);
+	assert_int_equal(4, rb_cbor_text_from(pb, 1));
+	assert_buf_equal(pb, "\xbf\x63" "abc");
+
+	/* Long text needs a longer head */
+	memset(text, 'x', sizeof(text));
+	printbuf_reset(pb);
+	printbuf_memappend_fast(pb, text, sizeof(text));
+	assert_int_equal(sizeof(text) + 2, rb_cbor_text_from(pb, 0));
+	assert_int_equal(pb->bpos, sizeof(text) + 2);
+	assert_memory_equal(pb->buf, "\x78\x1e", 2);
+	assert_memory_equal(pb->buf + 2, text, sizeof(text));
+
+	printbuf_free(pb);
+}
+
+/// Sensors enrichment JSON is transcoded
+static void testCborJsonMembers() {
+	static const char json[] =
+		"\"a\":1,\"b\":\"\\\"\\u00e9\\ud83d\\ude00\",\"c\":[true,false,null],"
+		"\"d\":{\"e\":-2},\"f\":1.5,\"g\":[]";
+	struct printbuf *pb = printbuf_new();
+
+	assert_int_equal(0, rb_cbor_put_json_members(pb, json, strlen(json)));
+	assert_buf_equal(pb,
+		"\x61" "a" "\x01"
+		"\x61" "b" "\x67" "\"" "\xc3\xa9" "\xf0\x9f\x98\x80"
+		"\x61" "c" "\x9f\xf5\xf4\xf6\xff"
+		"\x61" "d" "\xbf\x61" "e" "\x21\xff"
+		"\x61" "f" "\xfb\x3f\xf8\x00\x00\x00\x00\x00\x00"
+		"\x61" "g" "\x9f\xff");
+
+	/* Invalid JSON does not leave garbage */
+	printbuf_reset(pb);
+	printbuf_memappend_fast(pb, "\xbf", 1);
+	assert_int_not_equal(0, rb_cbor_put_json_members(pb, "\"a\":[1,", 7));
+	assert_int_not_equal(0, rb_cbor_put_json_members(pb, "\"a\":tru", 7));
+	assert_int_not_equal(0, rb_cbor_put_json_members(pb, "\"a\"1", 4));
+	assert_int_not_equal(0, rb_cbor_put_json_members(pb, "\"a\":\"\\x\"",
+		8));
+	assert_buf_equal(pb, "\xbf");
+
+	printbuf_free(pb);
+}
+
+/// Template fields are encoded as typed CBOR map entries
+static void testCborTemplate() {
+	static const uint8_t proto[] = {6};
+	static const uint8_t port[] = {0x01, 0xbb};
+	static const uint8_t tcp_flags[] = {0x12};
+	struct flowCache flow_cache;
+	struct printbuf *pb = printbuf_new();
+
+	memset(&flow_cache, 0, sizeof(flow_cache));
+	flow_message_start(pb);
+	printNetflowRecordWithTemplate(pb, TEMPLATE_OF(PROTOCOL), proto,
+		sizeof(proto), &flow_cache);
+	printNetflowRecordWithTemplate(pb, TEMPLATE_OF(L4_SRC_PORT), port,
+		sizeof(port), &flow_cache);
+	printNetflowRecordWithTemplate(pb, TEMPLATE_OF(TCP_FLAGS), tcp_flags,
+		sizeof(tcp_flags), &flow_cache);
+	/* Wrong length: no value, so no key either */
+	printNetflowRecordWithTemplate(pb, TEMPLATE_OF(L4_SRC_PORT), proto,
+		sizeof(proto), &flow_cache);
+	flow_message_end(pb);
+
+	assert_buf_equal(pb, "\xbf"
+		"\x68" "l4_proto" "\x06"
+		"\x68" "src_port" "\x19\x01\xbb"
+		"\x69" "tcp_flags" "\x68" "...A..S."
+		"\xff");
+
+	printbuf_free(pb);
+}
+
+/// Addresses and MACs are tagged byte strings, straight from the flow
+static void testCborAddresses() {
+	static const uint8_t ipv4[] = {10, 0, 0, 1};
+	static const uint8_t ipv6[] = {0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0,
+						0, 0, 0, 0, 0, 0, 0, 1};
+	static const uint8_t mac[] = {0x00, 0x24, 0x14, 0x01, 0x02, 0x03};
+	/* Without children, that need databases */
+	const V9V10TemplateElementId ipv4_template = {
+		.quote = true,
+		.jsonElementName = "src",
+		.export_fn = print_ipv4_src_addr,
+	};
+	const V9V10TemplateElementId ipv6_template = {
+		.quote = true,
+		.jsonElementName = "dst",
+		.export_fn = print_ipv6_dst_addr,
+	};
+	struct flowCache flow_cache;
+	struct printbuf *pb = printbuf_new();
+
+	memset(&flow_cache, 0, sizeof(flow_cache));
+	flow_message_start(pb);
+	printNetflowRecordWithTemplate(pb, &ipv4_template, ipv4, sizeof(ipv4),
+		&flow_cache);
+	printNetflowRecordWithTemplate(pb, &ipv6_template, ipv6, sizeof(ipv6),
+		&flow_cache);
+	printNetflowRecordWithTemplate(pb, TEMPLATE_OF(WAP_MAC_ADDRESS), mac,
+		sizeof(mac), &flow_cache);
+	/* Wrong length: no value, so no key either */
+	printNetflowRecordWithTemplate(pb, &ipv4_template, mac, sizeof(mac),
+		&flow_cache);
+	flow_message_end(pb);
+
+	assert_buf_equal(pb, "\xbf"
+		"\x63" "src" "\xd8\x34\x44" "\x0a\x00\x00\x01"
+		"\x63" "dst" "\xd8\x36\x50"
+			"\x20\x01\x0d\xb8\x00\x00\x00\x00"
+			"\x00\x00\x00\x00\x00\x00\x00\x01"
+		"\x70" "wireless_station" "\xd8\x30\x46"
+			"\x00\x24\x14\x01\x02\x03"
+		"\xff");
+
+	printbuf_free(pb);
+}
+
+/// Numbers of lengths that are not integer ones are skipped, not sent as 0
+static void testCborBadNumberLength() {
+	static const uint8_t number[] = {1, 2, 3};
+	struct flowCache flow_cache;
+	struct printbuf *pb = printbuf_new();
+
+	memset(&flow_cache, 0, sizeof(flow_cache));
+	flow_message_start(pb);
+	printNetflowRecordWithTemplate(pb, TEMPLATE_OF(PROTOCOL), number,
+		sizeof(number), &flow_cache);
+	/* Quoted number */
+	printNetflowRecordWithTemplate(pb, TEMPLATE_OF(FLOW_SEQUENCE), number,
+		sizeof(number), &flow_cache);
+	printNetflowRecordWithTemplate(pb, TEMPLATE_OF(FLOW_SEQUENCE), number,
+		2, &flow_cache);
+	flow_message_end(pb);
+
+	assert_buf_equal(pb, "\xbf"
+		"\x6d" "flow_sequence" "\x19\x01\x02"
+		"\xff");
+
+	printbuf_free(pb);
+}
+
+/// Strings are not JSON escaped in CBOR
+static void testCborNotEscaped() {
+	struct printbuf *pb = printbuf_new();
+
+	append_escaped(pb, "a\"b\\c", 5);
+	assert_buf_equal(pb, "a\"b\\c");
+
+	printbuf_free(pb);
+}
+
+/// Multi-flow messages use CBOR framing
+static void testCborMsgBatch() {
+	static const uint64_t keys[] = {0, 0};
+	const struct rb_msg_batch_conf conf = {
+		.max_msgs = 2,
+		.max_bytes = 1024,
+		.max_delay_ms = 100,
+		.format = RB_MSG_BATCH_ARRAY,
+	};
+	struct string_list nodes[2], *msgs[2], *ret;
+	struct rb_msg_batch *batch = rb_msg_batch_new(&conf);
+	size_t i;
+
+	assert_non_null(batch);
+	memset(nodes, 0, sizeof(nodes));
+	for (i = 0; i < 2; ++i) {
+		nodes[i].string = printbuf_new();
+		flow_message_start(nodes[i].string);
+		rb_cbor_put_text(nodes[i].string, "a", 1);
+		rb_cbor_put_uint(nodes[i].string, i);
+		flow_message_end(nodes[i].string);
+		msgs[i] = &nodes[i];
+	}
+
+	ret = rb_msg_batch_add(batch, msgs, keys, 2, 0);
+	assert_non_null(ret);
+	assert_null(ret->next);
+	assert_buf_equal(ret->string,
+		"\x9f" "\xbf\x61" "a" "\x00\xff" "\xbf\x61" "a" "\x01\xff" "\xff");
+
+	rb_msg_batch_list_free(ret);
+	rb_msg_batch_done(batch);
+	for (i = 0; i < 2; ++i) {
+		printbuf_free(nodes[i].string);
+	}
+}
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(testCborUint),
+		cmocka_unit_test(testCborFromPrinted),
+		cmocka_unit_test(testCborJsonMembers),
+		cmocka_unit_test(testCborTemplate),
+		cmocka_unit_test(testCborAddresses),
+		cmocka_unit_test(testCborBadNumberLength),
+		cmocka_unit_test(testCborNotEscaped),
+		cmocka_unit_test(testCborMsgBatch),
+	};
+
+	return cmocka_run_group_tests(tests, cbor_setup, cbor_teardown);
+}
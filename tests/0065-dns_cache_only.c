@@ -0,0 +1,206 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "collect.c"
+#include "f2k.h"
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#ifdef HAVE_UDNS
+
+/// PTR queries submitted to DNS threads. dns_ptr_query is wrapped at link
+/// time, so no DNS server is needed and the test decides the answers
+struct test_ptr_query {
+	uint8_t addr[16];
+	dns_ptr_query_cb cb;
+	void *opaque;
+};
+
+static struct test_ptr_query test_queries[8];
+static size_t test_queries_size;
+
+/// Cache entries reclamation
+static struct rb_epoch test_epoch = RB_EPOCH_INITIALIZER;
+/// Main test thread reader, like a worker one
+static struct rb_epoch_reader test_reader;
+
+void __wrap_dns_ptr_query(struct rb_dns_info *dns_info, const uint8_t *addr,
+					dns_ptr_query_cb cb, void *opaque);
+void __wrap_dns_ptr_query(struct rb_dns_info *dns_info, const uint8_t *addr,
+					dns_ptr_query_cb cb, void *opaque) {
+	(void)dns_info;
+	assert_true(test_queries_size < RD_ARRAYSIZE(test_queries));
+
+	struct test_ptr_query *query = &test_queries[test_queries_size++];
+	memcpy(query->addr, addr, sizeof(query->addr));
+	query->cb = cb;
+	query->opaque = opaque;
+}
+
+static void test_addr(uint8_t addr[16], uint32_t i) {
+	memset(addr, 0, 16);
+	addr[10] = addr[11] = 0xff;
+	addr[12] = 10;
+	addr[13] = i >> 16;
+	addr[14] = i >> 8;
+	addr[15] = i;
+}
+
+static int dns_cache_only_setup(void **state) {
+	static struct rb_dns_info dns_info;
+	static rd_thread_t *dns_thread;
+	(void)state;
+
+	/* PTR queries are submitted to this same thread */
+	dns_thread = rd_currthread_get();
+	readOnlyGlobals.numProcessThreads = 1;
+	readOnlyGlobals.udns.dns_poll_threads = &dns_thread;
+	readOnlyGlobals.udns.dns_info_array = &dns_info;
+	readOnlyGlobals.udns.cache_only = true;
+	readOnlyGlobals.udns.cache = dns_cache_new(&test_epoch, 1, 60, 10, 0);
+	test_queries_size = 0;
+	rb_epoch_register(&test_epoch, &test_reader);
+	return readOnlyGlobals.udns.cache ? 0 : -1;
+}
+
+static int dns_cache_only_teardown(void **state) {
+	(void)state;
+
+	rb_epoch_unregister(&test_epoch, &test_reader);
+	dns_cache_done(readOnlyGlobals.udns.cache);
+	rb_epoch_done(&test_epoch);
+	memset(&readOnlyGlobals.udns, 0, sizeof(readOnlyGlobals.udns));
+	readOnlyGlobals.numProcessThreads = 0;
+	return 0;
+}
+
+/** Print a flow client name in cache-only DNS mode, like a worker does
+  @param client Client address index
+  @return Printed flow. Must be freed with printbuf_free
+  */
+static struct printbuf *print_flow(uint32_t client) {
+	struct flowCache flow_cache;
+	struct printbuf *kafka_line_buffer = printbuf_new();
+	assert_non_null(kafka_line_buffer);
+
+	memset(&flow_cache, 0, sizeof(flow_cache));
+	test_addr(flow_cache.address.client, client);
+	memcpy(flow_cache.address.src, flow_cache.address.client,
+					sizeof(flow_cache.address.src));
+	test_addr(flow_cache.address.dst, 0xffffff);
+
+	rb_epoch_enter(&test_epoch, &test_reader);
+	print_cached_dns_names(kafka_line_buffer, &flow_cache, true, false);
+	rb_epoch_exit(&test_reader);
+
+	/* Run submitted PTR queries */
+	rd_thread_poll(0);
+	return kafka_line_buffer;
+}
+
+/// Answer every submitted PTR query, like DNS thread does
+static void answer_queries(const char *name) {
+	size_t i;
+
+	rb_epoch_enter(&test_epoch, &test_reader);
+	for (i = 0; i < test_queries_size; ++i) {
+		struct test_ptr_query *query = &test_queries[i];
+		struct dns_cache_elm *elm = dns_cache_save_elm(
+			readOnlyGlobals.udns.cache, query->addr, name,
+			name ? strlen(name) : 0, time(NULL));
+		assert_non_null(elm);
+		query->cb(NULL, elm, name, query->opaque);
+	}
+	rb_epoch_exit(&test_reader);
+
+	test_queries_size = 0;
+}
+
+/// A cache miss sends the flow right now without name, and asks for the name
+/// in background. Background queries are capped.
+static void testDNSCacheOnlyMiss() {
+	uint8_t addr[16];
+
+	struct printbuf *flow = print_flow(1);
+	assert_null(strstr(flow->buf, "lan_ip_name"));
+	printbuf_free(flow);
+
+	assert_int_equal(test_queries_size, 1);
+	test_addr(addr, 1);
+	assert_memory_equal(test_queries[0].addr, addr, sizeof(addr));
+	assert_int_equal(ATOMIC_LOAD_ACQUIRE(&dns_cache_only_queries), 1);
+
+	answer_queries(NULL);
+	assert_int_equal(ATOMIC_LOAD_ACQUIRE(&dns_cache_only_queries), 0);
+
+	/* Too many queries in flight: flow is sent, but no query is made */
+	ATOMIC_STORE_RELEASE(&dns_cache_only_queries,
+						DNS_CACHE_ONLY_MAX_QUERIES);
+	flow = print_flow(2);
+	assert_null(strstr(flow->buf, "lan_ip_name"));
+	printbuf_free(flow);
+
+	assert_int_equal(test_queries_size, 0);
+	assert_int_equal(ATOMIC_LOAD_ACQUIRE(&dns_cache_only_queries),
+						DNS_CACHE_ONLY_MAX_QUERIES);
+	ATOMIC_STORE_RELEASE(&dns_cache_only_queries, 0);
+
+	/* Below the cap again */
+	flow = print_flow(2);
+	printbuf_free(flow);
+	assert_int_equal(test_queries_size, 1);
+	answer_queries(NULL);
+}
+
+/// Flows after the answer get the cached name, without new queries
+static void testDNSCacheOnlyHit() {
+	struct printbuf *flow = print_flow(3);
+	assert_null(strstr(flow->buf, "lan_ip_name"));
+	printbuf_free(flow);
+	assert_int_equal(test_queries_size, 1);
+
+	answer_queries("host3.example.com");
+
+	flow = print_flow(3);
+	assert_non_null(strstr(flow->buf,
+				"\"lan_ip_name\":\"host3.example.com\""));
+	printbuf_free(flow);
+	assert_int_equal(test_queries_size, 0);
+	assert_int_equal(ATOMIC_LOAD_ACQUIRE(&dns_cache_only_queries), 0);
+}
+
+#else /* HAVE_UDNS */
+static void skip_test() { skip(); }
+#endif
+
+int main() {
+	const struct CMUnitTest tests[] = {
+#ifdef HAVE_UDNS
+		cmocka_unit_test_setup_teardown(testDNSCacheOnlyMiss,
+			dns_cache_only_setup, dns_cache_only_teardown),
+		cmocka_unit_test_setup_teardown(testDNSCacheOnlyHit,
+			dns_cache_only_setup, dns_cache_only_teardown),
+#else
+		cmocka_unit_test(skip_test),
+#endif
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
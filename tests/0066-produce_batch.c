@@ -0,0 +1,289 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "collect.c"
+#include "f2k.h"
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#ifdef HAVE_LIBRDKAFKA
+#include "rb_kafka.h"
+
+#if RD_KAFKA_VERSION >= 0x010500ff
+#define PRODUCE_BATCH_MOCK_CLUSTER
+#include <librdkafka/rdkafka_mock.h>
+#endif
+#endif
+
+/// Max send calls recorded by test sink
+#define TEST_SINK_MAX_SENDS 8
+/// Max messages that test sink records as kept by caller
+#define TEST_SINK_MAX_KEPT 8
+
+/// Sink that records how messages are sent, and forwards them to another
+/// sink
+struct test_sink {
+	struct rb_sink sink;
+	/// Sink to forward messages to. Can be NULL
+	struct rb_sink *next;
+	/// Number of messages of each send call
+	size_t sends[TEST_SINK_MAX_SENDS];
+	size_t n_sends;
+	/// Next expected message
+	size_t next_msg;
+	/// Messages whose buffer was not taken by next sink
+	size_t kept[TEST_SINK_MAX_KEPT];
+	size_t n_kept;
+};
+
+static size_t msg_index(const struct string_list *node) {
+	size_t ret;
+	assert_int_equal(1, sscanf(node->string->buf, "{\"msg\":%zu", &ret));
+	return ret;
+}
+
+static void test_sink_send(struct rb_sink *vsink,
+		struct string_list *const *msgs, size_t n_msgs,
+		struct worker_stats *stats) {
+	struct test_sink *sink = (struct test_sink *)vsink;
+	size_t i, idx[RB_SINK_BATCH];
+
+	assert_true(n_msgs > 0);
+	assert_true(n_msgs <= RB_SINK_BATCH);
+	assert_true(sink->n_sends < TEST_SINK_MAX_SENDS);
+	sink->sends[sink->n_sends++] = n_msgs;
+
+	/* Messages are sent in list order */
+	for (i = 0; i < n_msgs; ++i) {
+		idx[i] = msg_index(msgs[i]);
+		assert_int_equal(idx[i], sink->next_msg++);
+	}
+
+	if (NULL == sink->next) {
+		return;
+	}
+
+	rb_sink_send(sink->next, msgs, n_msgs, stats);
+	for (i = 0; i < n_msgs; ++i) {
+		if (msgs[i]->string->buf) {
+			/* Caller must free it */
+			assert_true(sink->n_kept < TEST_SINK_MAX_KEPT);
+			sink->kept[sink->n_kept++] = idx[i];
+		}
+	}
+}
+
+static void test_sink_init(struct test_sink *sink, struct rb_sink *next) {
+	static const struct rb_sink_ops test_sink_ops = {
+		.send = test_sink_send,
+	};
+
+	memset(sink, 0, sizeof(*sink));
+	sink->sink.ops = &test_sink_ops;
+	sink->next = next;
+}
+
+/** Creates a messages list, appending it node by node
+  @param n_msgs Number of messages
+  @param big_msg Message to pad with pad_len bytes. n_msgs for none
+  @param pad_len Big message padding
+  @return Messages list
+  */
+static struct string_list *test_list(size_t n_msgs, size_t big_msg,
+							size_t pad_len) {
+	struct string_list *ret = NULL, **tail = &ret;
+	size_t i;
+
+	/* Nodes without message are skipped, and don't count for batches */
+	struct string_list *empty = calloc(1, sizeof(*empty));
+	assert_non_null(empty);
+	string_list_append(&tail, empty);
+
+	for (i = 0; i < n_msgs; ++i) {
+		struct string_list *node = calloc(1, sizeof(*node));
+		assert_non_null(node);
+		node->string = printbuf_new();
+		assert_non_null(node->string);
+		sprintbuf(node->string, "{\"msg\":%zu", i);
+		if (i == big_msg) {
+			printbuf_memset(node->string, node->string->bpos, 'x',
+								pad_len);
+		}
+		printbuf_memappend_fast(node->string, "}", strlen("}"));
+		node->client_mac = i;
+		string_list_append(&tail, node);
+	}
+
+	assert_null(*tail);
+	return ret;
+}
+
+/// Appending keeps list order, and leaves tail at the end of the list
+static void testStringListAppend() {
+	struct string_list nodes[5], *list = NULL, **tail = &list;
+	size_t i;
+
+	memset(nodes, 0, sizeof(nodes));
+	/* Appending nothing leaves an empty list */
+	string_list_append(&tail, NULL);
+	assert_null(list);
+	assert_ptr_equal(tail, &list);
+
+	string_list_append(&tail, &nodes[0]);
+	assert_ptr_equal(tail, &nodes[0].next);
+
+	/* Many nodes list */
+	nodes[1].next = &nodes[2];
+	nodes[2].next = &nodes[3];
+	string_list_append(&tail, &nodes[1]);
+	assert_ptr_equal(tail, &nodes[3].next);
+
+	string_list_append(&tail, NULL);
+	assert_ptr_equal(tail, &nodes[3].next);
+	string_list_append(&tail, &nodes[4]);
+	assert_ptr_equal(tail, &nodes[4].next);
+
+	for (i = 0; list; list = list->next, ++i) {
+		assert_ptr_equal(list, &nodes[i]);
+	}
+	assert_int_equal(i, RD_ARRAYSIZE(nodes));
+}
+
+/** Send a list of messages, and check the batches sink receives
+  @param n_msgs Messages of the list
+  @param expected_sends Expected number of messages of each send call
+  @param n_expected_sends Expected number of send calls
+  */
+static void check_batches(size_t n_msgs, const size_t *expected_sends,
+						size_t n_expected_sends) {
+	struct test_sink sink;
+	struct worker_stats stats;
+	size_t i;
+
+	memset(&stats, 0, sizeof(stats));
+	test_sink_init(&sink, NULL);
+	send_string_list_to_sink(test_list(n_msgs, n_msgs, 0), &sink.sink,
+		NULL, &stats);
+
+	assert_int_equal(sink.next_msg, n_msgs);
+	assert_int_equal(sink.n_sends, n_expected_sends);
+	for (i = 0; i < n_expected_sends; ++i) {
+		assert_int_equal(sink.sends[i], expected_sends[i]);
+	}
+}
+
+/// Messages are sent in batches of RB_SINK_BATCH
+static void testSendBatches() {
+	static const size_t sends_127[] = {127};
+	static const size_t sends_128[] = {128};
+	static const size_t sends_129[] = {128, 1};
+	static const size_t sends_257[] = {128, 128, 1};
+
+	check_batches(0, NULL, 0);
+	check_batches(127, sends_127, RD_ARRAYSIZE(sends_127));
+	check_batches(128, sends_128, RD_ARRAYSIZE(sends_128));
+	check_batches(129, sends_129, RD_ARRAYSIZE(sends_129));
+	check_batches(257, sends_257, RD_ARRAYSIZE(sends_257));
+}
+
+#ifdef PRODUCE_BATCH_MOCK_CLUSTER
+
+#define MOCK_TOPIC "f2k-produce-batch"
+#define MOCK_TIMEOUT_MS 30000
+/// Producer max message size. librdkafka minimum
+#define MOCK_MAX_MSG_SIZE 1000
+
+/** Kafka sink over a mock cluster producer
+  @param producer Producer to initialize
+  @return Kafka sink
+  */
+static struct rb_sink *mock_kafka_sink(struct rb_kafka_producer *producer) {
+	char errstr[512], max_msg_size[32];
+	rd_kafka_conf_t *conf = rd_kafka_conf_new();
+
+	snprintf(max_msg_size, sizeof(max_msg_size), "%d", MOCK_MAX_MSG_SIZE);
+	assert_int_equal(RD_KAFKA_CONF_OK, rd_kafka_conf_set(conf,
+		"test.mock.num.brokers", "1", errstr, sizeof(errstr)));
+	assert_int_equal(RD_KAFKA_CONF_OK, rd_kafka_conf_set(conf,
+		"message.max.bytes", max_msg_size, errstr, sizeof(errstr)));
+	assert_int_equal(0, rb_kafka_producer_init(producer, conf, MOCK_TOPIC,
+		rd_kafka_topic_conf_new()));
+
+	rd_kafka_mock_cluster_t *mcluster = rd_kafka_handle_mock_cluster(
+		producer->rk);
+	assert_non_null(mcluster);
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+		rd_kafka_mock_topic_create(mcluster, MOCK_TOPIC, 1, 1));
+
+	struct rb_sink *ret = rb_sink_kafka_new(producer, NULL);
+	assert_non_null(ret);
+	return ret;
+}
+
+/** A message that librdkafka refuses in the middle of a batch is counted,
+  and its buffer is left to the caller, that frees it. The rest of the batch
+  is produced. */
+static void check_kafka_batch_failure(size_t n_msgs, size_t big_msg) {
+	struct rb_kafka_producer producer;
+	struct test_sink sink;
+	struct worker_stats stats;
+
+	memset(&stats, 0, sizeof(stats));
+	test_sink_init(&sink, mock_kafka_sink(&producer));
+	send_string_list_to_sink(test_list(n_msgs, big_msg,
+		2 * MOCK_MAX_MSG_SIZE), &sink.sink, NULL, &stats);
+
+	assert_int_equal(sink.next_msg, n_msgs);
+	assert_int_equal(sink.n_kept, 1);
+	assert_int_equal(sink.kept[0], big_msg);
+	assert_int_equal(stats.num_kafka_dropped_msg_size, 1);
+	assert_int_equal(stats.num_kafka_dropped_queue_full, 0);
+	assert_int_equal(stats.num_kafka_dropped_other, 0);
+
+	/* Rest of messages are delivered */
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+		rd_kafka_flush(producer.rk, MOCK_TIMEOUT_MS));
+
+	rb_sink_done(sink.next);
+	rb_kafka_producer_done(&producer);
+}
+
+static void testKafkaBatchFailure() {
+	/* Inside the first batch */
+	check_kafka_batch_failure(129, 5);
+	/* Last message of the first batch */
+	check_kafka_batch_failure(129, 127);
+	/* Only message of the second batch */
+	check_kafka_batch_failure(129, 128);
+}
+
+#endif /* PRODUCE_BATCH_MOCK_CLUSTER */
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(testStringListAppend),
+		cmocka_unit_test(testSendBatches),
+#ifdef PRODUCE_BATCH_MOCK_CLUSTER
+		cmocka_unit_test(testKafkaBatchFailure),
+#endif
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
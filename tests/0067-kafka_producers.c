@@ -0,0 +1,218 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rb_sink.h"
+
+#include "f2k.h"
+#include "printbuf.h"
+#include "rb_lists.h"
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#ifdef HAVE_LIBRDKAFKA
+#include "rb_kafka.h"
+
+#if RD_KAFKA_VERSION >= 0x010500ff
+#define PRODUCERS_MOCK_CLUSTER
+#include <librdkafka/rdkafka_mock.h>
+#endif
+#endif
+
+#define MAX_WORKERS 8
+
+/// Every producer gets workers, and as many different ones as possible
+static void testWorkersProducers() {
+	struct rb_sink sinks[MAX_WORKERS], *psinks[MAX_WORKERS];
+	size_t i, n_workers, n_sinks;
+
+	for (i = 0; i < MAX_WORKERS; ++i) {
+		psinks[i] = &sinks[i];
+	}
+
+	for (n_workers = 1; n_workers <= MAX_WORKERS; ++n_workers) {
+		for (n_sinks = 1; n_sinks <= n_workers; ++n_sinks) {
+			size_t workers_of[MAX_WORKERS] = {0};
+
+			for (i = 0; i < n_workers; ++i) {
+				const struct rb_sink *sink = rb_sink_of_worker(
+							psinks, n_sinks, i);
+				const size_t sink_idx = sink - sinks;
+				assert_true(sink_idx < n_sinks);
+				workers_of[sink_idx]++;
+			}
+
+			/* Workers are evenly spread, so one producer per
+			   worker gives every worker its own producer */
+			for (i = 0; i < n_sinks; ++i) {
+				assert_true(workers_of[i] >= n_workers / n_sinks);
+				assert_true(workers_of[i] <=
+					(n_workers + n_sinks - 1) / n_sinks);
+			}
+		}
+	}
+}
+
+#ifdef PRODUCERS_MOCK_CLUSTER
+
+#define MOCK_TOPIC "f2k-producers"
+#define MOCK_TIMEOUT_MS 30000
+#define MOCK_PARTITIONS 8
+#define N_PRODUCERS 3
+/// Client macs sent by each producer
+#define N_CLIENTS 32
+
+/// Partition of each client mac delivered message, per producer
+struct delivered_partitions {
+	int32_t partition[N_CLIENTS + 1];
+};
+
+static void record_partition_delivered(rd_kafka_t *rk,
+		const rd_kafka_message_t *rkmessage, void *opaque) {
+	struct delivered_partitions *delivered = opaque;
+	const intptr_t client_mac = (intptr_t)rkmessage->_private;
+	(void)rk;
+
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR, rkmessage->err);
+	assert_true(client_mac > 0 && client_mac <= N_CLIENTS);
+	delivered->partition[client_mac] = rkmessage->partition;
+}
+
+/** Send one flow of each client mac through a kafka sink
+  @param producer Sink producer
+  */
+static void send_clients(const struct rb_kafka_producer *producer) {
+	struct printbuf *pbs[N_CLIENTS];
+	struct string_list nodes[N_CLIENTS], *msgs[N_CLIENTS];
+	struct worker_stats stats;
+	size_t i;
+
+	memset(&stats, 0, sizeof(stats));
+	memset(nodes, 0, sizeof(nodes));
+	for (i = 0; i < N_CLIENTS; ++i) {
+		pbs[i] = printbuf_new();
+		assert_non_null(pbs[i]);
+		sprintbuf(pbs[i], "{\"client_mac\":%zu}", i + 1);
+		nodes[i].string = pbs[i];
+		nodes[i].client_mac = i + 1;
+		msgs[i] = &nodes[i];
+	}
+
+	struct rb_sink *sink = rb_sink_kafka_new(producer, NULL);
+	assert_non_null(sink);
+	rb_sink_send(sink, msgs, N_CLIENTS, &stats);
+	assert_int_equal(stats.num_kafka_dropped_queue_full, 0);
+	assert_int_equal(stats.num_kafka_dropped_msg_size, 0);
+	assert_int_equal(stats.num_kafka_dropped_other, 0);
+	rb_sink_done(sink);
+
+	for (i = 0; i < N_CLIENTS; ++i) {
+		/* Producer took the buffers */
+		assert_null(pbs[i]->buf);
+		printbuf_free(pbs[i]);
+	}
+}
+
+/** Creates a mock cluster with the test topic
+  @return Handle that owns the mock cluster
+  */
+static rd_kafka_t *mock_cluster_new(void) {
+	char errstr[512];
+	rd_kafka_conf_t *conf = rd_kafka_conf_new();
+
+	assert_int_equal(RD_KAFKA_CONF_OK, rd_kafka_conf_set(conf,
+		"test.mock.num.brokers", "1", errstr, sizeof(errstr)));
+	rd_kafka_t *rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr,
+		sizeof(errstr));
+	assert_non_null(rk);
+
+	rd_kafka_mock_cluster_t *mcluster = rd_kafka_handle_mock_cluster(rk);
+	assert_non_null(mcluster);
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+		rd_kafka_mock_topic_create(mcluster, MOCK_TOPIC,
+			MOCK_PARTITIONS, 1));
+	return rk;
+}
+
+/// Producers made from the same configuration send the same client mac to
+/// the same partition
+static void testProducersPartition() {
+	char errstr[512];
+	struct rb_kafka_producer producers[N_PRODUCERS];
+	struct delivered_partitions delivered[N_PRODUCERS];
+	rd_kafka_t *mock_rk = mock_cluster_new();
+	size_t i, j;
+
+	memset(delivered, 0xff, sizeof(delivered));
+
+	rd_kafka_conf_t *conf = rd_kafka_conf_new();
+	rd_kafka_topic_conf_t *topic_conf = rd_kafka_topic_conf_new();
+	assert_int_equal(RD_KAFKA_CONF_OK, rd_kafka_conf_set(conf,
+		"bootstrap.servers", rd_kafka_mock_cluster_bootstraps(
+			rd_kafka_handle_mock_cluster(mock_rk)),
+		errstr, sizeof(errstr)));
+	rd_kafka_conf_set_dr_msg_cb(conf, record_partition_delivered);
+	rd_kafka_topic_conf_set_partitioner_cb(topic_conf,
+		rb_client_mac_partitioner);
+
+	/* Same configuration duplication as f2k main */
+	for (i = N_PRODUCERS; i-- > 0;) {
+		rd_kafka_conf_t *producer_conf = i > 0 ?
+			rd_kafka_conf_dup(conf) : conf;
+		rd_kafka_topic_conf_t *producer_topic_conf = i > 0 ?
+			rd_kafka_topic_conf_dup(topic_conf) : topic_conf;
+
+		rd_kafka_conf_set_opaque(producer_conf, &delivered[i]);
+		assert_int_equal(0, rb_kafka_producer_init(&producers[i],
+			producer_conf, MOCK_TOPIC, producer_topic_conf));
+	}
+
+	for (i = 0; i < N_PRODUCERS; ++i) {
+		send_clients(&producers[i]);
+		assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+			rd_kafka_flush(producers[i].rk, MOCK_TIMEOUT_MS));
+	}
+
+	for (j = 1; j <= N_CLIENTS; ++j) {
+		assert_int_equal(delivered[0].partition[j],
+						j % MOCK_PARTITIONS);
+		for (i = 1; i < N_PRODUCERS; ++i) {
+			assert_int_equal(delivered[i].partition[j],
+						delivered[0].partition[j]);
+		}
+	}
+
+	for (i = 0; i < N_PRODUCERS; ++i) {
+		rb_kafka_producer_done(&producers[i]);
+	}
+	rd_kafka_destroy(mock_rk);
+}
+
+#endif /* PRODUCERS_MOCK_CLUSTER */
+
+int main() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(testWorkersProducers),
+#ifdef PRODUCERS_MOCK_CLUSTER
+		cmocka_unit_test(testProducersPartition),
+#endif
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,329 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rb_sink.h"
+
+#include "f2k.h"
+#include "printbuf.h"
+#include "rb_lists.h"
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#ifdef HAVE_LIBRDKAFKA
+#include "rb_kafka.h"
+
+#if RD_KAFKA_VERSION >= 0x010500ff
+#define QUEUE_FULL_MOCK_CLUSTER
+#include <librdkafka/rdkafka_mock.h>
+#endif
+#endif
+
+#ifdef QUEUE_FULL_MOCK_CLUSTER
+
+#define MOCK_TOPIC "f2k-queue-full"
+#define MOCK_TIMEOUT_MS 30000
+#define MOCK_PARTITIONS 2
+/// Producer queue size, in messages
+#define MOCK_QUEUE_MSGS 10
+/// Producer max message size. librdkafka minimum
+#define MOCK_MAX_MSG_SIZE 1000
+/// No message of this kind in test_send
+#define NO_MSG RB_SINK_BATCH
+
+/// Delivered messages. Only updated from test thread polls
+static size_t delivered_msgs;
+
+static void count_delivered(rd_kafka_t *rk,
+		const rd_kafka_message_t *rkmessage, void *opaque) {
+	(void)rk;
+	(void)opaque;
+
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR, rkmessage->err);
+	delivered_msgs++;
+}
+
+/** Creates a producer over a mock cluster, with a small queue. Producer
+  already knows topic partitions when this function returns
+  @param producer Producer to initialize
+  @param idempotence Enable idempotence
+  */
+static void mock_producer_init(struct rb_kafka_producer *producer,
+							bool idempotence) {
+	char errstr[512], queue_msgs[32], max_msg_size[32];
+	rd_kafka_conf_t *conf = rd_kafka_conf_new();
+	rd_kafka_topic_conf_t *topic_conf = rd_kafka_topic_conf_new();
+
+	snprintf(queue_msgs, sizeof(queue_msgs), "%d", MOCK_QUEUE_MSGS);
+	snprintf(max_msg_size, sizeof(max_msg_size), "%d", MOCK_MAX_MSG_SIZE);
+	assert_int_equal(RD_KAFKA_CONF_OK, rd_kafka_conf_set(conf,
+		"test.mock.num.brokers", "1", errstr, sizeof(errstr)));
+	assert_int_equal(RD_KAFKA_CONF_OK, rd_kafka_conf_set(conf,
+		"queue.buffering.max.messages", queue_msgs, errstr,
+		sizeof(errstr)));
+	assert_int_equal(RD_KAFKA_CONF_OK, rd_kafka_conf_set(conf,
+		"message.max.bytes", max_msg_size, errstr, sizeof(errstr)));
+	/* Queue room is only released when delivery reports are served */
+	rd_kafka_conf_set_dr_msg_cb(conf, count_delivered);
+	assert_int_equal(RD_KAFKA_CONF_OK, rd_kafka_conf_set(conf,
+		"enable.idempotence", idempotence ? "true" : "false", errstr,
+		sizeof(errstr)));
+	rd_kafka_topic_conf_set_partitioner_cb(topic_conf,
+		rb_client_mac_partitioner);
+	assert_int_equal(0, rb_kafka_producer_init(producer, conf, MOCK_TOPIC,
+		topic_conf));
+
+	rd_kafka_mock_cluster_t *mcluster = rd_kafka_handle_mock_cluster(
+		producer->rk);
+	assert_non_null(mcluster);
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+		rd_kafka_mock_topic_create(mcluster, MOCK_TOPIC,
+			MOCK_PARTITIONS, 1));
+
+	/* Partitioner is only called once topic metadata is known */
+	assert_int_equal(0, rd_kafka_produce(producer->rkt,
+		RD_KAFKA_PARTITION_UA, RD_KAFKA_MSG_F_COPY, "{}", strlen("{}"),
+		NULL, 0, (void *)(intptr_t)1));
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+		rd_kafka_flush(producer->rk, MOCK_TIMEOUT_MS));
+	delivered_msgs = 0;
+}
+
+/** Send a batch of messages
+  @param sink Sink
+  @param n_msgs Number of messages
+  @param big_msg Message bigger than producer max message size, or NO_MSG
+  @param stats Send stats
+  @return Messages whose buffer was kept by caller, i.e., not produced
+  */
+static size_t test_send(struct rb_sink *sink, size_t n_msgs, size_t big_msg,
+						struct worker_stats *stats) {
+	struct printbuf *pbs[RB_SINK_BATCH];
+	struct string_list nodes[RB_SINK_BATCH], *msgs[RB_SINK_BATCH];
+	size_t i, ret = 0;
+
+	assert_true(n_msgs <= RB_SINK_BATCH);
+	memset(nodes, 0, sizeof(nodes));
+	for (i = 0; i < n_msgs; ++i) {
+		pbs[i] = printbuf_new();
+		assert_non_null(pbs[i]);
+		sprintbuf(pbs[i], "{\"msg\":%zu", i);
+		if (i == big_msg) {
+			printbuf_memset(pbs[i], pbs[i]->bpos, 'x',
+						2 * MOCK_MAX_MSG_SIZE);
+		}
+		printbuf_memappend_fast(pbs[i], "}", strlen("}"));
+		nodes[i].string = pbs[i];
+		nodes[i].client_mac = i + 1;
+		msgs[i] = &nodes[i];
+	}
+
+	rb_sink_send(sink, msgs, n_msgs, stats);
+
+	for (i = 0; i < n_msgs; ++i) {
+		if (pbs[i]->buf) {
+			ret++;
+		}
+		printbuf_free(pbs[i]);
+	}
+
+	return ret;
+}
+
+/// Messages that don't fit in producer queue wait for room, and they are
+/// accounted as delayed
+static void testQueueFullRetry() {
+	struct rb_kafka_producer producer;
+	struct worker_stats stats;
+
+	memset(&stats, 0, sizeof(stats));
+	readOnlyGlobals.kafka.queue_full_timeout_ms = MOCK_TIMEOUT_MS;
+	mock_producer_init(&producer, false);
+	struct rb_sink *sink = rb_sink_kafka_new(&producer, NULL);
+	assert_non_null(sink);
+
+	assert_int_equal(0, test_send(sink, RB_SINK_BATCH, NO_MSG, &stats));
+	assert_int_equal(stats.num_kafka_delayed_msgs,
+		RB_SINK_BATCH - MOCK_QUEUE_MSGS);
+	assert_int_equal(stats.num_kafka_dropped_queue_full, 0);
+	assert_int_equal(stats.num_kafka_dropped_msg_size, 0);
+	assert_int_equal(stats.num_kafka_dropped_other, 0);
+
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+		rd_kafka_flush(producer.rk, MOCK_TIMEOUT_MS));
+	assert_int_equal(delivered_msgs, RB_SINK_BATCH);
+
+	rb_sink_done(sink);
+	rb_kafka_producer_done(&producer);
+	readOnlyGlobals.kafka.queue_full_timeout_ms = 0;
+}
+
+/// Without queue full timeout, messages that don't fit are dropped
+static void testQueueFullDrop() {
+	struct rb_kafka_producer producer;
+	struct worker_stats stats;
+
+	memset(&stats, 0, sizeof(stats));
+	mock_producer_init(&producer, false);
+	struct rb_sink *sink = rb_sink_kafka_new(&producer, NULL);
+	assert_non_null(sink);
+
+	assert_int_equal(RB_SINK_BATCH - MOCK_QUEUE_MSGS, test_send(sink,
+		RB_SINK_BATCH, NO_MSG, &stats));
+	assert_int_equal(stats.num_kafka_delayed_msgs, 0);
+	assert_int_equal(stats.num_kafka_dropped_queue_full,
+		RB_SINK_BATCH - MOCK_QUEUE_MSGS);
+	assert_int_equal(stats.num_kafka_dropped_msg_size, 0);
+	assert_int_equal(stats.num_kafka_dropped_other, 0);
+
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+		rd_kafka_flush(producer.rk, MOCK_TIMEOUT_MS));
+	assert_int_equal(delivered_msgs, MOCK_QUEUE_MSGS);
+
+	rb_sink_done(sink);
+	rb_kafka_producer_done(&producer);
+}
+
+/// Too large messages don't stop the rest of the batch
+static void testProduceMsgSize() {
+	struct rb_kafka_producer producer;
+	struct worker_stats stats;
+
+	memset(&stats, 0, sizeof(stats));
+	mock_producer_init(&producer, false);
+	struct rb_sink *sink = rb_sink_kafka_new(&producer, NULL);
+	assert_non_null(sink);
+
+	assert_int_equal(1, test_send(sink, 5, 1, &stats));
+	assert_int_equal(stats.num_kafka_delayed_msgs, 0);
+	assert_int_equal(stats.num_kafka_dropped_queue_full, 0);
+	assert_int_equal(stats.num_kafka_dropped_msg_size, 1);
+	assert_int_equal(stats.num_kafka_dropped_other, 0);
+
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+		rd_kafka_flush(producer.rk, MOCK_TIMEOUT_MS));
+	assert_int_equal(delivered_msgs, 4);
+
+	rb_sink_done(sink);
+	rb_kafka_producer_done(&producer);
+}
+
+/// Rest of errors are accounted together, and they are not retried even if
+/// there is queue full timeout
+static void testProduceOtherError() {
+	struct rb_kafka_producer producer;
+	struct worker_stats stats;
+
+	memset(&stats, 0, sizeof(stats));
+	readOnlyGlobals.kafka.queue_full_timeout_ms = MOCK_TIMEOUT_MS;
+	mock_producer_init(&producer, true);
+	struct rb_sink *sink = rb_sink_kafka_new(&producer, NULL);
+	assert_non_null(sink);
+
+	/* Producer refuses every message after a fatal error */
+	assert_int_equal(RD_KAFKA_RESP_ERR_NO_ERROR,
+		rd_kafka_test_fatal_error(producer.rk,
+			RD_KAFKA_RESP_ERR_OUT_OF_ORDER_SEQUENCE_NUMBER,
+			"test fatal error"));
+
+	assert_int_equal(5, test_send(sink, 5, NO_MSG, &stats));
+	assert_int_equal(stats.num_kafka_delayed_msgs, 0);
+	assert_int_equal(stats.num_kafka_dropped_queue_full, 0);
+	assert_int_equal(stats.num_kafka_dropped_msg_size, 0);
+	assert_int_equal(stats.num_kafka_dropped_other, 5);
+	assert_int_equal(delivered_msgs, 0);
+
+	rb_sink_done(sink);
+	rb_kafka_producer_done(&producer);
+	readOnlyGlobals.kafka.queue_full_timeout_ms = 0;
+}
+
+static uint64_t sink_dropped_msg_size() {
+	struct worker_stats stats;
+
+	memset(&stats, 0, sizeof(stats));
+	rb_kafka_sink_sum_stats(&stats);
+	return stats.num_kafka_dropped_msg_size;
+}
+
+/// Multi-flow messages sent by sink flusher thread, or when sink is freed,
+/// are accounted in sinks global counters
+static void testMultiFlowStats() {
+	struct rb_kafka_producer producer;
+	struct worker_stats stats;
+	struct rb_msg_batch_conf batch_conf = {
+		.max_msgs = 4,
+		.max_bytes = 4 * MOCK_MAX_MSG_SIZE,
+		.max_delay_ms = 10,
+		.format = RB_MSG_BATCH_NDJSON,
+	};
+	const uint64_t dropped_before = sink_dropped_msg_size();
+	size_t i;
+
+	memset(&stats, 0, sizeof(stats));
+	mock_producer_init(&producer, false);
+
+	/* Flusher sends it when deadline arrives */
+	struct rb_sink *sink = rb_sink_kafka_new(&producer, &batch_conf);
+	assert_non_null(sink);
+	assert_int_equal(1, test_send(sink, 1, 0, &stats));
+	for (i = 0; i < MOCK_TIMEOUT_MS / 100; ++i) {
+		if (sink_dropped_msg_size() > dropped_before) {
+			break;
+		}
+		rd_kafka_poll(producer.rk, 100);
+	}
+	assert_int_equal(sink_dropped_msg_size(), dropped_before + 1);
+	rb_sink_done(sink);
+
+	/* Sink sends it when freed */
+	batch_conf.max_delay_ms = 10 * MOCK_TIMEOUT_MS;
+	sink = rb_sink_kafka_new(&producer, &batch_conf);
+	assert_non_null(sink);
+	assert_int_equal(1, test_send(sink, 1, 0, &stats));
+	rb_sink_done(sink);
+	assert_int_equal(sink_dropped_msg_size(), dropped_before + 2);
+
+	/* Workers don't see them */
+	assert_int_equal(stats.num_kafka_dropped_msg_size, 0);
+
+	rb_kafka_producer_done(&producer);
+}
+
+#endif /* QUEUE_FULL_MOCK_CLUSTER */
+
+#ifndef QUEUE_FULL_MOCK_CLUSTER
+static void skip_test() { skip(); }
+#endif
+
+int main() {
+	const struct CMUnitTest tests[] = {
+#ifdef QUEUE_FULL_MOCK_CLUSTER
+		cmocka_unit_test(testQueueFullRetry),
+		cmocka_unit_test(testQueueFullDrop),
+		cmocka_unit_test(testProduceMsgSize),
+		cmocka_unit_test(testProduceOtherError),
+		cmocka_unit_test(testMultiFlowStats),
+#else
+		cmocka_unit_test(skip_test),
+#endif
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -1,6 +1,7 @@
 #include "rb_mem_wraps.h"
 
 size_t mem_wrap_fail_in = 0;
+size_t mem_wrap_n_allocs = 0;
 
 size_t mem_wraps_get_fail_in() {
 	return mem_wrap_fail_in;
@@ -10,12 +11,17 @@ void mem_wraps_set_fail_in(size_t i) {
 	mem_wrap_fail_in = i;
 }
 
+size_t mem_wraps_get_n_allocs() {
+	return mem_wrap_n_allocs;
+}
+
 #define COMMA ,
 
 #define WRAP_MEM_FN(fun, ret_t, args, real_args)                               \
 ret_t __real_##fun (args);                                              \
 ret_t __wrap_##fun (args); \
 ret_t __wrap_##fun (args) { \
+	__sync_fetch_and_add(&mem_wrap_n_allocs, 1);                          \
 	return (mem_wrap_fail_in == 0 || --mem_wrap_fail_in) ?                 \
 						__real_##fun (real_args) : 0;\
 }
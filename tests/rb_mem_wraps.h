@@ -2,5 +2,8 @@
 
 size_t mem_wraps_get_fail_in();
 void mem_wraps_set_fail_in(size_t i);
+/// Number of calls to wrapped allocation functions
+size_t mem_wraps_get_n_allocs();
 
 extern size_t mem_wrap_fail_in;
+extern size_t mem_wrap_n_allocs;
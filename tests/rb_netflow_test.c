@@ -35,6 +35,8 @@ static struct dns_ctx *dns_ctx;
 static rd_kafka_t *test_consumer_rk = NULL;
 static rd_kafka_t *test_producer_rk = NULL;
 static rd_kafka_topic_t *test_producer_rkt = NULL;
+/// f2k producer, used by f2k kafka sink
+static struct rb_kafka_producer f2k_test_producer;
 
 static char *rand_tmpl(const char *preffix) {
 	char *template = calloc(strlen(preffix) + 1 + 6, sizeof(char));
@@ -159,6 +161,9 @@ static void init_kafka_producer(const char *broker_ip, const char *topic) {
         rd_kafka_topic_new(readOnlyGlobals.kafka.rk, topic, rkt_conf);
     if (readOnlyGlobals.kafka.rkt != NULL) {
       rkt_conf = NULL;
+      f2k_test_producer.rk = readOnlyGlobals.kafka.rk;
+      f2k_test_producer.rkt = readOnlyGlobals.kafka.rkt;
+      readOnlyGlobals.sink = rb_sink_kafka_new(&f2k_test_producer, NULL);
     } else {
       traceEvent(TRACE_ERROR, "Unable to create a kafka topic");
       rd_kafka_destroy(readOnlyGlobals.kafka.rk);
@@ -186,13 +191,14 @@ int nf_test_teardown(void **state) {
       readOnlyGlobals.rb_databases.nets_name_as_list,
   };
 
+  ip_name_db_done(readOnlyGlobals.rb_databases.nets_name_as_db);
+  readOnlyGlobals.rb_databases.nets_name_as_db = NULL;
+  rb_epoch_reclaim(&readOnlyGlobals.rb_databases.epoch);
   for (i = 0; i < RD_ARRAYSIZE(hosts_lists); ++i) {
     freeHostsList(hosts_lists[i]);
   }
 
-#ifdef HAVE_GEOIP
   deleteGeoIPDatabases();
-#endif /* HAVE_GEOIP */
 
   if (readOnlyGlobals.rb_databases.sensors_info) {
     delete_rb_sensors_db(readOnlyGlobals.rb_databases.sensors_info);
@@ -215,6 +221,11 @@ int nf_test_teardown(void **state) {
 	}
 #endif
 
+  if (readOnlyGlobals.sink) {
+    rb_sink_done(readOnlyGlobals.sink);
+    readOnlyGlobals.sink = NULL;
+  }
+
   if (readOnlyGlobals.kafka.rk) {
     while (rd_kafka_outq_len(readOnlyGlobals.kafka.rk) > 0) {
       rd_kafka_poll(readOnlyGlobals.kafka.rk, 50);
@@ -265,10 +276,8 @@ static int load_geoip_databases(const char *geoip_path) {
 			"as-path" ,&AS_path,
 			"country-path" ,&country_path);
 
-#ifdef HAVE_GEOIP
 		readASs(AS_path);
 		readCountries(country_path);
-#endif /* HAVE_GEOIP */
 
 
 		free_json_unpacked(unpack_private);
@@ -412,31 +421,13 @@ static struct string_list *test_flow_i(const struct test_params *params,
 
     if (sensor_object) {
       // wait until worker end to process all templates
-      while (true) {
-        pthread_mutex_lock(&worker->templates_queue.rfq_lock);
-        const int cnt = worker->templates_queue.rfq_cnt;
-        pthread_mutex_unlock(&worker->templates_queue.rfq_lock);
-
-        if (cnt > 0) {
-          usleep(1);
-        } else {
-          break;
-        }
+      while (rb_ring_count(&worker->queue) > 0) {
+        usleep(1);
       }
 
-      // Let's lock to make drd & helgrind happy
-      pthread_mutex_lock(&worker->templates_queue.rfq_lock);
-      pthread_mutex_lock(&worker->packetsQueue.rfq_lock);
-
       mem_wraps_set_fail_in(mem_stash); // fail beyond this point
-      struct string_list *ret = dissectNetFlow(
-          worker, sensor_object, params->netflow_src_ip, params->record,
-          params->record_size);
-
-      pthread_mutex_unlock(&worker->packetsQueue.rfq_lock);
-      pthread_mutex_unlock(&worker->templates_queue.rfq_lock);
-
-      return ret;
+      return dissectNetFlow(worker, sensor_object, params->netflow_src_ip,
+                            params->record, params->record_size);
     }
 
     return NULL;
@@ -552,7 +543,7 @@ void testFlow(void **state) {
   worker_t *worker = NULL;
   // Repeat if we are testing memory
   while (!worker) {
-    worker = new_collect_worker();
+    worker = new_collect_worker(NULL);
   }
 
   // Consume f2k output messages to verify them
@@ -622,6 +613,73 @@ void testFlow(void **state) {
   free(st);
 }
 
+/// Dissections of every record in flow_allocs_test
+#define FLOW_ALLOCS_ROUNDS 16
+
+/** Send a dissection string list to a sink, giving back its objects to the
+ * worker flow arena
+ * @param worker Worker that dissected the list
+ * @param sink Sink
+ * @param sl String list
+ * @return Number of flows in the list
+ */
+static size_t flow_allocs_send(worker_t *worker, struct rb_sink *sink,
+                               struct string_list *sl) {
+  size_t flows = 0;
+  const struct string_list *iter;
+
+  for (iter = sl; iter; iter = iter->next) {
+    flows += NULL != iter->string;
+  }
+
+  send_string_list_to_sink(sl, sink, worker->flow_arena, NULL);
+  return flows;
+}
+
+void flow_allocs_test(void **vstate, struct rb_sink *sink,
+                      struct flow_allocs *allocs) {
+  size_t round, i;
+  struct nf_test_state *st = *vstate;
+  assert_true(st->magic == NF_TEST_STATE_MAGIC);
+
+  worker_t *worker = new_collect_worker(NULL);
+  assert_non_null(worker);
+
+  /* Load sensors and templates, and check flows */
+  for (i = 0; i < st->params.records_size; ++i) {
+    const struct test_params *params = &st->params.records[i];
+    struct string_list *sl = test_flow_i(params, worker);
+
+    check_string_list(sl, params->checkdata, params->checkdata_size);
+    allocs[i].flows = flow_allocs_send(worker, sink, sl);
+    allocs[i].allocs = 0;
+  }
+
+  for (round = 1; round < FLOW_ALLOCS_ROUNDS; ++round) {
+    for (i = 0; i < st->params.records_size; ++i) {
+      const struct test_params *params = &st->params.records[i];
+      if (0 == allocs[i].flows) {
+        /* Template record, already processed */
+        continue;
+      }
+
+      sensor_t *sensor = get_sensor(readOnlyGlobals.rb_databases.sensors_info,
+                                    params->netflow_src_ip);
+      assert_non_null(sensor);
+
+      const size_t allocs_before = mem_wraps_get_n_allocs();
+      struct string_list *sl = dissectNetFlow(worker, sensor,
+        params->netflow_src_ip, params->record, params->record_size);
+      allocs[i].allocs = mem_wraps_get_n_allocs() - allocs_before;
+
+      assert_int_equal(flow_allocs_send(worker, sink, sl), allocs[i].flows);
+    }
+  }
+
+  collect_worker_done(worker, NULL);
+  free(st);
+}
+
 void mem_test(void **vstate) {
   size_t i = 1;
   struct nf_test_state *state = *vstate;
@@ -72,3 +72,23 @@ void testFlow(void **state);
  * @param vstate Same as testFlow
  */
 void mem_test(void **vstate);
+
+struct rb_sink;
+
+/// Allocations made by the dissection of a record
+struct flow_allocs {
+	size_t flows;  ///< Flows of the record
+	size_t allocs; ///< Allocations of the record last dissection
+};
+
+/** Dissect every record many times with the same worker, sending the flows to
+ * a sink and giving back their objects to the worker flow arena, like the
+ * worker does with received packets. Flows of the first round are checked
+ * against records checkdata.
+ * @param vstate Same as testFlow
+ * @param sink Sink to send flows to
+ * @param allocs Allocations of each record last dissection, once worker flow
+ *               arena is warm
+ */
+void flow_allocs_test(void **vstate, struct rb_sink *sink,
+						struct flow_allocs *allocs);
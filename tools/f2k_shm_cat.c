@@ -0,0 +1,98 @@
+/*
+  Copyright (C) 2016 Eneo Tecnologia S.L.
+  Author: Eugenio Perez <eupm90@gmail.com>
+  Based on Luca Deri nprobe 6.22 collector
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+  Example consumer of f2k shm sink: prints every new flow of the ring, one per
+  line. Lost flows (reader too slow) are reported in stderr.
+
+  Usage: f2k_shm_cat <ring file>
+*/
+
+#include "rb_shm_ring.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/// Time to sleep when there are no new records
+#define IDLE_US 1000
+
+static volatile sig_atomic_t run = 1;
+
+static void sig_handler(int sig) {
+  (void)sig;
+  run = 0;
+}
+
+int main(int argc, char *argv[]) {
+  struct rb_shm_ring ring;
+  struct rb_shm_ring_reader reader;
+  uint64_t reported_lost = 0;
+  char *buf;
+  size_t buf_size;
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <ring file>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (0 != rb_shm_ring_open(&ring, argv[1])) {
+    fprintf(stderr, "Can't open ring %s: %s\n", argv[1], strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  buf_size = rb_shm_ring_max_record_size(&ring);
+  buf = malloc(buf_size);
+  if (NULL == buf) {
+    fprintf(stderr, "Can't allocate buffer (out of memory?)\n");
+    rb_shm_ring_close(&ring);
+    return EXIT_FAILURE;
+  }
+
+  signal(SIGINT, sig_handler);
+  signal(SIGTERM, sig_handler);
+
+  rb_shm_ring_reader_init(&reader, &ring);
+  while (run) {
+    size_t len;
+    uint64_t key;
+
+    if (0 != rb_shm_ring_read(&reader, buf, buf_size, &len, &key)) {
+      fflush(stdout);
+      usleep(IDLE_US);
+      continue;
+    }
+
+    if (reader.lost != reported_lost) {
+      fprintf(stderr, "Lost %"PRIu64" flows\n", reader.lost - reported_lost);
+      reported_lost = reader.lost;
+    }
+
+    fwrite(buf, 1, len, stdout);
+    fputc('\n', stdout);
+  }
+
+  free(buf);
+  rb_shm_ring_close(&ring);
+  return EXIT_SUCCESS;
+}